@@ -1,26 +1,74 @@
 {
+    "variables": {
+        # Build the LZ4 codec with `node-gyp rebuild --lz4=1`, requires liblz4
+        "lz4%": 0,
+        "proxy_sources": [
+            "../src/zstd-proxy.c",
+            "../src/zstd-proxy-posix.c",
+            "../src/zstd-proxy-metrics.c",
+            "../src/zstd-proxy-histogram.c",
+            "../src/zstd-proxy-affinity.c",
+            "../src/zstd-proxy-dedup.c",
+            "../src/zstd-proxy-capture.c",
+            "../src/zstd-proxy-arena.c",
+            "../src/zstd-proxy-codec.c",
+            "../src/zstd-proxy-framing.c",
+            "../src/zstd-proxy-stripe.c",
+            "../src/zstd-proxy-balancer.c",
+        ],
+    },
+    "target_defaults": {
+        "libraries": ["-lzstd"],
+        "conditions": [
+            [
+                'OS=="mac"',
+                {
+                    "libraries": ["-L/opt/homebrew/lib"],
+                    "include_dirs": ["/opt/homebrew/include"],
+                },
+            ],
+            [
+                'OS=="linux"',
+                {
+                    "libraries": ["-luring", "-lpthread"],
+                    "sources": ["../src/zstd-proxy-uring.c", "../src/zstd-proxy-epoll.c"],
+                },
+            ],
+            [
+                'lz4==1',
+                {
+                    "defines": ["ENABLE_LZ4=1"],
+                    "libraries": ["-llz4"],
+                },
+            ],
+        ],
+    },
     "targets": [
         {
             "target_name": "zstd_proxy",
-            "libraries": ["-lzstd"],
             "include_dirs" : ["<!(node -e \"require('nan')\")"],
-            "sources": ["../src/zstd-proxy.c", "../src/zstd-proxy-posix.c", "../src/zstd-proxy.addon.cc"],
-            "conditions": [
-                [
-                    'OS=="mac"',
-                    {
-                        "libraries": ["-L/opt/homebrew/lib"],
-                        "include_dirs": ["/opt/homebrew/include"],
-                    },
-                ],
-                [
-                    'OS=="linux"',
-                    {
-                        "libraries": ["-luring"],
-                        "sources": ["../src/zstd-proxy-uring.c"],
-                    },
-                ],
-            ],
-        }
+            "sources": ["<@(proxy_sources)", "../src/zstd-proxy.addon.cc"],
+        },
+        {
+            "target_name": "zstd_proxy_cli",
+            "product_name": "zstd-proxy",
+            "type": "executable",
+            "sources": ["<@(proxy_sources)", "../src/zstd-proxy.cli.c"],
+        },
+        {
+            "target_name": "zstd_proxy_bench",
+            "type": "executable",
+            "sources": ["<@(proxy_sources)", "../src/zstd-proxy-bench.c", "../src/zstd-proxy.bench.c"],
+        },
+        {
+            "target_name": "zstd_proxy_rtt",
+            "type": "executable",
+            "sources": ["<@(proxy_sources)", "../src/zstd-proxy-bench.c", "../src/zstd-proxy.rtt.c"],
+        },
+        {
+            "target_name": "zstd_proxy_advisor",
+            "type": "executable",
+            "sources": ["<@(proxy_sources)", "../src/zstd-proxy-bench.c", "../src/zstd-proxy.advisor.c"],
+        },
     ]
 }
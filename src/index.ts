@@ -1,2 +1,6 @@
-export {zstdProxy} from './zstd-proxy'
+export {zstdProxy, ZstdProxyCloseReason, ZstdProxyCodec, ZstdProxyConnection, ZstdProxyFraming} from './zstd-proxy'
 export {zstdProxyCli} from './zstd-proxy.cli'
+export {zstdProxyCapture, zstdProxyCaptureStats, readZstdProxyCapture} from './zstd-proxy.capture'
+export {zstdProxyLatency, zstdProxyMetrics, zstdProxyPrometheusMetrics} from './zstd-proxy.metrics'
+export {zstdProxyCompressStream, zstdProxyDecompressStream, zstdProxyStream, ZstdProxyStreamOptions} from './zstd-proxy.stream'
+export {zstdProxyArena, zstdProxyArenaTrim, ZstdProxyArenaOptions, ZstdProxyArenaStats} from './zstd-proxy.arena'
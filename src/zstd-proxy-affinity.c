@@ -0,0 +1,147 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "zstd-proxy-affinity.h"
+#include "zstd-proxy-utils.h"
+
+int zstd_proxy_cpu_set_parse(zstd_proxy_cpu_set *set, const char *list) {
+    const char *cursor = list;
+
+    memset(set, 0, sizeof(*set));
+
+    while (*cursor != '\0') {
+        char *end = NULL;
+        unsigned long first = strtoul(cursor, &end, 10), last = first;
+
+        if (end == cursor) {
+            return EINVAL;
+        }
+
+        if (*end == '-') {
+            cursor = end + 1;
+            last = strtoul(cursor, &end, 10);
+
+            if (end == cursor) {
+                return EINVAL;
+            }
+        }
+
+        if (first > last || last >= zstd_proxy_cpu_set_size || (*end != ',' && *end != '\0')) {
+            return EINVAL;
+        }
+
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            set->bits[cpu / 64] |= UINT64_C(1) << (cpu % 64);
+        }
+
+        if (*end == ',' && end[1] == '\0') {
+            return EINVAL;
+        }
+
+        cursor = *end == ',' ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+bool zstd_proxy_cpu_set_empty(const zstd_proxy_cpu_set *set) {
+    for (size_t i = 0; i < zstd_proxy_cpu_set_size / 64; i++) {
+        if (set->bits[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool zstd_proxy_cpu_set_has(const zstd_proxy_cpu_set *set, int cpu) {
+    return cpu >= 0 && cpu < zstd_proxy_cpu_set_size && (set->bits[cpu / 64] & (UINT64_C(1) << (cpu % 64))) != 0;
+}
+
+int zstd_proxy_cpu_set_at(const zstd_proxy_cpu_set *set, size_t index) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < zstd_proxy_cpu_set_size / 64; i++) {
+        count += __builtin_popcountll(set->bits[i]);
+    }
+
+    if (count == 0) {
+        return -1;
+    }
+
+    index %= count;
+
+    for (int cpu = 0; cpu < zstd_proxy_cpu_set_size; cpu++) {
+        if (zstd_proxy_cpu_set_has(set, cpu) && index-- == 0) {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+int zstd_proxy_incoming_cpu(int fd) {
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t length = sizeof(cpu);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == 0) {
+        return cpu;
+    }
+#endif
+
+    return -1;
+}
+
+int zstd_proxy_pin_thread(const zstd_proxy_cpu_set *set, int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+
+    if (cpu >= 0) {
+        CPU_SET(cpu, &cpus);
+    } else {
+        for (int i = 0; i < zstd_proxy_cpu_set_size && i < CPU_SETSIZE; i++) {
+            if (zstd_proxy_cpu_set_has(set, i)) {
+                CPU_SET(i, &cpus);
+            }
+        }
+    }
+
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    if (error != 0) {
+        log_error("error setting thread affinity: %s", strerror(error));
+    }
+
+    return error;
+#else
+    return 0;
+#endif
+}
+
+int zstd_proxy_affinity_apply(const zstd_proxy_affinity_options *options, int fd) {
+    bool any = zstd_proxy_cpu_set_empty(&options->cpus);
+
+    if (options->incoming_cpu) {
+        int cpu = zstd_proxy_incoming_cpu(fd);
+
+        if (cpu >= 0 && (any || zstd_proxy_cpu_set_has(&options->cpus, cpu))) {
+            return zstd_proxy_pin_thread(&options->cpus, cpu);
+        }
+    }
+
+    return any ? 0 : zstd_proxy_pin_thread(&options->cpus, -1);
+}
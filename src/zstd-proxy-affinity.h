@@ -0,0 +1,38 @@
+#ifndef zstd_proxy_affinity_H
+#define zstd_proxy_affinity_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#define zstd_proxy_cpu_set_size 1024
+
+/** CPUs as a bitmask, bit `n % 64` of `bits[n / 64]` for CPU `n`. Empty means any CPU. */
+typedef struct {
+    uint64_t bits[zstd_proxy_cpu_set_size / 64];
+} zstd_proxy_cpu_set;
+
+typedef struct {
+    /** Pin the direction threads to these CPUs, their buffers are then allocated on the local NUMA node. */
+    zstd_proxy_cpu_set cpus;
+    /** Pin each direction to the CPU receiving packets of its source socket (`SO_INCOMING_CPU`) if it's in `cpus`. */
+    bool incoming_cpu;
+} zstd_proxy_affinity_options;
+
+/** Parse a list like `0-3,8,10-11`, returns `EINVAL` on invalid input. */
+int zstd_proxy_cpu_set_parse(zstd_proxy_cpu_set *set, const char *list);
+bool zstd_proxy_cpu_set_empty(const zstd_proxy_cpu_set *set);
+bool zstd_proxy_cpu_set_has(const zstd_proxy_cpu_set *set, int cpu);
+/** CPU at `index` modulo the size of the set, -1 if it's empty. */
+int zstd_proxy_cpu_set_at(const zstd_proxy_cpu_set *set, size_t index);
+
+/** CPU which last received packets for `fd`, -1 if unknown or not supported. */
+int zstd_proxy_incoming_cpu(int fd);
+
+/** Pin the calling thread to `set`, or to `cpu` if not negative. A no-op where affinity is not supported. */
+int zstd_proxy_pin_thread(const zstd_proxy_cpu_set *set, int cpu);
+
+/** Pin the calling thread according to `options`, for a direction reading from `fd`. */
+int zstd_proxy_affinity_apply(const zstd_proxy_affinity_options *options, int fd);
+
+#endif
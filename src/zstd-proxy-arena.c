@@ -0,0 +1,258 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "zstd-proxy-arena.h"
+#include "zstd-proxy-metrics.h"
+
+#define zstd_proxy_arena_min_shift 12
+#define zstd_proxy_arena_max_shift 26
+/** Classes per power of two, bounds the rounding to 25%. */
+#define zstd_proxy_arena_steps 4
+#define zstd_proxy_arena_classes ((zstd_proxy_arena_max_shift - zstd_proxy_arena_min_shift) * zstd_proxy_arena_steps + 1)
+#define zstd_proxy_arena_shards 8
+/** Blocks larger than the last class are mapped and unmapped as is. */
+#define zstd_proxy_arena_uncached UINT32_MAX
+
+/** Placed at the start of every block, keeps the rest aligned for anything Zstd stores. */
+typedef union zstd_proxy_arena_block {
+    struct {
+        union zstd_proxy_arena_block *next;
+        size_t size;
+        uint64_t *gauge;
+        uint32_t class;
+    };
+    max_align_t align;
+    char padding[64];
+} zstd_proxy_arena_block;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t cached;
+    zstd_proxy_arena_block *free[zstd_proxy_arena_classes];
+} __attribute__((aligned(64))) zstd_proxy_arena_shard;
+
+static zstd_proxy_arena_shard zstd_proxy_arena_shard_list[zstd_proxy_arena_shards];
+static pthread_once_t zstd_proxy_arena_once = PTHREAD_ONCE_INIT;
+
+static zstd_proxy_arena_options zstd_proxy_arena_current = {
+    .cache_size = 64 * 1024 * 1024,
+    .limit = 0,
+};
+
+static zstd_proxy_arena_stats zstd_proxy_arena_counters;
+
+static void zstd_proxy_arena_init(void) {
+    for (size_t i = 0; i < zstd_proxy_arena_shards; i++) {
+        pthread_mutex_init(&zstd_proxy_arena_shard_list[i].lock, NULL);
+    }
+}
+
+static inline size_t zstd_proxy_arena_class_size(uint32_t class) {
+    size_t base = (size_t)1 << (zstd_proxy_arena_min_shift + class / zstd_proxy_arena_steps);
+
+    return base + base / zstd_proxy_arena_steps * (class % zstd_proxy_arena_steps);
+}
+
+static inline uint32_t zstd_proxy_arena_class(size_t size) {
+    for (uint32_t class = 0; class < zstd_proxy_arena_classes; class++) {
+        if (zstd_proxy_arena_class_size(class) >= size) {
+            return class;
+        }
+    }
+
+    return zstd_proxy_arena_uncached;
+}
+
+static inline zstd_proxy_arena_shard *zstd_proxy_arena_local_shard(void) {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0) {
+        return &zstd_proxy_arena_shard_list[cpu % zstd_proxy_arena_shards];
+    }
+#endif
+
+    // Threads have distinct stacks, the address of a local is enough to spread them
+    uintptr_t stack = (uintptr_t)&stack;
+
+    return &zstd_proxy_arena_shard_list[(stack >> 16) % zstd_proxy_arena_shards];
+}
+
+static inline size_t zstd_proxy_arena_cache_limit(void) {
+    return __atomic_load_n(&zstd_proxy_arena_current.cache_size, __ATOMIC_RELAXED) / zstd_proxy_arena_shards;
+}
+
+static void *zstd_proxy_arena_alloc(void *opaque, size_t size) {
+    uint32_t class = zstd_proxy_arena_class(size + sizeof(zstd_proxy_arena_block));
+    size_t block_size = class == zstd_proxy_arena_uncached
+        ? (size + sizeof(zstd_proxy_arena_block) + 4095) & ~(size_t)4095
+        : zstd_proxy_arena_class_size(class);
+    size_t limit = __atomic_load_n(&zstd_proxy_arena_current.limit, __ATOMIC_RELAXED);
+    uint64_t used = __atomic_add_fetch(&zstd_proxy_arena_counters.used, block_size, __ATOMIC_RELAXED);
+
+    if (limit > 0 && used > limit) {
+        __atomic_fetch_sub(&zstd_proxy_arena_counters.used, block_size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&zstd_proxy_arena_counters.failures, 1, __ATOMIC_RELAXED);
+
+        return NULL;
+    }
+
+    zstd_proxy_arena_block *block = NULL;
+
+    if (class != zstd_proxy_arena_uncached) {
+        zstd_proxy_arena_shard *shard = zstd_proxy_arena_local_shard();
+
+        pthread_once(&zstd_proxy_arena_once, zstd_proxy_arena_init);
+        pthread_mutex_lock(&shard->lock);
+
+        if ((block = shard->free[class]) != NULL) {
+            shard->free[class] = block->next;
+            shard->cached -= block_size;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    if (block != NULL) {
+        __atomic_fetch_sub(&zstd_proxy_arena_counters.cached, block_size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&zstd_proxy_arena_counters.hits, 1, __ATOMIC_RELAXED);
+    } else {
+        block = mmap(NULL, block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (block == MAP_FAILED) {
+            __atomic_fetch_sub(&zstd_proxy_arena_counters.used, block_size, __ATOMIC_RELAXED);
+
+            return NULL;
+        }
+
+        __atomic_fetch_add(&zstd_proxy_arena_counters.misses, 1, __ATOMIC_RELAXED);
+    }
+
+    block->next = NULL;
+    block->size = block_size;
+    block->gauge = opaque;
+    block->class = class;
+
+    if (block->gauge != NULL) {
+        __atomic_fetch_add(block->gauge, block_size, __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_add(&zstd_proxy_metrics_global()->zstd_memory, block_size, __ATOMIC_RELAXED);
+
+    return &block[1];
+}
+
+static void zstd_proxy_arena_free(void *opaque, void *address) {
+    (void)opaque;
+
+    if (address == NULL) {
+        return;
+    }
+
+    zstd_proxy_arena_block *block = &((zstd_proxy_arena_block *)address)[-1];
+    size_t block_size = block->size;
+    bool cached = false;
+
+    if (block->gauge != NULL) {
+        __atomic_fetch_sub(block->gauge, block_size, __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_sub(&zstd_proxy_metrics_global()->zstd_memory, block_size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&zstd_proxy_arena_counters.used, block_size, __ATOMIC_RELAXED);
+
+    if (block->class != zstd_proxy_arena_uncached) {
+        zstd_proxy_arena_shard *shard = zstd_proxy_arena_local_shard();
+
+        pthread_mutex_lock(&shard->lock);
+
+        if (shard->cached + block_size <= zstd_proxy_arena_cache_limit()) {
+            block->next = shard->free[block->class];
+            shard->free[block->class] = block;
+            shard->cached += block_size;
+            cached = true;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    if (cached) {
+        __atomic_fetch_add(&zstd_proxy_arena_counters.cached, block_size, __ATOMIC_RELAXED);
+    } else {
+        munmap(block, block_size);
+    }
+}
+
+/** Unmap the cached blocks of every shard above `limit` bytes. */
+static void zstd_proxy_arena_release(size_t limit) {
+    pthread_once(&zstd_proxy_arena_once, zstd_proxy_arena_init);
+
+    for (size_t i = 0; i < zstd_proxy_arena_shards; i++) {
+        zstd_proxy_arena_shard *shard = &zstd_proxy_arena_shard_list[i];
+        zstd_proxy_arena_block *released = NULL;
+
+        pthread_mutex_lock(&shard->lock);
+
+        // Largest classes first, they free the most memory per block
+        for (size_t class = zstd_proxy_arena_classes; class-- > 0 && shard->cached > limit;) {
+            while (shard->free[class] != NULL && shard->cached > limit) {
+                zstd_proxy_arena_block *block = shard->free[class];
+
+                shard->free[class] = block->next;
+                shard->cached -= block->size;
+                block->next = released;
+                released = block;
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        while (released != NULL) {
+            zstd_proxy_arena_block *block = released;
+
+            released = block->next;
+
+            __atomic_fetch_sub(&zstd_proxy_arena_counters.cached, block->size, __ATOMIC_RELAXED);
+            munmap(block, block->size);
+        }
+    }
+}
+
+void zstd_proxy_arena_configure(const zstd_proxy_arena_options *options) {
+    __atomic_store_n(&zstd_proxy_arena_current.cache_size, options->cache_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstd_proxy_arena_current.limit, options->limit, __ATOMIC_RELAXED);
+
+    zstd_proxy_arena_release(zstd_proxy_arena_cache_limit());
+}
+
+void zstd_proxy_arena_get_options(zstd_proxy_arena_options *options) {
+    options->cache_size = __atomic_load_n(&zstd_proxy_arena_current.cache_size, __ATOMIC_RELAXED);
+    options->limit = __atomic_load_n(&zstd_proxy_arena_current.limit, __ATOMIC_RELAXED);
+}
+
+void zstd_proxy_arena_get_stats(zstd_proxy_arena_stats *stats) {
+    stats->used = __atomic_load_n(&zstd_proxy_arena_counters.used, __ATOMIC_RELAXED);
+    stats->cached = __atomic_load_n(&zstd_proxy_arena_counters.cached, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&zstd_proxy_arena_counters.hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&zstd_proxy_arena_counters.misses, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&zstd_proxy_arena_counters.failures, __ATOMIC_RELAXED);
+}
+
+void zstd_proxy_arena_trim(void) {
+    zstd_proxy_arena_release(0);
+}
+
+ZSTD_customMem zstd_proxy_arena_allocator(uint64_t *gauge) {
+    ZSTD_customMem allocator = { zstd_proxy_arena_alloc, zstd_proxy_arena_free, gauge };
+
+    return allocator;
+}
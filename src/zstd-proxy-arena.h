@@ -0,0 +1,55 @@
+#ifndef zstd_proxy_arena_H
+#define zstd_proxy_arena_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+
+/**
+ * Process-wide allocator for the Zstd contexts, passed to them as a `ZSTD_customMem`.
+ *
+ * A context allocates a few large blocks sized by its level and window: the context itself, the
+ * workspace and the stream buffers. Blocks are mapped in size classes (4 per power of two, from 4 KB
+ * to 64 MB) and freed blocks are cached for the next context instead of being unmapped, so connection
+ * churn doesn't go through the system allocator or fragment its heap. The cache is split in shards
+ * picked by CPU, so concurrent connections don't contend on a lock, and released in bulk by
+ * `zstd_proxy_arena_trim`.
+ *
+ * Blocks in use count against a process-wide limit: beyond it Zstd fails to allocate, and the
+ * connection fails with `ENOMEM` instead of the process running out of memory.
+ */
+
+typedef struct {
+    /** Bytes of freed blocks kept for reuse, spread across the shards. */
+    size_t cache_size;
+    /** Bytes of blocks in use across every context, 0 for no limit. */
+    size_t limit;
+} zstd_proxy_arena_options;
+
+typedef struct {
+    /** Bytes of blocks in use, including their class rounding. */
+    uint64_t used;
+    /** Bytes of freed blocks cached for reuse. */
+    uint64_t cached;
+    /** Allocations served from the cache. */
+    uint64_t hits;
+    /** Allocations which mapped a new block. */
+    uint64_t misses;
+    /** Allocations refused by the limit. */
+    uint64_t failures;
+} zstd_proxy_arena_stats;
+
+/** Replace the options, trimming the cache if it shrank. Defaults to a 64 MB cache and no limit. */
+void zstd_proxy_arena_configure(const zstd_proxy_arena_options *options);
+void zstd_proxy_arena_get_options(zstd_proxy_arena_options *options);
+void zstd_proxy_arena_get_stats(zstd_proxy_arena_stats *stats);
+
+/** Unmap every cached block. */
+void zstd_proxy_arena_trim(void);
+
+/** Allocator for a context, the bytes it uses are also added to `gauge` while allocated. */
+ZSTD_customMem zstd_proxy_arena_allocator(uint64_t *gauge);
+
+#endif
@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "zstd-proxy-balancer.h"
+#include "zstd-proxy-utils.h"
+
+/** Interval between the slowness checks of an upstream. */
+#define zstd_proxy_balancer_check_ns (1000 * 1000 * 1000)
+/** Sends completed within an interval before an upstream can be judged slow. */
+#define zstd_proxy_balancer_check_samples 16
+/** The ejection time stops doubling after this many ejections. */
+#define zstd_proxy_balancer_doublings_max 6
+
+const char *const zstd_proxy_balance_names[] = {
+    [zstd_proxy_balance_p2c] = "p2c",
+    [zstd_proxy_balance_least] = "least",
+};
+
+struct zstd_proxy_balancer_entry {
+    struct zstd_proxy_balancer_entry *prev;
+    struct zstd_proxy_balancer_entry *next;
+    size_t upstream;
+    zstd_proxy *proxy;
+    bool compress;
+};
+
+typedef struct {
+    const char *name;
+    zstd_proxy_balancer_entry *entries;
+    size_t connections;
+    /** Failed connections in a row. */
+    size_t failures;
+    /** Ejected until this monotonic time, and how many times in a row. */
+    uint64_t ejected_until;
+    size_t ejections;
+
+    /** `process_to_send` totals of the closed connections, added to the ones of the running connections. */
+    uint64_t closed_sum;
+    uint64_t closed_count;
+    /** Totals at the last slowness check. */
+    uint64_t checked_sum;
+    uint64_t checked_count;
+    uint64_t checked_at;
+} zstd_proxy_balancer_upstream;
+
+struct zstd_proxy_balancer {
+    zstd_proxy_balancer_options options;
+    pthread_mutex_t lock;
+    /** xorshift state picking the candidates of `zstd_proxy_balance_p2c`. */
+    uint64_t random;
+    /** Rotates the start of the scans, so ties don't always go to the first upstream. */
+    size_t turn;
+    /** Upstreams which aren't ejected, refreshed by every pick. */
+    size_t *eligible;
+    size_t count;
+    zstd_proxy_balancer_upstream upstreams[];
+};
+
+zstd_proxy_balance_policy zstd_proxy_balance_parse(const char *name) {
+    for (zstd_proxy_balance_policy policy = 0; policy < zstd_proxy_balance_count; policy++) {
+        if (strcmp(name, zstd_proxy_balance_names[policy]) == 0) {
+            return policy;
+        }
+    }
+
+    return zstd_proxy_balance_count;
+}
+
+void zstd_proxy_balancer_default_options(zstd_proxy_balancer_options *options) {
+    options->policy = zstd_proxy_balance_p2c;
+    options->max_failures = 3;
+    options->ejection_ms = 10 * 1000;
+    options->slow_ms = 1000;
+}
+
+int zstd_proxy_balancer_create(
+    zstd_proxy_balancer **balancer_ptr,
+    const char *const *names,
+    size_t count,
+    const zstd_proxy_balancer_options *options
+) {
+    zstd_proxy_balancer *balancer = calloc(1, sizeof(zstd_proxy_balancer) + count * sizeof(zstd_proxy_balancer_upstream));
+
+    *balancer_ptr = NULL;
+
+    if (balancer == NULL || (balancer->eligible = calloc(count, sizeof(size_t))) == NULL) {
+        free(balancer);
+
+        return ENOMEM;
+    }
+
+    balancer->options = *options;
+    balancer->random = zstd_proxy_now_ns() | 1;
+    balancer->count = count;
+
+    for (size_t i = 0; i < count; i++) {
+        balancer->upstreams[i].name = names[i];
+    }
+
+    pthread_mutex_init(&balancer->lock, NULL);
+
+    *balancer_ptr = balancer;
+
+    return 0;
+}
+
+void zstd_proxy_balancer_destroy(zstd_proxy_balancer *balancer) {
+    if (balancer == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&balancer->lock);
+    free(balancer->eligible);
+    free(balancer);
+}
+
+static inline uint64_t zstd_proxy_balancer_random(zstd_proxy_balancer *balancer) {
+    uint64_t x = balancer->random;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return balancer->random = x;
+}
+
+/** Direction of `entry` sending to its upstream. */
+static inline zstd_proxy_direction_metrics *zstd_proxy_balancer_metrics(zstd_proxy_balancer_entry *entry) {
+    return entry->compress ? &entry->proxy->metrics.compress : &entry->proxy->metrics.decompress;
+}
+
+static inline zstd_proxy_histogram *zstd_proxy_balancer_sends(zstd_proxy_balancer_entry *entry) {
+    return entry->compress
+        ? &entry->proxy->latency.compress.process_to_send
+        : &entry->proxy->latency.decompress.process_to_send;
+}
+
+/** Bytes the connections of `upstream` produced for it and didn't send yet. */
+static uint64_t zstd_proxy_balancer_load(zstd_proxy_balancer_upstream *upstream) {
+    uint64_t load = 0;
+
+    for (zstd_proxy_balancer_entry *entry = upstream->entries; entry != NULL; entry = entry->next) {
+        zstd_proxy_direction_metrics *metrics = zstd_proxy_balancer_metrics(entry);
+        // Sent first, the counters are updated separately and the other order could see more sent than produced
+        uint64_t sent = __atomic_load_n(&metrics->bytes_out, __ATOMIC_RELAXED);
+        uint64_t produced = __atomic_load_n(&metrics->bytes_produced, __ATOMIC_RELAXED);
+
+        load += produced > sent ? produced - sent : 0;
+    }
+
+    return load;
+}
+
+static void zstd_proxy_balancer_eject(
+    zstd_proxy_balancer *balancer,
+    zstd_proxy_balancer_upstream *upstream,
+    uint64_t now,
+    const char *reason
+) {
+    size_t doublings = upstream->ejections < zstd_proxy_balancer_doublings_max
+        ? upstream->ejections
+        : zstd_proxy_balancer_doublings_max;
+    uint64_t duration = balancer->options.ejection_ms * 1000 * 1000 << doublings;
+
+    // Healthy for longer than its last ejection, start over
+    if (now > upstream->ejected_until && now - upstream->ejected_until > duration) {
+        upstream->ejections = 0;
+        duration = balancer->options.ejection_ms * 1000 * 1000;
+    }
+
+    upstream->ejected_until = now + duration;
+    upstream->ejections++;
+
+    log_error("upstream %s ejected for %llu ms: %s", upstream->name, (unsigned long long)(duration / 1000 / 1000), reason);
+}
+
+/** Eject `upstream` if its sends took more than `slow_ms` on average since the last check. */
+static void zstd_proxy_balancer_check(zstd_proxy_balancer *balancer, zstd_proxy_balancer_upstream *upstream, uint64_t now) {
+    if (balancer->options.slow_ms == 0 || now - upstream->checked_at < zstd_proxy_balancer_check_ns) {
+        return;
+    }
+
+    uint64_t sum = upstream->closed_sum;
+    uint64_t count = upstream->closed_count;
+
+    for (zstd_proxy_balancer_entry *entry = upstream->entries; entry != NULL; entry = entry->next) {
+        zstd_proxy_histogram *sends = zstd_proxy_balancer_sends(entry);
+
+        sum += __atomic_load_n(&sends->sum, __ATOMIC_RELAXED);
+        count += __atomic_load_n(&sends->count, __ATOMIC_RELAXED);
+    }
+
+    uint64_t samples = count - upstream->checked_count;
+    uint64_t total = sum - upstream->checked_sum;
+
+    upstream->checked_sum = sum;
+    upstream->checked_count = count;
+    upstream->checked_at = now;
+
+    if (samples >= zstd_proxy_balancer_check_samples && total / samples > balancer->options.slow_ms * 1000 * 1000) {
+        zstd_proxy_balancer_eject(balancer, upstream, now, "sends are slow");
+    }
+}
+
+/** Whether `a` should get the connection over `b`. */
+static inline bool zstd_proxy_balancer_better(uint64_t a_load, size_t a_connections, uint64_t b_load, size_t b_connections) {
+    return a_load < b_load || (a_load == b_load && a_connections < b_connections);
+}
+
+size_t zstd_proxy_balancer_pick(zstd_proxy_balancer *balancer) {
+    uint64_t now = zstd_proxy_now_ns();
+    size_t *eligible = balancer->eligible;
+    size_t count = 0;
+    size_t picked = 0;
+
+    pthread_mutex_lock(&balancer->lock);
+
+    for (size_t n = 0; n < balancer->count; n++) {
+        size_t i = (balancer->turn + n) % balancer->count;
+        zstd_proxy_balancer_upstream *upstream = &balancer->upstreams[i];
+
+        zstd_proxy_balancer_check(balancer, upstream, now);
+
+        if (now >= upstream->ejected_until) {
+            eligible[count++] = i;
+        }
+    }
+
+    // Better an upstream which may be down than none
+    if (count == 0) {
+        for (size_t n = 0; n < balancer->count; n++) {
+            eligible[count++] = (balancer->turn + n) % balancer->count;
+        }
+    }
+
+    balancer->turn++;
+
+    if (count == 1) {
+        picked = eligible[0];
+    } else if (balancer->options.policy == zstd_proxy_balance_p2c) {
+        size_t first = zstd_proxy_balancer_random(balancer) % count;
+        size_t second = (first + 1 + zstd_proxy_balancer_random(balancer) % (count - 1)) % count;
+        zstd_proxy_balancer_upstream *a = &balancer->upstreams[eligible[first]];
+        zstd_proxy_balancer_upstream *b = &balancer->upstreams[eligible[second]];
+        bool better = zstd_proxy_balancer_better(
+            zstd_proxy_balancer_load(b), b->connections,
+            zstd_proxy_balancer_load(a), a->connections
+        );
+
+        picked = eligible[better ? second : first];
+    } else {
+        uint64_t best_load = 0;
+        size_t best_connections = 0;
+
+        for (size_t n = 0; n < count; n++) {
+            zstd_proxy_balancer_upstream *upstream = &balancer->upstreams[eligible[n]];
+            uint64_t load = zstd_proxy_balancer_load(upstream);
+
+            if (n == 0 || zstd_proxy_balancer_better(load, upstream->connections, best_load, best_connections)) {
+                picked = eligible[n];
+                best_load = load;
+                best_connections = upstream->connections;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&balancer->lock);
+
+    return picked;
+}
+
+void zstd_proxy_balancer_connected(zstd_proxy_balancer *balancer, size_t upstream_index, bool success) {
+    zstd_proxy_balancer_upstream *upstream = &balancer->upstreams[upstream_index];
+
+    pthread_mutex_lock(&balancer->lock);
+
+    if (success) {
+        upstream->failures = 0;
+    } else if (++upstream->failures >= balancer->options.max_failures) {
+        upstream->failures = 0;
+        zstd_proxy_balancer_eject(balancer, upstream, zstd_proxy_now_ns(), "connections failed");
+    }
+
+    pthread_mutex_unlock(&balancer->lock);
+}
+
+int zstd_proxy_balancer_opened(
+    zstd_proxy_balancer *balancer,
+    size_t upstream_index,
+    zstd_proxy *proxy,
+    bool compress,
+    zstd_proxy_balancer_entry **entry_ptr
+) {
+    zstd_proxy_balancer_upstream *upstream = &balancer->upstreams[upstream_index];
+    zstd_proxy_balancer_entry *entry = malloc(sizeof(zstd_proxy_balancer_entry));
+
+    *entry_ptr = entry;
+
+    if (entry == NULL) {
+        return ENOMEM;
+    }
+
+    *entry = (zstd_proxy_balancer_entry){
+        .prev = NULL,
+        .next = NULL,
+        .upstream = upstream_index,
+        .proxy = proxy,
+        .compress = compress,
+    };
+
+    pthread_mutex_lock(&balancer->lock);
+
+    if ((entry->next = upstream->entries) != NULL) {
+        entry->next->prev = entry;
+    }
+
+    upstream->entries = entry;
+    upstream->connections++;
+
+    pthread_mutex_unlock(&balancer->lock);
+
+    return 0;
+}
+
+void zstd_proxy_balancer_closed(zstd_proxy_balancer *balancer, zstd_proxy_balancer_entry *entry) {
+    zstd_proxy_balancer_upstream *upstream = &balancer->upstreams[entry->upstream];
+    zstd_proxy_histogram *sends = zstd_proxy_balancer_sends(entry);
+
+    pthread_mutex_lock(&balancer->lock);
+
+    // Keeps the totals of the upstream growing, the next check still sees the sends of this connection
+    upstream->closed_sum += __atomic_load_n(&sends->sum, __ATOMIC_RELAXED);
+    upstream->closed_count += __atomic_load_n(&sends->count, __ATOMIC_RELAXED);
+    upstream->connections--;
+
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        upstream->entries = entry->next;
+    }
+
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    }
+
+    pthread_mutex_unlock(&balancer->lock);
+
+    free(entry);
+}
@@ -0,0 +1,81 @@
+#ifndef zstd_proxy_balancer_H
+#define zstd_proxy_balancer_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "zstd-proxy.h"
+
+/**
+ * Picks the upstream of each new connection among several, from the engine queues of the connections
+ * already running on them.
+ *
+ * The load of an upstream is the data its connections hold waiting to be sent to it: the bytes the direction
+ * sending to it produced and didn't send yet (`bytes_produced - bytes_out`), then its number of connections. An upstream refusing
+ * `max_failures` connections in a row, or whose connections wait more than `slow_ms` on average for their
+ * sends to complete (`process_to_send`), is ejected: it gets no new connections for `ejection_ms`, doubled
+ * each time it's ejected again, then is tried again. When every upstream is ejected, they are all used.
+ */
+
+typedef enum {
+    /** Least loaded of two upstreams picked at random, doesn't send every new connection to the same one. */
+    zstd_proxy_balance_p2c,
+    /** Least loaded upstream. */
+    zstd_proxy_balance_least,
+    zstd_proxy_balance_count,
+} zstd_proxy_balance_policy;
+
+extern const char *const zstd_proxy_balance_names[];
+
+/** Parse a policy name, returns `zstd_proxy_balance_count` if unknown. */
+zstd_proxy_balance_policy zstd_proxy_balance_parse(const char *name);
+
+typedef struct {
+    zstd_proxy_balance_policy policy;
+    /** Failed connections in a row ejecting an upstream. */
+    size_t max_failures;
+    /** First ejection time, in milliseconds. */
+    uint64_t ejection_ms;
+    /** Mean time from processing to send completion ejecting an upstream, 0 to disable. */
+    uint64_t slow_ms;
+} zstd_proxy_balancer_options;
+
+void zstd_proxy_balancer_default_options(zstd_proxy_balancer_options *options);
+
+typedef struct zstd_proxy_balancer zstd_proxy_balancer;
+
+/** A connection running on an upstream. */
+typedef struct zstd_proxy_balancer_entry zstd_proxy_balancer_entry;
+
+/** `names` are only used in logs, they must outlive the balancer. */
+int zstd_proxy_balancer_create(
+    zstd_proxy_balancer **balancer_ptr,
+    const char *const *names,
+    size_t count,
+    const zstd_proxy_balancer_options *options
+);
+
+/** Upstream of the next connection. */
+size_t zstd_proxy_balancer_pick(zstd_proxy_balancer *balancer);
+
+/** Report whether connecting to `upstream` failed. */
+void zstd_proxy_balancer_connected(zstd_proxy_balancer *balancer, size_t upstream, bool success);
+
+/**
+ * Count `proxy` in the load of `upstream` until `zstd_proxy_balancer_closed`, `compress` is set when the
+ * compressing direction sends to it. `proxy` must stay valid until then.
+ */
+int zstd_proxy_balancer_opened(
+    zstd_proxy_balancer *balancer,
+    size_t upstream,
+    zstd_proxy *proxy,
+    bool compress,
+    zstd_proxy_balancer_entry **entry_ptr
+);
+
+void zstd_proxy_balancer_closed(zstd_proxy_balancer *balancer, zstd_proxy_balancer_entry *entry);
+
+void zstd_proxy_balancer_destroy(zstd_proxy_balancer *balancer);
+
+#endif
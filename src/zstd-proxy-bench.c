@@ -0,0 +1,532 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "zstd-proxy-bench.h"
+#include "zstd-proxy-utils.h"
+#include "zstd-proxy-capture.h"
+
+#if __linux__
+#include "zstd-proxy-epoll.h"
+#endif
+
+static const char *const zstd_proxy_bench_words[] = {
+    "user", "session", "request", "response", "status", "ok", "error", "timeout", "click", "view",
+    "cart", "checkout", "payment", "region", "eu-west-1", "us-east-1", "latency", "bytes", "items", "price",
+};
+
+static inline uint64_t zstd_proxy_bench_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static inline void zstd_proxy_bench_fill_random(uint64_t *state, char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = zstd_proxy_bench_random(state);
+    }
+}
+
+static void zstd_proxy_bench_fill_json(uint64_t *state, char *data, size_t size) {
+    size_t words = sizeof(zstd_proxy_bench_words) / sizeof(char *);
+    size_t offset = 0;
+    char record[256];
+
+    while (offset < size) {
+        int length = snprintf(
+            record,
+            sizeof(record),
+            "{\"id\":%lu,\"%s\":\"%s\",\"%s\":%lu,\"tags\":[\"%s\",\"%s\"]}\n",
+            (unsigned long)(zstd_proxy_bench_random(state) % 1000000),
+            zstd_proxy_bench_words[zstd_proxy_bench_random(state) % words],
+            zstd_proxy_bench_words[zstd_proxy_bench_random(state) % words],
+            zstd_proxy_bench_words[zstd_proxy_bench_random(state) % words],
+            (unsigned long)(zstd_proxy_bench_random(state) % 100000),
+            zstd_proxy_bench_words[zstd_proxy_bench_random(state) % words],
+            zstd_proxy_bench_words[zstd_proxy_bench_random(state) % words]
+        );
+        size_t copy = (size_t)length < size - offset ? (size_t)length : size - offset;
+
+        memcpy(&data[offset], record, copy);
+        offset += copy;
+    }
+}
+
+static int zstd_proxy_bench_read_file(zstd_proxy_bench_corpus *corpus, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        int error = errno;
+
+        log_error("failed to open corpus %s: %s", path, strerror(error));
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return error;
+    }
+
+    corpus->size = info.st_size;
+    corpus->data = malloc(corpus->size);
+
+    int error = corpus->data == NULL ? ENOMEM : zstd_proxy_bench_read(fd, corpus->data, corpus->size);
+
+    close(fd);
+
+    if (error == 0 && corpus->size == 0) {
+        error = EINVAL;
+    }
+
+    if (error != 0) {
+        log_error("failed to read corpus %s: %s", path, strerror(error));
+    }
+
+    return error;
+}
+
+static int zstd_proxy_bench_append_record(const zstd_proxy_capture_record *record, const void *payload, void *data) {
+    zstd_proxy_bench_corpus *corpus = data;
+    char *grown = realloc(corpus->data, corpus->size + record->length);
+
+    if (grown == NULL) {
+        return ENOMEM;
+    }
+
+    memcpy(&grown[corpus->size], payload, record->length);
+
+    corpus->data = grown;
+    corpus->size += record->length;
+
+    return 0;
+}
+
+/** Concatenate the plaintext of a capture file, see `zstd-proxy-capture.h`. */
+static int zstd_proxy_bench_read_capture(zstd_proxy_bench_corpus *corpus, const char *path) {
+    corpus->size = 0;
+
+    int error = zstd_proxy_capture_read(path, zstd_proxy_bench_append_record, corpus);
+
+    if (error == 0 && corpus->size == 0) {
+        error = EINVAL;
+    }
+
+    if (error != 0) {
+        log_error("failed to read capture %s: %s", path, strerror(error));
+    }
+
+    return error;
+}
+
+int zstd_proxy_bench_parse_list(const char *value, size_t *values) {
+    int count = 0;
+
+    while (*value != '\0') {
+        char *end = NULL;
+
+        if (count == zstd_proxy_bench_max_values) {
+            return -1;
+        }
+
+        values[count++] = strtoull(value, &end, 10);
+
+        // Support k/m/g suffixes for sizes
+        switch (*end) {
+            case 'k': values[count - 1] <<= 10; end++; break;
+            case 'm': values[count - 1] <<= 20; end++; break;
+            case 'g': values[count - 1] <<= 30; end++; break;
+        }
+
+        if (end == value || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        value = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+int zstd_proxy_bench_parse_names(char *value, const char **names) {
+    int count = 0;
+    char *save = NULL;
+
+    for (char *name = strtok_r(value, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (count == zstd_proxy_bench_max_values) {
+            return -1;
+        }
+
+        names[count++] = name;
+    }
+
+    return count;
+}
+
+int zstd_proxy_bench_corpus_load(zstd_proxy_bench_corpus *corpus, const char *spec, double compressibility, size_t size) {
+    uint64_t state = 0x9E3779B97F4A7C15;
+
+    corpus->name = spec;
+    corpus->data = NULL;
+    corpus->size = size;
+
+    if (strncmp(spec, "file:", 5) == 0) {
+        int error = zstd_proxy_bench_read_file(corpus, &spec[5]);
+
+        if (error != 0) {
+            return error;
+        }
+    } else if (strncmp(spec, "capture:", 8) == 0) {
+        int error = zstd_proxy_bench_read_capture(corpus, &spec[8]);
+
+        if (error != 0) {
+            return error;
+        }
+    } else {
+        corpus->data = malloc(size);
+
+        if (corpus->data == NULL) {
+            return ENOMEM;
+        }
+
+        if (strcmp(spec, "zeros") == 0) {
+            memset(corpus->data, 0, size);
+        } else if (strcmp(spec, "random") == 0) {
+            zstd_proxy_bench_fill_random(&state, corpus->data, size);
+        } else if (strcmp(spec, "json") == 0) {
+            zstd_proxy_bench_fill_json(&state, corpus->data, size);
+        } else {
+            log_error("unknown corpus %s", spec);
+
+            return EINVAL;
+        }
+    }
+
+    if (compressibility < 1) {
+        size_t block = 256;
+        size_t noise = (1 - compressibility) * block;
+
+        for (size_t offset = 0; offset < corpus->size; offset += block) {
+            size_t end = offset + block < corpus->size ? offset + block : corpus->size;
+            size_t start = end - offset > noise ? end - noise : offset;
+
+            zstd_proxy_bench_fill_random(&state, &corpus->data[start], end - start);
+        }
+    }
+
+    return 0;
+}
+
+void zstd_proxy_bench_corpus_free(zstd_proxy_bench_corpus *corpus) {
+    free(corpus->data);
+
+    corpus->data = NULL;
+    corpus->size = 0;
+}
+
+static int zstd_proxy_bench_tcp_pair(int fds[2]) {
+    int error = 0;
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t length = sizeof(address);
+
+    fds[0] = fds[1] = -1;
+
+    if (
+        server < 0 ||
+        bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server, 1) != 0 ||
+        getsockname(server, (struct sockaddr *)&address, &length) != 0 ||
+        (fds[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(fds[0], (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        (fds[1] = accept(server, NULL, NULL)) < 0
+    ) {
+        error = errno;
+        log_error("failed to create loopback connection: %s", strerror(error));
+
+        if (fds[0] >= 0) {
+            close(fds[0]);
+        }
+    } else {
+        setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (server >= 0) {
+        close(server);
+    }
+
+    return error;
+}
+
+int zstd_proxy_bench_socketpair(const char *transport, int fds[2]) {
+    if (strcmp(transport, "tcp") == 0) {
+        return zstd_proxy_bench_tcp_pair(fds);
+    } else if (strcmp(transport, "unix") == 0) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            int error = errno;
+
+            log_error("failed to create socket pair: %s", strerror(error));
+
+            return error;
+        }
+
+        return 0;
+    }
+
+    log_error("unknown transport %s", transport);
+
+    return EINVAL;
+}
+
+int zstd_proxy_bench_engine_create(zstd_proxy_epoll **engine) {
+#if __linux__
+    zstd_proxy_epoll_options options;
+
+    zstd_proxy_epoll_default_options(&options);
+
+    return zstd_proxy_epoll_create(engine, &options);
+#else
+    log_error("the epoll backend is only available on Linux");
+
+    return ENOTSUP;
+#endif
+}
+
+void zstd_proxy_bench_engine_destroy(zstd_proxy_epoll *engine) {
+#if __linux__
+    zstd_proxy_epoll_destroy(engine);
+#endif
+}
+
+static void zstd_proxy_bench_done(zstd_proxy *proxy, int error, void *data) {
+    zstd_proxy_bench_pipeline *pipeline = data;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    if (proxy == &pipeline->compress) {
+        pipeline->compress_error = error;
+    } else {
+        pipeline->decompress_error = error;
+    }
+
+    pipeline->running--;
+
+    pthread_cond_signal(&pipeline->done);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static int zstd_proxy_bench_pipeline_start_engine(zstd_proxy_bench_pipeline *pipeline) {
+    int error = 0;
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->done, NULL);
+
+    pipeline->running = 2;
+
+    if ((error = zstd_proxy_start(&pipeline->compress, pipeline->engine, zstd_proxy_bench_done, pipeline)) != 0) {
+        // The decompress sockets are still open
+        close(pipeline->decompress.listen.fd);
+        close(pipeline->decompress.connect.fd);
+
+        pipeline->running = 0;
+    } else if ((error = zstd_proxy_start(&pipeline->decompress, pipeline->engine, zstd_proxy_bench_done, pipeline)) != 0) {
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->running--;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        zstd_proxy_stop(&pipeline->compress);
+    }
+
+    if (error != 0) {
+        log_error("error starting proxy on engine: %s", strerror(error));
+
+        // Callers do not join pipelines which failed to start
+        zstd_proxy_bench_pipeline_join(pipeline);
+    }
+
+    return error;
+}
+
+static void *zstd_proxy_bench_compress_thread(void *data) {
+    zstd_proxy_bench_pipeline *pipeline = data;
+
+    pipeline->compress_error = zstd_proxy_run(&pipeline->compress);
+
+    return NULL;
+}
+
+static void *zstd_proxy_bench_decompress_thread(void *data) {
+    zstd_proxy_bench_pipeline *pipeline = data;
+
+    pipeline->decompress_error = zstd_proxy_run(&pipeline->decompress);
+
+    return NULL;
+}
+
+int zstd_proxy_bench_pipeline_start(zstd_proxy_bench_pipeline *pipeline, const char *transport) {
+    int error = 0;
+    int client[2], link[2], server[2];
+
+    pipeline->compress_error = 0;
+    pipeline->decompress_error = 0;
+
+    if (!pipeline->proxied) {
+        error = zstd_proxy_bench_socketpair(transport, client);
+
+        pipeline->client_fd = client[0];
+        pipeline->server_fd = client[1];
+
+        return error;
+    }
+
+    if (
+        (error = zstd_proxy_bench_socketpair(transport, client)) != 0 ||
+        (error = zstd_proxy_bench_socketpair(transport, link)) != 0 ||
+        (error = zstd_proxy_bench_socketpair(transport, server)) != 0
+    ) {
+        return error;
+    }
+
+    zstd_proxy_init(&pipeline->compress);
+    zstd_proxy_init(&pipeline->decompress);
+
+    pipeline->client_fd = client[0];
+    pipeline->server_fd = server[1];
+
+    // client -> compress proxy -> link -> decompress proxy -> server
+    pipeline->compress.options = pipeline->options;
+    pipeline->compress.listen.fd = client[1];
+    pipeline->compress.connect.fd = link[0];
+
+    pipeline->decompress.options = pipeline->options;
+    pipeline->decompress.listen.fd = server[0];
+    pipeline->decompress.connect.fd = link[1];
+
+    if (pipeline->engine != NULL) {
+        return zstd_proxy_bench_pipeline_start_engine(pipeline);
+    }
+
+    error = pthread_create(&pipeline->compress_thread, NULL, zstd_proxy_bench_compress_thread, pipeline);
+
+    if (error != 0) {
+        log_error("error creating compress proxy thread: %s", strerror(error));
+
+        return error;
+    }
+
+    error = pthread_create(&pipeline->decompress_thread, NULL, zstd_proxy_bench_decompress_thread, pipeline);
+
+    if (error != 0) {
+        log_error("error creating decompress proxy thread: %s", strerror(error));
+
+        return error;
+    }
+
+    return 0;
+}
+
+int zstd_proxy_bench_pipeline_join(zstd_proxy_bench_pipeline *pipeline) {
+    if (!pipeline->proxied) {
+        return 0;
+    }
+
+    if (pipeline->engine != NULL) {
+        pthread_mutex_lock(&pipeline->lock);
+
+        while (pipeline->running > 0) {
+            pthread_cond_wait(&pipeline->done, &pipeline->lock);
+        }
+
+        pthread_mutex_unlock(&pipeline->lock);
+        pthread_mutex_destroy(&pipeline->lock);
+        pthread_cond_destroy(&pipeline->done);
+    } else {
+        pthread_join(pipeline->compress_thread, NULL);
+        pthread_join(pipeline->decompress_thread, NULL);
+    }
+
+    return pipeline->compress_error != 0 ? pipeline->compress_error : pipeline->decompress_error;
+}
+
+int zstd_proxy_bench_write(int fd, const void *data, size_t size) {
+    size_t offset = 0;
+
+    while (offset < size) {
+        ssize_t written = send(fd, &((const char *)data)[offset], size - offset, MSG_NOSIGNAL);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        }
+
+        offset += written;
+    }
+
+    return 0;
+}
+
+int zstd_proxy_bench_read(int fd, void *data, size_t size) {
+    size_t offset = 0;
+
+    while (offset < size) {
+        ssize_t received = read(fd, &((char *)data)[offset], size - offset);
+
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        } else if (received == 0) {
+            return EPIPE;
+        }
+
+        offset += received;
+    }
+
+    return 0;
+}
+
+double zstd_proxy_bench_cpu_seconds(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return
+        usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+void zstd_proxy_bench_print_histogram(const zstd_proxy_histogram *histogram) {
+    printf(
+        "{\"count\": %lu, \"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f}",
+        (unsigned long)histogram->count,
+        histogram->count == 0 ? 0 : histogram->sum / 1e3 / histogram->count,
+        zstd_proxy_histogram_percentile(histogram, 0.5) / 1e3,
+        zstd_proxy_histogram_percentile(histogram, 0.99) / 1e3,
+        zstd_proxy_histogram_percentile(histogram, 0.999) / 1e3
+    );
+}
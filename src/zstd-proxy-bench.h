@@ -0,0 +1,83 @@
+#ifndef zstd_proxy_bench_H
+#define zstd_proxy_bench_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "zstd-proxy.h"
+
+/** Maximum values accepted by a comma-separated list option. */
+#define zstd_proxy_bench_max_values 16
+
+typedef struct {
+    /** Corpus name as passed on the command line. */
+    const char *name;
+    /** Corpus data, repeated to fill messages. */
+    char *data;
+    /** Size of `data`. */
+    size_t size;
+} zstd_proxy_bench_corpus;
+
+typedef struct {
+    /** `true` to route traffic through a compress and a decompress proxy. */
+    bool proxied;
+    /** Options passed to both proxies. */
+    zstd_proxy_options options;
+    /** Run both proxies on this engine instead of a thread each when set. */
+    zstd_proxy_epoll *engine;
+
+    /** Plaintext side of the compressing proxy. */
+    int client_fd;
+    /** Plaintext side of the decompressing proxy. */
+    int server_fd;
+
+    zstd_proxy compress;
+    zstd_proxy decompress;
+    pthread_t compress_thread;
+    pthread_t decompress_thread;
+    int compress_error;
+    int decompress_error;
+    /** Proxies still running on `engine`, signalled through `done`. */
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} zstd_proxy_bench_pipeline;
+
+/** Parse a comma-separated list of unsigned integers, returns the count or -1. */
+int zstd_proxy_bench_parse_list(const char *value, size_t *values);
+
+/** Parse a comma-separated list of strings, `value` is modified in place. Returns the count or -1. */
+int zstd_proxy_bench_parse_names(char *value, const char **names);
+
+/**
+ * Load a corpus: `zeros`, `random`, `json` (synthetic records), `file:<path>` or `capture:<path>` (a capture file).
+ * `compressibility` from 0 to 1 replaces a share of every 256 bytes block with random data.
+ */
+int zstd_proxy_bench_corpus_load(zstd_proxy_bench_corpus *corpus, const char *spec, double compressibility, size_t size);
+void zstd_proxy_bench_corpus_free(zstd_proxy_bench_corpus *corpus);
+
+/** Create the engine for the `epoll` backend with its default options, `ENOTSUP` off Linux. */
+int zstd_proxy_bench_engine_create(zstd_proxy_epoll **engine);
+void zstd_proxy_bench_engine_destroy(zstd_proxy_epoll *engine);
+
+/** Create a pair of connected `unix` or `tcp` (loopback) stream sockets. */
+int zstd_proxy_bench_socketpair(const char *transport, int fds[2]);
+
+/** Connect `client_fd` to `server_fd`, through a compress/decompress proxy pair if `proxied`. */
+int zstd_proxy_bench_pipeline_start(zstd_proxy_bench_pipeline *pipeline, const char *transport);
+/** Wait for both proxies to exit, returns the first error. */
+int zstd_proxy_bench_pipeline_join(zstd_proxy_bench_pipeline *pipeline);
+
+/** Write or read exactly `size` bytes, returns 0 or an errno value (`EPIPE` on EOF). */
+int zstd_proxy_bench_write(int fd, const void *data, size_t size);
+int zstd_proxy_bench_read(int fd, void *data, size_t size);
+
+/** User + system CPU time of the process. */
+double zstd_proxy_bench_cpu_seconds(void);
+
+/** Print a histogram as a JSON object with percentiles in microseconds. */
+void zstd_proxy_bench_print_histogram(const zstd_proxy_histogram *histogram);
+
+#endif
@@ -0,0 +1,323 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "zstd-proxy-capture.h"
+#include "zstd-proxy-utils.h"
+
+#define zstd_proxy_capture_align(size) (((size) + 7) & ~(size_t)7)
+
+uint32_t zstd_proxy_capture_sample = 0;
+
+/** Held for reading while recording, for writing while the mapping changes. */
+static pthread_rwlock_t zstd_proxy_capture_mapping_lock = PTHREAD_RWLOCK_INITIALIZER;
+/** Held while reserving room in the ring, the payload is copied after it's released. */
+static pthread_mutex_t zstd_proxy_capture_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static zstd_proxy_capture_header *zstd_proxy_capture_mapping = NULL;
+static size_t zstd_proxy_capture_mapping_size = 0;
+static size_t zstd_proxy_capture_max_length = 0;
+
+static inline zstd_proxy_capture_record *zstd_proxy_capture_at(zstd_proxy_capture_header *header, uint64_t offset) {
+    return (zstd_proxy_capture_record *)((char *)header + header->header_size + offset);
+}
+
+static inline size_t zstd_proxy_capture_record_size(const zstd_proxy_capture_record *record) {
+    return zstd_proxy_capture_align(sizeof(zstd_proxy_capture_record) + record->length);
+}
+
+/** Overwrite the oldest records until `[head, end)` is free, `false` if a record still being written is in the way. */
+static bool zstd_proxy_capture_evict(zstd_proxy_capture_header *header, uint64_t end) {
+    while (header->entries > 0 && header->tail >= header->head && header->tail < end) {
+        zstd_proxy_capture_record *record = zstd_proxy_capture_at(header, header->tail);
+        uint32_t state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+
+        // Its writer copies the payload without the ring lock, the space can't be handed out before it commits
+        if (state == zstd_proxy_capture_writing) {
+            return false;
+        }
+
+        if (state == zstd_proxy_capture_padding) {
+            header->tail = 0;
+        } else {
+            header->tail += zstd_proxy_capture_record_size(record);
+            header->overwritten++;
+        }
+
+        if (header->tail + sizeof(zstd_proxy_capture_record) > header->capacity) {
+            header->tail = 0;
+        }
+
+        header->entries--;
+    }
+
+    return true;
+}
+
+/** Reserve room for a record of `length` bytes, `NULL` when it's dropped. */
+static zstd_proxy_capture_record *zstd_proxy_capture_reserve(zstd_proxy_capture_header *header, size_t length) {
+    size_t size = zstd_proxy_capture_align(sizeof(zstd_proxy_capture_record) + length);
+    zstd_proxy_capture_record *record = NULL;
+
+    pthread_mutex_lock(&zstd_proxy_capture_ring_lock);
+
+    if (header->head + size > header->capacity) {
+        if (!zstd_proxy_capture_evict(header, header->capacity)) {
+            goto cleanup;
+        }
+
+        if (header->head + sizeof(zstd_proxy_capture_record) <= header->capacity) {
+            zstd_proxy_capture_at(header, header->head)->state = zstd_proxy_capture_padding;
+            header->entries++;
+        }
+
+        header->head = 0;
+    }
+
+    if (!zstd_proxy_capture_evict(header, header->head + size)) {
+        goto cleanup;
+    }
+
+    record = zstd_proxy_capture_at(header, header->head);
+
+    record->state = zstd_proxy_capture_writing;
+    record->length = length;
+
+    header->head += size;
+    header->entries++;
+    header->records++;
+    header->bytes += length;
+
+    if (header->head + sizeof(zstd_proxy_capture_record) > header->capacity) {
+        header->head = 0;
+    }
+
+    cleanup:
+
+    if (record == NULL) {
+        header->dropped++;
+    }
+
+    pthread_mutex_unlock(&zstd_proxy_capture_ring_lock);
+
+    return record;
+}
+
+void zstd_proxy_capture_record_chunk(uint64_t connection, zstd_proxy_capture_direction direction, const void *data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+
+    pthread_rwlock_rdlock(&zstd_proxy_capture_mapping_lock);
+
+    zstd_proxy_capture_header *header = zstd_proxy_capture_mapping;
+
+    if (header != NULL) {
+        uint64_t start = zstd_proxy_now_ns();
+        struct timespec now;
+        size_t captured = length < zstd_proxy_capture_max_length ? length : zstd_proxy_capture_max_length;
+        zstd_proxy_capture_record *record = zstd_proxy_capture_reserve(header, captured);
+
+        if (record != NULL) {
+            clock_gettime(CLOCK_REALTIME, &now);
+
+            record->direction = direction;
+            record->original_length = length > UINT32_MAX ? UINT32_MAX : length;
+            record->connection = connection;
+            record->timestamp_ns = (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+
+            memcpy(&record[1], data, captured);
+
+            // Readers of a live capture skip records until they're complete, and writers don't overwrite them
+            __atomic_store_n(&record->state, zstd_proxy_capture_committed, __ATOMIC_RELEASE);
+        }
+
+        __atomic_fetch_add(&header->record_ns, zstd_proxy_now_ns() - start, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&zstd_proxy_capture_mapping_lock);
+}
+
+int zstd_proxy_capture_start(const char *path, size_t size, uint32_t sample) {
+    size_t capacity = size > sizeof(zstd_proxy_capture_header) ? size - sizeof(zstd_proxy_capture_header) : 0;
+
+    // At least 16 records of a header and 4 KB
+    if (sample == 0 || capacity < 16 * (sizeof(zstd_proxy_capture_record) + 4096)) {
+        return EINVAL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        int error = errno;
+
+        log_error("failed to open capture file %s: %s", path, strerror(error));
+
+        return error;
+    }
+
+    int error = ftruncate(fd, size) == 0 ? 0 : errno;
+    zstd_proxy_capture_header *header = NULL;
+
+    if (error == 0) {
+#ifdef MAP_POPULATE
+        // Fault the ring in now rather than on the first lap of records
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+#else
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+        error = header == MAP_FAILED ? errno : 0;
+    }
+
+    close(fd);
+
+    if (error != 0) {
+        log_error("failed to map capture file %s: %s", path, strerror(error));
+
+        return error;
+    }
+
+    memset(header, 0, sizeof(zstd_proxy_capture_header));
+    memcpy(header->magic, zstd_proxy_capture_magic, sizeof(header->magic));
+
+    header->version = zstd_proxy_capture_version;
+    header->header_size = sizeof(zstd_proxy_capture_header);
+    header->capacity = capacity;
+
+    zstd_proxy_capture_stop();
+
+    pthread_rwlock_wrlock(&zstd_proxy_capture_mapping_lock);
+
+    zstd_proxy_capture_mapping = header;
+    zstd_proxy_capture_mapping_size = size;
+    zstd_proxy_capture_max_length = capacity / 16 - sizeof(zstd_proxy_capture_record);
+
+    __atomic_store_n(&zstd_proxy_capture_sample, sample, __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(&zstd_proxy_capture_mapping_lock);
+
+    return 0;
+}
+
+void zstd_proxy_capture_stop(void) {
+    __atomic_store_n(&zstd_proxy_capture_sample, 0, __ATOMIC_RELAXED);
+
+    // Waits for the records in progress
+    pthread_rwlock_wrlock(&zstd_proxy_capture_mapping_lock);
+
+    if (zstd_proxy_capture_mapping != NULL) {
+        munmap(zstd_proxy_capture_mapping, zstd_proxy_capture_mapping_size);
+    }
+
+    zstd_proxy_capture_mapping = NULL;
+    zstd_proxy_capture_mapping_size = 0;
+
+    pthread_rwlock_unlock(&zstd_proxy_capture_mapping_lock);
+}
+
+bool zstd_proxy_capture_stats(zstd_proxy_capture_header *header) {
+    pthread_rwlock_rdlock(&zstd_proxy_capture_mapping_lock);
+
+    bool running = zstd_proxy_capture_mapping != NULL;
+
+    if (running) {
+        pthread_mutex_lock(&zstd_proxy_capture_ring_lock);
+        memcpy(header, zstd_proxy_capture_mapping, sizeof(zstd_proxy_capture_header));
+        pthread_mutex_unlock(&zstd_proxy_capture_ring_lock);
+
+        header->record_ns = __atomic_load_n(&zstd_proxy_capture_mapping->record_ns, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&zstd_proxy_capture_mapping_lock);
+
+    return running;
+}
+
+int zstd_proxy_capture_read(const char *path, zstd_proxy_capture_callback callback, void *data) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        int error = errno;
+
+        log_error("failed to open capture file %s: %s", path, strerror(error));
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return error;
+    }
+
+    int error = 0;
+    size_t size = info.st_size;
+    zstd_proxy_capture_header *header = size < sizeof(zstd_proxy_capture_header)
+        ? MAP_FAILED
+        : mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (header == MAP_FAILED) {
+        error = size < sizeof(zstd_proxy_capture_header) ? EINVAL : errno;
+
+        log_error("failed to map capture file %s: %s", path, strerror(error));
+
+        return error;
+    }
+
+    if (
+        memcmp(header->magic, zstd_proxy_capture_magic, sizeof(header->magic)) != 0 ||
+        header->version != zstd_proxy_capture_version ||
+        header->header_size < sizeof(zstd_proxy_capture_header) ||
+        header->header_size + header->capacity > size ||
+        header->tail >= header->capacity
+    ) {
+        error = EINVAL;
+
+        log_error("invalid capture file %s", path);
+
+        goto cleanup;
+    }
+
+    uint64_t offset = header->tail;
+
+    for (uint64_t i = 0; i < header->entries && error == 0; i++) {
+        if (offset + sizeof(zstd_proxy_capture_record) > header->capacity) {
+            offset = 0;
+        }
+
+        const zstd_proxy_capture_record *record = zstd_proxy_capture_at(header, offset);
+        uint32_t state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+
+        if (state == zstd_proxy_capture_padding) {
+            offset = 0;
+
+            continue;
+        }
+
+        if (offset + zstd_proxy_capture_record_size(record) > header->capacity) {
+            error = EINVAL;
+
+            log_error("invalid capture record at offset %" PRIu64 " in %s", offset, path);
+
+            break;
+        }
+
+        if (state == zstd_proxy_capture_committed) {
+            error = callback(record, &record[1], data);
+        }
+
+        offset += zstd_proxy_capture_record_size(record);
+    }
+
+    cleanup:
+
+    munmap(header, size);
+
+    return error;
+}
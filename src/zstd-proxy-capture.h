@@ -0,0 +1,104 @@
+#ifndef zstd_proxy_capture_H
+#define zstd_proxy_capture_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Process-wide capture of the plaintext flowing through the proxies, for replay and dictionary training.
+ *
+ * Sampled chunks are copied into a memory-mapped ring file: recording is a `memcpy` into the page cache,
+ * the kernel writes it back to disk in the background. Once the ring is full the oldest records are overwritten,
+ * unless one of them is still being written: the new record is dropped instead of waiting for it.
+ *
+ * File layout, native endianness: a `zstd_proxy_capture_header` followed by `capacity` bytes of records.
+ * Each record is a `zstd_proxy_capture_record` followed by `length` bytes, padded to 8 bytes.
+ * Records start at `tail`, continue up to a padding record or until less than a record header is left
+ * before `capacity`, then continue from the start of the ring, `entries` times.
+ */
+
+#define zstd_proxy_capture_magic "ZPCAPTUR"
+#define zstd_proxy_capture_version 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    /** Bytes of records after the header. */
+    uint64_t capacity;
+    /** Offset of the next record. */
+    uint64_t head;
+    /** Offset of the oldest record. */
+    uint64_t tail;
+    /** Records and padding records in the ring. */
+    uint64_t entries;
+    /** Records written since the capture started, including overwritten ones. */
+    uint64_t records;
+    /** Payload bytes written since the capture started. */
+    uint64_t bytes;
+    /** Records overwritten by newer ones. */
+    uint64_t overwritten;
+    /** Nanoseconds spent recording, to measure the overhead of the capture. */
+    uint64_t record_ns;
+    /** Records dropped because the oldest one in their way was still being written. */
+    uint64_t dropped;
+} zstd_proxy_capture_header;
+
+typedef enum {
+    /** Plaintext received by the compressing side. */
+    zstd_proxy_capture_compress,
+    /** Plaintext sent by the decompressing side. */
+    zstd_proxy_capture_decompress,
+} zstd_proxy_capture_direction;
+
+typedef enum {
+    zstd_proxy_capture_writing,
+    zstd_proxy_capture_committed,
+    /** The rest of the ring is unused, the next record is at offset 0. */
+    zstd_proxy_capture_padding,
+} zstd_proxy_capture_state;
+
+typedef struct {
+    /** A `zstd_proxy_capture_state`, set last. */
+    uint32_t state;
+    /** A `zstd_proxy_capture_direction`. */
+    uint32_t direction;
+    /** Bytes following the record. */
+    uint32_t length;
+    /** Bytes of the chunk, above `length` when it was truncated. */
+    uint32_t original_length;
+    /** `zstd_proxy.id` of the connection. */
+    uint64_t connection;
+    /** `CLOCK_REALTIME` in nanoseconds. */
+    uint64_t timestamp_ns;
+} zstd_proxy_capture_record;
+
+/** Capture one chunk out of `zstd_proxy_capture_sample`, 0 while disabled. */
+extern uint32_t zstd_proxy_capture_sample;
+
+/**
+ * Start capturing to `path`, created or truncated to `size` bytes, stopping a running capture.
+ * One chunk out of `sample` is recorded, chunks larger than `size / 16` are truncated.
+ */
+int zstd_proxy_capture_start(const char *path, size_t size, uint32_t sample);
+void zstd_proxy_capture_stop(void);
+
+/** Copy the header of the running capture, `false` when there is none. */
+bool zstd_proxy_capture_stats(zstd_proxy_capture_header *header);
+
+/** Check whether the next chunk of a direction is sampled, `counter` is kept by the caller. */
+static inline bool zstd_proxy_capture_sampled(uint64_t *counter) {
+    uint32_t sample = __atomic_load_n(&zstd_proxy_capture_sample, __ATOMIC_RELAXED);
+
+    return sample != 0 && ++*counter % sample == 0;
+}
+
+void zstd_proxy_capture_record_chunk(uint64_t connection, zstd_proxy_capture_direction direction, const void *data, size_t length);
+
+typedef int (*zstd_proxy_capture_callback)(const zstd_proxy_capture_record *record, const void *payload, void *data);
+
+/** Call `callback` with each committed record of a capture file, oldest first, stopping on a non-zero return. */
+int zstd_proxy_capture_read(const char *path, zstd_proxy_capture_callback callback, void *data);
+
+#endif
@@ -0,0 +1,373 @@
+#include <errno.h>
+#include <string.h>
+
+#include "zstd-proxy-codec.h"
+#include "zstd-proxy-utils.h"
+
+#if ENABLE_LZ4
+#include <lz4frame.h>
+#endif
+
+const char *const zstd_proxy_codec_names[] = {
+    [zstd_proxy_codec_none] = "none",
+    [zstd_proxy_codec_zstd] = "zstd",
+    [zstd_proxy_codec_lz4] = "lz4",
+};
+
+zstd_proxy_codec zstd_proxy_codec_parse(const char *name) {
+    for (zstd_proxy_codec codec = 0; codec < zstd_proxy_codec_count; codec++) {
+        if (strcmp(name, zstd_proxy_codec_names[codec]) == 0) {
+            return codec;
+        }
+    }
+
+    return zstd_proxy_codec_count;
+}
+
+static inline void zstd_proxy_write_le32(uint8_t *buffer, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buffer[i] = value >> (i * 8);
+    }
+}
+
+void zstd_proxy_hello_write(uint8_t buffer[zstd_proxy_hello_size], const zstd_proxy_hello *hello) {
+    memset(buffer, 0, zstd_proxy_hello_size);
+    zstd_proxy_write_le32(&buffer[0], zstd_proxy_hello_magic);
+    zstd_proxy_write_le32(&buffer[4], zstd_proxy_hello_payload_size);
+
+    uint8_t *payload = &buffer[8];
+
+    payload[0] = hello->version;
+    payload[1] = hello->codec;
+    payload[2] = hello->level;
+    payload[3] = hello->window_log;
+    zstd_proxy_write_le32(&payload[4], hello->dictionary_id);
+    zstd_proxy_write_le32(&payload[8], hello->codecs);
+}
+
+int zstd_proxy_hello_read(const uint8_t *payload, size_t size, zstd_proxy_hello *hello) {
+    if (size < zstd_proxy_hello_payload_size) {
+        log_error("hello of %zu bytes is too short", size);
+
+        return EPROTO;
+    }
+
+    hello->version = payload[0];
+    hello->codec = payload[1];
+    hello->level = payload[2];
+    hello->window_log = payload[3];
+    hello->dictionary_id = zstd_proxy_read_le32(&payload[4]);
+    hello->codecs = zstd_proxy_read_le32(&payload[8]);
+
+    return 0;
+}
+
+#if ENABLE_LZ4
+
+/** Input compressed per `LZ4F_compressUpdate`, one block. */
+#define zstd_proxy_lz4_slice (64 * 1024)
+
+struct zstd_proxy_lz4_encoder {
+    LZ4F_cctx *ctx;
+    LZ4F_preferences_t preferences;
+    /** `true` once the header of the current frame is written. */
+    bool started;
+
+    /** Output which didn't fit, written before anything else. */
+    char *pending;
+    size_t pending_capacity;
+    size_t pending_pos;
+    size_t pending_size;
+};
+
+struct zstd_proxy_lz4_decoder {
+    LZ4F_dctx *ctx;
+};
+
+int zstd_proxy_lz4_encoder_create(zstd_proxy_lz4_encoder **encoder_ptr, int level) {
+    zstd_proxy_lz4_encoder *encoder = calloc(1, sizeof(zstd_proxy_lz4_encoder));
+
+    *encoder_ptr = NULL;
+
+    if (encoder == NULL) {
+        return ENOMEM;
+    }
+
+    // Linked blocks compress against the previous 64 KB, partial blocks are buffered until a flush
+    encoder->preferences = (LZ4F_preferences_t){
+        .frameInfo = { .blockSizeID = LZ4F_max64KB, .blockMode = LZ4F_blockLinked },
+        .compressionLevel = level,
+    };
+
+    size_t bound = LZ4F_compressBound(zstd_proxy_lz4_slice, &encoder->preferences);
+
+    encoder->pending_capacity = bound > LZ4F_HEADER_SIZE_MAX ? bound : LZ4F_HEADER_SIZE_MAX;
+    encoder->pending = malloc(encoder->pending_capacity);
+
+    size_t error = LZ4F_createCompressionContext(&encoder->ctx, LZ4F_VERSION);
+
+    if (encoder->pending == NULL || LZ4F_isError(error)) {
+        log_error("failed to create LZ4 compression context");
+        zstd_proxy_lz4_encoder_destroy(encoder);
+
+        return ENOMEM;
+    }
+
+    *encoder_ptr = encoder;
+
+    return 0;
+}
+
+/** Write pending output, `false` if the output filled up first. */
+static bool zstd_proxy_lz4_drain(zstd_proxy_lz4_encoder *encoder, ZSTD_outBuffer *output) {
+    size_t size = encoder->pending_size - encoder->pending_pos;
+    size_t room = output->size - output->pos;
+
+    if (size > room) {
+        size = room;
+    }
+
+    memcpy(&((char *)output->dst)[output->pos], &encoder->pending[encoder->pending_pos], size);
+    output->pos += size;
+    encoder->pending_pos += size;
+
+    return encoder->pending_pos == encoder->pending_size;
+}
+
+/** Set output written by LZ4 to `pending` and write what fits. */
+static bool zstd_proxy_lz4_stage(zstd_proxy_lz4_encoder *encoder, ZSTD_outBuffer *output, size_t size) {
+    encoder->pending_pos = 0;
+    encoder->pending_size = size;
+
+    return zstd_proxy_lz4_drain(encoder, output);
+}
+
+int zstd_proxy_lz4_encode(zstd_proxy_lz4_encoder *encoder, ZSTD_inBuffer *input, ZSTD_outBuffer *output, bool flush) {
+    if (!zstd_proxy_lz4_drain(encoder, output)) {
+        return 0;
+    }
+
+    if (!encoder->started) {
+        size_t size = LZ4F_compressBegin(
+            encoder->ctx,
+            encoder->pending,
+            encoder->pending_capacity,
+            &encoder->preferences
+        );
+
+        if (LZ4F_isError(size)) {
+            log_error("error starting LZ4 frame: %s", LZ4F_getErrorName(size));
+
+            return EPROTO;
+        }
+
+        encoder->started = true;
+
+        if (!zstd_proxy_lz4_stage(encoder, output, size)) {
+            return 0;
+        }
+    }
+
+    while (input->pos < input->size) {
+        size_t slice = input->size - input->pos;
+
+        if (slice > zstd_proxy_lz4_slice) {
+            slice = zstd_proxy_lz4_slice;
+        }
+
+        // LZ4 needs room for the worst case, compress to `pending` when the output is short of it
+        size_t room = output->size - output->pos;
+        bool direct = room >= LZ4F_compressBound(slice, &encoder->preferences);
+        size_t size = LZ4F_compressUpdate(
+            encoder->ctx,
+            direct ? &((char *)output->dst)[output->pos] : encoder->pending,
+            direct ? room : encoder->pending_capacity,
+            &((const char *)input->src)[input->pos],
+            slice,
+            NULL
+        );
+
+        if (LZ4F_isError(size)) {
+            log_error("error compressing data: %s", LZ4F_getErrorName(size));
+
+            return EPROTO;
+        }
+
+        input->pos += slice;
+
+        if (direct) {
+            output->pos += size;
+        } else if (!zstd_proxy_lz4_stage(encoder, output, size)) {
+            return 0;
+        }
+    }
+
+    if (flush) {
+        size_t room = output->size - output->pos;
+        bool direct = room >= LZ4F_compressBound(0, &encoder->preferences);
+        size_t size = LZ4F_flush(
+            encoder->ctx,
+            direct ? &((char *)output->dst)[output->pos] : encoder->pending,
+            direct ? room : encoder->pending_capacity,
+            NULL
+        );
+
+        if (LZ4F_isError(size)) {
+            log_error("error flushing data: %s", LZ4F_getErrorName(size));
+
+            return EPROTO;
+        }
+
+        if (direct) {
+            output->pos += size;
+        } else {
+            zstd_proxy_lz4_stage(encoder, output, size);
+        }
+    }
+
+    return 0;
+}
+
+int zstd_proxy_lz4_encode_end(zstd_proxy_lz4_encoder *encoder, ZSTD_outBuffer *output, bool *done) {
+    *done = false;
+
+    if (!zstd_proxy_lz4_drain(encoder, output)) {
+        return 0;
+    }
+
+    if (encoder->started) {
+        size_t size = LZ4F_compressEnd(encoder->ctx, encoder->pending, encoder->pending_capacity, NULL);
+
+        if (LZ4F_isError(size)) {
+            log_error("error ending LZ4 frame: %s", LZ4F_getErrorName(size));
+
+            return EPROTO;
+        }
+
+        encoder->started = false;
+
+        if (!zstd_proxy_lz4_stage(encoder, output, size)) {
+            return 0;
+        }
+    }
+
+    *done = true;
+
+    return 0;
+}
+
+void zstd_proxy_lz4_encoder_destroy(zstd_proxy_lz4_encoder *encoder) {
+    if (encoder == NULL) {
+        return;
+    }
+
+    if (encoder->ctx != NULL) {
+        LZ4F_freeCompressionContext(encoder->ctx);
+    }
+
+    free(encoder->pending);
+    free(encoder);
+}
+
+int zstd_proxy_lz4_decoder_create(zstd_proxy_lz4_decoder **decoder_ptr) {
+    zstd_proxy_lz4_decoder *decoder = calloc(1, sizeof(zstd_proxy_lz4_decoder));
+
+    *decoder_ptr = NULL;
+
+    if (decoder == NULL) {
+        return ENOMEM;
+    }
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&decoder->ctx, LZ4F_VERSION))) {
+        log_error("failed to create LZ4 decompression context");
+        free(decoder);
+
+        return ENOMEM;
+    }
+
+    *decoder_ptr = decoder;
+
+    return 0;
+}
+
+int zstd_proxy_lz4_decode(zstd_proxy_lz4_decoder *decoder, ZSTD_inBuffer *input, ZSTD_outBuffer *output, bool *frame_end) {
+    size_t output_size = output->size - output->pos;
+    size_t input_size = input->size - input->pos;
+    size_t hint = LZ4F_decompress(
+        decoder->ctx,
+        &((char *)output->dst)[output->pos],
+        &output_size,
+        &((const char *)input->src)[input->pos],
+        &input_size,
+        NULL
+    );
+
+    if (LZ4F_isError(hint)) {
+        log_error("error decompressing data: %s", LZ4F_getErrorName(hint));
+
+        return EPROTO;
+    }
+
+    input->pos += input_size;
+    output->pos += output_size;
+    *frame_end = hint == 0;
+
+    return 0;
+}
+
+void zstd_proxy_lz4_decoder_destroy(zstd_proxy_lz4_decoder *decoder) {
+    if (decoder == NULL) {
+        return;
+    }
+
+    LZ4F_freeDecompressionContext(decoder->ctx);
+    free(decoder);
+}
+
+#else
+
+int zstd_proxy_lz4_encoder_create(zstd_proxy_lz4_encoder **encoder_ptr, int level) {
+    (void)level;
+
+    *encoder_ptr = NULL;
+    log_error("LZ4 support is not built in");
+
+    return EPROTONOSUPPORT;
+}
+
+int zstd_proxy_lz4_encode(zstd_proxy_lz4_encoder *encoder, ZSTD_inBuffer *input, ZSTD_outBuffer *output, bool flush) {
+    (void)encoder, (void)input, (void)output, (void)flush;
+
+    return EPROTONOSUPPORT;
+}
+
+int zstd_proxy_lz4_encode_end(zstd_proxy_lz4_encoder *encoder, ZSTD_outBuffer *output, bool *done) {
+    (void)encoder, (void)output;
+    *done = true;
+
+    return 0;
+}
+
+void zstd_proxy_lz4_encoder_destroy(zstd_proxy_lz4_encoder *encoder) {
+    (void)encoder;
+}
+
+int zstd_proxy_lz4_decoder_create(zstd_proxy_lz4_decoder **decoder_ptr) {
+    *decoder_ptr = NULL;
+    log_error("LZ4 support is not built in");
+
+    return EPROTONOSUPPORT;
+}
+
+int zstd_proxy_lz4_decode(zstd_proxy_lz4_decoder *decoder, ZSTD_inBuffer *input, ZSTD_outBuffer *output, bool *frame_end) {
+    (void)decoder, (void)input, (void)output;
+    *frame_end = false;
+
+    return EPROTONOSUPPORT;
+}
+
+void zstd_proxy_lz4_decoder_destroy(zstd_proxy_lz4_decoder *decoder) {
+    (void)decoder;
+}
+
+#endif
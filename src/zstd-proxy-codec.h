@@ -0,0 +1,99 @@
+#ifndef zstd_proxy_codec_H
+#define zstd_proxy_codec_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <zstd.h>
+
+#ifndef ENABLE_LZ4
+#define ENABLE_LZ4 0
+#endif
+
+/**
+ * Codecs a connection compresses with, and the hello announcing them.
+ *
+ * Unless compression is disabled, the compressing end starts its stream with a hello carrying the codec,
+ * level, window and dictionary id of the frames following it, and the codecs it can decode itself. The
+ * hello is a Zstd skippable frame, which LZ4 frames share: decompressors predating it skip it, and
+ * decompressors seeing no hello assume Zstd. The decompressing end picks its decoder from the hello, and
+ * tells its own compressing end which codecs the peer accepts, so the preferred codec can be switched to
+ * without both ends being upgraded at once.
+ *
+ * A new hello can follow any frame, a compressor switching codec ends its frame and sends one.
+ */
+
+typedef enum {
+    /** Data is sent as is, no hello is sent either. */
+    zstd_proxy_codec_none,
+    zstd_proxy_codec_zstd,
+    /** LZ4 frames, only available when built with `ENABLE_LZ4`. */
+    zstd_proxy_codec_lz4,
+    zstd_proxy_codec_count,
+} zstd_proxy_codec;
+
+extern const char *const zstd_proxy_codec_names[];
+
+/** Parse a codec name, returns `zstd_proxy_codec_count` if unknown. */
+zstd_proxy_codec zstd_proxy_codec_parse(const char *name);
+
+/** Bit of `codec` in `zstd_proxy_hello.codecs`. */
+#define zstd_proxy_codec_bit(codec) ((uint32_t)1 << (codec))
+
+/** Codecs this build can decode. */
+#define zstd_proxy_codecs_supported \
+    (zstd_proxy_codec_bit(zstd_proxy_codec_zstd) | (ENABLE_LZ4 ? zstd_proxy_codec_bit(zstd_proxy_codec_lz4) : 0))
+
+/** Skippable frame magic of the hello, followed by the little-endian size of the payload. */
+#define zstd_proxy_hello_magic 0x184D2A5AU
+#define zstd_proxy_hello_version 1
+/** Payload size of version 1, later versions may only append fields. */
+#define zstd_proxy_hello_payload_size 16
+#define zstd_proxy_hello_size (8 + zstd_proxy_hello_payload_size)
+
+typedef struct {
+    uint8_t version;
+    /** Codec of the frames following the hello. */
+    zstd_proxy_codec codec;
+    /** Level they are compressed at, informative. */
+    int8_t level;
+    /** Zstd window log, 0 for the default of the level. */
+    uint8_t window_log;
+    /** `ZSTD_getDictID_fromDict` of the Zstd dictionary, 0 without one. */
+    uint32_t dictionary_id;
+    /** `zstd_proxy_codec_bit` of every codec the sender can decode. */
+    uint32_t codecs;
+} zstd_proxy_hello;
+
+static inline uint32_t zstd_proxy_read_le32(const uint8_t *buffer) {
+    return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+void zstd_proxy_hello_write(uint8_t buffer[zstd_proxy_hello_size], const zstd_proxy_hello *hello);
+
+/** Read the payload of a hello, `EPROTO` if it's too short to be one. */
+int zstd_proxy_hello_read(const uint8_t *payload, size_t size, zstd_proxy_hello *hello);
+
+/**
+ * LZ4 frame encoder and decoder following the Zstd streaming conventions: they consume as much input
+ * and fill as much output as they can, and are called again while input is left or the output is full.
+ * `zstd_proxy_lz4_encode` flushes when asked to, frames are only ended by `zstd_proxy_lz4_encode_end`.
+ * Without `ENABLE_LZ4` creating them fails with `EPROTONOSUPPORT`.
+ */
+typedef struct zstd_proxy_lz4_encoder zstd_proxy_lz4_encoder;
+typedef struct zstd_proxy_lz4_decoder zstd_proxy_lz4_decoder;
+
+/** `level` is the LZ4 compression level, 0 for the fast default and 3 and above for LZ4 HC. */
+int zstd_proxy_lz4_encoder_create(zstd_proxy_lz4_encoder **encoder_ptr, int level);
+int zstd_proxy_lz4_encode(zstd_proxy_lz4_encoder *encoder, ZSTD_inBuffer *input, ZSTD_outBuffer *output, bool flush);
+/** End the current frame, sets `done` once it's written, the next call of `zstd_proxy_lz4_encode` starts another. */
+int zstd_proxy_lz4_encode_end(zstd_proxy_lz4_encoder *encoder, ZSTD_outBuffer *output, bool *done);
+void zstd_proxy_lz4_encoder_destroy(zstd_proxy_lz4_encoder *encoder);
+
+int zstd_proxy_lz4_decoder_create(zstd_proxy_lz4_decoder **decoder_ptr);
+/** Sets `frame_end` when the frame being decoded ended and its content was written to `output`. */
+int zstd_proxy_lz4_decode(zstd_proxy_lz4_decoder *decoder, ZSTD_inBuffer *input, ZSTD_outBuffer *output, bool *frame_end);
+void zstd_proxy_lz4_decoder_destroy(zstd_proxy_lz4_decoder *decoder);
+
+#endif
@@ -0,0 +1,818 @@
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "zstd-proxy-dedup.h"
+#include "zstd-proxy-utils.h"
+
+/** Chunk sizes: boundaries are searched from `min`, their average is around `avg` and they are forced at `max`. */
+#define zstd_proxy_dedup_min (2 * 1024)
+#define zstd_proxy_dedup_avg (8 * 1024)
+#define zstd_proxy_dedup_max (64 * 1024)
+
+/** Harder to match before the average size and easier after, so sizes cluster around it (FastCDC normalization). */
+#define zstd_proxy_dedup_mask_small (~UINT64_C(0) << (64 - 15))
+#define zstd_proxy_dedup_mask_large (~UINT64_C(0) << (64 - 11))
+
+/** Largest record header: a tag and a 64-bit varint. */
+#define zstd_proxy_dedup_header_max 11
+
+/** Largest session record: a tag and three 64-bit varints. */
+#define zstd_proxy_dedup_control_max 31
+
+typedef enum {
+    zstd_proxy_dedup_literal,
+    zstd_proxy_dedup_boundary,
+    zstd_proxy_dedup_reference,
+    /** Session of the encoder, the first record of a connection with sessions. */
+    zstd_proxy_dedup_session,
+    /** `zstd_proxy_dedup_offer` of the decoder of the other direction. */
+    zstd_proxy_dedup_offered,
+    /** Session of the offer, both ends switch to its cache. */
+    zstd_proxy_dedup_resume,
+} zstd_proxy_dedup_tag;
+
+typedef enum {
+    zstd_proxy_dedup_read_tag,
+    zstd_proxy_dedup_read_length,
+    zstd_proxy_dedup_read_distance,
+    zstd_proxy_dedup_read_control,
+    zstd_proxy_dedup_read_literal,
+    zstd_proxy_dedup_read_reference,
+} zstd_proxy_dedup_state;
+
+typedef struct {
+    uint64_t hash;
+    size_t offset;
+    size_t length;
+} zstd_proxy_dedup_entry;
+
+struct zstd_proxy_dedup_cache {
+    /** Ring of chunk data, a chunk which doesn't fit before the end starts over at 0. */
+    char *data;
+    size_t size;
+    size_t head;
+
+    /** Chunks by id modulo `capacity`, ids in [oldest, next) are cached. */
+    zstd_proxy_dedup_entry *entries;
+    size_t capacity;
+    uint64_t oldest;
+    uint64_t next;
+
+    /** Encoder only: chunk ids + 1 by hash, direct-mapped, stale slots are caught by comparing the data. */
+    uint64_t *table;
+    size_t table_mask;
+
+    /** While parked: session, key of the peer, and the next parked cache. */
+    uint64_t session;
+    uint64_t peer;
+    zstd_proxy_dedup_cache *older;
+};
+
+struct zstd_proxy_dedup {
+    zstd_proxy_dedup_cache *cache;
+
+    /** `NULL` without sessions. */
+    zstd_proxy_dedup_link *link;
+    /** Session of the connection, 0 until a decoder reads it. */
+    uint64_t session;
+    /** Decoder: parked cache offered to the peer, until it resumes it. */
+    zstd_proxy_dedup_cache *offered;
+    /** Encoder: session records already written, or handled for the offer of the peer. */
+    bool announced;
+    bool offer_sent;
+    bool offer_handled;
+
+    uint64_t gear[256];
+    uint64_t rolling;
+
+    /** Current chunk, of which `emitted` bytes were already written as literals. */
+    char chunk[zstd_proxy_dedup_max];
+    size_t chunk_length;
+    size_t emitted;
+    /** Encoder: a boundary was found, the chunk waits for room in the output. */
+    bool complete;
+    uint64_t chunk_hash;
+
+    /** Decoder: position in the current record. */
+    zstd_proxy_dedup_state state;
+    uint64_t value;
+    unsigned shift;
+    size_t remaining;
+    size_t source;
+    /** Decoder: values of the session record being read. */
+    zstd_proxy_dedup_tag control;
+    uint64_t values[3];
+    unsigned value_count;
+};
+
+/** Caches of closed connections, most recent first. */
+static pthread_mutex_t zstd_proxy_dedup_parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static zstd_proxy_dedup_cache *zstd_proxy_dedup_parked = NULL;
+
+static uint64_t zstd_proxy_dedup_session_seed = 0;
+static uint64_t zstd_proxy_dedup_session_count = 0;
+static pthread_once_t zstd_proxy_dedup_session_once = PTHREAD_ONCE_INIT;
+
+/** splitmix64 finalizer. */
+static inline uint64_t zstd_proxy_dedup_mix(uint64_t value) {
+    value = (value ^ (value >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    value = (value ^ (value >> 27)) * UINT64_C(0x94D049BB133111EB);
+
+    return value ^ (value >> 31);
+}
+
+static uint64_t zstd_proxy_dedup_hash(const char *data, size_t length) {
+    uint64_t hash = length * UINT64_C(0x9E3779B97F4A7C15);
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+
+        memcpy(&word, &data[i], sizeof(word));
+
+        hash = (hash ^ word) * UINT64_C(0xFF51AFD7ED558CCD);
+        hash ^= hash >> 32;
+    }
+
+    for (; i < length; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * UINT64_C(0x100000001B3);
+    }
+
+    return hash ^ (hash >> 29);
+}
+
+static inline zstd_proxy_dedup_entry *zstd_proxy_dedup_entry_at(zstd_proxy_dedup_cache *cache, uint64_t id) {
+    return &cache->entries[id % cache->capacity];
+}
+
+/** Cache the current chunk, evicting the oldest ones it overwrites. Both ends do it in the same order. */
+static void zstd_proxy_dedup_insert(zstd_proxy_dedup *dedup) {
+    zstd_proxy_dedup_cache *cache = dedup->cache;
+    size_t length = dedup->chunk_length;
+
+    if (cache->head + length > cache->size) {
+        // Chunks left past the head are the oldest ones, the ring starts over before them
+        while (cache->oldest < cache->next && zstd_proxy_dedup_entry_at(cache, cache->oldest)->offset >= cache->head) {
+            cache->oldest++;
+        }
+
+        cache->head = 0;
+    }
+
+    while (cache->oldest < cache->next) {
+        zstd_proxy_dedup_entry *entry = zstd_proxy_dedup_entry_at(cache, cache->oldest);
+
+        if (
+            cache->next - cache->oldest < cache->capacity &&
+            (entry->offset < cache->head || entry->offset >= cache->head + length)
+        ) {
+            break;
+        }
+
+        cache->oldest++;
+    }
+
+    zstd_proxy_dedup_entry *entry = zstd_proxy_dedup_entry_at(cache, cache->next);
+
+    entry->hash = dedup->chunk_hash;
+    entry->offset = cache->head;
+    entry->length = length;
+
+    memcpy(&cache->data[cache->head], dedup->chunk, length);
+
+    if (cache->table != NULL) {
+        cache->table[entry->hash & cache->table_mask] = cache->next + 1;
+    }
+
+    cache->head += length;
+    cache->next++;
+}
+
+/** Id of a cached chunk equal to the current one, `UINT64_MAX` if none. */
+static uint64_t zstd_proxy_dedup_lookup(zstd_proxy_dedup *dedup) {
+    zstd_proxy_dedup_cache *cache = dedup->cache;
+    uint64_t slot = cache->table[dedup->chunk_hash & cache->table_mask];
+
+    if (slot == 0 || slot - 1 < cache->oldest) {
+        return UINT64_MAX;
+    }
+
+    zstd_proxy_dedup_entry *entry = zstd_proxy_dedup_entry_at(cache, slot - 1);
+
+    if (
+        entry->hash != dedup->chunk_hash ||
+        entry->length != dedup->chunk_length ||
+        memcmp(&cache->data[entry->offset], dedup->chunk, entry->length) != 0
+    ) {
+        return UINT64_MAX;
+    }
+
+    return slot - 1;
+}
+
+static void zstd_proxy_dedup_cache_destroy(zstd_proxy_dedup_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    free(cache->data);
+    free(cache->entries);
+    free(cache->table);
+    free(cache);
+}
+
+static zstd_proxy_dedup_cache *zstd_proxy_dedup_cache_create(size_t size, bool encoder) {
+    zstd_proxy_dedup_cache *cache = calloc(1, sizeof(zstd_proxy_dedup_cache));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->size = size;
+    cache->capacity = size / zstd_proxy_dedup_min + 1;
+    cache->data = malloc(size);
+    cache->entries = calloc(cache->capacity, sizeof(zstd_proxy_dedup_entry));
+
+    if (encoder) {
+        size_t table_size = 1;
+
+        while (table_size < cache->capacity * 2) {
+            table_size *= 2;
+        }
+
+        cache->table = calloc(table_size, sizeof(uint64_t));
+        cache->table_mask = table_size - 1;
+    }
+
+    if (cache->data == NULL || cache->entries == NULL || (encoder && cache->table == NULL)) {
+        zstd_proxy_dedup_cache_destroy(cache);
+
+        return NULL;
+    }
+
+    return cache;
+}
+
+/** Hashed from the data, decoders don't hash the chunks they insert. */
+static uint64_t zstd_proxy_dedup_cache_last_hash(zstd_proxy_dedup_cache *cache) {
+    if (cache->next == cache->oldest) {
+        return 0;
+    }
+
+    zstd_proxy_dedup_entry *entry = zstd_proxy_dedup_entry_at(cache, cache->next - 1);
+
+    return zstd_proxy_dedup_hash(&cache->data[entry->offset], entry->length);
+}
+
+/** Park `cache` as the most recent one, freeing the oldest ones past `limit`. */
+static void zstd_proxy_dedup_park(zstd_proxy_dedup_cache *cache, size_t limit) {
+    pthread_mutex_lock(&zstd_proxy_dedup_parked_lock);
+
+    cache->older = zstd_proxy_dedup_parked;
+    zstd_proxy_dedup_parked = cache;
+
+    zstd_proxy_dedup_cache **link = &zstd_proxy_dedup_parked;
+
+    for (size_t count = 0; *link != NULL && count < limit; count++) {
+        link = &(*link)->older;
+    }
+
+    zstd_proxy_dedup_cache *evicted = *link;
+
+    *link = NULL;
+
+    pthread_mutex_unlock(&zstd_proxy_dedup_parked_lock);
+
+    while (evicted != NULL) {
+        zstd_proxy_dedup_cache *older = evicted->older;
+
+        zstd_proxy_dedup_cache_destroy(evicted);
+        evicted = older;
+    }
+}
+
+/** Unpark the most recent cache of `peer` and `size`, of `session` unless it's 0. */
+static zstd_proxy_dedup_cache *zstd_proxy_dedup_unpark(bool encoder, uint64_t peer, uint64_t session, size_t size) {
+    zstd_proxy_dedup_cache *cache = NULL;
+
+    pthread_mutex_lock(&zstd_proxy_dedup_parked_lock);
+
+    for (zstd_proxy_dedup_cache **link = &zstd_proxy_dedup_parked; *link != NULL; link = &(*link)->older) {
+        zstd_proxy_dedup_cache *parked = *link;
+
+        if (
+            (parked->table != NULL) == encoder &&
+            parked->peer == peer &&
+            parked->size == size &&
+            (session == 0 || parked->session == session)
+        ) {
+            *link = parked->older;
+            parked->older = NULL;
+            cache = parked;
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&zstd_proxy_dedup_parked_lock);
+
+    return cache;
+}
+
+static void zstd_proxy_dedup_session_init(void) {
+    uint64_t seed = zstd_proxy_now_ns() ^ (uint64_t)time(NULL) << 24 ^ (uint64_t)getpid() << 40;
+
+    // The address adds the randomization of the layout to processes started at the same time
+    zstd_proxy_dedup_session_seed = seed ^ (uintptr_t)&seed;
+}
+
+/** Random non-zero id, unique within the process since the mix is a bijection. */
+static uint64_t zstd_proxy_dedup_next_session(void) {
+    pthread_once(&zstd_proxy_dedup_session_once, zstd_proxy_dedup_session_init);
+
+    uint64_t count = __atomic_add_fetch(&zstd_proxy_dedup_session_count, 1, __ATOMIC_RELAXED);
+    uint64_t session = zstd_proxy_dedup_mix(zstd_proxy_dedup_session_seed + count);
+
+    return session != 0 ? session : zstd_proxy_dedup_next_session();
+}
+
+static inline size_t zstd_proxy_dedup_cache_size(size_t cache_size) {
+    return cache_size < zstd_proxy_dedup_max ? zstd_proxy_dedup_max : cache_size;
+}
+
+void zstd_proxy_dedup_link_open(zstd_proxy_dedup_link *link, uint64_t peer, size_t cache_size, size_t sessions) {
+    *link = (zstd_proxy_dedup_link){ .peer = peer, .sessions = sessions };
+
+    if (sessions == 0) {
+        return;
+    }
+
+    zstd_proxy_dedup_cache *cache = zstd_proxy_dedup_unpark(false, peer, 0, zstd_proxy_dedup_cache_size(cache_size));
+
+    if (cache != NULL) {
+        link->offered = cache;
+        link->local = (zstd_proxy_dedup_offer){
+            .session = cache->session,
+            .chunks = cache->next,
+            .hash = zstd_proxy_dedup_cache_last_hash(cache),
+        };
+    }
+}
+
+void zstd_proxy_dedup_link_close(zstd_proxy_dedup_link *link) {
+    if (link->offered != NULL) {
+        zstd_proxy_dedup_park(link->offered, link->sessions);
+        link->offered = NULL;
+    }
+}
+
+static inline void zstd_proxy_dedup_reset_chunk(zstd_proxy_dedup *dedup) {
+    dedup->chunk_length = 0;
+    dedup->emitted = 0;
+    dedup->complete = false;
+}
+
+static inline void zstd_proxy_dedup_put_varint(ZSTD_outBuffer *output, uint64_t value) {
+    uint8_t *dst = output->dst;
+
+    do {
+        dst[output->pos++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+    } while (value > 0);
+}
+
+static inline void zstd_proxy_dedup_put_header(ZSTD_outBuffer *output, zstd_proxy_dedup_tag tag, uint64_t value) {
+    ((uint8_t *)output->dst)[output->pos++] = tag;
+
+    zstd_proxy_dedup_put_varint(output, value);
+}
+
+/** Values of each session record. */
+static inline unsigned zstd_proxy_dedup_control_count(zstd_proxy_dedup_tag tag) {
+    return tag == zstd_proxy_dedup_offered ? 3 : 1;
+}
+
+static inline void zstd_proxy_dedup_put_control(ZSTD_outBuffer *output, zstd_proxy_dedup_tag tag, const uint64_t *values) {
+    ((uint8_t *)output->dst)[output->pos++] = tag;
+
+    for (unsigned i = 0; i < zstd_proxy_dedup_control_count(tag); i++) {
+        zstd_proxy_dedup_put_varint(output, values[i]);
+    }
+}
+
+/** Switch to the offer of the peer if this end parked the same cache, returns `false` while it waits for room. */
+static bool zstd_proxy_dedup_resume_offer(zstd_proxy_dedup *dedup, ZSTD_outBuffer *output) {
+    const zstd_proxy_dedup_offer *offer = &dedup->link->remote;
+
+    if (output->size - output->pos < zstd_proxy_dedup_control_max) {
+        return false;
+    }
+
+    dedup->offer_handled = true;
+
+    zstd_proxy_dedup_cache *cache = zstd_proxy_dedup_unpark(true, dedup->link->peer, offer->session, dedup->cache->size);
+
+    if (cache == NULL) {
+        return true;
+    }
+
+    // The copies differ once a connection was cut short, this one can't be resumed anymore
+    if (cache->next != offer->chunks || zstd_proxy_dedup_cache_last_hash(cache) != offer->hash) {
+        zstd_proxy_dedup_cache_destroy(cache);
+
+        return true;
+    }
+
+    zstd_proxy_dedup_put_control(output, zstd_proxy_dedup_resume, &offer->session);
+    zstd_proxy_dedup_cache_destroy(dedup->cache);
+
+    dedup->cache = cache;
+    dedup->session = offer->session;
+
+    return true;
+}
+
+/** Write the session records due, returns `false` while they wait for room in `output`. */
+static bool zstd_proxy_dedup_encode_control(zstd_proxy_dedup *dedup, ZSTD_outBuffer *output) {
+    zstd_proxy_dedup_link *link = dedup->link;
+
+    if (!dedup->announced) {
+        if (output->size - output->pos < zstd_proxy_dedup_control_max) {
+            return false;
+        }
+
+        zstd_proxy_dedup_put_control(output, zstd_proxy_dedup_session, &dedup->session);
+        dedup->announced = true;
+    }
+
+    // Set before the directions started
+    if (!dedup->offer_sent && link->local.session != 0) {
+        if (output->size - output->pos < zstd_proxy_dedup_control_max) {
+            return false;
+        }
+
+        uint64_t values[3] = { link->local.session, link->local.chunks, link->local.hash };
+
+        zstd_proxy_dedup_put_control(output, zstd_proxy_dedup_offered, values);
+        dedup->offer_sent = true;
+    }
+
+    // Both ends switch caches between chunks
+    if (!dedup->offer_handled && dedup->chunk_length == 0 && __atomic_load_n(&link->remote_ready, __ATOMIC_ACQUIRE)) {
+        return zstd_proxy_dedup_resume_offer(dedup, output);
+    }
+
+    return true;
+}
+
+/** Apply a session record read by a decoder. */
+static int zstd_proxy_dedup_decode_control(zstd_proxy_dedup *dedup) {
+    zstd_proxy_dedup_link *link = dedup->link;
+    uint64_t *values = dedup->values;
+
+    switch (dedup->control) {
+        case zstd_proxy_dedup_session:
+            if (dedup->session != 0 || values[0] == 0) {
+                return EPROTO;
+            }
+
+            dedup->session = values[0];
+
+            return 0;
+        case zstd_proxy_dedup_offered:
+            if (link == NULL) {
+                return 0;
+            }
+
+            if (__atomic_load_n(&link->remote_ready, __ATOMIC_RELAXED)) {
+                return EPROTO;
+            }
+
+            link->remote = (zstd_proxy_dedup_offer){ .session = values[0], .chunks = values[1], .hash = values[2] };
+
+            __atomic_store_n(&link->remote_ready, true, __ATOMIC_RELEASE);
+
+            return 0;
+        case zstd_proxy_dedup_resume:
+            // Only the cache offered can be resumed, between chunks like the encoder does
+            if (dedup->offered == NULL || dedup->offered->session != values[0] || dedup->chunk_length != 0) {
+                return EPROTO;
+            }
+
+            zstd_proxy_dedup_cache_destroy(dedup->cache);
+
+            dedup->cache = dedup->offered;
+            dedup->offered = NULL;
+            dedup->session = values[0];
+
+            return 0;
+        default:
+            return EPROTO;
+    }
+}
+
+int zstd_proxy_dedup_create(zstd_proxy_dedup **dedup_ptr, size_t cache_size, bool encoder, zstd_proxy_dedup_link *link) {
+    zstd_proxy_dedup *dedup = calloc(1, sizeof(zstd_proxy_dedup));
+
+    *dedup_ptr = NULL;
+
+    if (dedup == NULL) {
+        return ENOMEM;
+    }
+
+    cache_size = zstd_proxy_dedup_cache_size(cache_size);
+
+    dedup->state = zstd_proxy_dedup_read_tag;
+
+    if (link != NULL && link->sessions > 0) {
+        dedup->link = link;
+    }
+
+    if (encoder) {
+        // Any random table works, only the encoder looks for boundaries
+        for (uint64_t i = 0, seed = 0; i < 256; i++) {
+            dedup->gear[i] = zstd_proxy_dedup_mix(seed += UINT64_C(0x9E3779B97F4A7C15));
+        }
+
+        // Decoders read the session of the connection from the encoder
+        if (dedup->link != NULL) {
+            dedup->session = zstd_proxy_dedup_next_session();
+        }
+    } else if (dedup->link != NULL) {
+        dedup->offered = link->offered;
+        link->offered = NULL;
+    }
+
+    if ((dedup->cache = zstd_proxy_dedup_cache_create(cache_size, encoder)) == NULL) {
+        log_error("failed to allocate dedup cache of %zu bytes", cache_size);
+        zstd_proxy_dedup_destroy(dedup);
+
+        return ENOMEM;
+    }
+
+    *dedup_ptr = dedup;
+
+    return 0;
+}
+
+void zstd_proxy_dedup_destroy(zstd_proxy_dedup *dedup) {
+    if (dedup == NULL) {
+        return;
+    }
+
+    // An offer the peer didn't resume is left as it was
+    zstd_proxy_dedup_link *link = dedup->link;
+
+    if (dedup->offered != NULL) {
+        zstd_proxy_dedup_park(dedup->offered, link->sessions);
+    }
+
+    if (dedup->cache != NULL && link != NULL && dedup->session != 0) {
+        dedup->cache->session = dedup->session;
+        dedup->cache->peer = link->peer;
+
+        zstd_proxy_dedup_park(dedup->cache, link->sessions);
+    } else {
+        zstd_proxy_dedup_cache_destroy(dedup->cache);
+    }
+
+    free(dedup);
+}
+
+bool zstd_proxy_dedup_encode(zstd_proxy_dedup *dedup, ZSTD_inBuffer *input, ZSTD_outBuffer *output) {
+    const uint8_t *src = input->src;
+
+    for (;;) {
+        if (dedup->link != NULL && !zstd_proxy_dedup_encode_control(dedup, output)) {
+            return true;
+        }
+
+        // Read until a boundary or the end of the input
+        while (!dedup->complete && input->pos < input->size) {
+            uint8_t byte = src[input->pos++];
+            size_t length = ++dedup->chunk_length;
+
+            dedup->rolling = (dedup->rolling << 1) + dedup->gear[byte];
+            dedup->chunk[length - 1] = byte;
+
+            if (
+                length >= zstd_proxy_dedup_max ||
+                (
+                    length >= zstd_proxy_dedup_min &&
+                    (dedup->rolling & (length < zstd_proxy_dedup_avg ? zstd_proxy_dedup_mask_small : zstd_proxy_dedup_mask_large)) == 0
+                )
+            ) {
+                dedup->complete = true;
+                dedup->chunk_hash = zstd_proxy_dedup_hash(dedup->chunk, length);
+            }
+        }
+
+        // Literals are written before the boundary is known, the reference then only replaces the rest of the chunk
+        if (dedup->complete && dedup->emitted < dedup->chunk_length) {
+            uint64_t id = zstd_proxy_dedup_lookup(dedup);
+
+            if (id != UINT64_MAX) {
+                if (output->size - output->pos < zstd_proxy_dedup_header_max) {
+                    return true;
+                }
+
+                zstd_proxy_dedup_put_header(output, zstd_proxy_dedup_reference, dedup->cache->next - id);
+                zstd_proxy_dedup_reset_chunk(dedup);
+
+                continue;
+            }
+        }
+
+        size_t pending = dedup->chunk_length - dedup->emitted;
+
+        if (pending > 0) {
+            size_t room = output->size - output->pos;
+
+            if (room <= zstd_proxy_dedup_header_max) {
+                return true;
+            }
+
+            size_t length = pending < room - zstd_proxy_dedup_header_max ? pending : room - zstd_proxy_dedup_header_max;
+
+            zstd_proxy_dedup_put_header(output, zstd_proxy_dedup_literal, length);
+            memcpy(&((char *)output->dst)[output->pos], &dedup->chunk[dedup->emitted], length);
+
+            output->pos += length;
+            dedup->emitted += length;
+
+            if (length < pending) {
+                return true;
+            }
+        }
+
+        if (!dedup->complete) {
+            return false;
+        }
+
+        if (output->pos == output->size) {
+            return true;
+        }
+
+        ((uint8_t *)output->dst)[output->pos++] = zstd_proxy_dedup_boundary;
+
+        zstd_proxy_dedup_insert(dedup);
+        zstd_proxy_dedup_reset_chunk(dedup);
+    }
+}
+
+int zstd_proxy_dedup_decode(zstd_proxy_dedup *dedup, ZSTD_inBuffer *input, ZSTD_outBuffer *output) {
+    const uint8_t *src = input->src;
+    char *dst = output->dst;
+
+    for (;;) {
+        size_t size;
+
+        switch (dedup->state) {
+            case zstd_proxy_dedup_read_tag:
+                if (input->pos == input->size) {
+                    return 0;
+                }
+
+                switch (src[input->pos++]) {
+                    case zstd_proxy_dedup_literal:
+                        dedup->state = zstd_proxy_dedup_read_length;
+                        break;
+                    case zstd_proxy_dedup_reference:
+                        dedup->state = zstd_proxy_dedup_read_distance;
+                        break;
+                    case zstd_proxy_dedup_boundary:
+                        if (dedup->chunk_length == 0) {
+                            return EPROTO;
+                        }
+
+                        zstd_proxy_dedup_insert(dedup);
+                        zstd_proxy_dedup_reset_chunk(dedup);
+                        break;
+                    case zstd_proxy_dedup_session:
+                    case zstd_proxy_dedup_offered:
+                    case zstd_proxy_dedup_resume:
+                        dedup->control = src[input->pos - 1];
+                        dedup->value_count = 0;
+                        dedup->state = zstd_proxy_dedup_read_control;
+                        break;
+                    default:
+                        return EPROTO;
+                }
+
+                dedup->value = 0;
+                dedup->shift = 0;
+                break;
+            case zstd_proxy_dedup_read_length:
+            case zstd_proxy_dedup_read_distance:
+            case zstd_proxy_dedup_read_control:
+                if (input->pos == input->size) {
+                    return 0;
+                }
+
+                if (dedup->shift > 63) {
+                    return EPROTO;
+                }
+
+                dedup->value |= (uint64_t)(src[input->pos] & 0x7f) << dedup->shift;
+                dedup->shift += 7;
+
+                if (src[input->pos++] & 0x80) {
+                    break;
+                }
+
+                if (dedup->state == zstd_proxy_dedup_read_control) {
+                    dedup->values[dedup->value_count++] = dedup->value;
+                    dedup->value = 0;
+                    dedup->shift = 0;
+
+                    if (dedup->value_count == zstd_proxy_dedup_control_count(dedup->control)) {
+                        int error = zstd_proxy_dedup_decode_control(dedup);
+
+                        if (error != 0) {
+                            return error;
+                        }
+
+                        dedup->state = zstd_proxy_dedup_read_tag;
+                    }
+                } else if (dedup->state == zstd_proxy_dedup_read_length) {
+                    if (dedup->value == 0 || dedup->value > zstd_proxy_dedup_max - dedup->chunk_length) {
+                        return EPROTO;
+                    }
+
+                    dedup->remaining = dedup->value;
+                    dedup->state = zstd_proxy_dedup_read_literal;
+                } else {
+                    // Evicted chunks can't be referenced, the encoder keeps the same cache
+                    zstd_proxy_dedup_cache *cache = dedup->cache;
+
+                    if (dedup->value == 0 || dedup->value > cache->next - cache->oldest) {
+                        return EPROTO;
+                    }
+
+                    zstd_proxy_dedup_entry *entry = zstd_proxy_dedup_entry_at(cache, cache->next - dedup->value);
+
+                    // The literals received so far are the start of the chunk
+                    if (entry->length <= dedup->chunk_length) {
+                        return EPROTO;
+                    }
+
+                    dedup->source = entry->offset + dedup->chunk_length;
+                    dedup->remaining = entry->length - dedup->chunk_length;
+                    dedup->state = zstd_proxy_dedup_read_reference;
+
+                    zstd_proxy_dedup_reset_chunk(dedup);
+                }
+
+                break;
+            case zstd_proxy_dedup_read_literal:
+                size = dedup->remaining;
+
+                if (size > input->size - input->pos) {
+                    size = input->size - input->pos;
+                }
+
+                if (size > output->size - output->pos) {
+                    size = output->size - output->pos;
+                }
+
+                if (size == 0) {
+                    return 0;
+                }
+
+                memcpy(&dst[output->pos], &src[input->pos], size);
+                memcpy(&dedup->chunk[dedup->chunk_length], &src[input->pos], size);
+
+                input->pos += size;
+                output->pos += size;
+                dedup->chunk_length += size;
+                dedup->remaining -= size;
+
+                if (dedup->remaining == 0) {
+                    dedup->state = zstd_proxy_dedup_read_tag;
+                }
+
+                break;
+            case zstd_proxy_dedup_read_reference:
+                size = dedup->remaining < output->size - output->pos ? dedup->remaining : output->size - output->pos;
+
+                if (size == 0) {
+                    return 0;
+                }
+
+                memcpy(&dst[output->pos], &dedup->cache->data[dedup->source], size);
+
+                output->pos += size;
+                dedup->source += size;
+                dedup->remaining -= size;
+
+                if (dedup->remaining == 0) {
+                    dedup->state = zstd_proxy_dedup_read_tag;
+                }
+
+                break;
+        }
+    }
+}
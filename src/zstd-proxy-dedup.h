@@ -0,0 +1,71 @@
+#ifndef zstd_proxy_dedup_H
+#define zstd_proxy_dedup_H
+
+#include <zstd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Deduplication stage, runs before compression.
+ *
+ * The encoder splits the stream into content-defined chunks (Gear rolling hash with FastCDC normalized
+ * chunking, so an insertion only moves the boundaries around it) and replaces the chunks it already sent
+ * with a reference. The decoder sees the same chunks in the same order and keeps an identical cache,
+ * references can then reach data sent long before the Zstd window.
+ *
+ * Records: literal bytes of the current chunk, end of the current chunk, or the rest of a cached chunk.
+ * Literals are written as soon as they are read so the stage never holds data back, a chunk which turns
+ * out to be cached once its boundary is found is completed with a reference.
+ *
+ * Sessions carry a cache over to the next connections with the same peer. Encoders announce a session, and
+ * both ends park their cache under it and the address of the peer when the connection closes. A connection
+ * starts by offering the peer the latest cache parked by a decoder for its address, with its number of chunks
+ * and the hash of the last one, through the other direction. The encoder resumes it when its own copy is in
+ * the same state, both ends then switch caches at the resume record. A connection cut short leaves the copies
+ * out of step, they are never resumed and the next connection starts with an empty cache.
+ */
+
+typedef struct zstd_proxy_dedup zstd_proxy_dedup;
+typedef struct zstd_proxy_dedup_cache zstd_proxy_dedup_cache;
+
+/** Cache parked by a decoder, as it's offered to the encoder of its peer. `session` is 0 for no offer. */
+typedef struct {
+    uint64_t session;
+    uint64_t chunks;
+    uint64_t hash;
+} zstd_proxy_dedup_offer;
+
+/** Shared by the two directions of a connection, sessions are disabled while `sessions` is 0. */
+typedef struct {
+    /** Key of the address of the peer, and caches the process keeps parked, the oldest are freed first. */
+    uint64_t peer;
+    size_t sessions;
+    /** Cache offered to the peer until the decoder takes it, and its offer, sent by the encoder. */
+    zstd_proxy_dedup_cache *offered;
+    zstd_proxy_dedup_offer local;
+    /** Offer of the peer, resumed by the encoder once the decoder sets `remote_ready`. */
+    zstd_proxy_dedup_offer remote;
+    bool remote_ready;
+} zstd_proxy_dedup_link;
+
+/** Pick the cache to offer the peer, before the directions start. */
+void zstd_proxy_dedup_link_open(zstd_proxy_dedup_link *link, uint64_t peer, size_t cache_size, size_t sessions);
+/** Park the offered cache again if no decoder took it, once the directions ended. */
+void zstd_proxy_dedup_link_close(zstd_proxy_dedup_link *link);
+
+/**
+ * `cache_size` bytes of chunks are kept, both ends must use the same size.
+ * `link` is `NULL` without another direction to exchange offers through, like streams.
+ */
+int zstd_proxy_dedup_create(zstd_proxy_dedup **dedup_ptr, size_t cache_size, bool encoder, zstd_proxy_dedup_link *link);
+/** Park the cache when sessions are enabled, free it otherwise. */
+void zstd_proxy_dedup_destroy(zstd_proxy_dedup *dedup);
+
+/** Read `input` and append records to `output`, returns `true` while read data is waiting for room in `output`. */
+bool zstd_proxy_dedup_encode(zstd_proxy_dedup *dedup, ZSTD_inBuffer *input, ZSTD_outBuffer *output);
+
+/** Decode the records of `input` into `output`, returns `EPROTO` on invalid records. */
+int zstd_proxy_dedup_decode(zstd_proxy_dedup *dedup, ZSTD_inBuffer *input, ZSTD_outBuffer *output);
+
+#endif
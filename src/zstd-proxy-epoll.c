@@ -0,0 +1,1085 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "zstd-proxy-epoll.h"
+#include "zstd-proxy-utils.h"
+
+/** Buffers passed to a single `sendmsg`. */
+#define zstd_proxy_epoll_iov_max 16
+/** Events read by a single `epoll_wait`. */
+#define zstd_proxy_epoll_events 64
+/** Interval between idle and stall timeout checks. */
+#define zstd_proxy_epoll_tick_ms 100
+/** Smallest input passed to the codec at the end of a turn, each call ends a compressed block. */
+#define zstd_proxy_epoll_slice_min (16 * 1024)
+
+typedef struct zstd_proxy_epoll_buffer zstd_proxy_epoll_buffer;
+typedef struct zstd_proxy_epoll_worker zstd_proxy_epoll_worker;
+typedef struct zstd_proxy_epoll_pair zstd_proxy_epoll_pair;
+
+struct zstd_proxy_epoll_buffer {
+    zstd_proxy_epoll_buffer *next;
+    /** Bytes already sent. */
+    size_t offset;
+    /** Bytes filled. */
+    size_t length;
+    /** Monotonic time at which processing first filled this buffer. */
+    uint64_t processed_at;
+    char data[];
+};
+
+typedef struct {
+    zstd_proxy_epoll_pair *pair;
+    int fd;
+    /** Edge-triggered state: `true` until a call returns `EAGAIN`. */
+    bool readable;
+    bool writable;
+} zstd_proxy_epoll_socket;
+
+typedef struct {
+    zstd_proxy_connection *connection;
+    /** Source and destination, indexes in `zstd_proxy_epoll_pair.sockets`. */
+    zstd_proxy_epoll_socket *source;
+    zstd_proxy_epoll_socket *destination;
+
+    /** recv buffer, taken from the pool on first read. */
+    zstd_proxy_epoll_buffer *input_buffer;
+    ZSTD_inBuffer input;
+    /** Monotonic time of the last recv, 0 once processing started. */
+    uint64_t received_at;
+    /** `true` when the last call filled its output, the codec may hold more data. */
+    bool flushing;
+
+    /** Send queue. */
+    zstd_proxy_epoll_buffer *head;
+    zstd_proxy_epoll_buffer *tail;
+    size_t queued;
+    /** Monotonic time of the last send progress, for the stall timeout. */
+    uint64_t progress_at;
+
+    /** `true` once the source returned EOF. */
+    bool eof;
+} zstd_proxy_epoll_direction;
+
+struct zstd_proxy_epoll_pair {
+    zstd_proxy_epoll_pair *prev;
+    zstd_proxy_epoll_pair *next;
+    zstd_proxy_epoll_worker *worker;
+
+    /** Compress and decompress. */
+    zstd_proxy_epoll_direction directions[2];
+    /** Compress source and destination. */
+    zstd_proxy_epoll_socket sockets[2];
+    zstd_proxy_epoll_socket wakeup;
+
+    zstd_proxy_epoll_callback done;
+    void *data;
+    bool closed;
+    /** Set once adopted by a worker, a stolen pair already sent its initial data. */
+    bool started;
+
+    /** Bytes left to process in the current turn. */
+    size_t budget;
+    /** `true` while in the worker ready queue, its turn ended with work left. */
+    bool ready;
+    zstd_proxy_epoll_pair *ready_next;
+};
+
+struct zstd_proxy_epoll_worker {
+    zstd_proxy_epoll *engine;
+    pthread_t thread;
+    /** CPU the worker is pinned to, -1 if not pinned. */
+    int cpu;
+    int epoll_fd;
+    /** Signalled when `inbox` is filled or the engine stops. */
+    int event_fd;
+
+    pthread_mutex_t lock;
+    /** Pairs waiting to be adopted by the worker, guarded by `lock`. */
+    zstd_proxy_epoll_pair *inbox;
+    /** Set under `lock` once the worker stopped adopting pairs. */
+    bool exited;
+
+    /** Pairs served by this worker. */
+    zstd_proxy_epoll_pair *pairs;
+    /** Pairs closed during the current batch of events, freed at the end of it. */
+    zstd_proxy_epoll_pair *closed;
+    /** Pairs waiting for their next turn, served round-robin between batches of events. */
+    zstd_proxy_epoll_pair *ready;
+    zstd_proxy_epoll_pair *ready_tail;
+    size_t ready_count;
+    /** Set while blocked waiting for events, busy workers then hand it ready pairs. */
+    bool idle;
+
+    /** Pairs with an idle or stall timeout. */
+    size_t timed;
+    uint64_t ticked_at;
+
+    zstd_proxy_epoll_buffer *pool;
+    size_t pooled;
+};
+
+struct zstd_proxy_epoll {
+    zstd_proxy_epoll_options options;
+    bool stopping;
+    /** Round-robin counter to pick workers. */
+    size_t next;
+    size_t size;
+    zstd_proxy_epoll_worker workers[];
+};
+
+void zstd_proxy_epoll_default_options(zstd_proxy_epoll_options *options) {
+    options->workers = 0;
+    options->buffer_size = 256 * 1024;
+    options->depth = 4;
+    options->incoming_cpu = false;
+    options->quantum = 64 * 1024;
+    options->steal = true;
+
+    memset(&options->cpus, 0, sizeof(options->cpus));
+}
+
+static zstd_proxy_epoll_buffer *zstd_proxy_epoll_buffer_get(zstd_proxy_epoll_worker *worker) {
+    zstd_proxy_epoll_buffer *buffer = worker->pool;
+
+    if (buffer != NULL) {
+        worker->pool = buffer->next;
+        worker->pooled--;
+    } else if ((buffer = malloc(sizeof(zstd_proxy_epoll_buffer) + worker->engine->options.buffer_size)) == NULL) {
+        return NULL;
+    }
+
+    buffer->next = NULL;
+    buffer->offset = 0;
+    buffer->length = 0;
+    buffer->processed_at = 0;
+
+    return buffer;
+}
+
+static void zstd_proxy_epoll_buffer_put(zstd_proxy_epoll_worker *worker, zstd_proxy_epoll_buffer *buffer) {
+    // Keep enough buffers for a few busy connections, give the rest back
+    if (worker->pooled >= worker->engine->options.depth * 16) {
+        free(buffer);
+
+        return;
+    }
+
+    buffer->next = worker->pool;
+    worker->pool = buffer;
+    worker->pooled++;
+}
+
+static inline size_t zstd_proxy_epoll_depth(zstd_proxy_epoll_direction *direction, zstd_proxy_epoll *engine) {
+    size_t limit = __atomic_load_n(&direction->connection->options->depth_limit, __ATOMIC_RELAXED);
+
+    return limit == 0 || limit > engine->options.depth ? engine->options.depth : limit;
+}
+
+/**
+ * Pass `input` to the process callback, appending the output to the send queue.
+ * With `limit`, stops once the queue is full or the turn of the pair is over.
+ */
+static int zstd_proxy_epoll_process(zstd_proxy_epoll_pair *pair, zstd_proxy_epoll_direction *direction, ZSTD_inBuffer *input, bool limit) {
+    zstd_proxy_epoll_worker *worker = pair->worker;
+    zstd_proxy_connection *connection = direction->connection;
+    size_t buffer_size = worker->engine->options.buffer_size;
+    size_t depth = zstd_proxy_epoll_depth(direction, worker->engine);
+
+    while ((input->pos < input->size || direction->flushing) && (!limit || (direction->queued < depth && pair->budget > 0))) {
+        zstd_proxy_epoll_buffer *buffer = direction->tail;
+        bool fresh = buffer == NULL || buffer_size - buffer->length < buffer_size / 4;
+
+        // Append to the last buffer when it has room, to send fewer and larger chunks
+        if (fresh && (buffer = zstd_proxy_epoll_buffer_get(worker)) == NULL) {
+            return ENOMEM;
+        }
+
+        ZSTD_outBuffer output = {
+            .dst = &buffer->data[buffer->length],
+            .pos = 0,
+            .size = buffer_size - buffer->length,
+        };
+
+        uint64_t start = zstd_proxy_now_ns();
+
+        if (direction->received_at != 0) {
+            zstd_proxy_latency_record(connection, recv_to_process, start - direction->received_at);
+
+            direction->received_at = 0;
+        }
+
+        // Slice large inputs so a bulk transfer can't hold the worker for a whole buffer
+        ZSTD_inBuffer slice = *input;
+        size_t slice_size = pair->budget < zstd_proxy_epoll_slice_min ? zstd_proxy_epoll_slice_min : pair->budget;
+
+        if (limit && slice.size - slice.pos > slice_size) {
+            slice.size = slice.pos + slice_size;
+        }
+
+        trace_probe(process_start, direction->source->fd, 0, input->pos, input->size);
+
+        int error = connection->process(connection->process_data, &slice, &output);
+
+        if (limit) {
+            size_t consumed = slice.pos - input->pos;
+
+            pair->budget -= consumed < pair->budget ? consumed : pair->budget;
+        }
+
+        input->pos = slice.pos;
+
+        uint64_t end = zstd_proxy_now_ns();
+
+        trace_probe(process_done, direction->source->fd, 0, input->pos, output.pos, end - start);
+
+        zstd_proxy_metric_add(connection, chunks, 1);
+        zstd_proxy_metric_add(connection, bytes_produced, output.pos);
+        zstd_proxy_metric_add(connection, process_ns, end - start);
+        zstd_proxy_latency_record(connection, process, end - start);
+
+        direction->flushing = error == 0 && output.pos == output.size;
+
+        if (error != 0 || output.pos == 0) {
+            if (fresh) {
+                zstd_proxy_epoll_buffer_put(worker, buffer);
+            }
+
+            if (error != 0) {
+                return error;
+            }
+
+            continue;
+        }
+
+        if (buffer->processed_at == 0) {
+            buffer->processed_at = end;
+        }
+
+        buffer->length += output.pos;
+
+        // Only queue buffers with data, an empty one would count against the depth forever
+        if (fresh) {
+            if (direction->tail == NULL) {
+                direction->head = buffer;
+                direction->progress_at = end;
+            } else {
+                direction->tail->next = buffer;
+            }
+
+            direction->tail = buffer;
+            direction->queued++;
+        }
+    }
+
+    zstd_proxy_metric_set(connection, queue_running, direction->queued);
+
+    return 0;
+}
+
+/** Send the queue with `sendmsg`, returns -1 if nothing could be sent. */
+static int zstd_proxy_epoll_flush(zstd_proxy_epoll_pair *pair, zstd_proxy_epoll_direction *direction) {
+    zstd_proxy_connection *connection = direction->connection;
+    zstd_proxy_epoll_socket *destination = direction->destination;
+    struct iovec iov[zstd_proxy_epoll_iov_max];
+    struct msghdr message = { .msg_iov = iov };
+    size_t total = 0;
+
+    for (
+        zstd_proxy_epoll_buffer *buffer = direction->head;
+        buffer != NULL && message.msg_iovlen < zstd_proxy_epoll_iov_max;
+        buffer = buffer->next
+    ) {
+        if (buffer->length > buffer->offset) {
+            iov[message.msg_iovlen].iov_base = &buffer->data[buffer->offset];
+            iov[message.msg_iovlen].iov_len = buffer->length - buffer->offset;
+            total += iov[message.msg_iovlen++].iov_len;
+        }
+    }
+
+    if (total == 0) {
+        return -1;
+    }
+
+    trace_probe(send_submit, destination->fd, 0, total, direction->queued);
+
+    // The codec still holds the rest of the frame, it follows once the queue drains
+    int flags = direction->flushing && connection->options->socket.cork ? MSG_MORE : 0;
+
+    // sendmsg() instead of writev() for MSG_NOSIGNAL
+    ssize_t sent = sendmsg(destination->fd, &message, MSG_NOSIGNAL | flags);
+
+    trace_probe(send_complete, destination->fd, 0, sent, direction->queued);
+
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            destination->writable = false;
+
+            return -1;
+        } else if (errno == EINTR) {
+            return -1;
+        }
+
+        log_error("error writing to fd %d: %s", destination->fd, strerror(errno));
+
+        return errno;
+    }
+
+    uint64_t now = zstd_proxy_now_ns();
+
+    zstd_proxy_metric_add(connection, sends, 1);
+    zstd_proxy_metric_add(connection, bytes_out, sent);
+
+    if ((size_t)sent < total) {
+        zstd_proxy_metric_add(connection, partial_sends, 1);
+        trace_probe(send_partial, destination->fd, 0, sent, total - sent);
+
+        destination->writable = false;
+    }
+
+    direction->progress_at = now;
+
+    // Release the buffers which were fully sent
+    for (size_t remaining = sent; direction->head != NULL;) {
+        zstd_proxy_epoll_buffer *buffer = direction->head;
+        size_t pending = buffer->length - buffer->offset;
+
+        if (remaining < pending) {
+            buffer->offset += remaining;
+
+            break;
+        }
+
+        remaining -= pending;
+
+        zstd_proxy_latency_record(connection, process_to_send, now - buffer->processed_at);
+
+        direction->head = buffer->next;
+        direction->queued--;
+
+        if (direction->head == NULL) {
+            direction->tail = NULL;
+        }
+
+        zstd_proxy_epoll_buffer_put(pair->worker, buffer);
+    }
+
+    zstd_proxy_metric_set(connection, queue_running, direction->queued);
+
+    return 0;
+}
+
+static inline bool zstd_proxy_epoll_has_output(zstd_proxy_epoll_direction *direction) {
+    return direction->head != NULL;
+}
+
+/** Read and process one chunk, returns -1 if nothing could be read. */
+static int zstd_proxy_epoll_read(zstd_proxy_epoll_pair *pair, zstd_proxy_epoll_direction *direction) {
+    zstd_proxy_connection *connection = direction->connection;
+    zstd_proxy_epoll_socket *source = direction->source;
+    size_t size = pair->worker->engine->options.buffer_size;
+    size_t recv_size = __atomic_load_n(&connection->options->recv_size, __ATOMIC_RELAXED);
+
+    if (direction->input_buffer == NULL && (direction->input_buffer = zstd_proxy_epoll_buffer_get(pair->worker)) == NULL) {
+        return ENOMEM;
+    }
+
+    if (recv_size == 0 || recv_size > size) {
+        recv_size = size;
+    }
+
+    trace_probe(recv_submit, source->fd, 0, recv_size, direction->queued);
+
+    ssize_t received = recv(source->fd, direction->input_buffer->data, recv_size, 0);
+
+    trace_probe(recv_complete, source->fd, 0, received, direction->queued);
+
+    if (received == 0) {
+        direction->eof = true;
+
+        if (connection->end == NULL) {
+            return 0;
+        }
+
+        // Flush the end of a message the source never finished, the pump keeps going while the queue is full
+        connection->end(connection->process_data);
+        direction->flushing = true;
+        direction->input.pos = direction->input.size;
+
+        return zstd_proxy_epoll_process(pair, direction, &direction->input, true);
+    } else if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            source->readable = false;
+
+            return -1;
+        } else if (errno == EINTR) {
+            return -1;
+        }
+
+        log_error("error reading fd %d: %s", source->fd, strerror(errno));
+
+        return errno;
+    }
+
+    direction->received_at = zstd_proxy_now_ns();
+    direction->input.src = direction->input_buffer->data;
+    direction->input.pos = 0;
+    direction->input.size = received;
+
+    zstd_proxy_touch(connection->options, direction->received_at);
+    zstd_proxy_metric_add(connection, bytes_in, received);
+
+    return zstd_proxy_epoll_process(pair, direction, &direction->input, true);
+}
+
+/**
+ * Move data until both directions would block.
+ * Returns an errno value, or -1 once a direction reached EOF and sent everything.
+ */
+static int zstd_proxy_epoll_pump(zstd_proxy_epoll_pair *pair) {
+    zstd_proxy_options *options = pair->directions[0].connection->options;
+    bool progress = true;
+
+    while (progress && pair->budget > 0) {
+        progress = false;
+
+        if (zstd_proxy_stopped(options)) {
+            return -1;
+        }
+
+        bool paused = __atomic_load_n(&options->paused, __ATOMIC_RELAXED);
+
+        for (size_t i = 0; i < 2; i++) {
+            zstd_proxy_epoll_direction *direction = &pair->directions[i];
+            int error;
+
+            if (zstd_proxy_epoll_has_output(direction) && direction->destination->writable) {
+                if ((error = zstd_proxy_epoll_flush(pair, direction)) > 0) {
+                    return error;
+                }
+
+                progress |= error == 0;
+            }
+
+            // Finish processing the last recv once the queue has room
+            if (direction->input.pos < direction->input.size || direction->flushing) {
+                size_t queued = direction->queued;
+                size_t pos = direction->input.pos;
+
+                if ((error = zstd_proxy_epoll_process(pair, direction, &direction->input, true)) != 0) {
+                    return error;
+                }
+
+                progress |= direction->input.pos != pos || direction->queued != queued;
+            } else if (
+                !direction->eof &&
+                !paused &&
+                direction->source->readable &&
+                direction->queued < zstd_proxy_epoll_depth(direction, pair->worker->engine)
+            ) {
+                if ((error = zstd_proxy_epoll_read(pair, direction)) > 0) {
+                    return error;
+                }
+
+                progress |= error == 0;
+            }
+
+            // Same as the thread backends: the connection ends with its first direction
+            if (direction->eof && !direction->flushing && !zstd_proxy_epoll_has_output(direction)) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/** Queue `pair` for another turn once the other pairs had theirs. */
+static void zstd_proxy_epoll_ready_push(zstd_proxy_epoll_worker *worker, zstd_proxy_epoll_pair *pair) {
+    pair->ready = true;
+    pair->ready_next = NULL;
+
+    if (worker->ready_tail == NULL) {
+        worker->ready = pair;
+    } else {
+        worker->ready_tail->ready_next = pair;
+    }
+
+    worker->ready_tail = pair;
+    worker->ready_count++;
+}
+
+/** Remove `pair`, or the head of the ready queue if NULL. */
+static zstd_proxy_epoll_pair *zstd_proxy_epoll_ready_remove(zstd_proxy_epoll_worker *worker, zstd_proxy_epoll_pair *pair) {
+    zstd_proxy_epoll_pair **link = &worker->ready, *previous = NULL;
+
+    // Removing anything but the head only happens on close, the queue holds the busy pairs of one worker
+    while (*link != NULL && pair != NULL && *link != pair) {
+        previous = *link;
+        link = &previous->ready_next;
+    }
+
+    if ((pair = *link) == NULL) {
+        return NULL;
+    }
+
+    *link = pair->ready_next;
+
+    if (worker->ready_tail == pair) {
+        worker->ready_tail = previous;
+    }
+
+    pair->ready = false;
+    pair->ready_next = NULL;
+
+    worker->ready_count--;
+
+    return pair;
+}
+
+/** Stop watching the sockets of `pair` and unlink it from its worker. */
+static void zstd_proxy_epoll_detach(zstd_proxy_epoll_pair *pair) {
+    zstd_proxy_epoll_worker *worker = pair->worker;
+
+    if (pair->ready) {
+        zstd_proxy_epoll_ready_remove(worker, pair);
+    }
+
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, pair->sockets[0].fd, NULL);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, pair->sockets[1].fd, NULL);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, pair->wakeup.fd, NULL);
+
+    if (pair->prev != NULL) {
+        pair->prev->next = pair->next;
+    } else {
+        worker->pairs = pair->next;
+    }
+
+    if (pair->next != NULL) {
+        pair->next->prev = pair->prev;
+    }
+
+    zstd_proxy_options *options = pair->directions[0].connection->options;
+
+    if (options->idle_timeout_ms > 0 || options->stall_timeout_ms > 0) {
+        worker->timed--;
+    }
+}
+
+static void zstd_proxy_epoll_close(zstd_proxy_epoll_pair *pair, int error) {
+    zstd_proxy_epoll_worker *worker = pair->worker;
+
+    if (pair->closed) {
+        return;
+    }
+
+    zstd_proxy_epoll_detach(pair);
+
+    for (size_t i = 0; i < 2; i++) {
+        zstd_proxy_epoll_direction *direction = &pair->directions[i];
+
+        zstd_proxy_metric_set(direction->connection, queue_running, 0);
+
+        if (direction->input_buffer != NULL) {
+            zstd_proxy_epoll_buffer_put(worker, direction->input_buffer);
+        }
+
+        while (direction->head != NULL) {
+            zstd_proxy_epoll_buffer *buffer = direction->head;
+
+            direction->head = buffer->next;
+            zstd_proxy_epoll_buffer_put(worker, buffer);
+        }
+    }
+
+    // The connections belong to the caller, they must not be used past this point
+    pair->closed = true;
+    pair->next = worker->closed;
+    worker->closed = pair;
+    pair->done(pair->data, error);
+}
+
+/** Give `pair` a turn, it goes to the back of the ready queue if it still has work once its budget is spent. */
+static void zstd_proxy_epoll_update(zstd_proxy_epoll_pair *pair) {
+    zstd_proxy_epoll_worker *worker = pair->worker;
+    size_t quantum = worker->engine->options.quantum;
+    size_t weight = __atomic_load_n(&pair->directions[0].connection->options->weight, __ATOMIC_RELAXED);
+
+    pair->budget = quantum == 0 ? SIZE_MAX : quantum * (weight > 0 ? weight : 1);
+
+    int error = zstd_proxy_epoll_pump(pair);
+
+    if (error != 0) {
+        zstd_proxy_epoll_close(pair, error < 0 ? 0 : error);
+    } else if (pair->budget == 0 && !pair->ready) {
+        zstd_proxy_epoll_ready_push(worker, pair);
+    }
+}
+
+/** Hand the next ready pair to an idle worker, with its state and buffers, when more than one is waiting. */
+static void zstd_proxy_epoll_give(zstd_proxy_epoll_worker *worker) {
+    zstd_proxy_epoll *engine = worker->engine;
+    zstd_proxy_epoll_worker *target = NULL;
+    uint64_t value = 1;
+
+    // Keep one so moving pairs doesn't just swap which worker is busy
+    if (!engine->options.steal || worker->ready_count < 2) {
+        return;
+    }
+
+    for (size_t i = 0; i < engine->size && target == NULL; i++) {
+        bool idle = true;
+
+        // Claim it so other busy workers pick another one
+        if (__atomic_compare_exchange_n(&engine->workers[i].idle, &idle, false, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            target = &engine->workers[i];
+        }
+    }
+
+    if (target == NULL) {
+        return;
+    }
+
+    // Holding the lock also keeps the target from exiting and closing its eventfd
+    pthread_mutex_lock(&target->lock);
+
+    if (!target->exited) {
+        zstd_proxy_epoll_pair *pair = zstd_proxy_epoll_ready_remove(worker, NULL);
+
+        zstd_proxy_epoll_detach(pair);
+
+        pair->next = target->inbox;
+        target->inbox = pair;
+
+        if (write(target->event_fd, &value, sizeof(value)) < 0) {
+            log_error("failed to wake epoll worker: %s", strerror(errno));
+        }
+    }
+
+    pthread_mutex_unlock(&target->lock);
+}
+
+static int zstd_proxy_epoll_register(zstd_proxy_epoll_worker *worker, zstd_proxy_epoll_socket *socket, uint32_t events) {
+    struct epoll_event event = { .events = events | EPOLLET, .data.ptr = socket };
+
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, socket->fd, &event) != 0) {
+        log_error("failed to add fd %d to epoll: %s", socket->fd, strerror(errno));
+
+        return errno;
+    }
+
+    return 0;
+}
+
+static void zstd_proxy_epoll_adopt(zstd_proxy_epoll_worker *worker) {
+    uint64_t value;
+
+    if (read(worker->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        log_error("failed to read worker eventfd: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&worker->lock);
+
+    zstd_proxy_epoll_pair *inbox = worker->inbox;
+
+    worker->inbox = NULL;
+
+    pthread_mutex_unlock(&worker->lock);
+
+    while (inbox != NULL) {
+        zstd_proxy_epoll_pair *pair = inbox;
+        zstd_proxy_options *options = pair->directions[0].connection->options;
+        int error = 0;
+
+        inbox = pair->next;
+
+        pair->worker = worker;
+        pair->prev = NULL;
+        pair->next = worker->pairs;
+
+        if (worker->pairs != NULL) {
+            worker->pairs->prev = pair;
+        }
+
+        worker->pairs = pair;
+
+        if (options->idle_timeout_ms > 0 || options->stall_timeout_ms > 0) {
+            worker->timed++;
+        }
+
+        if (
+            (error = zstd_proxy_epoll_register(worker, &pair->sockets[0], EPOLLIN | EPOLLOUT | EPOLLRDHUP)) != 0 ||
+            (error = zstd_proxy_epoll_register(worker, &pair->sockets[1], EPOLLIN | EPOLLOUT | EPOLLRDHUP)) != 0 ||
+            (error = zstd_proxy_epoll_register(worker, &pair->wakeup, EPOLLIN)) != 0
+        ) {
+            zstd_proxy_epoll_close(pair, error);
+
+            continue;
+        }
+
+        // Send any buffered data if needed, a stolen pair already did
+        for (size_t i = 0; i < 2 && error == 0 && !pair->started; i++) {
+            zstd_proxy_epoll_direction *direction = &pair->directions[i];
+            zstd_proxy_descriptor *listen = direction->connection->listen;
+            ZSTD_inBuffer head = { .src = listen->data, .pos = 0, .size = listen->data_length };
+
+            if (head.size > 0) {
+                direction->received_at = zstd_proxy_now_ns();
+
+                zstd_proxy_metric_add(direction->connection, bytes_in, head.size);
+
+                error = zstd_proxy_epoll_process(pair, direction, &head, false);
+            }
+        }
+
+        pair->started = true;
+
+        if (error != 0) {
+            zstd_proxy_epoll_close(pair, error);
+        } else {
+            zstd_proxy_epoll_update(pair);
+        }
+    }
+}
+
+static void zstd_proxy_epoll_tick(zstd_proxy_epoll_worker *worker) {
+    uint64_t now = zstd_proxy_now_ns();
+
+    if (now - worker->ticked_at < zstd_proxy_epoll_tick_ms * 1000 * 1000) {
+        return;
+    }
+
+    worker->ticked_at = now;
+
+    for (zstd_proxy_epoll_pair *pair = worker->pairs, *next; pair != NULL; pair = next) {
+        zstd_proxy_options *options = pair->directions[0].connection->options;
+        uint64_t stall_timeout = options->stall_timeout_ms * 1000 * 1000;
+
+        next = pair->next;
+
+        if (options->idle_timeout_ms > 0 && zstd_proxy_idle_remaining(options, now) == 0) {
+            zstd_proxy_set_close_reason(options, zstd_proxy_close_idle_timeout);
+            zstd_proxy_epoll_close(pair, ETIMEDOUT);
+
+            continue;
+        }
+
+        for (size_t i = 0; i < 2 && stall_timeout > 0; i++) {
+            zstd_proxy_epoll_direction *direction = &pair->directions[i];
+
+            if (zstd_proxy_epoll_has_output(direction) && now - direction->progress_at >= stall_timeout) {
+                log_error("send stalled on fd %d", direction->destination->fd);
+                zstd_proxy_set_close_reason(options, zstd_proxy_close_stall_timeout);
+                zstd_proxy_epoll_close(pair, ETIMEDOUT);
+
+                break;
+            }
+        }
+    }
+}
+
+static void *zstd_proxy_epoll_worker_run(void *data) {
+    zstd_proxy_epoll_worker *worker = data;
+    struct epoll_event events[zstd_proxy_epoll_events];
+
+    // Pooled buffers are then allocated on the local NUMA node
+    if (worker->cpu >= 0) {
+        zstd_proxy_pin_thread(&worker->engine->options.cpus, worker->cpu);
+    }
+
+    while (!__atomic_load_n(&worker->engine->stopping, __ATOMIC_ACQUIRE)) {
+        // Only poll for events while pairs are waiting for their turn
+        int timeout = worker->ready != NULL ? 0 : worker->timed > 0 ? zstd_proxy_epoll_tick_ms : -1;
+
+        __atomic_store_n(&worker->idle, timeout != 0, __ATOMIC_RELAXED);
+
+        int count = epoll_wait(worker->epoll_fd, events, zstd_proxy_epoll_events, timeout);
+
+        __atomic_store_n(&worker->idle, false, __ATOMIC_RELAXED);
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_error("failed to wait for epoll events: %s", strerror(errno));
+
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            zstd_proxy_epoll_socket *socket = events[i].data.ptr;
+            uint32_t flags = events[i].events;
+
+            if (socket == NULL) {
+                zstd_proxy_epoll_adopt(worker);
+
+                continue;
+            }
+
+            zstd_proxy_epoll_pair *pair = socket->pair;
+
+            // Closed by an earlier event of this batch
+            if (pair->closed) {
+                continue;
+            }
+
+            if (socket == &pair->wakeup) {
+                zstd_proxy_wakeup_drain(socket->fd);
+            } else {
+                // Errors and hang-ups are reported by the next recv() or sendmsg()
+                if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    socket->readable = true;
+                }
+
+                if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                    socket->writable = true;
+                }
+            }
+
+            // Already waiting for its turn, events don't let it skip the queue
+            if (!pair->ready) {
+                zstd_proxy_epoll_update(pair);
+            }
+        }
+
+        // One turn for each pair which was waiting, those still busy go to the back again
+        for (size_t turns = worker->ready_count; turns > 0 && worker->ready != NULL; turns--) {
+            zstd_proxy_epoll_update(zstd_proxy_epoll_ready_remove(worker, NULL));
+        }
+
+        zstd_proxy_epoll_give(worker);
+
+        if (worker->timed > 0) {
+            zstd_proxy_epoll_tick(worker);
+        }
+
+        while (worker->closed != NULL) {
+            zstd_proxy_epoll_pair *pair = worker->closed;
+
+            worker->closed = pair->next;
+            free(pair);
+        }
+    }
+
+    // Engine destroyed: adopt late pairs to close them too, busy workers stop giving pairs after this
+    pthread_mutex_lock(&worker->lock);
+
+    worker->exited = true;
+
+    pthread_mutex_unlock(&worker->lock);
+
+    zstd_proxy_epoll_adopt(worker);
+
+    while (worker->pairs != NULL) {
+        zstd_proxy_epoll_close(worker->pairs, ECANCELED);
+    }
+
+    while (worker->closed != NULL) {
+        zstd_proxy_epoll_pair *pair = worker->closed;
+
+        worker->closed = pair->next;
+        free(pair);
+    }
+
+    return NULL;
+}
+
+static void zstd_proxy_epoll_worker_destroy(zstd_proxy_epoll_worker *worker) {
+    if (worker->epoll_fd >= 0) {
+        close(worker->epoll_fd);
+    }
+
+    if (worker->event_fd >= 0) {
+        close(worker->event_fd);
+    }
+
+    while (worker->pool != NULL) {
+        zstd_proxy_epoll_buffer *buffer = worker->pool;
+
+        worker->pool = buffer->next;
+        free(buffer);
+    }
+
+    pthread_mutex_destroy(&worker->lock);
+}
+
+static int zstd_proxy_epoll_worker_init(zstd_proxy_epoll *engine, zstd_proxy_epoll_worker *worker, size_t index) {
+    worker->engine = engine;
+    worker->thread = 0;
+    worker->cpu = zstd_proxy_cpu_set_at(&engine->options.cpus, index);
+    worker->inbox = NULL;
+    worker->exited = false;
+    worker->ready = NULL;
+    worker->ready_tail = NULL;
+    worker->ready_count = 0;
+    worker->idle = false;
+    worker->pairs = NULL;
+    worker->closed = NULL;
+    worker->timed = 0;
+    worker->ticked_at = 0;
+    worker->pool = NULL;
+    worker->pooled = 0;
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    pthread_mutex_init(&worker->lock, NULL);
+
+    if (worker->epoll_fd < 0 || worker->event_fd < 0) {
+        log_error("failed to create epoll worker: %s", strerror(errno));
+
+        return errno;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &event) != 0) {
+        log_error("failed to add eventfd to epoll: %s", strerror(errno));
+
+        return errno;
+    }
+
+    int error = pthread_create(&worker->thread, NULL, zstd_proxy_epoll_worker_run, worker);
+
+    if (error != 0) {
+        log_error("error creating epoll worker thread: %s", strerror(error));
+    }
+
+    return error;
+}
+
+int zstd_proxy_epoll_create(zstd_proxy_epoll **engine_ptr, const zstd_proxy_epoll_options *options) {
+    int error = 0;
+    size_t size = options->workers;
+
+    if (size == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        size = cpus > 0 ? cpus : 1;
+    }
+
+    zstd_proxy_epoll *engine = calloc(1, sizeof(zstd_proxy_epoll) + size * sizeof(zstd_proxy_epoll_worker));
+
+    if (engine == NULL) {
+        return ENOMEM;
+    }
+
+    engine->options = *options;
+    engine->stopping = false;
+    engine->next = 0;
+    engine->size = 0;
+
+    if (engine->options.depth == 0) {
+        engine->options.depth = 1;
+    }
+
+    for (; engine->size < size; engine->size++) {
+        if ((error = zstd_proxy_epoll_worker_init(engine, &engine->workers[engine->size], engine->size)) != 0) {
+            // Only the failed worker has no thread to join
+            zstd_proxy_epoll_worker_destroy(&engine->workers[engine->size]);
+
+            break;
+        }
+    }
+
+    if (error != 0) {
+        zstd_proxy_epoll_destroy(engine);
+        engine = NULL;
+    }
+
+    *engine_ptr = engine;
+
+    return error;
+}
+
+void zstd_proxy_epoll_destroy(zstd_proxy_epoll *engine) {
+    uint64_t value = 1;
+
+    if (engine == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&engine->stopping, true, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < engine->size; i++) {
+        zstd_proxy_epoll_worker *worker = &engine->workers[i];
+
+        if (write(worker->event_fd, &value, sizeof(value)) < 0) {
+            log_error("failed to wake epoll worker: %s", strerror(errno));
+        }
+
+        pthread_join(worker->thread, NULL);
+        zstd_proxy_epoll_worker_destroy(worker);
+    }
+
+    free(engine);
+}
+
+int zstd_proxy_epoll_add(
+    zstd_proxy_epoll *engine,
+    zstd_proxy_connection *compress,
+    zstd_proxy_connection *decompress,
+    zstd_proxy_epoll_callback done,
+    void *data
+) {
+    uint64_t value = 1;
+    zstd_proxy_epoll_pair *pair = calloc(1, sizeof(zstd_proxy_epoll_pair));
+
+    if (pair == NULL) {
+        return ENOMEM;
+    }
+
+    size_t index = engine->size;
+
+    if (engine->options.incoming_cpu) {
+        int cpu = zstd_proxy_incoming_cpu(compress->listen->fd);
+
+        for (index = 0; cpu >= 0 && index < engine->size && engine->workers[index].cpu != cpu; index++);
+    }
+
+    if (index == engine->size) {
+        index = __atomic_fetch_add(&engine->next, 1, __ATOMIC_RELAXED) % engine->size;
+    }
+
+    zstd_proxy_epoll_worker *worker = &engine->workers[index];
+
+    pair->worker = worker;
+    pair->done = done;
+    pair->data = data;
+    pair->closed = false;
+
+    // Optimistic until the first EAGAIN, the edge for the initial state may have passed already
+    pair->sockets[0] = (zstd_proxy_epoll_socket){ .pair = pair, .fd = compress->listen->fd, .readable = true, .writable = true };
+    pair->sockets[1] = (zstd_proxy_epoll_socket){ .pair = pair, .fd = compress->connect->fd, .readable = true, .writable = true };
+    pair->wakeup = (zstd_proxy_epoll_socket){ .pair = pair, .fd = compress->wakeup_fd };
+
+    pair->directions[0].connection = compress;
+    pair->directions[0].source = &pair->sockets[0];
+    pair->directions[0].destination = &pair->sockets[1];
+    pair->directions[1].connection = decompress;
+    pair->directions[1].source = &pair->sockets[1];
+    pair->directions[1].destination = &pair->sockets[0];
+
+    // Hand the pair to the worker, it owns it from now on
+    pthread_mutex_lock(&worker->lock);
+
+    pair->next = worker->inbox;
+    worker->inbox = pair;
+
+    pthread_mutex_unlock(&worker->lock);
+
+    if (write(worker->event_fd, &value, sizeof(value)) < 0) {
+        log_error("failed to wake epoll worker: %s", strerror(errno));
+    }
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef zstd_proxy_epoll_H
+#define zstd_proxy_epoll_H
+
+#include "zstd-proxy.h"
+#include "zstd-proxy-affinity.h"
+
+typedef struct {
+    /** Worker threads, one per online CPU if 0. */
+    size_t workers;
+    /** Size of the pooled recv and send buffers. */
+    size_t buffer_size;
+    /** Send buffers queued per direction before it stops reading. */
+    size_t depth;
+    /** Pin worker `i` to the `i`-th CPU of the set, modulo its size. Empty to let the scheduler decide. */
+    zstd_proxy_cpu_set cpus;
+    /** Serve connections on the worker pinned to the CPU receiving their packets (`SO_INCOMING_CPU`), if any. */
+    bool incoming_cpu;
+    /** Bytes a connection processes, times its `weight`, before the other connections of its worker get a turn. 0 for no limit. */
+    size_t quantum;
+    /** Let idle workers take over connections waiting for their turn on a busy worker. */
+    bool steal;
+} zstd_proxy_epoll_options;
+
+typedef void (*zstd_proxy_epoll_callback)(void *data, int error);
+
+void zstd_proxy_epoll_default_options(zstd_proxy_epoll_options *options);
+int zstd_proxy_epoll_create(zstd_proxy_epoll **engine_ptr, const zstd_proxy_epoll_options *options);
+/** Stop the workers, connections still running are closed with `ECANCELED`. */
+void zstd_proxy_epoll_destroy(zstd_proxy_epoll *engine);
+
+/**
+ * Serve both directions of a connection on one worker, the sockets must be non-blocking.
+ * `done` is called from the worker thread once the connection is closed.
+ */
+int zstd_proxy_epoll_add(
+    zstd_proxy_epoll *engine,
+    zstd_proxy_connection *compress,
+    zstd_proxy_connection *decompress,
+    zstd_proxy_epoll_callback done,
+    void *data
+);
+
+#endif
@@ -0,0 +1,388 @@
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include "zstd-proxy-framing.h"
+
+/** Longer HTTP lines are truncated, only short headers are parsed. */
+#define zstd_proxy_framing_line_max 1024
+
+/** Responses start with it, checked at the start of response bodies which may not exist. */
+#define zstd_proxy_framing_http_prefix "HTTP/1."
+
+const char *const zstd_proxy_framing_names[] = {
+    [zstd_proxy_framing_none] = "none",
+    [zstd_proxy_framing_length] = "length",
+    [zstd_proxy_framing_http] = "http",
+    [zstd_proxy_framing_lines] = "lines",
+};
+
+typedef enum {
+    /** The stream couldn't be parsed, every byte ends a message. */
+    zstd_proxy_framing_unframed,
+    zstd_proxy_framing_length_header,
+    zstd_proxy_framing_length_body,
+    zstd_proxy_framing_http_start,
+    zstd_proxy_framing_http_header,
+    /** First bytes of a response body, a new response after a response to `HEAD`. */
+    zstd_proxy_framing_http_body_start,
+    zstd_proxy_framing_http_body,
+    zstd_proxy_framing_http_chunk_size,
+    zstd_proxy_framing_http_chunk_data,
+    zstd_proxy_framing_http_chunk_end,
+    zstd_proxy_framing_http_trailer,
+    zstd_proxy_framing_newline,
+} zstd_proxy_framing_state;
+
+struct zstd_proxy_framing {
+    zstd_proxy_framing_options options;
+    zstd_proxy_framing_state state;
+
+    /** Bytes left in the current body or chunk. */
+    uint64_t remaining;
+    /** Current HTTP line or length prefix, NUL-terminated. */
+    char line[zstd_proxy_framing_line_max + 1];
+    size_t line_size;
+
+    /** Current HTTP message. */
+    bool response;
+    bool no_body;
+    bool upgrade;
+    bool chunked;
+    bool has_length;
+    uint64_t content_length;
+};
+
+zstd_proxy_framing_protocol zstd_proxy_framing_parse(const char *name) {
+    for (zstd_proxy_framing_protocol protocol = 0; protocol < zstd_proxy_framing_count; protocol++) {
+        if (strcmp(name, zstd_proxy_framing_names[protocol]) == 0) {
+            return protocol;
+        }
+    }
+
+    return zstd_proxy_framing_count;
+}
+
+int zstd_proxy_framing_create(zstd_proxy_framing **framing_ptr, const zstd_proxy_framing_options *options) {
+    zstd_proxy_framing *framing = calloc(1, sizeof(zstd_proxy_framing));
+
+    *framing_ptr = NULL;
+
+    if (framing == NULL) {
+        return ENOMEM;
+    }
+
+    framing->options = *options;
+
+    switch (options->protocol) {
+        case zstd_proxy_framing_length:
+            if (options->length_size < 1 || options->length_size > 8 || options->length_offset > zstd_proxy_framing_line_max - 8) {
+                free(framing);
+
+                return EINVAL;
+            }
+
+            framing->state = zstd_proxy_framing_length_header;
+            break;
+        case zstd_proxy_framing_http:
+            framing->state = zstd_proxy_framing_http_start;
+            break;
+        case zstd_proxy_framing_lines:
+            framing->state = zstd_proxy_framing_newline;
+            break;
+        default:
+            framing->state = zstd_proxy_framing_unframed;
+            break;
+    }
+
+    *framing_ptr = framing;
+
+    return 0;
+}
+
+void zstd_proxy_framing_destroy(zstd_proxy_framing *framing) {
+    free(framing);
+}
+
+/** Start the body of a length-prefixed message once its prefix is read, `true` if it's empty. */
+static bool zstd_proxy_framing_length_start(zstd_proxy_framing *framing) {
+    const zstd_proxy_framing_options *options = &framing->options;
+    const uint8_t *field = (const uint8_t *)&framing->line[options->length_offset];
+    uint64_t length = 0;
+
+    for (uint32_t i = 0; i < options->length_size; i++) {
+        uint32_t index = options->length_little_endian ? options->length_size - 1 - i : i;
+
+        length = length << 8 | field[index];
+    }
+
+    int64_t remaining = (int64_t)length + options->length_adjust;
+
+    framing->line_size = 0;
+
+    if (remaining < 0) {
+        framing->state = zstd_proxy_framing_unframed;
+
+        return true;
+    }
+
+    framing->remaining = remaining;
+    framing->state = remaining > 0 ? zstd_proxy_framing_length_body : zstd_proxy_framing_length_header;
+
+    return remaining == 0;
+}
+
+static inline bool zstd_proxy_framing_header_is(const char *line, const char *name, const char **value) {
+    size_t size = strlen(name);
+
+    if (strncasecmp(line, name, size) != 0 || line[size] != ':') {
+        return false;
+    }
+
+    for (*value = &line[size + 1]; **value == ' ' || **value == '\t'; (*value)++) {}
+
+    return true;
+}
+
+/** Whether `value` contains `token`, ignoring case. */
+static bool zstd_proxy_framing_contains(const char *value, const char *token) {
+    size_t size = strlen(token);
+
+    for (; *value != '\0'; value++) {
+        if (strncasecmp(value, token, size) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void zstd_proxy_framing_http_message(zstd_proxy_framing *framing, const char *line) {
+    framing->response = strncmp(line, "HTTP/", 5) == 0;
+    framing->no_body = false;
+    framing->upgrade = false;
+    framing->chunked = false;
+    framing->has_length = false;
+    framing->content_length = 0;
+
+    if (framing->response) {
+        const char *status = strchr(line, ' ');
+        int code = status != NULL ? atoi(status + 1) : 0;
+
+        // Never followed by a body, `101 Switching Protocols` hands the connection over
+        framing->no_body = code < 200 || code == 204 || code == 304;
+        framing->upgrade = code == 101;
+    } else {
+        framing->upgrade = strncmp(line, "CONNECT ", 8) == 0;
+    }
+
+    framing->state = zstd_proxy_framing_http_header;
+}
+
+/** Headers ended, pick how the body ends. */
+static void zstd_proxy_framing_http_headers_end(zstd_proxy_framing *framing) {
+    if (framing->upgrade) {
+        framing->state = zstd_proxy_framing_unframed;
+    } else if (framing->response && framing->no_body) {
+        framing->state = zstd_proxy_framing_http_start;
+    } else if (framing->chunked) {
+        framing->state = zstd_proxy_framing_http_chunk_size;
+    } else if (framing->has_length && framing->content_length > 0) {
+        framing->remaining = framing->content_length;
+        framing->state = framing->response ? zstd_proxy_framing_http_body_start : zstd_proxy_framing_http_body;
+    } else if (framing->has_length || !framing->response) {
+        framing->state = zstd_proxy_framing_http_start;
+    } else {
+        // The body ends with the connection
+        framing->state = zstd_proxy_framing_unframed;
+    }
+}
+
+/** Handle a complete HTTP line, `true` if it ends a message or the headers of one. */
+static bool zstd_proxy_framing_http_line(zstd_proxy_framing *framing) {
+    char *line = framing->line;
+    size_t size = framing->line_size;
+
+    if (size > 0 && line[size - 1] == '\r') {
+        line[--size] = '\0';
+    }
+
+    framing->line_size = 0;
+
+    switch (framing->state) {
+        case zstd_proxy_framing_http_start:
+            // Empty lines are allowed between messages
+            if (size > 0) {
+                zstd_proxy_framing_http_message(framing, line);
+            }
+
+            return false;
+        case zstd_proxy_framing_http_header: {
+            const char *value = NULL;
+
+            if (size == 0) {
+                zstd_proxy_framing_http_headers_end(framing);
+
+                return true;
+            }
+
+            if (zstd_proxy_framing_header_is(line, "content-length", &value)) {
+                char *end = NULL;
+
+                framing->content_length = strtoull(value, &end, 10);
+                framing->has_length = end != value;
+            } else if (zstd_proxy_framing_header_is(line, "transfer-encoding", &value)) {
+                framing->chunked = zstd_proxy_framing_contains(value, "chunked");
+            } else if (!framing->response && zstd_proxy_framing_header_is(line, "upgrade", &value)) {
+                // The server may accept it, the connection is then flushed every chunk
+                framing->upgrade = true;
+            }
+
+            return false;
+        }
+        case zstd_proxy_framing_http_chunk_size: {
+            char *end = NULL;
+            uint64_t chunk = strtoull(line, &end, 16);
+
+            if (end == line) {
+                framing->state = zstd_proxy_framing_unframed;
+
+                return true;
+            }
+
+            framing->remaining = chunk;
+            framing->state = chunk > 0 ? zstd_proxy_framing_http_chunk_data : zstd_proxy_framing_http_trailer;
+
+            return false;
+        }
+        case zstd_proxy_framing_http_chunk_end:
+            framing->state = size == 0 ? zstd_proxy_framing_http_chunk_size : zstd_proxy_framing_unframed;
+
+            return framing->state == zstd_proxy_framing_unframed;
+        case zstd_proxy_framing_http_trailer:
+            if (size == 0) {
+                framing->state = zstd_proxy_framing_http_start;
+
+                return true;
+            }
+
+            return false;
+        default:
+            return false;
+    }
+}
+
+/** Append to the current line up to `\n`, returns the bytes used and sets `complete` once it's found. */
+static size_t zstd_proxy_framing_read_line(zstd_proxy_framing *framing, const uint8_t *data, size_t size, bool *complete) {
+    const uint8_t *newline = memchr(data, '\n', size);
+    size_t used = newline != NULL ? (size_t)(newline - data) + 1 : size;
+    size_t copy = newline != NULL ? used - 1 : used;
+
+    if (copy > zstd_proxy_framing_line_max - framing->line_size) {
+        copy = zstd_proxy_framing_line_max - framing->line_size;
+    }
+
+    memcpy(&framing->line[framing->line_size], data, copy);
+    framing->line_size += copy;
+    framing->line[framing->line_size] = '\0';
+    *complete = newline != NULL;
+
+    return used;
+}
+
+size_t zstd_proxy_framing_scan(zstd_proxy_framing *framing, const uint8_t *data, size_t size) {
+    size_t pos = 0;
+    size_t ended = 0;
+
+    while (pos < size) {
+        switch (framing->state) {
+            case zstd_proxy_framing_unframed:
+                return size;
+            case zstd_proxy_framing_newline:
+                for (size_t i = size; i > pos; i--) {
+                    if (data[i - 1] == '\n') {
+                        return i;
+                    }
+                }
+
+                return ended;
+            case zstd_proxy_framing_length_header: {
+                size_t header = framing->options.length_offset + framing->options.length_size;
+                size_t copy = header - framing->line_size;
+
+                copy = copy < size - pos ? copy : size - pos;
+                memcpy(&framing->line[framing->line_size], &data[pos], copy);
+                framing->line_size += copy;
+                pos += copy;
+
+                if (framing->line_size == header && zstd_proxy_framing_length_start(framing)) {
+                    ended = pos;
+                }
+
+                break;
+            }
+            case zstd_proxy_framing_length_body:
+            case zstd_proxy_framing_http_body:
+            case zstd_proxy_framing_http_chunk_data: {
+                uint64_t skip = size - pos < framing->remaining ? size - pos : framing->remaining;
+
+                pos += skip;
+                framing->remaining -= skip;
+
+                if (framing->remaining > 0) {
+                    break;
+                }
+
+                if (framing->state == zstd_proxy_framing_http_chunk_data) {
+                    framing->state = zstd_proxy_framing_http_chunk_end;
+                } else {
+                    framing->state = framing->state == zstd_proxy_framing_length_body
+                        ? zstd_proxy_framing_length_header
+                        : zstd_proxy_framing_http_start;
+                    ended = pos;
+                }
+
+                break;
+            }
+            case zstd_proxy_framing_http_body_start: {
+                const char *prefix = zstd_proxy_framing_http_prefix;
+                size_t prefix_size = strlen(prefix);
+
+                // Too short to hold a response, or not one
+                if (framing->remaining < prefix_size) {
+                    framing->state = zstd_proxy_framing_http_body;
+                    break;
+                }
+
+                while (pos < size && framing->line_size < prefix_size && data[pos] == prefix[framing->line_size]) {
+                    framing->line[framing->line_size++] = data[pos++];
+                }
+
+                if (framing->line_size == prefix_size) {
+                    // The previous response had no body, its headers were already flushed
+                    framing->line[framing->line_size] = '\0';
+                    framing->state = zstd_proxy_framing_http_start;
+                } else if (pos < size) {
+                    framing->remaining -= framing->line_size;
+                    framing->line_size = 0;
+                    framing->state = zstd_proxy_framing_http_body;
+                }
+
+                break;
+            }
+            default: {
+                bool complete = false;
+
+                pos += zstd_proxy_framing_read_line(framing, &data[pos], size - pos, &complete);
+
+                if (complete && zstd_proxy_framing_http_line(framing)) {
+                    ended = pos;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return framing->state == zstd_proxy_framing_unframed ? size : ended;
+}
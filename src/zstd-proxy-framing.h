@@ -0,0 +1,64 @@
+#ifndef zstd_proxy_framing_H
+#define zstd_proxy_framing_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Message boundaries of the data a connection compresses, so it flushes at the end of messages instead
+ * of at the end of every recv.
+ *
+ * The compressor flushes the data up to the last message ending in a chunk, and keeps compressing the
+ * rest of a message without flushing until it's complete, so a message split across recvs is sent in
+ * one flush and isn't held any longer than it takes to arrive. Boundaries only change when data is
+ * flushed: a stream which can't be parsed is flushed every chunk from then on, like without framing.
+ */
+
+typedef enum {
+    /** Flush every chunk. */
+    zstd_proxy_framing_none,
+    /** Binary messages starting with their length, see `zstd_proxy_framing_options`. */
+    zstd_proxy_framing_length,
+    /**
+     * HTTP/1.1 requests or responses, with a `Content-Length` or chunked body. Messages with a body are
+     * also flushed at the end of their headers, responses to `HEAD` have them but no body. Upgraded
+     * connections and bodies ending with the connection are flushed every chunk.
+     */
+    zstd_proxy_framing_http,
+    /** Messages ending with `\n`. */
+    zstd_proxy_framing_lines,
+    zstd_proxy_framing_count,
+} zstd_proxy_framing_protocol;
+
+extern const char *const zstd_proxy_framing_names[];
+
+/** Parse a protocol name, returns `zstd_proxy_framing_count` if unknown. */
+zstd_proxy_framing_protocol zstd_proxy_framing_parse(const char *name);
+
+typedef struct {
+    zstd_proxy_framing_protocol protocol;
+
+    /** `length`: bytes before the length field, eg. a message type. */
+    uint32_t length_offset;
+    /** `length`: size of the length field, from 1 to 8 bytes. */
+    uint32_t length_size;
+    /** `length`: added to the length to get the bytes following the field, eg. -4 when it counts itself. */
+    int64_t length_adjust;
+    /** `length`: the field is little-endian instead of network order. */
+    bool length_little_endian;
+} zstd_proxy_framing_options;
+
+typedef struct zstd_proxy_framing zstd_proxy_framing;
+
+int zstd_proxy_framing_create(zstd_proxy_framing **framing_ptr, const zstd_proxy_framing_options *options);
+
+/**
+ * Parse the next `size` bytes of the stream. Returns how many of them belong to messages which ended,
+ * the bytes after them are part of a message still incomplete.
+ */
+size_t zstd_proxy_framing_scan(zstd_proxy_framing *framing, const uint8_t *data, size_t size);
+
+void zstd_proxy_framing_destroy(zstd_proxy_framing *framing);
+
+#endif
@@ -0,0 +1,73 @@
+#include "zstd-proxy-histogram.h"
+
+#define zstd_proxy_latency_name(name, help) #name,
+#define zstd_proxy_latency_describe(name, help) help,
+
+const char *const zstd_proxy_latency_names[] = {
+    zstd_proxy_latency_fields(zstd_proxy_latency_name)
+};
+
+const char *const zstd_proxy_latency_help[] = {
+    zstd_proxy_latency_fields(zstd_proxy_latency_describe)
+};
+
+const size_t zstd_proxy_latency_count = sizeof(zstd_proxy_latency_names) / sizeof(char *);
+
+// Keep it on its own cache lines, it's written from every connection thread
+static zstd_proxy_latency global_latency __attribute__((aligned(64)));
+
+zstd_proxy_latency *zstd_proxy_latency_global(void) {
+    return &global_latency;
+}
+
+static inline uint64_t zstd_proxy_histogram_upper_bound(size_t index) {
+    if (index < zstd_proxy_histogram_sub_buckets) {
+        return index;
+    }
+
+    size_t shift = index / zstd_proxy_histogram_sub_buckets - 1;
+    uint64_t base = index % zstd_proxy_histogram_sub_buckets + zstd_proxy_histogram_sub_buckets;
+
+    return ((base + 1) << shift) - 1;
+}
+
+void zstd_proxy_histogram_merge(zstd_proxy_histogram *dst, const zstd_proxy_histogram *src) {
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < zstd_proxy_histogram_buckets; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t zstd_proxy_histogram_percentile(const zstd_proxy_histogram *histogram, double quantile) {
+    uint64_t total = 0;
+
+    // Sum the buckets rather than trusting `count`, they could be updated while we read
+    for (size_t i = 0; i < zstd_proxy_histogram_buckets; i++) {
+        total += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(quantile * total + 0.5);
+    uint64_t seen = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > total) {
+        rank = total;
+    }
+
+    for (size_t i = 0; i < zstd_proxy_histogram_buckets; i++) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+        if (seen >= rank) {
+            return zstd_proxy_histogram_upper_bound(i);
+        }
+    }
+
+    return zstd_proxy_histogram_max_value;
+}
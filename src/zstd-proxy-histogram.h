@@ -0,0 +1,91 @@
+#ifndef zstd_proxy_histogram_H
+#define zstd_proxy_histogram_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Linear sub-buckets per power of two, 16 gives a worst-case error of 6.25%. */
+#define zstd_proxy_histogram_sub_bucket_bits 4
+#define zstd_proxy_histogram_sub_buckets (1 << zstd_proxy_histogram_sub_bucket_bits)
+/** Values are clamped to 2^40 ns (~18 minutes). */
+#define zstd_proxy_histogram_max_bits 40
+#define zstd_proxy_histogram_max_value ((UINT64_C(1) << zstd_proxy_histogram_max_bits) - 1)
+#define zstd_proxy_histogram_buckets \
+    ((zstd_proxy_histogram_max_bits - zstd_proxy_histogram_sub_bucket_bits + 1) * zstd_proxy_histogram_sub_buckets)
+
+/** Log-linear histogram (HdrHistogram-style), buckets are plain counters so histograms can be summed. */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[zstd_proxy_histogram_buckets];
+} zstd_proxy_histogram;
+
+/** Hops measured for each direction of a connection. */
+#define zstd_proxy_latency_fields(field) \
+    field(recv_to_process, "Time from recv completion to the start of processing") \
+    field(process, "Time spent in the process callback") \
+    field(process_to_send, "Time from the end of processing to send completion")
+
+#define zstd_proxy_latency_declare(name, help) zstd_proxy_histogram name;
+
+typedef struct {
+    zstd_proxy_latency_fields(zstd_proxy_latency_declare)
+} zstd_proxy_direction_latency;
+
+#undef zstd_proxy_latency_declare
+
+typedef struct {
+    zstd_proxy_direction_latency compress;
+    zstd_proxy_direction_latency decompress;
+} zstd_proxy_latency;
+
+extern const char *const zstd_proxy_latency_names[];
+extern const char *const zstd_proxy_latency_help[];
+extern const size_t zstd_proxy_latency_count;
+
+/** Process-wide aggregate of every connection. */
+zstd_proxy_latency *zstd_proxy_latency_global(void);
+
+/** Add every sample of `src` into `dst`. */
+void zstd_proxy_histogram_merge(zstd_proxy_histogram *dst, const zstd_proxy_histogram *src);
+
+/** Upper bound of the bucket containing the `quantile` (0 to 1) sample, 0 if empty. */
+uint64_t zstd_proxy_histogram_percentile(const zstd_proxy_histogram *histogram, double quantile);
+
+static inline size_t zstd_proxy_histogram_index(uint64_t value) {
+    if (value > zstd_proxy_histogram_max_value) {
+        value = zstd_proxy_histogram_max_value;
+    }
+
+    if (value < zstd_proxy_histogram_sub_buckets) {
+        return value;
+    }
+
+    size_t shift = 63 - __builtin_clzll(value) - zstd_proxy_histogram_sub_bucket_bits;
+
+    return (shift + 1) * zstd_proxy_histogram_sub_buckets + (value >> shift) - zstd_proxy_histogram_sub_buckets;
+}
+
+/** Record a sample in a histogram with a single writer. */
+static inline void zstd_proxy_histogram_record(zstd_proxy_histogram *histogram, uint64_t value) {
+    uint64_t *bucket = &histogram->buckets[zstd_proxy_histogram_index(value)];
+
+    // Single writer: no need for a locked instruction
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+static inline void zstd_proxy_histograms_record(zstd_proxy_histogram *local, zstd_proxy_histogram *global, uint64_t value) {
+    zstd_proxy_histogram_record(local, value);
+
+    __atomic_fetch_add(&global->buckets[zstd_proxy_histogram_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global->count, 1, __ATOMIC_RELAXED);
+}
+
+/** Record a duration in a direction histogram of `connection` and its global aggregate. */
+#define zstd_proxy_latency_record(connection, name, value) \
+    zstd_proxy_histograms_record(&(connection)->latency->name, &(connection)->global_latency->name, (value))
+
+#endif
@@ -0,0 +1,33 @@
+#include "zstd-proxy-metrics.h"
+
+#define zstd_proxy_metrics_describe(name, type, help) { #name, help, zstd_proxy_metric_##type },
+
+const zstd_proxy_metric_info zstd_proxy_connection_metrics_info[] = {
+    zstd_proxy_connection_metrics_fields(zstd_proxy_metrics_describe)
+};
+
+const size_t zstd_proxy_connection_metrics_count =
+    sizeof(zstd_proxy_connection_metrics_info) / sizeof(zstd_proxy_metric_info);
+
+const zstd_proxy_metric_info zstd_proxy_direction_metrics_info[] = {
+    zstd_proxy_direction_metrics_fields(zstd_proxy_metrics_describe)
+};
+
+const size_t zstd_proxy_direction_metrics_count =
+    sizeof(zstd_proxy_direction_metrics_info) / sizeof(zstd_proxy_metric_info);
+
+// Keep it on its own cache lines, it's written from every connection thread
+static zstd_proxy_metrics global_metrics __attribute__((aligned(64)));
+
+zstd_proxy_metrics *zstd_proxy_metrics_global(void) {
+    return &global_metrics;
+}
+
+void zstd_proxy_metrics_snapshot(const zstd_proxy_metrics *src, zstd_proxy_metrics *dst) {
+    const uint64_t *from = (const uint64_t *)src;
+    uint64_t *to = (uint64_t *)dst;
+
+    for (size_t i = 0; i < zstd_proxy_metrics_length; i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef zstd_proxy_metrics_H
+#define zstd_proxy_metrics_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef enum {
+    zstd_proxy_metric_counter,
+    zstd_proxy_metric_gauge
+} zstd_proxy_metric_type;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    zstd_proxy_metric_type type;
+} zstd_proxy_metric_info;
+
+/** Counters tracked once per connection. */
+#define zstd_proxy_connection_metrics_fields(field) \
+    field(connections_opened, counter, "Connections opened") \
+    field(connections_active, gauge, "Connections currently running") \
+    field(connections_failed, counter, "Connections closed with an error") \
+    field(zstd_memory, gauge, "Bytes of memory allocated by the Zstd contexts, see zstd-proxy-arena.h")
+
+/** Counters tracked for each direction of a connection. */
+#define zstd_proxy_direction_metrics_fields(field) \
+    field(bytes_in, counter, "Bytes received from the source socket") \
+    field(bytes_out, counter, "Bytes sent to the destination socket") \
+    field(bytes_produced, counter, "Bytes written by the process callback, sent or still queued") \
+    field(chunks, counter, "Calls to the process callback") \
+    field(process_ns, counter, "Nanoseconds spent in the process callback") \
+    field(sends, counter, "Send requests issued") \
+    field(partial_sends, counter, "Sends that only wrote a part of their buffer") \
+    field(send_starvations, counter, "Times processing waited for a free send buffer") \
+    field(zero_copy_sends, counter, "Sends issued with MSG_ZEROCOPY") \
+    field(zero_copy_copied, counter, "MSG_ZEROCOPY sends the kernel completed with a copy") \
+    field(busy_polls, counter, "Completions or receives picked up while spinning instead of sleeping") \
+    field(queue_running, gauge, "Queue items currently in flight")
+
+#define zstd_proxy_metrics_declare(name, type, help) uint64_t name;
+
+typedef struct {
+    zstd_proxy_direction_metrics_fields(zstd_proxy_metrics_declare)
+} zstd_proxy_direction_metrics;
+
+/**
+ * Plain array of `uint64_t` so it can be shared as-is with Node.js.
+ * Each direction only has one writer, readers use relaxed loads.
+ */
+typedef struct {
+    zstd_proxy_connection_metrics_fields(zstd_proxy_metrics_declare)
+
+    zstd_proxy_direction_metrics compress;
+    zstd_proxy_direction_metrics decompress;
+} zstd_proxy_metrics;
+
+#undef zstd_proxy_metrics_declare
+
+#define zstd_proxy_metrics_length (sizeof(zstd_proxy_metrics) / sizeof(uint64_t))
+
+extern const zstd_proxy_metric_info zstd_proxy_connection_metrics_info[];
+extern const size_t zstd_proxy_connection_metrics_count;
+extern const zstd_proxy_metric_info zstd_proxy_direction_metrics_info[];
+extern const size_t zstd_proxy_direction_metrics_count;
+
+/** Process-wide aggregate of every connection. */
+zstd_proxy_metrics *zstd_proxy_metrics_global(void);
+
+/** Copy `src` into `dst` using atomic loads. */
+void zstd_proxy_metrics_snapshot(const zstd_proxy_metrics *src, zstd_proxy_metrics *dst);
+
+static inline void zstd_proxy_metrics_add(uint64_t *local, uint64_t *global, uint64_t value) {
+    // Single writer: no need for a locked instruction on the connection counter
+    __atomic_store_n(local, __atomic_load_n(local, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(global, value, __ATOMIC_RELAXED);
+}
+
+static inline void zstd_proxy_metrics_set(uint64_t *local, uint64_t *global, uint64_t value) {
+    uint64_t previous = __atomic_load_n(local, __ATOMIC_RELAXED);
+
+    if (previous != value) {
+        __atomic_store_n(local, value, __ATOMIC_RELAXED);
+        __atomic_fetch_add(global, value - previous, __ATOMIC_RELAXED);
+    }
+}
+
+/** Update a direction counter of `connection` and its global aggregate. */
+#define zstd_proxy_metric_add(connection, name, value) \
+    zstd_proxy_metrics_add(&(connection)->metrics->name, &(connection)->global_metrics->name, (value))
+
+/** Update a direction gauge of `connection` and its global aggregate. */
+#define zstd_proxy_metric_set(connection, name, value) \
+    zstd_proxy_metrics_set(&(connection)->metrics->name, &(connection)->global_metrics->name, (value))
+
+#endif
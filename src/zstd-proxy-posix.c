@@ -1,37 +1,625 @@
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 
+#if __linux__
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
 #include "zstd-proxy-posix.h"
 #include "zstd-proxy-utils.h"
 
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define ENABLE_POSIX_ZEROCOPY 1
+#else
+#define ENABLE_POSIX_ZEROCOPY 0
+#endif
+
+/** Out of order zero-copy completions kept before giving up on the connection. */
+#define zstd_proxy_posix_zero_copy_ranges 32
+
+typedef struct {
+    char *data;
+    size_t length;
+    /** The frame continues in the next buffer. */
+    bool more;
+    uint64_t processed_at;
+    /** Id of the first `MSG_ZEROCOPY` send of this buffer, it can't be reused before they all completed. */
+    uint64_t zero_copy_first;
+    uint64_t zero_copy_sends;
+} zstd_proxy_posix_buffer;
+
+/**
+ * Output ring shared by the direction thread, which receives and processes into it,
+ * and a sender thread. Positions only grow, a buffer is at `position % depth`:
+ * [released, sent) wait for zero-copy completions and [sent, filled) for the sender.
+ */
+typedef struct {
+    zstd_proxy_connection *connection;
+    zstd_proxy_posix_buffer *buffers;
+    size_t depth;
+    size_t released;
+    size_t sent;
+    size_t filled;
+    /** Set by the direction thread once it stopped filling buffers. */
+    bool closing;
+    /** First send error, stops both threads. */
+    int error;
+    /** When data was first processed into the buffer being filled. */
+    uint64_t processed_at;
+
+    /** Chunks of at least this size are sent with `MSG_ZEROCOPY`, 0 when disabled. */
+    size_t zero_copy_threshold;
+    /** Next zero-copy id, the kernel counts every successful `MSG_ZEROCOPY` send. */
+    uint64_t zero_copy_next;
+    /** Every id below this one completed. */
+    uint64_t zero_copy_completed;
+    /** Completions received out of order, as `[first, last]` ranges. */
+    uint64_t zero_copy_ranges[zstd_proxy_posix_zero_copy_ranges][2];
+    size_t zero_copy_range_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} zstd_proxy_posix_pipeline;
+
+/** Blocking `recv`, trying non-blocking ones for `busy_poll.spin_us` first since waking up costs more. */
+static ssize_t zstd_proxy_posix_recv(zstd_proxy_connection *connection, int fd, void *buffer, size_t size) {
+    uint64_t spin_us = connection->options->busy_poll.spin_us;
+
+    if (spin_us > 0) {
+        uint64_t deadline = zstd_proxy_now_ns() + spin_us * 1000;
+
+        do {
+            ssize_t received = recv(fd, buffer, size, MSG_DONTWAIT);
+
+            if (received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                if (received > 0) {
+                    zstd_proxy_metric_add(connection, busy_polls, 1);
+                }
+
+                return received;
+            }
+
+            zstd_proxy_cpu_relax();
+        } while (zstd_proxy_now_ns() < deadline);
+    }
+
+    return recv(fd, buffer, size, 0);
+}
+
+static int zstd_proxy_posix_set_timeout(int fd, int option, uint64_t ns) {
+    struct timeval timeout = { .tv_sec = ns / 1000000000, .tv_usec = ns % 1000000000 / 1000 };
+
+    // A zero timeval disables the timeout
+    if (ns > 0 && timeout.tv_sec == 0 && timeout.tv_usec == 0) {
+        timeout.tv_usec = 1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout)) != 0) {
+        log_error("error setting socket timeout on fd %d: %s", fd, strerror(errno));
+
+        return errno;
+    }
+
+    return 0;
+}
+
+/**
+ * Send `size` bytes, with `MSG_ZEROCOPY` if `zero_copy_sends` is set, where the successful calls are counted.
+ * `more` is set when the rest of the frame follows, it is then sent with `MSG_MORE` if `socket.cork` is set.
+ */
+static int zstd_proxy_posix_send(
+    zstd_proxy_connection *connection,
+    const char *data,
+    size_t size,
+    uint64_t *zero_copy_sends,
+    bool more
+) {
+    int fd = connection->connect->fd;
+    size_t offset = 0;
+    int more_flags = more && connection->options->socket.cork ? MSG_MORE : 0;
+
+    while (offset < size) {
+        int flags = 0;
+
+#if ENABLE_POSIX_ZEROCOPY
+        if (zero_copy_sends != NULL) {
+            flags |= MSG_ZEROCOPY;
+        }
+#endif
+
+        trace_probe(send_submit, fd, 0, size - offset, 0);
+
+        ssize_t sent = send(fd, &data[offset], size - offset, flags | more_flags);
+
+        trace_probe(send_complete, fd, 0, sent, 0);
+
+        // Out of pinned memory for zero-copy, copy this chunk instead
+        if (sent < 0 && errno == ENOBUFS && flags != 0) {
+            zero_copy_sends = NULL;
+
+            continue;
+        }
+
+        if (sent < 0) {
+            int error = errno;
+
+            // SO_SNDTIMEO expired
+            if ((error == EAGAIN || error == EWOULDBLOCK) && connection->options->stall_timeout_ms > 0) {
+                zstd_proxy_set_close_reason(connection->options, zstd_proxy_close_stall_timeout);
+
+                error = ETIMEDOUT;
+            }
+
+            log_error("error writing to fd %d: %s", fd, strerror(error));
+
+            return error;
+        }
+
+        offset += sent;
+
+        if (flags != 0) {
+            (*zero_copy_sends)++;
+
+            zstd_proxy_metric_add(connection, zero_copy_sends, 1);
+        }
+
+        zstd_proxy_metric_add(connection, sends, 1);
+        zstd_proxy_metric_add(connection, bytes_out, sent);
+
+        if (offset < size) {
+            zstd_proxy_metric_add(connection, partial_sends, 1);
+            trace_probe(send_partial, fd, 0, sent, size - offset);
+        }
+    }
+
+    return 0;
+}
+
+/** Release the oldest buffers once sent and acknowledged, with the lock held. */
+static void zstd_proxy_posix_pipeline_release(zstd_proxy_posix_pipeline *pipeline) {
+    size_t released = pipeline->released;
+
+    while (pipeline->released < pipeline->sent) {
+        zstd_proxy_posix_buffer *buffer = &pipeline->buffers[pipeline->released % pipeline->depth];
+
+        if (buffer->zero_copy_sends > 0 && buffer->zero_copy_first + buffer->zero_copy_sends > pipeline->zero_copy_completed) {
+            break;
+        }
+
+        pipeline->released++;
+    }
+
+    if (pipeline->released != released) {
+        zstd_proxy_metric_set(pipeline->connection, queue_running, pipeline->filled - pipeline->released);
+    }
+}
+
+#if ENABLE_POSIX_ZEROCOPY
+/** Record the `[first, last]` zero-copy completion range, with the lock held. */
+static int zstd_proxy_posix_complete(zstd_proxy_posix_pipeline *pipeline, uint32_t first, uint32_t last) {
+    uint64_t base = pipeline->zero_copy_completed;
+    uint64_t range[2] = { base + (uint32_t)(first - (uint32_t)base), base + (uint32_t)(last - (uint32_t)base) };
+
+    if (range[0] > base) {
+        if (pipeline->zero_copy_range_count == zstd_proxy_posix_zero_copy_ranges) {
+            log_error("too many zero-copy completions out of order");
+
+            return EPROTO;
+        }
+
+        memcpy(pipeline->zero_copy_ranges[pipeline->zero_copy_range_count++], range, sizeof(range));
+
+        return 0;
+    }
+
+    pipeline->zero_copy_completed = range[1] + 1;
+
+    // Merge the ranges which are now contiguous
+    for (size_t i = 0; i < pipeline->zero_copy_range_count;) {
+        uint64_t *pending = pipeline->zero_copy_ranges[i];
+
+        if (pending[0] > pipeline->zero_copy_completed) {
+            i++;
+
+            continue;
+        }
+
+        if (pending[1] + 1 > pipeline->zero_copy_completed) {
+            pipeline->zero_copy_completed = pending[1] + 1;
+        }
+
+        memcpy(pending, pipeline->zero_copy_ranges[--pipeline->zero_copy_range_count], sizeof(range));
+        i = 0;
+    }
+
+    return 0;
+}
+#endif
+
+/** Read zero-copy completions from the error queue without blocking, with the lock held. */
+static int zstd_proxy_posix_reap(zstd_proxy_posix_pipeline *pipeline) {
+#if ENABLE_POSIX_ZEROCOPY
+    zstd_proxy_connection *connection = pipeline->connection;
+    int fd = connection->connect->fd;
+    char control[256];
+
+    while (true) {
+        struct msghdr message = { .msg_control = control, .msg_controllen = sizeof(control) };
+
+        if (recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+
+            log_error("error reading error queue of fd %d: %s", fd, strerror(errno));
+
+            return errno;
+        }
+
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+            if (
+                !(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) &&
+                !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR)
+            ) {
+                continue;
+            }
+
+            struct sock_extended_err *notification = (struct sock_extended_err *)CMSG_DATA(header);
+
+            if (notification->ee_origin != SO_EE_ORIGIN_ZEROCOPY || notification->ee_errno != 0) {
+                continue;
+            }
+
+            if (notification->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zstd_proxy_metric_add(connection, zero_copy_copied, notification->ee_data - notification->ee_info + 1);
+            }
+
+            int error = zstd_proxy_posix_complete(pipeline, notification->ee_info, notification->ee_data);
+
+            if (error != 0) {
+                return error;
+            }
+        }
+    }
+
+    zstd_proxy_posix_pipeline_release(pipeline);
+#endif
+
+    return 0;
+}
+
+static void *zstd_proxy_posix_sender(void *data) {
+    zstd_proxy_posix_pipeline *pipeline = data;
+    zstd_proxy_connection *connection = pipeline->connection;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    while (pipeline->error == 0) {
+        if (pipeline->sent == pipeline->filled) {
+            if (pipeline->closing) {
+                break;
+            }
+
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+            continue;
+        }
+
+        zstd_proxy_posix_buffer *buffer = &pipeline->buffers[pipeline->sent % pipeline->depth];
+        bool zero_copy = pipeline->zero_copy_threshold > 0 && buffer->length >= pipeline->zero_copy_threshold;
+        uint64_t zero_copy_sends = 0;
+
+        buffer->zero_copy_first = pipeline->zero_copy_next;
+
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int error = zstd_proxy_posix_send(
+            connection, buffer->data, buffer->length, zero_copy ? &zero_copy_sends : NULL, buffer->more
+        );
+
+        zstd_proxy_latency_record(connection, process_to_send, zstd_proxy_now_ns() - buffer->processed_at);
+
+        pthread_mutex_lock(&pipeline->lock);
+
+        buffer->zero_copy_sends = zero_copy_sends;
+        pipeline->zero_copy_next += zero_copy_sends;
+
+        if (error != 0) {
+            pipeline->error = error;
+
+            // Wake the direction thread up if it's waiting on recv
+            shutdown(connection->listen->fd, SHUT_RDWR);
+        } else {
+            __atomic_store_n(&pipeline->sent, pipeline->sent + 1, __ATOMIC_RELAXED);
+
+            zstd_proxy_posix_pipeline_release(pipeline);
+        }
+
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+static int zstd_proxy_posix_pipeline_open(zstd_proxy_posix_pipeline **pipeline_ptr, zstd_proxy_connection *connection) {
+    int error = 0;
+    zstd_proxy_options *options = connection->options;
+    zstd_proxy_posix_pipeline *pipeline = calloc(1, sizeof(zstd_proxy_posix_pipeline));
+
+    if (pipeline == NULL || (pipeline->buffers = calloc(options->posix.depth, sizeof(zstd_proxy_posix_buffer))) == NULL) {
+        free(pipeline);
+
+        return ENOMEM;
+    }
+
+    pipeline->connection = connection;
+    pipeline->depth = options->posix.depth;
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+
+    for (size_t i = 0; i < pipeline->depth; i++) {
+        if ((pipeline->buffers[i].data = malloc(options->buffer_size)) == NULL) {
+            error = ENOMEM;
+
+            goto cleanup;
+        }
+    }
+
+#if ENABLE_POSIX_ZEROCOPY
+    int enable = 1;
+
+    // Not supported on UNIX sockets, send with copies there
+    if (
+        options->posix.zero_copy_threshold > 0 &&
+        setsockopt(connection->connect->fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0
+    ) {
+        pipeline->zero_copy_threshold = options->posix.zero_copy_threshold;
+    }
+#endif
+
+    if ((error = pthread_create(&pipeline->thread, NULL, zstd_proxy_posix_sender, pipeline)) != 0) {
+        log_error("error creating send thread: %s", strerror(error));
+    }
+
+    cleanup:
+
+    if (error != 0) {
+        for (size_t i = 0; i < pipeline->depth; i++) {
+            free(pipeline->buffers[i].data);
+        }
 
-int zstd_proxy_posix_process(zstd_proxy_connection* connection, ZSTD_inBuffer *input, ZSTD_outBuffer *output) {
+        free(pipeline->buffers);
+        free(pipeline);
+    } else {
+        *pipeline_ptr = pipeline;
+    }
+
+    return error;
+}
+
+/** Wait for the sender to flush the queued buffers, returns its error. */
+static int zstd_proxy_posix_pipeline_close(zstd_proxy_posix_pipeline *pipeline) {
+    int fd = pipeline->connection->connect->fd;
     int error = 0;
 
-    while (input->pos < input->size) {
-        output->pos = 0;
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->closing = true;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pthread_join(pipeline->thread, NULL);
+
+    error = pipeline->error;
+
+    // The kernel still reads from buffers sent with MSG_ZEROCOPY until they complete
+    uint64_t deadline = zstd_proxy_now_ns() + 1000 * 1000 * 1000;
+
+    while (pipeline->released < pipeline->sent && zstd_proxy_now_ns() < deadline) {
+        struct pollfd events = { .fd = fd, .events = 0 };
+
+        if (poll(&events, 1, 10) < 0 && errno != EINTR) {
+            break;
+        }
+
+        if (zstd_proxy_posix_reap(pipeline) != 0) {
+            break;
+        }
+    }
+
+    bool leak = pipeline->released < pipeline->sent;
+
+    // Buffers left unsent or waiting for completions are dropped with the connection
+    zstd_proxy_metric_set(pipeline->connection, queue_running, 0);
+
+    if (leak) {
+        log_error("zero-copy sends on fd %d did not complete, leaking their buffers", fd);
+    }
+
+    for (size_t i = 0; i < pipeline->depth && !leak; i++) {
+        free(pipeline->buffers[i].data);
+    }
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->cond);
+
+    if (!leak) {
+        free(pipeline->buffers);
+    }
+
+    free(pipeline);
+
+    return error;
+}
+
+/** Wait for a free buffer and point `output` to it. */
+static int zstd_proxy_posix_pipeline_acquire(zstd_proxy_posix_pipeline *pipeline, ZSTD_outBuffer *output) {
+    zstd_proxy_connection *connection = pipeline->connection;
+    int error = 0;
+    bool starved = false;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    if (pipeline->zero_copy_threshold > 0) {
+        error = zstd_proxy_posix_reap(pipeline);
+    }
+
+    while (error == 0 && (error = pipeline->error) == 0 && pipeline->filled - pipeline->released == pipeline->depth) {
+        starved = true;
+
+        if (pipeline->released == pipeline->sent) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+            continue;
+        }
+
+        // The oldest buffer was sent with MSG_ZEROCOPY, only this thread reads completions
+        struct pollfd events = { .fd = connection->connect->fd, .events = 0 };
+        // They stop coming while the peer doesn't read, like a blocked send
+        uint64_t stall_timeout_ms = connection->options->stall_timeout_ms;
+        int timeout = stall_timeout_ms > 0 && stall_timeout_ms < INT_MAX ? (int)stall_timeout_ms : -1;
+
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int ready = poll(&events, 1, timeout);
+
+        pthread_mutex_lock(&pipeline->lock);
+
+        if (ready < 0 && errno != EINTR) {
+            error = errno;
+        } else if (ready == 0) {
+            zstd_proxy_set_close_reason(connection->options, zstd_proxy_close_stall_timeout);
+
+            error = ETIMEDOUT;
+            log_error("zero-copy sends on fd %d did not complete: %s", events.fd, strerror(error));
+        } else if ((error = zstd_proxy_posix_reap(pipeline)) == 0 && (events.revents & (POLLHUP | POLLNVAL))) {
+            // Completions still missing after a shutdown will never come
+            error = pipeline->filled - pipeline->released == pipeline->depth ? EPIPE : 0;
+        }
+    }
+
+    if (error == 0) {
+        zstd_proxy_posix_buffer *buffer = &pipeline->buffers[pipeline->filled % pipeline->depth];
+
+        output->dst = buffer->data;
+        output->size = connection->options->buffer_size;
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (starved) {
+        zstd_proxy_metric_add(connection, send_starvations, 1);
+    }
+
+    return error;
+}
+
+/** `true` when the sender has nothing left to send. */
+static inline bool zstd_proxy_posix_pipeline_idle(zstd_proxy_posix_pipeline *pipeline) {
+    return __atomic_load_n(&pipeline->sent, __ATOMIC_RELAXED) == pipeline->filled;
+}
+
+/** Queue the buffer `output` points to, which was returned by `zstd_proxy_posix_pipeline_acquire`. */
+static void zstd_proxy_posix_pipeline_commit(zstd_proxy_posix_pipeline *pipeline, ZSTD_outBuffer *output, bool more) {
+    pthread_mutex_lock(&pipeline->lock);
+
+    zstd_proxy_posix_buffer *buffer = &pipeline->buffers[pipeline->filled % pipeline->depth];
+
+    buffer->length = output->pos;
+    buffer->more = more;
+    buffer->processed_at = pipeline->processed_at;
+    buffer->zero_copy_sends = 0;
+    pipeline->filled++;
+
+    output->dst = NULL;
+    output->pos = 0;
+
+    zstd_proxy_metric_set(pipeline->connection, queue_running, pipeline->filled - pipeline->released);
+
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/** `flush` calls the codec even without input, once the source ended. */
+static int zstd_proxy_posix_process(
+    zstd_proxy_connection* connection,
+    zstd_proxy_posix_pipeline *pipeline,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    uint64_t received_at,
+    bool flush
+) {
+    int error = 0;
+    bool flushing = flush;
+
+    // A full output buffer can leave data in the codec, call it again even if the input is consumed
+    while (input->pos < input->size || flushing) {
+        if (pipeline == NULL) {
+            output->pos = 0;
+        } else if (output->dst == NULL && (error = zstd_proxy_posix_pipeline_acquire(pipeline, output)) != 0) {
+            break;
+        }
+
+        size_t pending = output->pos;
+        uint64_t start = zstd_proxy_now_ns();
+
+        if (received_at != 0) {
+            zstd_proxy_latency_record(connection, recv_to_process, start - received_at);
+
+            received_at = 0;
+        }
+
+        trace_probe(process_start, connection->listen->fd, 0, input->pos, input->size);
 
         error = connection->process(connection->process_data, input, output);
 
+        uint64_t end = zstd_proxy_now_ns();
+
+        trace_probe(process_done, connection->listen->fd, 0, input->pos, output->pos, end - start);
+
+        zstd_proxy_metric_add(connection, chunks, 1);
+        zstd_proxy_metric_add(connection, bytes_produced, output->pos - pending);
+        zstd_proxy_metric_add(connection, process_ns, end - start);
+        zstd_proxy_latency_record(connection, process, end - start);
+
         if (error != 0) {
             break;
         }
 
-        ssize_t sent = send(connection->connect->fd, output->dst, output->pos, 0);
+        flushing = output->pos == output->size;
 
-        if (sent < 0) {
-            error = errno;
-            log_error("error writing to fd %d: %s", connection->connect->fd, strerror(error));
+        if (pipeline != NULL) {
+            if (pending == 0) {
+                pipeline->processed_at = end;
+            }
+
+            // Keep appending while the sender is busy, it picks everything up in one send
+            if (output->pos > 0 && (output->size - output->pos < output->size / 4 || zstd_proxy_posix_pipeline_idle(pipeline))) {
+                zstd_proxy_posix_pipeline_commit(pipeline, output, flushing);
+            }
+
+            continue;
+        }
 
+        if ((error = zstd_proxy_posix_send(connection, output->dst, output->pos, NULL, flushing)) != 0) {
             break;
         }
+
+        zstd_proxy_latency_record(connection, process_to_send, zstd_proxy_now_ns() - end);
     }
 
     return error;
@@ -40,13 +628,36 @@ int zstd_proxy_posix_process(zstd_proxy_connection* connection, ZSTD_inBuffer *i
 int zstd_proxy_posix_run(zstd_proxy_connection* connection) {
     int error = 0;
     int recv_fd = connection->listen->fd;
-    size_t size = connection->options->buffer_size;
+    zstd_proxy_options *options = connection->options;
+    size_t size = options->buffer_size;
+    uint64_t idle_timeout = options->idle_timeout_ms * 1000 * 1000;
+    uint64_t recv_timeout = idle_timeout;
+    zstd_proxy_posix_pipeline *pipeline = NULL;
     ZSTD_inBuffer input = { .src = malloc(size) };
-    ZSTD_outBuffer output = { .dst = malloc(size), .size = size };
+    ZSTD_outBuffer output = { .dst = NULL, .size = size };
+
+    if (options->posix.depth > 1) {
+        error = zstd_proxy_posix_pipeline_open(&pipeline, connection);
+    } else if ((output.dst = malloc(size)) == NULL) {
+        error = ENOMEM;
+    }
+
+    if (input.src == NULL) {
+        error = ENOMEM;
+    }
+
+    if (error != 0) {
+        goto cleanup;
+    }
 
-    if (input.src == NULL || output.dst == NULL) {
-        error = errno;
+    if (idle_timeout > 0 && (error = zstd_proxy_posix_set_timeout(recv_fd, SO_RCVTIMEO, idle_timeout)) != 0) {
+        goto cleanup;
+    }
 
+    if (
+        options->stall_timeout_ms > 0 &&
+        (error = zstd_proxy_posix_set_timeout(connection->connect->fd, SO_SNDTIMEO, options->stall_timeout_ms * 1000 * 1000)) != 0
+    ) {
         goto cleanup;
     }
 
@@ -57,16 +668,88 @@ int zstd_proxy_posix_run(zstd_proxy_connection* connection) {
         input.src = connection->listen->data;
         input.size = connection->listen->data_length;
 
-        error = zstd_proxy_posix_process(connection, &input, &output);
+        zstd_proxy_metric_add(connection, bytes_in, input.size);
+
+        error = zstd_proxy_posix_process(connection, pipeline, &input, &output, zstd_proxy_now_ns(), false);
 
         input.src = buffer;
     }
 
-    while (!error && !connection->options->stop) {
-        ssize_t received = recv(recv_fd, (void *)input.src, size, 0);
+    // recv() is only blocking while running: stopping shuts the socket down, which wakes it up
+    while (!error && !zstd_proxy_stopped(options)) {
+        // Data appended while the sender was busy, send it before waiting
+        bool pending = pipeline != NULL && output.pos > 0;
+
+        if (__atomic_load_n(&options->paused, __ATOMIC_RELAXED)) {
+            if (pending) {
+                zstd_proxy_posix_pipeline_commit(pipeline, &output, false);
+            }
+
+            // The source socket hangs up when the sender fails
+            struct pollfd events[2] = {
+                { .fd = connection->wakeup_fd, .events = POLLIN },
+                { .fd = recv_fd, .events = 0 },
+            };
+
+            if (poll(events, 2, -1) < 0 && errno != EINTR) {
+                error = errno;
+                log_error("error polling fd %d: %s", events[0].fd, strerror(error));
+
+                break;
+            }
+
+            if (events[1].revents & POLLHUP) {
+                break;
+            }
+
+            zstd_proxy_wakeup_drain(events[0].fd);
+
+            continue;
+        }
+
+        size_t recv_size = __atomic_load_n(&options->recv_size, __ATOMIC_RELAXED);
+
+        if (recv_size == 0 || recv_size > size) {
+            recv_size = size;
+        }
+
+        trace_probe(recv_submit, recv_fd, 0, recv_size, 0);
+
+        ssize_t received = pending
+            ? recv(recv_fd, (void *)input.src, recv_size, MSG_DONTWAIT)
+            : zstd_proxy_posix_recv(connection, recv_fd, (void *)input.src, recv_size);
+
+        trace_probe(recv_complete, recv_fd, 0, received, 0);
 
         if (received == 0) {
+            // Flush the end of a message the source never finished
+            if (connection->end != NULL) {
+                connection->end(connection->process_data);
+
+                input.pos = 0;
+                input.size = 0;
+                error = zstd_proxy_posix_process(connection, pipeline, &input, &output, 0, true);
+            }
+
             break;
+        } else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && pending) {
+            zstd_proxy_posix_pipeline_commit(pipeline, &output, false);
+
+            continue;
+        } else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && idle_timeout > 0) {
+            // SO_RCVTIMEO expired, wait for the rest of the timeout if the other direction was active
+            recv_timeout = zstd_proxy_idle_remaining(options, zstd_proxy_now_ns());
+
+            if (recv_timeout == 0) {
+                zstd_proxy_set_close_reason(options, zstd_proxy_close_idle_timeout);
+
+                error = ETIMEDOUT;
+                break;
+            }
+
+            error = zstd_proxy_posix_set_timeout(recv_fd, SO_RCVTIMEO, recv_timeout);
+
+            continue;
         } else if (received < 0) {
             error = errno;
             log_error("error reading fd %d: %s", recv_fd, strerror(error));
@@ -74,14 +757,42 @@ int zstd_proxy_posix_run(zstd_proxy_connection* connection) {
             break;
         }
 
+        uint64_t now = zstd_proxy_now_ns();
+
+        zstd_proxy_touch(options, now);
+
+        if (recv_timeout != idle_timeout) {
+            recv_timeout = idle_timeout;
+            error = zstd_proxy_posix_set_timeout(recv_fd, SO_RCVTIMEO, recv_timeout);
+        }
+
         input.pos = 0;
         input.size = received;
 
-        error = zstd_proxy_posix_process(connection, &input, &output);
+        zstd_proxy_metric_add(connection, bytes_in, received);
+
+        if (error == 0) {
+            error = zstd_proxy_posix_process(connection, pipeline, &input, &output, now, false);
+        }
     }
 
     cleanup:
 
+    if (pipeline != NULL) {
+        if (error == 0 && output.pos > 0) {
+            zstd_proxy_posix_pipeline_commit(pipeline, &output, false);
+        }
+
+        int pipeline_error = zstd_proxy_posix_pipeline_close(pipeline);
+
+        if (error == 0) {
+            error = pipeline_error;
+        }
+
+        // Pointed to a pipeline buffer
+        output.dst = NULL;
+    }
+
     free((void *)input.src);
     free((void *)output.dst);
 
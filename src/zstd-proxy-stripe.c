@@ -0,0 +1,692 @@
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if __linux__
+#include <linux/sockios.h>
+#endif
+
+#include "zstd-proxy-stripe.h"
+#include "zstd-proxy-utils.h"
+
+/** Magic, index, count, reserved and set id, little-endian. */
+#define zstd_proxy_stripe_magic 0x5A505331U
+#define zstd_proxy_stripe_hello_size 24
+/** Sequence number and size, little-endian. */
+#define zstd_proxy_stripe_header_size 12
+/** Time a connection has to send its hello, and a set to complete. */
+#define zstd_proxy_stripe_timeout_ms 10000
+
+typedef struct zstd_proxy_stripe_segment {
+    struct zstd_proxy_stripe_segment *next;
+    uint64_t sequence;
+    size_t size;
+    char data[];
+} zstd_proxy_stripe_segment;
+
+typedef struct zstd_proxy_stripe zstd_proxy_stripe;
+
+typedef struct {
+    zstd_proxy_stripe *stripe;
+    int fd;
+} zstd_proxy_stripe_flow;
+
+/**
+ * A running set: one thread reads the stream from the socketpair and sends its segments, and one
+ * thread per connection receives segments and delivers them in order to the socketpair.
+ */
+struct zstd_proxy_stripe {
+    zstd_proxy_stripe_options options;
+    /** End of the socketpair opposite to the proxy. */
+    int fd;
+    zstd_proxy_stripe_flow flows[zstd_proxy_stripe_max];
+    size_t count;
+
+    pthread_mutex_t lock;
+    /** Signaled when segments are delivered or the set fails. */
+    pthread_cond_t cond;
+    /** Sequence number of the next segment to deliver. */
+    uint64_t next;
+    /** Segments received ahead of `next`, by sequence number. */
+    zstd_proxy_stripe_segment *pending;
+    size_t pending_size;
+    /** Connections the peer stopped sending on. */
+    size_t finished;
+    bool failed;
+    /** Threads still running, the last one frees the set. */
+    size_t threads;
+};
+
+typedef struct zstd_proxy_stripe_set {
+    struct zstd_proxy_stripe_set *next;
+    uint64_t id;
+    size_t count;
+    size_t joined;
+    uint64_t created_at;
+    int fds[zstd_proxy_stripe_max];
+} zstd_proxy_stripe_set;
+
+struct zstd_proxy_stripe_listener {
+    zstd_proxy_stripe_options options;
+    /** Guards `sets`, hellos are read by the threads of their connections. */
+    pthread_mutex_t lock;
+    zstd_proxy_stripe_set *sets;
+};
+
+void zstd_proxy_stripe_default_options(zstd_proxy_stripe_options *options) {
+    options->count = 1;
+    options->segment_size = 64 * 1024;
+    options->reorder_size = 16 * 1024 * 1024;
+}
+
+static inline void zstd_proxy_stripe_write_le(uint8_t *buffer, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = value >> (i * 8);
+    }
+}
+
+static inline uint64_t zstd_proxy_stripe_read_le(const uint8_t *buffer, size_t size) {
+    uint64_t value = 0;
+
+    for (size_t i = size; i-- > 0;) {
+        value = value << 8 | buffer[i];
+    }
+
+    return value;
+}
+
+static int zstd_proxy_stripe_send_all(int fd, const void *data, size_t size) {
+    for (size_t offset = 0; offset < size;) {
+        ssize_t sent = send(fd, &((const char *)data)[offset], size - offset, 0);
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        }
+
+        offset += sent;
+    }
+
+    return 0;
+}
+
+/** Receive exactly `size` bytes, `eof` is set if the connection ended before the first one. */
+static int zstd_proxy_stripe_recv_all(int fd, void *data, size_t size, bool *eof) {
+    *eof = false;
+
+    for (size_t offset = 0; offset < size;) {
+        ssize_t received = recv(fd, &((char *)data)[offset], size - offset, 0);
+
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        }
+
+        if (received == 0) {
+            *eof = offset == 0;
+
+            return offset == 0 ? 0 : EPROTO;
+        }
+
+        offset += received;
+    }
+
+    return 0;
+}
+
+/** Stop every thread of the set, the proxy sees its socket fail. */
+static void zstd_proxy_stripe_fail(zstd_proxy_stripe *stripe, int error) {
+    if (__atomic_exchange_n(&stripe->failed, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    log_error("striped stream failed: %s", strerror(error));
+
+    // Without the lock, a thread delivering holds it while blocked on the socketpair
+    shutdown(stripe->fd, SHUT_RDWR);
+
+    for (size_t i = 0; i < stripe->count; i++) {
+        shutdown(stripe->flows[i].fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_lock(&stripe->lock);
+    pthread_cond_broadcast(&stripe->cond);
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+static void zstd_proxy_stripe_release(zstd_proxy_stripe *stripe) {
+    pthread_mutex_lock(&stripe->lock);
+
+    bool last = --stripe->threads == 0;
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (!last) {
+        return;
+    }
+
+    while (stripe->pending != NULL) {
+        zstd_proxy_stripe_segment *segment = stripe->pending;
+
+        stripe->pending = segment->next;
+        free(segment);
+    }
+
+    for (size_t i = 0; i < stripe->count; i++) {
+        close(stripe->flows[i].fd);
+    }
+
+    close(stripe->fd);
+    pthread_cond_destroy(&stripe->cond);
+    pthread_mutex_destroy(&stripe->lock);
+    free(stripe);
+}
+
+/** Writable connection with the least unsent data, so the connections keeping up take more segments. */
+static int zstd_proxy_stripe_pick(zstd_proxy_stripe *stripe, size_t *turn) {
+    struct pollfd fds[zstd_proxy_stripe_max];
+    int best = -1;
+    int best_unsent = 0;
+
+    for (size_t i = 0; i < stripe->count; i++) {
+        fds[i] = (struct pollfd){ .fd = stripe->flows[i].fd, .events = POLLOUT };
+    }
+
+    while (poll(fds, stripe->count, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    // Ties go round-robin, connections without a backlog share the segments
+    for (size_t n = 0; n < stripe->count; n++) {
+        size_t i = (*turn + n) % stripe->count;
+        int unsent = 0;
+
+        if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            return -1;
+        }
+
+        if (!(fds[i].revents & POLLOUT)) {
+            continue;
+        }
+
+#if defined(SIOCOUTQNSD)
+        ioctl(fds[i].fd, SIOCOUTQNSD, &unsent);
+#elif defined(SIOCOUTQ)
+        ioctl(fds[i].fd, SIOCOUTQ, &unsent);
+#endif
+
+        if (best < 0 || unsent < best_unsent) {
+            best = i;
+            best_unsent = unsent;
+        }
+    }
+
+    *turn = best + 1;
+
+    return fds[best].fd;
+}
+
+static void *zstd_proxy_stripe_send_thread(void *data) {
+    zstd_proxy_stripe *stripe = data;
+    size_t segment_size = stripe->options.segment_size;
+    uint8_t *buffer = malloc(zstd_proxy_stripe_header_size + segment_size);
+    uint64_t sequence = 0;
+    size_t turn = 0;
+    int error = buffer == NULL ? ENOMEM : 0;
+
+    while (error == 0) {
+        ssize_t received = recv(stripe->fd, &buffer[zstd_proxy_stripe_header_size], segment_size, 0);
+
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (received < 0) {
+            error = errno;
+
+            break;
+        }
+
+        // The proxy is done sending, the peer delivers what's in flight and ends its side
+        if (received == 0) {
+            for (size_t i = 0; i < stripe->count; i++) {
+                shutdown(stripe->flows[i].fd, SHUT_WR);
+            }
+
+            break;
+        }
+
+        int fd = zstd_proxy_stripe_pick(stripe, &turn);
+
+        if (fd < 0) {
+            error = EPIPE;
+
+            break;
+        }
+
+        zstd_proxy_stripe_write_le(&buffer[0], sequence++, 8);
+        zstd_proxy_stripe_write_le(&buffer[8], received, 4);
+
+        error = zstd_proxy_stripe_send_all(fd, buffer, zstd_proxy_stripe_header_size + received);
+    }
+
+    if (error != 0) {
+        zstd_proxy_stripe_fail(stripe, error);
+    }
+
+    free(buffer);
+    zstd_proxy_stripe_release(stripe);
+
+    return NULL;
+}
+
+/** Queue `segment` and deliver the segments now in order, blocks while too much is buffered ahead. */
+static int zstd_proxy_stripe_deliver(zstd_proxy_stripe *stripe, zstd_proxy_stripe_segment *segment) {
+    int error = 0;
+
+    pthread_mutex_lock(&stripe->lock);
+
+    // The next segment is always taken, it's the one the others wait for
+    while (
+        !__atomic_load_n(&stripe->failed, __ATOMIC_ACQUIRE) &&
+        segment->sequence != stripe->next &&
+        stripe->pending_size > 0 &&
+        stripe->pending_size + segment->size > stripe->options.reorder_size
+    ) {
+        pthread_cond_wait(&stripe->cond, &stripe->lock);
+    }
+
+    zstd_proxy_stripe_segment **link = &stripe->pending;
+
+    while (*link != NULL && (*link)->sequence < segment->sequence) {
+        link = &(*link)->next;
+    }
+
+    if (__atomic_load_n(&stripe->failed, __ATOMIC_ACQUIRE)) {
+        error = ECONNABORTED;
+    } else if (segment->sequence < stripe->next || (*link != NULL && (*link)->sequence == segment->sequence)) {
+        error = EPROTO;
+    }
+
+    if (error != 0) {
+        pthread_mutex_unlock(&stripe->lock);
+        free(segment);
+
+        return error;
+    }
+
+    segment->next = *link;
+    *link = segment;
+    stripe->pending_size += segment->size;
+
+    while (error == 0 && stripe->pending != NULL && stripe->pending->sequence == stripe->next) {
+        segment = stripe->pending;
+        stripe->pending = segment->next;
+        stripe->pending_size -= segment->size;
+        stripe->next++;
+
+        error = zstd_proxy_stripe_send_all(stripe->fd, segment->data, segment->size);
+        free(segment);
+    }
+
+    pthread_cond_broadcast(&stripe->cond);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return error;
+}
+
+/** The peer stopped sending on a connection, the stream ends once it stopped on all of them. */
+static int zstd_proxy_stripe_finish(zstd_proxy_stripe *stripe) {
+    int error = 0;
+
+    pthread_mutex_lock(&stripe->lock);
+
+    if (++stripe->finished == stripe->count) {
+        if (stripe->pending != NULL) {
+            error = EPROTO;
+        } else {
+            shutdown(stripe->fd, SHUT_WR);
+        }
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    return error;
+}
+
+static void *zstd_proxy_stripe_recv_thread(void *data) {
+    zstd_proxy_stripe_flow *flow = data;
+    zstd_proxy_stripe *stripe = flow->stripe;
+    int error = 0;
+
+    for (;;) {
+        uint8_t header[zstd_proxy_stripe_header_size];
+        bool eof = false;
+
+        if ((error = zstd_proxy_stripe_recv_all(flow->fd, header, sizeof(header), &eof)) != 0) {
+            break;
+        }
+
+        if (eof) {
+            error = zstd_proxy_stripe_finish(stripe);
+
+            break;
+        }
+
+        uint64_t size = zstd_proxy_stripe_read_le(&header[8], 4);
+        zstd_proxy_stripe_segment *segment = NULL;
+
+        if (size == 0 || size > zstd_proxy_stripe_segment_max) {
+            error = EPROTO;
+
+            break;
+        }
+
+        if ((segment = malloc(sizeof(zstd_proxy_stripe_segment) + size)) == NULL) {
+            error = ENOMEM;
+
+            break;
+        }
+
+        segment->sequence = zstd_proxy_stripe_read_le(&header[0], 8);
+        segment->size = size;
+
+        if ((error = zstd_proxy_stripe_recv_all(flow->fd, segment->data, size, &eof)) != 0 || eof) {
+            error = error != 0 ? error : EPROTO;
+            free(segment);
+
+            break;
+        }
+
+        if ((error = zstd_proxy_stripe_deliver(stripe, segment)) != 0) {
+            break;
+        }
+    }
+
+    if (error != 0) {
+        zstd_proxy_stripe_fail(stripe, error);
+    }
+
+    zstd_proxy_stripe_release(stripe);
+
+    return NULL;
+}
+
+/** Run a set over `count` connections, takes ownership of `fds`. */
+static int zstd_proxy_stripe_start(const int *fds, size_t count, const zstd_proxy_stripe_options *options, int *fd_ptr) {
+    zstd_proxy_stripe *stripe = calloc(1, sizeof(zstd_proxy_stripe));
+    int pair[2] = { -1, -1 };
+    int error = 0;
+
+    *fd_ptr = -1;
+
+    if (stripe == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        error = stripe == NULL ? ENOMEM : errno;
+
+        log_error("failed to create striped stream: %s", strerror(error));
+        free(stripe);
+
+        for (size_t i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+
+        return error;
+    }
+
+    stripe->options = *options;
+    stripe->fd = pair[1];
+    stripe->count = count;
+    stripe->threads = count + 1;
+
+    pthread_mutex_init(&stripe->lock, NULL);
+    pthread_cond_init(&stripe->cond, NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        int enable = 1;
+
+        stripe->flows[i] = (zstd_proxy_stripe_flow){ stripe, fds[i] };
+
+        // Segments are already batched, they leave as soon as they are sent
+        setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+
+    pthread_attr_t attributes;
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    for (size_t i = 0; i <= count; i++) {
+        pthread_t thread;
+
+        if (error == 0) {
+            error = i == count
+                ? pthread_create(&thread, &attributes, zstd_proxy_stripe_send_thread, stripe)
+                : pthread_create(&thread, &attributes, zstd_proxy_stripe_recv_thread, &stripe->flows[i]);
+
+            if (error != 0) {
+                zstd_proxy_stripe_fail(stripe, error);
+            }
+        }
+
+        // Threads which didn't start, the running ones stop on the failure
+        if (error != 0) {
+            zstd_proxy_stripe_release(stripe);
+        }
+    }
+
+    pthread_attr_destroy(&attributes);
+
+    if (error != 0) {
+        close(pair[0]);
+
+        return error;
+    }
+
+    *fd_ptr = pair[0];
+
+    return 0;
+}
+
+int zstd_proxy_stripe_connect(const int *fds, const zstd_proxy_stripe_options *options, int *fd_ptr) {
+    static uint64_t sets = 0;
+    size_t count = options->count;
+    int error = 0;
+
+    *fd_ptr = -1;
+
+    // Only has to be unique among the sets waiting to complete on the listener
+    uint64_t id = zstd_proxy_now_ns() ^ (uint64_t)getpid() << 32 ^ __atomic_add_fetch(&sets, 1, __ATOMIC_RELAXED) * 0x9E3779B97F4A7C15;
+
+    for (size_t i = 0; i < count && error == 0; i++) {
+        uint8_t hello[zstd_proxy_stripe_hello_size] = { 0 };
+
+        zstd_proxy_stripe_write_le(&hello[0], zstd_proxy_stripe_magic, 4);
+        zstd_proxy_stripe_write_le(&hello[4], i, 4);
+        zstd_proxy_stripe_write_le(&hello[8], count, 4);
+        zstd_proxy_stripe_write_le(&hello[16], id, 8);
+
+        if ((error = zstd_proxy_stripe_send_all(fds[i], hello, sizeof(hello))) != 0) {
+            log_error("error sending stripe hello: %s", strerror(error));
+        }
+    }
+
+    if (error != 0) {
+        for (size_t i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+
+        return error;
+    }
+
+    return zstd_proxy_stripe_start(fds, count, options, fd_ptr);
+}
+
+int zstd_proxy_stripe_listener_create(zstd_proxy_stripe_listener **listener_ptr, const zstd_proxy_stripe_options *options) {
+    zstd_proxy_stripe_listener *listener = calloc(1, sizeof(zstd_proxy_stripe_listener));
+
+    *listener_ptr = listener;
+
+    if (listener == NULL) {
+        return ENOMEM;
+    }
+
+    listener->options = *options;
+    pthread_mutex_init(&listener->lock, NULL);
+
+    return 0;
+}
+
+static void zstd_proxy_stripe_set_free(zstd_proxy_stripe_set *set) {
+    for (size_t i = 0; i < set->count; i++) {
+        if (set->fds[i] >= 0) {
+            close(set->fds[i]);
+        }
+    }
+
+    free(set);
+}
+
+/** Drop the sets a connection never joined, their peers gave up on them. */
+static void zstd_proxy_stripe_expire(zstd_proxy_stripe_listener *listener, uint64_t now) {
+    for (zstd_proxy_stripe_set **link = &listener->sets; *link != NULL;) {
+        zstd_proxy_stripe_set *set = *link;
+
+        if (now - set->created_at < (uint64_t)zstd_proxy_stripe_timeout_ms * 1000 * 1000) {
+            link = &set->next;
+
+            continue;
+        }
+
+        log_error("dropping incomplete striped set, %zu of %zu connections joined", set->joined, set->count);
+
+        *link = set->next;
+        zstd_proxy_stripe_set_free(set);
+    }
+}
+
+int zstd_proxy_stripe_accept(zstd_proxy_stripe_listener *listener, int fd, int *fd_ptr) {
+    uint8_t hello[zstd_proxy_stripe_hello_size];
+    struct timeval timeout = { .tv_sec = zstd_proxy_stripe_timeout_ms / 1000 };
+    struct timeval blocking = { 0 };
+    bool eof = false;
+
+    *fd_ptr = -1;
+
+    // A connection not sending its hello only holds its own thread, until the timeout
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int error = zstd_proxy_stripe_recv_all(fd, hello, sizeof(hello), &eof);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &blocking, sizeof(blocking));
+
+    uint64_t index = zstd_proxy_stripe_read_le(&hello[4], 4);
+    uint64_t count = zstd_proxy_stripe_read_le(&hello[8], 4);
+    uint64_t id = zstd_proxy_stripe_read_le(&hello[16], 8);
+
+    if (error == 0 && (eof || zstd_proxy_stripe_read_le(&hello[0], 4) != zstd_proxy_stripe_magic || count == 0 || count > zstd_proxy_stripe_max || index >= count)) {
+        error = EPROTO;
+    }
+
+    if (error != 0) {
+        log_error("error reading stripe hello: %s", strerror(error));
+        close(fd);
+
+        return error;
+    }
+
+    uint64_t now = zstd_proxy_now_ns();
+    zstd_proxy_stripe_set *set = NULL;
+
+    pthread_mutex_lock(&listener->lock);
+
+    zstd_proxy_stripe_expire(listener, now);
+
+    zstd_proxy_stripe_set **link = &listener->sets;
+
+    while (*link != NULL && ((*link)->id != id || (*link)->count != count)) {
+        link = &(*link)->next;
+    }
+
+    if ((set = *link) == NULL) {
+        if ((set = calloc(1, sizeof(zstd_proxy_stripe_set))) == NULL) {
+            error = ENOMEM;
+
+            goto cleanup;
+        }
+
+        set->id = id;
+        set->count = count;
+        set->created_at = now;
+
+        for (size_t i = 0; i < count; i++) {
+            set->fds[i] = -1;
+        }
+
+        *link = set;
+    }
+
+    if (set->fds[index] >= 0) {
+        log_error("connection %zu joined its striped set twice", (size_t)index);
+        error = EPROTO;
+
+        goto cleanup;
+    }
+
+    set->fds[index] = fd;
+    fd = -1;
+
+    // Complete: the set is this thread's to start, out of the lock
+    if (++set->joined == set->count) {
+        *link = set->next;
+    } else {
+        set = NULL;
+    }
+
+    cleanup:
+
+    pthread_mutex_unlock(&listener->lock);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (error != 0 || set == NULL) {
+        return error;
+    }
+
+    error = zstd_proxy_stripe_start(set->fds, set->count, &listener->options, fd_ptr);
+    free(set);
+
+    return error;
+}
+
+void zstd_proxy_stripe_listener_destroy(zstd_proxy_stripe_listener *listener) {
+    if (listener == NULL) {
+        return;
+    }
+
+    while (listener->sets != NULL) {
+        zstd_proxy_stripe_set *set = listener->sets;
+
+        listener->sets = set->next;
+        zstd_proxy_stripe_set_free(set);
+    }
+
+    pthread_mutex_destroy(&listener->lock);
+    free(listener);
+}
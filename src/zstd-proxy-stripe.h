@@ -0,0 +1,55 @@
+#ifndef zstd_proxy_stripe_H
+#define zstd_proxy_stripe_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * One byte stream carried by a set of TCP connections, so a compressed stream isn't bound to what a
+ * single flow gets through a long or shaped path.
+ *
+ * Each connection of a set starts with a hello naming the set, then carries segments of the stream in
+ * both directions, prefixed with their sequence number and size. Segments go to the writable connection
+ * with the least unsent data, so faster flows take more of them, and the receiving end puts them back
+ * in order. The proxy sees the stream as one end of a socketpair, like any other socket.
+ */
+
+/** Most connections per set. */
+#define zstd_proxy_stripe_max 64
+/** Larger segments are a protocol error, bounds what a peer makes the receiving end allocate. */
+#define zstd_proxy_stripe_segment_max (16 * 1024 * 1024)
+
+typedef struct {
+    /** Connections per set, 1 to disable striping. */
+    size_t count;
+    /** Most stream bytes per segment, smaller ones are sent as soon as they are read. */
+    size_t segment_size;
+    /** Out-of-order bytes buffered by the receiving end before it stops reading the connections ahead. */
+    size_t reorder_size;
+} zstd_proxy_stripe_options;
+
+void zstd_proxy_stripe_default_options(zstd_proxy_stripe_options *options);
+
+/**
+ * Start a set over `options->count` connected sockets, sending their hellos. Sets `fd_ptr` to the end
+ * of the stream, closing it ends the set. Takes ownership of `fds`, they are closed on error.
+ */
+int zstd_proxy_stripe_connect(const int *fds, const zstd_proxy_stripe_options *options, int *fd_ptr);
+
+/** Connections accepted until their set is complete. */
+typedef struct zstd_proxy_stripe_listener zstd_proxy_stripe_listener;
+
+int zstd_proxy_stripe_listener_create(zstd_proxy_stripe_listener **listener_ptr, const zstd_proxy_stripe_options *options);
+
+/**
+ * Read the hello of an accepted connection and add it to its set. Sets `fd_ptr` to the end of the
+ * stream when it completes the set, -1 until then. Takes ownership of `fd`, it is closed on error.
+ * Sets missing connections for too long are dropped. Waits for the hello, so call it from a thread of
+ * the connection rather than the accept loop: any number of threads can accept at once.
+ */
+int zstd_proxy_stripe_accept(zstd_proxy_stripe_listener *listener, int fd, int *fd_ptr);
+
+void zstd_proxy_stripe_listener_destroy(zstd_proxy_stripe_listener *listener);
+
+#endif
@@ -31,6 +31,13 @@ struct zstd_proxy_uring_buffer {
     /** Ring buffer data. */
     char *queue_data;
 
+    /** Monotonic time of the recv completion, 0 once processing started. */
+    uint64_t received_at;
+    /** Monotonic time at which processing filled this send buffer. */
+    uint64_t processed_at;
+    /** The frame continues in the next send buffer. */
+    bool more;
+
     /** Return code. */
     int result;
     /** `true` if `buffer` is being filled by the kernel. */
@@ -58,6 +65,17 @@ struct zstd_proxy_uring_queue {
     int (*process)(void *process_data, ZSTD_inBuffer *input, ZSTD_outBuffer *output);
 
     struct io_uring uring;
+    /** Flags the ring was created with, see `zstd_proxy_uring_setup_flags`. */
+    unsigned setup_flags;
+    /** Target of the read on `connection->wakeup_fd`, also used as its `user_data`. */
+    uint64_t wakeup;
+    /** `user_data` of linked timeouts, their completions are ignored. */
+    bool link_timeout;
+    /** `true` once the source ended and `connection->end` was called, only the sends are left. */
+    bool ending;
+    /** Linked to recv and send requests, read by the kernel on submit. */
+    struct __kernel_timespec recv_timeout;
+    struct __kernel_timespec send_timeout;
     zstd_proxy_connection *connection;
     zstd_proxy_uring_buffer buffers[];
 };
@@ -125,6 +143,25 @@ void zstd_proxy_uring_options(zstd_proxy_options *options) {
     }
 }
 
+/** Ring flags for the busy poll options, 0 if none are enabled or liburing predates them. */
+static inline unsigned zstd_proxy_uring_setup_flags(const zstd_proxy_busy_poll_options *options) {
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    // Deferred task work must run on the thread which created the ring
+    if (options->defer_taskrun) {
+        return IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    }
+#endif
+
+#ifdef IORING_SETUP_COOP_TASKRUN
+    // Without an interrupt, the flag tells `io_uring_peek_cqe` when to enter the kernel for completions
+    if (options->coop_taskrun) {
+        return IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    }
+#endif
+
+    return 0;
+}
+
 static inline void zstd_proxy_uring_destroy(zstd_proxy_uring_queue *queue) {
     if (queue == NULL) {
         return;
@@ -156,6 +193,7 @@ int zstd_proxy_uring_create(zstd_proxy_uring_queue **queue_ptr, zstd_proxy_conne
     queue->id = 0;
     queue->size = size;
     queue->running = 0;
+    queue->ending = false;
     queue->connection = connection;
     queue->buffer_size = buffer_size;
 
@@ -173,12 +211,23 @@ int zstd_proxy_uring_create(zstd_proxy_uring_queue **queue_ptr, zstd_proxy_conne
         buffer->index = i;
         buffer->running = false;
         buffer->available = true;
+        buffer->received_at = 0;
+        buffer->processed_at = 0;
+        buffer->more = false;
 
         vec->iov_len = buffer_size;
         vec->iov_base = buffer->data;
     }
 
-    error = io_uring_queue_init(depth, uring, 0);
+    // Extra entries for the wakeup read and linked timeouts
+    queue->setup_flags = zstd_proxy_uring_setup_flags(&connection->options->busy_poll);
+    error = io_uring_queue_init(depth + 2, uring, queue->setup_flags);
+
+    // Kernels before 5.19 (6.1 for deferred task work) reject these flags, they only help latency
+    if (error == -EINVAL && queue->setup_flags != 0) {
+        queue->setup_flags = 0;
+        error = io_uring_queue_init(depth + 2, uring, 0);
+    }
 
     if (error != 0) {
         error = -error;
@@ -226,23 +275,74 @@ static inline zstd_proxy_uring_buffer *zstd_proxy_uring_get(zstd_proxy_uring_que
     return next;
 }
 
+/** Link a timeout to `sqe`, which completes with `-ECANCELED` if it expires. */
+static inline int zstd_proxy_uring_link_timeout(
+    zstd_proxy_uring_queue *queue,
+    struct io_uring_sqe *sqe,
+    struct __kernel_timespec *timeout,
+    uint64_t ns
+) {
+    if (ns == 0) {
+        return 0;
+    }
+
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+
+    struct io_uring_sqe *timeout_sqe = io_uring_get_sqe(&queue->uring);
+
+    if (timeout_sqe == NULL) {
+        log_error("failed to get uring timeout sqe");
+
+        return EIO;
+    }
+
+    timeout->tv_sec = ns / 1000000000;
+    timeout->tv_nsec = ns % 1000000000;
+
+    io_uring_prep_link_timeout(timeout_sqe, timeout, 0);
+    io_uring_sqe_set_data(timeout_sqe, &queue->link_timeout);
+
+    return 0;
+}
+
+/** Buffers of each type which can be in use, lowered by `zstd_proxy_set_buffer_limits`. */
+static inline size_t zstd_proxy_uring_depth(zstd_proxy_uring_queue *queue) {
+    size_t limit = __atomic_load_n(&queue->connection->options->depth_limit, __ATOMIC_RELAXED);
+
+    return limit == 0 || limit > queue->size ? queue->size : limit;
+}
+
 /** Send a recv request */
 int zstd_proxy_uring_submit_recv(zstd_proxy_uring_queue *queue) {
     zstd_proxy_uring_buffer *recv_buffer = NULL;
+    zstd_proxy_options *options = queue->connection->options;
+    size_t used = 0;
+
+    if (queue->ending || __atomic_load_n(&options->paused, __ATOMIC_RELAXED)) {
+        return 0;
+    }
 
     zstd_proxy_uring_foreach(queue, zstd_proxy_uring_recv_buffer) {
         if (buffer->running) {
             return 0;
-        } else if (recv_buffer == NULL && buffer->available) {
+        } else if (!buffer->available) {
+            used++;
+        } else if (recv_buffer == NULL) {
             recv_buffer = buffer;
         }
     }
 
     // We don't have any memory left to fill
-    if (recv_buffer == NULL) {
+    if (recv_buffer == NULL || used >= zstd_proxy_uring_depth(queue)) {
         return 0;
     }
 
+    size_t size = __atomic_load_n(&options->recv_size, __ATOMIC_RELAXED);
+
+    if (size == 0 || size > queue->buffer_size) {
+        size = queue->buffer_size;
+    }
+
     struct io_uring *uring = &queue->uring;
     struct io_uring_sqe *sqe = io_uring_get_sqe(uring);
 
@@ -263,16 +363,30 @@ int zstd_proxy_uring_submit_recv(zstd_proxy_uring_queue *queue) {
     int fd = connection->listen->fd;
 
     // log_debug("scheduling recv on fd %d, buffer=%d", fd, recv_buffer->index);
+    trace_probe(recv_submit, fd, recv_buffer->index, size, queue->running);
 
     if (connection->options->io_uring.fixed_buffers) {
-        io_uring_prep_read_fixed(sqe, fd, recv_buffer->data, queue->buffer_size, 0, recv_buffer->index);
+        io_uring_prep_read_fixed(sqe, fd, recv_buffer->data, size, 0, recv_buffer->index);
     } else {
-        io_uring_prep_read(sqe, fd, recv_buffer->data, queue->buffer_size, 0);
+        io_uring_prep_read(sqe, fd, recv_buffer->data, size, 0);
     }
 
     io_uring_sqe_set_data(sqe, recv_buffer);
 
-    int error = io_uring_submit(uring);
+    int error = 0;
+
+    // Only wait for what's left of the idle timeout, the other direction may have been active
+    if (options->idle_timeout_ms > 0) {
+        uint64_t remaining = zstd_proxy_idle_remaining(options, zstd_proxy_now_ns());
+
+        error = zstd_proxy_uring_link_timeout(queue, sqe, &queue->recv_timeout, remaining > 0 ? remaining : 1);
+
+        if (error != 0) {
+            return error;
+        }
+    }
+
+    error = io_uring_submit(uring);
 
     if (error < 0) {
         log_error("failed to submit read for fd %d: %s", fd, strerror(errno));
@@ -285,6 +399,31 @@ int zstd_proxy_uring_submit_recv(zstd_proxy_uring_queue *queue) {
     return 0;
 }
 
+/** Read the wakeup eventfd, its completion interrupts `io_uring_wait_cqe` when options change. */
+int zstd_proxy_uring_submit_wakeup(zstd_proxy_uring_queue *queue) {
+    struct io_uring *uring = &queue->uring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(uring);
+
+    if (sqe == NULL) {
+        log_error("failed to get uring wakeup sqe");
+
+        return EIO;
+    }
+
+    io_uring_prep_read(sqe, queue->connection->wakeup_fd, &queue->wakeup, sizeof(queue->wakeup), 0);
+    io_uring_sqe_set_data(sqe, &queue->wakeup);
+
+    int error = io_uring_submit(uring);
+
+    if (error < 0) {
+        log_error("failed to submit wakeup read: %s", strerror(-error));
+
+        return -error;
+    }
+
+    return 0;
+}
+
 int zstd_proxy_uring_submit_send(zstd_proxy_uring_queue *queue) {
     zstd_proxy_uring_buffer *buffer = zstd_proxy_uring_get(queue, zstd_proxy_uring_send_buffer);
 
@@ -311,9 +450,15 @@ int zstd_proxy_uring_submit_send(zstd_proxy_uring_queue *queue) {
     int fd = connection->connect->fd;
 
     // log_debug("scheduling send on fd %d, buffer=%d, size=%d", fd, buffer->index, buffer->size);
+    trace_probe(send_submit, fd, buffer->index, buffer->size, queue->running);
+
+    // Writes don't take flags, the rare sends which need `MSG_MORE` give up on fixed buffers
+    int flags = buffer->more && connection->options->socket.cork ? MSG_MORE : 0;
 
     if (options->zero_copy) {
-        io_uring_prep_send_zc_fixed(sqe, fd, &buffer->data[buffer->offset], buffer->size, 0, 0, buffer->index);
+        io_uring_prep_send_zc_fixed(sqe, fd, &buffer->data[buffer->offset], buffer->size, flags, 0, buffer->index);
+    } else if (flags != 0) {
+        io_uring_prep_send(sqe, fd, &buffer->data[buffer->offset], buffer->size, flags);
     } else if (options->fixed_buffers) {
         io_uring_prep_write_fixed(sqe, fd, &buffer->data[buffer->offset], buffer->size, 0, buffer->index);
     } else {
@@ -322,7 +467,18 @@ int zstd_proxy_uring_submit_send(zstd_proxy_uring_queue *queue) {
 
     io_uring_sqe_set_data(sqe, buffer);
 
-    int error = io_uring_submit(uring);
+    int error = zstd_proxy_uring_link_timeout(
+        queue,
+        sqe,
+        &queue->send_timeout,
+        connection->options->stall_timeout_ms * 1000 * 1000
+    );
+
+    if (error != 0) {
+        return error;
+    }
+
+    error = io_uring_submit(uring);
 
     if (error < 0) {
         log_error("failed to submit write on fd %d: %s", fd, strerror(errno));
@@ -330,6 +486,8 @@ int zstd_proxy_uring_submit_send(zstd_proxy_uring_queue *queue) {
         return errno;
     }
 
+    zstd_proxy_metric_add(connection, sends, 1);
+
     return 0;
 }
 
@@ -342,22 +500,29 @@ static inline int zstd_proxy_uring_process(zstd_proxy_uring_buffer *recv_buffer)
         .size = recv_buffer->size,
     };
 
+    // Past the end of the source, the codec is called on the empty input until it flushed everything
+    bool flushing = queue->ending;
+
     // Loop in case the input doesn't fit in the output
-    while (input.pos < input.size) {
+    while (input.pos < input.size || flushing) {
         zstd_proxy_uring_buffer *send_buffer = NULL;
+        size_t used = 0;
 
         zstd_proxy_uring_foreach(queue, zstd_proxy_uring_send_buffer) {
-            if (buffer->available) {
+            if (!buffer->available) {
+                used++;
+            } else if (send_buffer == NULL) {
                 send_buffer = buffer;
-
-                break;
             }
         }
 
-        if (send_buffer == NULL) {
+        if (send_buffer == NULL || used >= zstd_proxy_uring_depth(queue)) {
             // No send buffer available, save the offset and wait for next cqe
             recv_buffer->offset = input.pos;
 
+            zstd_proxy_metric_add(queue->connection, send_starvations, 1);
+            trace_probe(send_starved, queue->connection->listen->fd, recv_buffer->index, input.size - input.pos, queue->running);
+
             return 0;
         }
 
@@ -367,18 +532,41 @@ static inline int zstd_proxy_uring_process(zstd_proxy_uring_buffer *recv_buffer)
             .size = queue->buffer_size,
         };
 
+        uint64_t start = zstd_proxy_now_ns();
+
+        if (recv_buffer->received_at != 0) {
+            zstd_proxy_latency_record(queue->connection, recv_to_process, start - recv_buffer->received_at);
+
+            recv_buffer->received_at = 0;
+        }
+
+        trace_probe(process_start, queue->connection->listen->fd, recv_buffer->index, input.pos, input.size);
+
         // Pass the data to Zstd
         error = queue->process(queue->process_data, &input, &output);
 
+        uint64_t end = zstd_proxy_now_ns();
+
+        trace_probe(process_done, queue->connection->listen->fd, send_buffer->index, input.pos, output.pos, end - start);
+
+        zstd_proxy_metric_add(queue->connection, chunks, 1);
+        zstd_proxy_metric_add(queue->connection, bytes_produced, output.pos);
+        zstd_proxy_metric_add(queue->connection, process_ns, end - start);
+        zstd_proxy_latency_record(queue->connection, process, end - start);
+
         if (error != 0) {
             return error;
         }
 
+        flushing = queue->ending && output.pos == output.size;
+
         queue->running++;
         send_buffer->id = ++queue->id;
         send_buffer->size = output.pos;
         send_buffer->offset = 0;
+        send_buffer->processed_at = end;
         send_buffer->available = false;
+        send_buffer->more = input.pos < input.size || flushing;
 
         // Enqueue a send() if none are pending
         error = zstd_proxy_uring_submit_send(queue);
@@ -403,6 +591,24 @@ static inline int zstd_proxy_uring_complete(zstd_proxy_uring_buffer *buffer) {
         int fd = queue->connection->listen->fd;
 
         log_debug("received data on fd %d, res=%d", fd, res);
+        trace_probe(recv_complete, fd, buffer->index, res, queue->running);
+
+        zstd_proxy_options *options = queue->connection->options;
+
+        if (res == -ECANCELED && options->idle_timeout_ms > 0) {
+            // The linked timeout expired, close unless the other direction was active meanwhile
+            if (zstd_proxy_idle_remaining(options, zstd_proxy_now_ns()) == 0) {
+                zstd_proxy_set_close_reason(options, zstd_proxy_close_idle_timeout);
+
+                return ETIMEDOUT;
+            }
+
+            // Release the buffer, the event loop submits a new recv
+            queue->running--;
+            buffer->available = true;
+
+            return 0;
+        }
 
         if (res < 0) {
             buffer->size = 0;
@@ -415,12 +621,25 @@ static inline int zstd_proxy_uring_complete(zstd_proxy_uring_buffer *buffer) {
 
         buffer->size = res;
         buffer->offset = 0;
+        buffer->received_at = zstd_proxy_now_ns();
+
+        zstd_proxy_touch(options, buffer->received_at);
+
+        zstd_proxy_metric_add(queue->connection, bytes_in, res);
 
         return 0;
     } else if (buffer->type == zstd_proxy_uring_send_buffer) {
         int fd = queue->connection->connect->fd;
 
         log_debug("sent data on fd %d, res=%d", fd, res);
+        trace_probe(send_complete, fd, buffer->index, res, queue->running);
+
+        if (res == -ECANCELED && queue->connection->options->stall_timeout_ms > 0) {
+            log_error("send stalled on fd %d", fd);
+            zstd_proxy_set_close_reason(queue->connection->options, zstd_proxy_close_stall_timeout);
+
+            return ETIMEDOUT;
+        }
 
         if (res < 0) {
             log_error("failed write to socket on fd %d: %s", fd, strerror(-res));
@@ -430,11 +649,18 @@ static inline int zstd_proxy_uring_complete(zstd_proxy_uring_buffer *buffer) {
 
         size_t size = res;
 
+        zstd_proxy_metric_add(queue->connection, bytes_out, size);
+
         if (size < buffer->size) {
+            zstd_proxy_metric_add(queue->connection, partial_sends, 1);
+            trace_probe(send_partial, fd, buffer->index, size, buffer->size - size);
+
             // Only a part of the buffer was sent, send more
             buffer->size -= size;
             buffer->offset += size;
         } else {
+            zstd_proxy_latency_record(queue->connection, process_to_send, zstd_proxy_now_ns() - buffer->processed_at);
+
             // Everything got sent, mark the buffer as available
             queue->running--;
             buffer->available = true;
@@ -448,6 +674,35 @@ static inline int zstd_proxy_uring_complete(zstd_proxy_uring_buffer *buffer) {
     }
 }
 
+/** `io_uring_wait_cqe`, spinning on the completion queue for `busy_poll.spin_us` before sleeping. */
+static inline int zstd_proxy_uring_wait(zstd_proxy_uring_queue *queue, struct io_uring_cqe **cqe) {
+    zstd_proxy_connection *connection = queue->connection;
+    uint64_t spin_us = connection->options->busy_poll.spin_us;
+
+    if (spin_us > 0) {
+        uint64_t deadline = zstd_proxy_now_ns() + spin_us * 1000;
+
+        do {
+#ifdef IORING_SETUP_DEFER_TASKRUN
+            // Deferred completions are only posted when entering the kernel
+            if (queue->setup_flags & IORING_SETUP_DEFER_TASKRUN) {
+                io_uring_get_events(&queue->uring);
+            }
+#endif
+
+            if (io_uring_peek_cqe(&queue->uring, cqe) == 0) {
+                zstd_proxy_metric_add(connection, busy_polls, 1);
+
+                return 0;
+            }
+
+            zstd_proxy_cpu_relax();
+        } while (zstd_proxy_now_ns() < deadline);
+    }
+
+    return io_uring_wait_cqe(&queue->uring, cqe);
+}
+
 int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
     int error = 0;
     zstd_proxy_uring_queue *queue;
@@ -471,6 +726,9 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
         buffer->data = connection->listen->data;
         buffer->size = connection->listen->data_length;
         buffer->offset = 0;
+        buffer->received_at = zstd_proxy_now_ns();
+
+        zstd_proxy_metric_add(connection, bytes_in, buffer->size);
 
         // Process the recv buffer (pass to Zstd and enqueue send() calls)
         error = zstd_proxy_uring_process(buffer);
@@ -480,6 +738,12 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
         }
     }
 
+    error = zstd_proxy_uring_submit_wakeup(queue);
+
+    if (error != 0) {
+        goto cleanup;
+    }
+
     // Send a first recv()
     error = zstd_proxy_uring_submit_recv(queue);
 
@@ -489,17 +753,37 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
 
     struct io_uring *uring = &queue->uring;
     struct io_uring_cqe *cqe = NULL;
+    zstd_proxy_options *options = connection->options;
+    uint64_t generation = __atomic_load_n(&options->generation, __ATOMIC_ACQUIRE);
+
+    // Event loop, keeps running while paused even if nothing is in flight
+    while (
+        !zstd_proxy_stopped(options) &&
+        (queue->running > 0 || (!queue->ending && __atomic_load_n(&options->paused, __ATOMIC_RELAXED)))
+    ) {
+        uint64_t current = __atomic_load_n(&options->generation, __ATOMIC_ACQUIRE);
+
+        // Options changed: resume reading if we were paused or limited
+        if (current != generation) {
+            generation = current;
+            error = zstd_proxy_uring_submit_recv(queue);
+
+            if (error != 0) {
+                goto cleanup;
+            }
+        }
 
-    // Event loop
-    while (!connection->options->stop && queue->running > 0) {
         // Wait for an event
-        error = io_uring_wait_cqe(uring, &cqe);
+        error = zstd_proxy_uring_wait(queue, &cqe);
 
         // Acknowledge it
-        io_uring_cqe_seen(uring, cqe);
+        if (error == 0) {
+            io_uring_cqe_seen(uring, cqe);
+        }
 
         if (error != 0) {
-            log_error("failed to wait for cqe: %s", strerror(errno));
+            error = -error;
+            log_error("failed to wait for cqe: %s", strerror(error));
 
             goto cleanup;
         }
@@ -509,6 +793,29 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
             continue;
         }
 
+        // Linked timeouts complete on their own, their request is the one that matters
+        if (io_uring_cqe_get_data(cqe) == &queue->link_timeout) {
+            continue;
+        }
+
+        // Options changed or stopping: re-arm and check them at the top of the loop
+        if (io_uring_cqe_get_data(cqe) == &queue->wakeup) {
+            if (cqe->res < 0) {
+                error = -cqe->res;
+                log_error("failed to read wakeup fd: %s", strerror(error));
+
+                goto cleanup;
+            }
+
+            error = zstd_proxy_uring_submit_wakeup(queue);
+
+            if (error != 0) {
+                goto cleanup;
+            }
+
+            continue;
+        }
+
         // Get associated buffer with the event
         zstd_proxy_uring_buffer *buffer = io_uring_cqe_get_data(cqe);
 
@@ -518,6 +825,8 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
         // Mark event as completed
         error = zstd_proxy_uring_complete(buffer);
 
+        zstd_proxy_metric_set(connection, queue_running, queue->running);
+
         if (error != 0) {
             goto cleanup;
         }
@@ -545,7 +854,15 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
 
         // Connection got closed
         if (recv_buffer->size == 0) {
-            break;
+            if (connection->end == NULL) {
+                break;
+            }
+
+            // Flush the end of a message the source never finished, then wait for the sends
+            if (!queue->ending) {
+                connection->end(connection->process_data);
+                queue->ending = true;
+            }
         }
 
         debug_assert(!recv_buffer->running);
@@ -553,6 +870,8 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
         // Process the recv buffer (pass to Zstd and enqueue send() calls)
         error = zstd_proxy_uring_process(recv_buffer);
 
+        zstd_proxy_metric_set(connection, queue_running, queue->running);
+
         if (error != 0) {
             goto cleanup;
         }
@@ -565,10 +884,12 @@ int zstd_proxy_uring_run(zstd_proxy_connection *connection) {
         }
     }
 
+    // In-flight requests, including the wakeup read, are cancelled by io_uring_queue_exit()
     log_debug("stopping, queue items running=%lu", queue->running);
     
     cleanup:
 
+    zstd_proxy_metric_set(connection, queue_running, 0);
     zstd_proxy_uring_destroy(queue);
 
     return error;
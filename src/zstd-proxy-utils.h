@@ -1,7 +1,21 @@
 #ifndef zstd_proxy_utils_H
 #define zstd_proxy_utils_H
 
+#include <time.h>
 #include <stdio.h>
+#include <stdint.h>
+
+#ifndef ENABLE_USDT
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define ENABLE_USDT 1
+#endif
+#endif
+#endif
+
+#if ENABLE_USDT
+#include <sys/sdt.h>
+#endif
 
 #define log_buffer(fmt, buffer, size, ...) \
     do { \
@@ -12,6 +26,33 @@
 
 #define log_error(fmt, ...) fprintf(stderr, "error: %s in " __FILE__ ": " fmt "\n", __func__, ##__VA_ARGS__)
 
+/**
+ * USDT probe under the `zstd_proxy` provider, a single `nop` when nothing is attached.
+ * List them with `bpftrace -l 'usdt:/path/to/zstd_proxy.node:*'`.
+ */
+#if ENABLE_USDT
+#define trace_probe(name, ...) STAP_PROBEV(zstd_proxy, name, ##__VA_ARGS__)
+#else
+#define trace_probe(name, ...)
+#endif
+
+static inline uint64_t zstd_proxy_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** Hint the CPU that we are spinning, frees resources for a sibling hyper-thread. */
+static inline void zstd_proxy_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
 #if DEBUG
 #define debug_assert(x) assert(x)
 #define log_debug(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
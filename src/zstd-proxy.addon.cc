@@ -1,5 +1,8 @@
 #include <nan.h>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include <signal.h>
 #include <stdio.h>
 #include <execinfo.h>
@@ -9,6 +12,11 @@
 extern "C" {
     #include "zstd-proxy.h"
     #include "zstd-proxy-utils.h"
+    #include "zstd-proxy-capture.h"
+    #include "zstd-proxy-arena.h"
+#if __linux__
+    #include "zstd-proxy-epoll.h"
+#endif
 }
 
 namespace zstdProxy {
@@ -21,12 +29,222 @@ namespace zstdProxy {
 
     struct thread_data {
         int error;
+        /** Owners on the main thread: the async handle and the JavaScript connection object. */
+        int refs;
         uv_async_t async;
         Nan::AsyncResource async_resource;
         Nan::Callback callback;
         zstd_proxy proxy;
+        /** Copy of the Zstd dictionary, the JavaScript buffer can change while connections start. */
+        std::string dictionary;
+
+        thread_data(): refs(2), async_resource("ZstdProxy") {}
+    };
+
+    static inline void Release(thread_data *data) {
+        if (--data->refs == 0) {
+            delete data;
+        }
+    }
+
+    /** JavaScript handle returned by `proxy()`, controls a running connection. */
+    class Connection : public node::ObjectWrap {
+        public:
+            /** Not a `Global`, its static destructor would reset it after the isolate is gone and crash on exit. */
+            static v8::Eternal<v8::Function> constructor;
+
+            thread_data *data;
 
-        thread_data(): async_resource("ZstdProxy") {}
+            using node::ObjectWrap::Wrap;
+
+            explicit Connection(thread_data *data): data(data) {}
+            ~Connection() { Release(data); }
+
+            static inline zstd_proxy *Unwrap(const FunctionCallbackInfo<Value> &args) {
+                return &node::ObjectWrap::Unwrap<Connection>(args.Holder())->data->proxy;
+            }
+
+            static void New(const FunctionCallbackInfo<Value> &) {}
+            static void Stats(const FunctionCallbackInfo<Value> &args);
+            static void SetLevel(const FunctionCallbackInfo<Value> &args);
+            static void Pause(const FunctionCallbackInfo<Value> &args);
+            static void Resume(const FunctionCallbackInfo<Value> &args);
+            static void SetBufferLimits(const FunctionCallbackInfo<Value> &args);
+            static void Close(const FunctionCallbackInfo<Value> &args);
+    };
+
+    v8::Eternal<v8::Function> Connection::constructor;
+
+    /** JavaScript handle returned by `stream()`, one direction of a proxy without sockets. */
+    class Stream : public node::ObjectWrap {
+        public:
+            static v8::Eternal<v8::Function> constructor;
+
+            zstd_proxy proxy;
+            zstd_proxy_stream *stream = nullptr;
+            std::string dictionary;
+            /** A `StreamWorker` is using the stream, `Close` leaves it to the worker to destroy. */
+            bool busy = false;
+            bool closed = false;
+
+            using node::ObjectWrap::Wrap;
+
+            ~Stream() { zstd_proxy_stream_destroy(stream); }
+
+            static void New(const FunctionCallbackInfo<Value> &) {}
+            static void Process(const FunctionCallbackInfo<Value> &args);
+            static void Close(const FunctionCallbackInfo<Value> &args);
+    };
+
+    v8::Eternal<v8::Function> Stream::constructor;
+
+    /**
+     * Runs a batch of chunks through a stream on the libuv thread pool.
+     *
+     * Chunks are read in place, kept alive by the persistent handle on their array, and the output buffers
+     * are handed over to JavaScript as external memory. Consecutive chunks are processed together up to
+     * `buffer_size`, the largest a socket proxy would receive at once, so each batch is a single flush.
+     */
+    class StreamWorker : public Nan::AsyncWorker {
+        public:
+            StreamWorker(Stream *stream, Local<Object> handle, Local<v8::Array> chunks, bool ended, Nan::Callback *callback):
+                Nan::AsyncWorker(callback, "ZstdProxyStream"), stream(stream), ended(ended) {
+                Local<Context> context = handle->GetIsolate()->GetCurrentContext();
+
+                SaveToPersistent("stream", handle);
+                SaveToPersistent("chunks", chunks);
+
+                for (uint32_t i = 0; i < chunks->Length(); i++) {
+                    auto chunk = chunks->Get(context, i).ToLocalChecked();
+
+                    if (node::Buffer::Length(chunk) > 0) {
+                        inputs.emplace_back(node::Buffer::Data(chunk), node::Buffer::Length(chunk));
+                    }
+                }
+            }
+
+            ~StreamWorker() {
+                for (auto &output : outputs) {
+                    free(output.first);
+                }
+            }
+
+            void Execute() override {
+                size_t buffer_size = stream->proxy.options.buffer_size;
+
+                for (size_t i = 0; i < inputs.size() && error == 0;) {
+                    size_t end = i + 1, size = inputs[i].second;
+
+                    while (end < inputs.size() && size + inputs[end].second <= buffer_size) {
+                        size += inputs[end++].second;
+                    }
+
+                    if (end - i == 1) {
+                        Process(inputs[i].first, size);
+                    } else {
+                        staging.clear();
+
+                        for (; i < end; i++) {
+                            staging.append(inputs[i].first, inputs[i].second);
+                        }
+
+                        Process(staging.data(), size);
+                    }
+
+                    i = end;
+                }
+
+                // The input ended, flush what the codec held back for a message it cut short
+                if (ended && error == 0) {
+                    zstd_proxy_stream_end(stream->stream);
+                    Process(nullptr, 0);
+                }
+            }
+
+            void HandleOKCallback() override {
+                Isolate *isolate = Isolate::GetCurrent();
+                Local<Context> context = isolate->GetCurrentContext();
+                auto buffers = v8::Array::New(isolate, outputs.size());
+
+                for (size_t i = 0; i < outputs.size(); i++) {
+                    auto buffer = Nan::NewBuffer(
+                        outputs[i].first,
+                        outputs[i].second,
+                        [](char *data, void *) { free(data); },
+                        nullptr
+                    ).ToLocalChecked();
+
+                    outputs[i].first = nullptr;
+                    buffers->Set(context, i, buffer).Check();
+                }
+
+                Local<Value> argv[] = {
+                    error == 0 ? Nan::Undefined().As<Value>() : v8::Number::New(isolate, error).As<Value>(),
+                    buffers,
+                };
+
+                stream->busy = false;
+
+                if (stream->closed) {
+                    zstd_proxy_stream_destroy(stream->stream);
+
+                    stream->stream = nullptr;
+                }
+
+                callback->Call(2, argv, async_resource);
+            }
+
+        private:
+            Stream *stream;
+            bool ended;
+            std::vector<std::pair<const char *, size_t>> inputs;
+            std::vector<std::pair<char *, size_t>> outputs;
+            /** Small chunks copied together, to flush them at once. */
+            std::string staging;
+            int error = 0;
+
+            /** Same loop as the socket backends: until the input is consumed and the output isn't full. */
+            void Process(const char *data, size_t size) {
+                size_t buffer_size = stream->proxy.options.buffer_size;
+                // Compressed data fits in its bound, decompressed data grows, sized so small chunks stay small
+                size_t capacity = std::min(
+                    buffer_size,
+                    std::max<size_t>(64 * 1024, stream->proxy.options.zstd.enabled ? ZSTD_compressBound(size) : size)
+                );
+                ZSTD_inBuffer input = { data, size, 0 };
+                // Only the end of the stream processes an empty input
+                bool flushing = size == 0;
+
+                while ((input.pos < input.size || flushing) && error == 0) {
+                    char *output_data = (char *)malloc(capacity);
+
+                    if (output_data == nullptr) {
+                        error = ENOMEM;
+
+                        break;
+                    }
+
+                    ZSTD_outBuffer output = { output_data, capacity, 0 };
+
+                    error = zstd_proxy_stream_process(stream->stream, &input, &output);
+                    flushing = output.pos == output.size;
+
+                    if (output.pos == 0) {
+                        free(output_data);
+
+                        continue;
+                    }
+
+                    // Give back the unused end of the buffer rather than keeping it alive in JavaScript
+                    if (output.pos < capacity / 2) {
+                        char *shrunk = (char *)realloc(output_data, output.pos);
+
+                        output_data = shrunk == nullptr ? output_data : shrunk;
+                    }
+
+                    outputs.emplace_back(output_data, output.pos);
+                }
+            }
     };
 
     void HandleAbortSignal(int sig) {
@@ -48,6 +266,19 @@ namespace zstdProxy {
         return nullptr;
     }
 
+#if __linux__
+    /** Shared by every connection using the epoll engine, created on first use. */
+    zstd_proxy_epoll *engine = nullptr;
+
+    void Done(zstd_proxy *, int error, void *data_ptr) {
+        auto data = (thread_data *)data_ptr;
+
+        data->error = error;
+
+        uv_async_send(&data->async);
+    }
+#endif
+
     static inline Local<Value> GetOption(Local<Context> context, Local<Object> options, const char *name) {
         return options->
             Get(context, v8::String::NewFromUtf8(context->GetIsolate(), name).ToLocalChecked()).
@@ -74,6 +305,364 @@ namespace zstdProxy {
         }
     }
 
+    static inline int64_t GetIntegerOption(Local<Context> context, Local<Object> options, const char *name, int64_t defaultValue) {
+        auto option = GetOption(context, options, name);
+
+        if (option->IsUndefined()) {
+            return defaultValue;
+        } else {
+            return option->NumberValue(context).ToChecked();
+        }
+    }
+
+    /** Read a Zstd level, `false` unless it's an integer within the levels of the library. */
+    static inline bool GetLevel(Local<Context> context, Local<Value> value, int *level) {
+        if (!value->IsNumber()) {
+            return false;
+        }
+
+        double number = value->NumberValue(context).ToChecked();
+
+        // Also rejects NaN, before it's converted
+        if (!(number >= ZSTD_minCLevel() && number <= ZSTD_maxCLevel()) || number != (int)number) {
+            return false;
+        }
+
+        *level = number;
+
+        return true;
+    }
+
+    /**
+     * Options shared by proxies and streams, `dictionary` keeps a copy of the Zstd dictionary.
+     * Returns `false` when the Zstd level is invalid.
+     */
+    static bool SetCodecOptions(
+        Local<Context> context,
+        Local<Object> options,
+        zstd_proxy_options *proxy_options,
+        std::string *dictionary
+    ) {
+        auto zstd = GetBoolOption(context, options, "zstd", true);
+        auto buffer_size = GetUnsignedOption(context, options, "buffer_size", 0);
+
+        proxy_options->zstd.enabled = zstd;
+
+        if (zstd) {
+            auto level = GetOption(context, options, "zstd_level");
+            auto zstd_dictionary = GetOption(context, options, "zstd_dictionary");
+
+            if (!level->IsUndefined() && !GetLevel(context, level, &proxy_options->zstd.level)) {
+                return false;
+            }
+
+            proxy_options->zstd.window_log = GetUnsignedOption(context, options, "zstd_window_log", 0);
+
+            if (node::Buffer::HasInstance(zstd_dictionary)) {
+                dictionary->assign(node::Buffer::Data(zstd_dictionary), node::Buffer::Length(zstd_dictionary));
+                proxy_options->zstd.dictionary = dictionary->data();
+                proxy_options->zstd.dictionary_size = dictionary->size();
+            }
+        }
+
+        auto codec = GetOption(context, options, "codec");
+
+        if (codec->IsString()) {
+            v8::String::Utf8Value name(context->GetIsolate(), codec);
+            auto preferred = zstd_proxy_codec_parse(*name);
+
+            // Names are checked by the TypeScript types, keep the default for anything else
+            if (preferred != zstd_proxy_codec_count) {
+                proxy_options->codec.preferred = preferred;
+            }
+        }
+
+        proxy_options->codec.negotiate = GetBoolOption(context, options, "codec_negotiate", true);
+        proxy_options->codec.lz4_level = GetUnsignedOption(context, options, "codec_lz4_level", 0);
+
+        auto framing = GetOption(context, options, "framing");
+
+        if (framing->IsString()) {
+            v8::String::Utf8Value name(context->GetIsolate(), framing);
+            auto protocol = zstd_proxy_framing_parse(*name);
+
+            if (protocol != zstd_proxy_framing_count) {
+                proxy_options->framing.protocol = protocol;
+            }
+        }
+
+        proxy_options->framing.length_offset = GetUnsignedOption(context, options, "framing_length_offset", 0);
+        proxy_options->framing.length_size = GetUnsignedOption(context, options, "framing_length_size", 4);
+        proxy_options->framing.length_adjust = GetIntegerOption(context, options, "framing_length_adjust", 0);
+        proxy_options->framing.length_little_endian = GetBoolOption(context, options, "framing_length_little_endian", false);
+        proxy_options->dedup.enabled = GetBoolOption(context, options, "dedup", false);
+        proxy_options->dedup.cache_size = GetUnsignedOption(
+            context, options, "dedup_cache_size", proxy_options->dedup.cache_size
+        );
+        proxy_options->dedup.sessions = GetUnsignedOption(
+            context, options, "dedup_sessions", proxy_options->dedup.sessions
+        );
+
+        if (buffer_size > 0) {
+            proxy_options->buffer_size = buffer_size;
+        }
+
+        return true;
+    }
+
+    static inline Local<v8::BigUint64Array> NewMetricsArray(Isolate *isolate, const zstd_proxy_metrics *metrics) {
+        auto buffer = v8::ArrayBuffer::New(isolate, sizeof(zstd_proxy_metrics));
+
+        zstd_proxy_metrics_snapshot(metrics, (zstd_proxy_metrics *)buffer->GetBackingStore()->Data());
+
+        return v8::BigUint64Array::New(buffer, 0, zstd_proxy_metrics_length);
+    }
+
+    static inline Local<v8::Array> NewMetricsLayout(Isolate *isolate, const zstd_proxy_metric_info *info, size_t count) {
+        Local<Context> context = isolate->GetCurrentContext();
+        auto layout = v8::Array::New(isolate, count);
+
+        for (size_t i = 0; i < count; i++) {
+            auto field = v8::Object::New(isolate);
+
+            field->Set(context, Nan::New("name").ToLocalChecked(), Nan::New(info[i].name).ToLocalChecked()).Check();
+            field->Set(context, Nan::New("help").ToLocalChecked(), Nan::New(info[i].help).ToLocalChecked()).Check();
+            field->Set(
+                context,
+                Nan::New("type").ToLocalChecked(),
+                Nan::New(info[i].type == zstd_proxy_metric_gauge ? "gauge" : "counter").ToLocalChecked()
+            ).Check();
+            layout->Set(context, i, field).Check();
+        }
+
+        return layout;
+    }
+
+    static inline Local<Object> NewHistogramObject(Isolate *isolate, const zstd_proxy_histogram *histogram) {
+        Local<Context> context = isolate->GetCurrentContext();
+        auto object = v8::Object::New(isolate);
+        auto count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        auto sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+        auto set = [&](const char *name, double value) {
+            object->Set(context, Nan::New(name).ToLocalChecked(), v8::Number::New(isolate, value)).Check();
+        };
+
+        set("count", count);
+        set("mean", count == 0 ? 0 : (double)sum / count);
+        set("p50", zstd_proxy_histogram_percentile(histogram, 0.5));
+        set("p99", zstd_proxy_histogram_percentile(histogram, 0.99));
+        set("p999", zstd_proxy_histogram_percentile(histogram, 0.999));
+
+        return object;
+    }
+
+    static inline Local<Object> NewLatencyObject(Isolate *isolate, const zstd_proxy_latency *latency) {
+        Local<Context> context = isolate->GetCurrentContext();
+        auto object = v8::Object::New(isolate);
+        const zstd_proxy_direction_latency *directions[] = { &latency->compress, &latency->decompress };
+        const char *names[] = { "compress", "decompress" };
+
+        for (size_t i = 0; i < 2; i++) {
+            auto direction = v8::Object::New(isolate);
+            auto histograms = (const zstd_proxy_histogram *)directions[i];
+
+            for (size_t j = 0; j < zstd_proxy_latency_count; j++) {
+                direction->Set(
+                    context,
+                    Nan::New(zstd_proxy_latency_names[j]).ToLocalChecked(),
+                    NewHistogramObject(isolate, &histograms[j])
+                ).Check();
+            }
+
+            object->Set(context, Nan::New(names[i]).ToLocalChecked(), direction).Check();
+        }
+
+        return object;
+    }
+
+    void Latency(const FunctionCallbackInfo<Value> &args) {
+        args.GetReturnValue().Set(NewLatencyObject(args.GetIsolate(), zstd_proxy_latency_global()));
+    }
+
+    void CaptureStart(const FunctionCallbackInfo<Value> &args) {
+        Isolate *isolate = args.GetIsolate();
+        Local<Context> context = isolate->GetCurrentContext();
+        v8::String::Utf8Value path(isolate, args[0]);
+        int error = zstd_proxy_capture_start(
+            *path,
+            args[1]->NumberValue(context).ToChecked(),
+            args[2]->Uint32Value(context).ToChecked()
+        );
+
+        if (error != 0) {
+            isolate->ThrowException(node::ErrnoException(isolate, error, "zstd_proxy_capture_start", nullptr, *path));
+        }
+    }
+
+    void CaptureStop(const FunctionCallbackInfo<Value> &) {
+        zstd_proxy_capture_stop();
+    }
+
+    void CaptureStats(const FunctionCallbackInfo<Value> &args) {
+        Isolate *isolate = args.GetIsolate();
+        Local<Context> context = isolate->GetCurrentContext();
+        zstd_proxy_capture_header header;
+
+        if (!zstd_proxy_capture_stats(&header)) {
+            return args.GetReturnValue().SetNull();
+        }
+
+        auto object = v8::Object::New(isolate);
+        auto set = [&](const char *name, double value) {
+            object->Set(context, Nan::New(name).ToLocalChecked(), v8::Number::New(isolate, value)).Check();
+        };
+
+        set("records", header.records);
+        set("bytes", header.bytes);
+        set("overwritten", header.overwritten);
+        set("dropped", header.dropped);
+        set("recordNs", header.record_ns);
+
+        args.GetReturnValue().Set(object);
+    }
+
+    void ArenaConfigure(const FunctionCallbackInfo<Value> &args) {
+        Local<Context> context = args.GetIsolate()->GetCurrentContext();
+        zstd_proxy_arena_options options;
+
+        options.cache_size = args[0]->NumberValue(context).ToChecked();
+        options.limit = args[1]->NumberValue(context).ToChecked();
+
+        zstd_proxy_arena_configure(&options);
+    }
+
+    void ArenaStats(const FunctionCallbackInfo<Value> &args) {
+        Isolate *isolate = args.GetIsolate();
+        Local<Context> context = isolate->GetCurrentContext();
+        zstd_proxy_arena_options options;
+        zstd_proxy_arena_stats stats;
+        auto object = v8::Object::New(isolate);
+        auto set = [&](const char *name, double value) {
+            object->Set(context, Nan::New(name).ToLocalChecked(), v8::Number::New(isolate, value)).Check();
+        };
+
+        zstd_proxy_arena_get_options(&options);
+        zstd_proxy_arena_get_stats(&stats);
+
+        set("cacheSize", options.cache_size);
+        set("limit", options.limit);
+        set("used", stats.used);
+        set("cached", stats.cached);
+        set("hits", stats.hits);
+        set("misses", stats.misses);
+        set("failures", stats.failures);
+
+        args.GetReturnValue().Set(object);
+    }
+
+    void ArenaTrim(const FunctionCallbackInfo<Value> &) {
+        zstd_proxy_arena_trim();
+    }
+
+    void Connection::Stats(const FunctionCallbackInfo<Value> &args) {
+        Isolate *isolate = args.GetIsolate();
+        Local<Context> context = isolate->GetCurrentContext();
+        zstd_proxy *proxy = Unwrap(args);
+        auto stats = v8::Object::New(isolate);
+
+        stats->Set(context, Nan::New("metrics").ToLocalChecked(), NewMetricsArray(isolate, &proxy->metrics)).Check();
+        stats->Set(context, Nan::New("latency").ToLocalChecked(), NewLatencyObject(isolate, &proxy->latency)).Check();
+
+        args.GetReturnValue().Set(stats);
+    }
+
+    void Connection::SetLevel(const FunctionCallbackInfo<Value> &args) {
+        int level = 0;
+
+        if (!GetLevel(args.GetIsolate()->GetCurrentContext(), args[0], &level)) {
+            return Nan::ThrowRangeError("invalid zstd level");
+        }
+
+        zstd_proxy_set_level(Unwrap(args), level);
+    }
+
+    void Connection::Pause(const FunctionCallbackInfo<Value> &args) {
+        zstd_proxy_pause(Unwrap(args), true);
+    }
+
+    void Connection::Resume(const FunctionCallbackInfo<Value> &args) {
+        zstd_proxy_pause(Unwrap(args), false);
+    }
+
+    void Connection::SetBufferLimits(const FunctionCallbackInfo<Value> &args) {
+        Local<Context> context = args.GetIsolate()->GetCurrentContext();
+
+        zstd_proxy_set_buffer_limits(
+            Unwrap(args),
+            args[0]->NumberValue(context).ToChecked(),
+            args[1]->NumberValue(context).ToChecked()
+        );
+    }
+
+    void Connection::Close(const FunctionCallbackInfo<Value> &args) {
+        zstd_proxy_stop(Unwrap(args));
+    }
+
+    void Stream::Process(const FunctionCallbackInfo<Value> &args) {
+        auto stream = node::ObjectWrap::Unwrap<Stream>(args.Holder());
+
+        if (stream->busy || stream->stream == nullptr) {
+            return Nan::ThrowError(stream->busy ? "stream is busy" : "stream is closed");
+        }
+
+        stream->busy = true;
+
+        Nan::AsyncQueueWorker(new StreamWorker(
+            stream,
+            args.Holder(),
+            args[0].As<v8::Array>(),
+            args[1]->BooleanValue(args.GetIsolate()),
+            new Nan::Callback(args[2].As<v8::Function>())
+        ));
+    }
+
+    void Stream::Close(const FunctionCallbackInfo<Value> &args) {
+        auto stream = node::ObjectWrap::Unwrap<Stream>(args.Holder());
+
+        stream->closed = true;
+
+        if (!stream->busy) {
+            zstd_proxy_stream_destroy(stream->stream);
+
+            stream->stream = nullptr;
+        }
+    }
+
+    void CreateStream(const FunctionCallbackInfo<Value> &args) {
+        Isolate *isolate = args.GetIsolate();
+        Local<Context> context = isolate->GetCurrentContext();
+        auto handle = Stream::constructor.Get(isolate)->NewInstance(context).ToLocalChecked();
+        auto stream = new Stream();
+
+        stream->Wrap(handle);
+
+        zstd_proxy_init(&stream->proxy);
+
+        auto options = args[1]->IsUndefined() ? v8::Object::New(isolate) : args[1]->ToObject(context).ToLocalChecked();
+
+        if (!SetCodecOptions(context, options, &stream->proxy.options, &stream->dictionary)) {
+            return Nan::ThrowRangeError("invalid zstd level");
+        }
+
+        int error = zstd_proxy_stream_create(&stream->stream, &stream->proxy, args[0]->BooleanValue(isolate));
+
+        if (error != 0) {
+            return Nan::ThrowError(("failed to create stream: error " + std::to_string(error)).c_str());
+        }
+
+        args.GetReturnValue().Set(handle);
+    }
+
 #if DEBUG
     bool registered = false;
 #endif
@@ -92,6 +681,10 @@ namespace zstdProxy {
         Local<Context> context = isolate->GetCurrentContext();
         auto *data = new thread_data();
         auto async = &data->async;
+        bool epoll = false;
+        bool epoll_steal = true;
+        unsigned epoll_workers = 0;
+        int64_t epoll_quantum = -1;
 
         zstd_proxy_init(&data->proxy);
 
@@ -111,23 +704,62 @@ namespace zstdProxy {
 
         if (!args[4]->IsUndefined()) {
             auto options = args[4]->ToObject(context).ToLocalChecked();
-            auto zstd = GetBoolOption(context, options, "zstd", true);
             auto io_uring = GetBoolOption(context, options, "io_uring", true);
-            auto buffer_size = GetUnsignedOption(context, options, "buffer_size", 0);
 
-            data->proxy.options.zstd.enabled = zstd;
-            data->proxy.options.io_uring.enabled = io_uring;
+            auto cpus = GetOption(context, options, "cpus");
+
+            epoll = GetBoolOption(context, options, "epoll", false);
+            epoll_workers = GetUnsignedOption(context, options, "epoll_workers", 0);
+            epoll_steal = GetBoolOption(context, options, "epoll_steal", true);
 
-            if (zstd) {
-                auto level = GetUnsignedOption(context, options, "zstd_level", 1);
-                
-                data->proxy.options.zstd.level = level;
+            if (!GetOption(context, options, "epoll_quantum")->IsUndefined()) {
+                epoll_quantum = GetUnsignedOption(context, options, "epoll_quantum", 0);
             }
 
-            if (buffer_size > 0) {
-                data->proxy.options.buffer_size = buffer_size;
+            data->proxy.options.weight = GetUnsignedOption(context, options, "epoll_weight", 1);
+
+            if (!cpus->IsUndefined()) {
+                v8::String::Utf8Value list(isolate, cpus);
+
+                if (zstd_proxy_cpu_set_parse(&data->proxy.options.affinity.cpus, *list) != 0) {
+                    delete data;
+
+                    return Nan::ThrowRangeError("invalid cpus option");
+                }
             }
 
+            data->proxy.options.affinity.incoming_cpu = GetBoolOption(context, options, "incoming_cpu", false);
+
+            data->proxy.options.busy_poll.spin_us = GetUnsignedOption(context, options, "busy_poll_spin", 0);
+            data->proxy.options.busy_poll.socket_us = GetUnsignedOption(context, options, "busy_poll_socket", 0);
+            data->proxy.options.busy_poll.prefer = GetBoolOption(context, options, "busy_poll_prefer", false);
+            data->proxy.options.busy_poll.coop_taskrun = GetBoolOption(context, options, "busy_poll_coop_taskrun", false);
+            data->proxy.options.busy_poll.defer_taskrun = GetBoolOption(context, options, "busy_poll_defer_taskrun", false);
+
+            data->proxy.options.socket.notsent_lowat = GetUnsignedOption(context, options, "socket_notsent_lowat", 0);
+            data->proxy.options.socket.send_buffer = GetUnsignedOption(context, options, "socket_send_buffer", 0);
+            data->proxy.options.socket.recv_buffer = GetUnsignedOption(context, options, "socket_recv_buffer", 0);
+            data->proxy.options.socket.nodelay = GetBoolOption(context, options, "socket_nodelay", false);
+            data->proxy.options.socket.cork = GetBoolOption(context, options, "socket_cork", false);
+
+            data->proxy.options.idle_timeout_ms = GetUnsignedOption(context, options, "idle_timeout", 0);
+            data->proxy.options.stall_timeout_ms = GetUnsignedOption(context, options, "stall_timeout", 0);
+
+            data->proxy.options.io_uring.enabled = io_uring;
+
+            if (!SetCodecOptions(context, options, &data->proxy.options, &data->dictionary)) {
+                delete data;
+
+                return Nan::ThrowRangeError("invalid zstd level");
+            }
+
+            data->proxy.options.posix.depth = GetUnsignedOption(
+                context, options, "posix_depth", data->proxy.options.posix.depth
+            );
+            data->proxy.options.posix.zero_copy_threshold = GetUnsignedOption(
+                context, options, "posix_zero_copy_threshold", data->proxy.options.posix.zero_copy_threshold
+            );
+
             if (io_uring) {
                 auto depth = GetUnsignedOption(context, options, "io_uring_depth", 0);
                 auto zero_copy = GetBoolOption(context, options, "io_uring_zero_copy", true);
@@ -148,21 +780,67 @@ namespace zstdProxy {
             Isolate *isolate = Isolate::GetCurrent();
             v8::HandleScope scope(isolate);
             auto data = (thread_data *)async->data;
+            auto reason = data->proxy.options.close_reason;
+            Local<Value> argv[] = {
+                data->error == 0 ? Nan::Undefined().As<Value>() : v8::Number::New(isolate, data->error).As<Value>(),
+                NewMetricsArray(isolate, &data->proxy.metrics),
+                NewLatencyObject(isolate, &data->proxy.latency),
+                reason == zstd_proxy_close_none
+                    ? Nan::Undefined().As<Value>()
+                    : Nan::New(zstd_proxy_close_reason_names[reason]).ToLocalChecked().As<Value>(),
+            };
+
+            data->callback.Call(4, argv, &data->async_resource);
+
+            uv_close((uv_handle_t *)async, [](uv_handle_t *handle) {
+                Release((thread_data *)handle->data);
+            });
+        });
+
+        auto connection = Connection::constructor.Get(isolate)->NewInstance(context).ToLocalChecked();
+
+        (new Connection(data))->Wrap(connection);
+        args.GetReturnValue().Set(connection);
+
+#if __linux__
+        if (epoll) {
+            int error = 0;
+
+            if (engine == nullptr) {
+                zstd_proxy_epoll_options engine_options;
+
+                zstd_proxy_epoll_default_options(&engine_options);
+
+                if (epoll_workers > 0) {
+                    engine_options.workers = epoll_workers;
+                }
 
-            if (data->error == 0) {
-                data->callback.Call(0, nullptr, &data->async_resource);
-            } else {
-                Local<Value> argv[] = { v8::Number::New(isolate, data->error) };
+                if (epoll_quantum >= 0) {
+                    engine_options.quantum = epoll_quantum;
+                }
+
+                engine_options.steal = epoll_steal;
 
-                data->callback.Call(1, argv, &data->async_resource);
+                // The engine is shared, so the first connection decides where its workers run
+                engine_options.cpus = data->proxy.options.affinity.cpus;
+                engine_options.incoming_cpu = data->proxy.options.affinity.incoming_cpu;
+
+                error = zstd_proxy_epoll_create(&engine, &engine_options);
             }
 
-            uv_close((uv_handle_t *)async, [](uv_handle_t *handle) {
-                auto data = (thread_data *)handle->data;
+            if (error == 0) {
+                error = zstd_proxy_start(&data->proxy, engine, Done, data);
+            }
 
-                delete data;
-            });
-        });
+            if (error != 0) {
+                data->error = error;
+
+                uv_async_send(async);
+            }
+
+            return;
+        }
+#endif
 
         pthread_t thread_id = 0;
 
@@ -176,7 +854,69 @@ namespace zstdProxy {
     }
 
     void Initialize(Local<Object> exports, v8::Local<v8::Value>, void *) {
+        Isolate *isolate = exports->GetIsolate();
+        Local<Context> context = isolate->GetCurrentContext();
+        auto layout = v8::Object::New(isolate);
+
+        // Share the global counters with JavaScript to avoid a call per read
+        auto store = v8::ArrayBuffer::NewBackingStore(
+            zstd_proxy_metrics_global(),
+            sizeof(zstd_proxy_metrics),
+            [](void *, size_t, void *) {},
+            nullptr
+        );
+        auto metrics = v8::BigUint64Array::New(
+            v8::ArrayBuffer::New(isolate, std::move(store)),
+            0,
+            zstd_proxy_metrics_length
+        );
+
+        layout->Set(
+            context,
+            Nan::New("connection").ToLocalChecked(),
+            NewMetricsLayout(isolate, zstd_proxy_connection_metrics_info, zstd_proxy_connection_metrics_count)
+        ).Check();
+        layout->Set(
+            context,
+            Nan::New("direction").ToLocalChecked(),
+            NewMetricsLayout(isolate, zstd_proxy_direction_metrics_info, zstd_proxy_direction_metrics_count)
+        ).Check();
+
+        auto connection = v8::FunctionTemplate::New(isolate, Connection::New);
+
+        connection->SetClassName(Nan::New("ZstdProxyConnection").ToLocalChecked());
+        connection->InstanceTemplate()->SetInternalFieldCount(1);
+
+        NODE_SET_PROTOTYPE_METHOD(connection, "stats", Connection::Stats);
+        NODE_SET_PROTOTYPE_METHOD(connection, "setLevel", Connection::SetLevel);
+        NODE_SET_PROTOTYPE_METHOD(connection, "pause", Connection::Pause);
+        NODE_SET_PROTOTYPE_METHOD(connection, "resume", Connection::Resume);
+        NODE_SET_PROTOTYPE_METHOD(connection, "setBufferLimits", Connection::SetBufferLimits);
+        NODE_SET_PROTOTYPE_METHOD(connection, "close", Connection::Close);
+
+        Connection::constructor.Set(isolate, connection->GetFunction(context).ToLocalChecked());
+
+        auto stream = v8::FunctionTemplate::New(isolate, Stream::New);
+
+        stream->SetClassName(Nan::New("ZstdProxyStream").ToLocalChecked());
+        stream->InstanceTemplate()->SetInternalFieldCount(1);
+
+        NODE_SET_PROTOTYPE_METHOD(stream, "process", Stream::Process);
+        NODE_SET_PROTOTYPE_METHOD(stream, "close", Stream::Close);
+
+        Stream::constructor.Set(isolate, stream->GetFunction(context).ToLocalChecked());
+
         NODE_SET_METHOD(exports, "proxy", Proxy);
+        NODE_SET_METHOD(exports, "stream", CreateStream);
+        NODE_SET_METHOD(exports, "latency", Latency);
+        NODE_SET_METHOD(exports, "captureStart", CaptureStart);
+        NODE_SET_METHOD(exports, "captureStop", CaptureStop);
+        NODE_SET_METHOD(exports, "captureStats", CaptureStats);
+        NODE_SET_METHOD(exports, "arenaConfigure", ArenaConfigure);
+        NODE_SET_METHOD(exports, "arenaStats", ArenaStats);
+        NODE_SET_METHOD(exports, "arenaTrim", ArenaTrim);
+        exports->Set(context, Nan::New("metrics").ToLocalChecked(), metrics).Check();
+        exports->Set(context, Nan::New("metricsLayout").ToLocalChecked(), layout).Check();
     }
 
     NODE_MODULE(NODE_GYP_MODULE_NAME, Initialize)
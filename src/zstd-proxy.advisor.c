@@ -0,0 +1,607 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <zdict.h>
+
+#include "zstd-proxy-bench.h"
+#include "zstd-proxy-utils.h"
+#include "zstd-proxy-capture.h"
+
+/**
+ * Offline tuning advisor.
+ *
+ * Replays a capture file through `zstd_proxy_stream`, the process callbacks of the proxy, for every
+ * combination of the options, one combination per core at a time. Each connection and direction of the
+ * capture is replayed as a stream of its chunks, in the order the proxy received them, and decompressed
+ * back to check it. Results are printed as JSON.
+ *
+ * The flush delay simulates a proxy waiting up to that long for more data before flushing: chunks arriving
+ * within the delay are processed by a single call, which ends with a flush. The flush latency of a chunk
+ * is the time it waited for its flush in the capture timeline, plus the time spent compressing.
+ */
+
+typedef struct {
+    uint64_t connection;
+    uint32_t direction;
+    uint64_t timestamp_ns;
+    /** Offset in `zstd_proxy_advisor_capture.data`, chunks of a stream are contiguous. */
+    size_t offset;
+    size_t length;
+    /** Position in the capture, keeps chunks ordered when sorting by stream. */
+    size_t index;
+} zstd_proxy_advisor_chunk;
+
+typedef struct {
+    zstd_proxy_advisor_chunk *chunks;
+    size_t count;
+    size_t capacity;
+    char *data;
+    size_t size;
+} zstd_proxy_advisor_capture;
+
+typedef struct {
+    const char *name;
+    void *data;
+    size_t size;
+} zstd_proxy_advisor_dictionary;
+
+typedef struct {
+    size_t level;
+    size_t window_log;
+    const zstd_proxy_advisor_dictionary *dictionary;
+    size_t buffer_size;
+    size_t flush_delay_us;
+
+    int error;
+    size_t bytes;
+    size_t compressed;
+    double compress_seconds;
+    double decompress_seconds;
+    zstd_proxy_histogram *flush_latency;
+} zstd_proxy_advisor_run;
+
+typedef struct {
+    const zstd_proxy_advisor_capture *capture;
+    zstd_proxy_advisor_run *runs;
+    size_t count;
+    /** Next run to pick, shared by the worker threads. */
+    size_t next;
+} zstd_proxy_advisor_queue;
+
+static inline double zstd_proxy_advisor_thread_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int zstd_proxy_advisor_append(const zstd_proxy_capture_record *record, const void *payload, void *data) {
+    zstd_proxy_advisor_capture *capture = data;
+
+    if (capture->count == capture->capacity) {
+        size_t capacity = capture->capacity == 0 ? 1024 : capture->capacity * 2;
+        zstd_proxy_advisor_chunk *chunks = realloc(capture->chunks, capacity * sizeof(zstd_proxy_advisor_chunk));
+
+        if (chunks == NULL) {
+            return ENOMEM;
+        }
+
+        capture->chunks = chunks;
+        capture->capacity = capacity;
+    }
+
+    char *grown = realloc(capture->data, capture->size + record->length);
+
+    if (grown == NULL) {
+        return ENOMEM;
+    }
+
+    memcpy(&grown[capture->size], payload, record->length);
+
+    capture->chunks[capture->count] = (zstd_proxy_advisor_chunk){
+        .connection = record->connection,
+        .direction = record->direction,
+        .timestamp_ns = record->timestamp_ns,
+        .offset = capture->size,
+        .length = record->length,
+        .index = capture->count,
+    };
+    capture->count++;
+    capture->data = grown;
+    capture->size += record->length;
+
+    return 0;
+}
+
+static int zstd_proxy_advisor_compare(const void *a_ptr, const void *b_ptr) {
+    const zstd_proxy_advisor_chunk *a = a_ptr, *b = b_ptr;
+
+    if (a->connection != b->connection) {
+        return a->connection < b->connection ? -1 : 1;
+    }
+
+    if (a->direction != b->direction) {
+        return a->direction < b->direction ? -1 : 1;
+    }
+
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/** Load a capture and lay its chunks out stream by stream. */
+static int zstd_proxy_advisor_load(zstd_proxy_advisor_capture *capture, const char *path) {
+    int error = zstd_proxy_capture_read(path, zstd_proxy_advisor_append, capture);
+
+    if (error != 0) {
+        return error;
+    }
+
+    if (capture->count == 0) {
+        log_error("capture %s is empty", path);
+
+        return EINVAL;
+    }
+
+    qsort(capture->chunks, capture->count, sizeof(zstd_proxy_advisor_chunk), zstd_proxy_advisor_compare);
+
+    char *data = malloc(capture->size);
+    size_t offset = 0;
+
+    if (data == NULL) {
+        return ENOMEM;
+    }
+
+    for (size_t i = 0; i < capture->count; i++) {
+        zstd_proxy_advisor_chunk *chunk = &capture->chunks[i];
+
+        memcpy(&data[offset], &capture->data[chunk->offset], chunk->length);
+
+        chunk->offset = offset;
+        offset += chunk->length;
+    }
+
+    free(capture->data);
+    capture->data = data;
+
+    return 0;
+}
+
+/** `train:<size>` trains a dictionary on the capture, `file:<path>` loads one. */
+static int zstd_proxy_advisor_dictionary_load(
+    zstd_proxy_advisor_dictionary *dictionary,
+    const char *spec,
+    const zstd_proxy_advisor_capture *capture
+) {
+    dictionary->name = spec;
+    dictionary->data = NULL;
+    dictionary->size = 0;
+
+    if (strcmp(spec, "none") == 0) {
+        return 0;
+    }
+
+    if (strncmp(spec, "file:", 5) == 0) {
+        zstd_proxy_bench_corpus corpus;
+        int error = zstd_proxy_bench_corpus_load(&corpus, spec, 1, 0);
+
+        dictionary->data = corpus.data;
+        dictionary->size = corpus.size;
+
+        return error;
+    }
+
+    size_t size;
+
+    if (strncmp(spec, "train:", 6) != 0 || zstd_proxy_bench_parse_list(&spec[6], &size) != 1 || size == 0) {
+        log_error("unknown dictionary %s", spec);
+
+        return EINVAL;
+    }
+
+    size_t *sizes = malloc(capture->count * sizeof(size_t));
+
+    dictionary->data = malloc(size);
+
+    if (sizes == NULL || dictionary->data == NULL) {
+        free(sizes);
+
+        return ENOMEM;
+    }
+
+    for (size_t i = 0; i < capture->count; i++) {
+        sizes[i] = capture->chunks[i].length;
+    }
+
+    size_t trained = ZDICT_trainFromBuffer(dictionary->data, size, capture->data, sizes, capture->count);
+
+    free(sizes);
+
+    if (ZDICT_isError(trained)) {
+        log_error("failed to train dictionary: %s", ZDICT_getErrorName(trained));
+
+        return EINVAL;
+    }
+
+    dictionary->size = trained;
+
+    return 0;
+}
+
+/** Decompress `input` and check it against the plaintext at `*expected`. */
+static int zstd_proxy_advisor_decompress(
+    zstd_proxy_stream *stream,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    const char **expected,
+    const char *end
+) {
+    bool flushing = false;
+
+    while (input->pos < input->size || flushing) {
+        output->pos = 0;
+
+        int error = zstd_proxy_stream_process(stream, input, output);
+
+        if (error != 0) {
+            return error;
+        }
+
+        if (output->pos > (size_t)(end - *expected) || memcmp(output->dst, *expected, output->pos) != 0) {
+            log_error("decompressed data doesn't match the capture");
+
+            return EPROTO;
+        }
+
+        *expected += output->pos;
+        flushing = output->pos == output->size;
+    }
+
+    return 0;
+}
+
+/** Replay the chunks `[start, end)` of a single stream. */
+static int zstd_proxy_advisor_replay(
+    zstd_proxy_advisor_run *run,
+    const zstd_proxy_advisor_capture *capture,
+    size_t start,
+    size_t end,
+    char *compressed,
+    char *decompressed
+) {
+    zstd_proxy proxy;
+    zstd_proxy_stream *compress = NULL, *decompress = NULL;
+    uint64_t delay = run->flush_delay_us * 1000;
+    const char *expected = &capture->data[capture->chunks[start].offset];
+    const char *expected_end = &capture->data[capture->chunks[end - 1].offset + capture->chunks[end - 1].length];
+
+    zstd_proxy_init(&proxy);
+
+    proxy.options.buffer_size = run->buffer_size;
+    proxy.options.zstd.level = run->level;
+    proxy.options.zstd.window_log = run->window_log;
+    proxy.options.zstd.dictionary = run->dictionary->data;
+    proxy.options.zstd.dictionary_size = run->dictionary->size;
+
+    int error = zstd_proxy_stream_create(&compress, &proxy, false);
+
+    if (error == 0) {
+        error = zstd_proxy_stream_create(&decompress, &proxy, true);
+    }
+
+    for (size_t i = start; i < end && error == 0;) {
+        const zstd_proxy_advisor_chunk *first = &capture->chunks[i];
+        size_t last = i, size = first->length;
+        bool full = size >= run->buffer_size;
+
+        // Coalesce the chunks arriving within the delay, as long as they fit in a buffer
+        while (
+            !full &&
+            last + 1 < end &&
+            capture->chunks[last + 1].timestamp_ns - first->timestamp_ns <= delay
+        ) {
+            if (size + capture->chunks[last + 1].length > run->buffer_size) {
+                full = true;
+
+                break;
+            }
+
+            size += capture->chunks[++last].length;
+        }
+
+        // Flushed when the buffer fills up, otherwise once the delay expired
+        uint64_t flushed_at = full ? capture->chunks[last].timestamp_ns : first->timestamp_ns + delay;
+
+        for (size_t offset = 0; offset < size && error == 0;) {
+            // Larger chunks are received in several buffers
+            ZSTD_inBuffer input = {
+                &capture->data[first->offset + offset],
+                size - offset < run->buffer_size ? size - offset : run->buffer_size,
+                0,
+            };
+            bool flushing = false;
+            double seconds = 0;
+
+            while ((input.pos < input.size || flushing) && error == 0) {
+                ZSTD_outBuffer output = { compressed, run->buffer_size, 0 };
+                double cpu = zstd_proxy_advisor_thread_seconds();
+
+                error = zstd_proxy_stream_process(compress, &input, &output);
+                seconds += zstd_proxy_advisor_thread_seconds() - cpu;
+                flushing = output.pos == output.size;
+                run->compressed += output.pos;
+
+                ZSTD_inBuffer records = { compressed, output.pos, 0 };
+                ZSTD_outBuffer plaintext = { decompressed, run->buffer_size, 0 };
+
+                cpu = zstd_proxy_advisor_thread_seconds();
+
+                if (error == 0) {
+                    error = zstd_proxy_advisor_decompress(decompress, &records, &plaintext, &expected, expected_end);
+                }
+
+                run->decompress_seconds += zstd_proxy_advisor_thread_seconds() - cpu;
+            }
+
+            offset += input.size;
+            run->compress_seconds += seconds;
+
+            if (offset == size) {
+                for (size_t j = i; j <= last; j++) {
+                    uint64_t waited = flushed_at - capture->chunks[j].timestamp_ns;
+
+                    zstd_proxy_histogram_record(run->flush_latency, waited + seconds * 1e9);
+                }
+            }
+        }
+
+        run->bytes += size;
+        i = last + 1;
+    }
+
+    if (error == 0 && expected != expected_end) {
+        log_error("decompressed stream is truncated");
+
+        error = EPROTO;
+    }
+
+    zstd_proxy_stream_destroy(compress);
+    zstd_proxy_stream_destroy(decompress);
+
+    return error;
+}
+
+static void zstd_proxy_advisor_execute(zstd_proxy_advisor_run *run, const zstd_proxy_advisor_capture *capture) {
+    char *compressed = malloc(run->buffer_size);
+    char *decompressed = malloc(run->buffer_size);
+
+    run->flush_latency = calloc(1, sizeof(zstd_proxy_histogram));
+
+    if (compressed == NULL || decompressed == NULL || run->flush_latency == NULL) {
+        run->error = ENOMEM;
+    }
+
+    for (size_t start = 0, end = 0; start < capture->count && run->error == 0; start = end) {
+        const zstd_proxy_advisor_chunk *first = &capture->chunks[start];
+
+        for (end = start + 1; end < capture->count; end++) {
+            const zstd_proxy_advisor_chunk *chunk = &capture->chunks[end];
+
+            if (chunk->connection != first->connection || chunk->direction != first->direction) {
+                break;
+            }
+        }
+
+        run->error = zstd_proxy_advisor_replay(run, capture, start, end, compressed, decompressed);
+    }
+
+    free(compressed);
+    free(decompressed);
+}
+
+static void *zstd_proxy_advisor_worker(void *data) {
+    zstd_proxy_advisor_queue *queue = data;
+    size_t index;
+
+    while ((index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count) {
+        zstd_proxy_advisor_execute(&queue->runs[index], queue->capture);
+    }
+
+    return NULL;
+}
+
+static void zstd_proxy_advisor_print(const zstd_proxy_advisor_run *run, bool first) {
+    double gb = run->bytes / 1e9;
+
+    printf(
+        "%s  {\"level\": %zu, \"window_log\": %zu, \"dictionary\": \"%s\", \"dictionary_size\": %zu, "
+        "\"buffer_size\": %zu, \"flush_delay_us\": %zu, \"error\": %d, \"bytes\": %zu, \"compressed\": %zu, "
+        "\"ratio\": %.3f, \"compress_cpu_seconds_per_gb\": %.3f, \"decompress_cpu_seconds_per_gb\": %.3f, "
+        "\"flush_latency_us\": ",
+        first ? "" : ",\n",
+        run->level,
+        run->window_log,
+        run->dictionary->name,
+        run->dictionary->size,
+        run->buffer_size,
+        run->flush_delay_us,
+        run->error,
+        run->bytes,
+        run->compressed,
+        run->compressed > 0 ? (double)run->bytes / run->compressed : 1,
+        gb > 0 ? run->compress_seconds / gb : 0,
+        gb > 0 ? run->decompress_seconds / gb : 0
+    );
+    zstd_proxy_bench_print_histogram(run->flush_latency);
+    printf("}");
+}
+
+static void zstd_proxy_advisor_usage(const char *name) {
+    fprintf(
+        stderr,
+        "usage: %s --capture=PATH [options], list options accept comma-separated values and run every combination\n"
+        "  --capture=PATH          capture file recorded with a sample of 1, see zstdProxyCapture\n"
+        "  --level=LIST            Zstd level (default: 1,3,6)\n"
+        "  --window-log=LIST       Zstd window log, 0 for the default of the level (default: 0)\n"
+        "  --dictionary=LIST       none, train:<size> (trained on the capture) or file:<path> (default: none)\n"
+        "  --dictionary-out=PATH   write the first trained dictionary there, to pass it to the proxies\n"
+        "  --buffer-size=LIST      proxy buffer size, accepts k/m/g suffixes (default: 64k,1m,4m)\n"
+        "  --flush-delay=LIST      microseconds to wait for more data before flushing (default: 0)\n"
+        "  --threads=N             runs in parallel (default: one per CPU)\n",
+        name
+    );
+}
+
+int main(int argc, char **argv) {
+    char dictionary_names[] = "none";
+    const char *capture_path = NULL, *dictionary_out = NULL;
+    const char *dictionary_specs[zstd_proxy_bench_max_values];
+    size_t levels[zstd_proxy_bench_max_values] = { 1, 3, 6 };
+    size_t window_logs[zstd_proxy_bench_max_values] = { 0 };
+    size_t buffer_sizes[zstd_proxy_bench_max_values] = { 64 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+    size_t flush_delays[zstd_proxy_bench_max_values] = { 0 };
+    int dictionary_count = zstd_proxy_bench_parse_names(dictionary_names, dictionary_specs);
+    int level_count = 3, window_log_count = 1, buffer_size_count = 3, flush_delay_count = 1;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        char *value = strchr(arg, '=');
+        bool valid = value != NULL && strncmp(arg, "--", 2) == 0;
+
+        if (valid) {
+            *value++ = '\0';
+            arg += 2;
+
+            if (strcmp(arg, "capture") == 0) {
+                capture_path = value;
+            } else if (strcmp(arg, "level") == 0) {
+                valid = (level_count = zstd_proxy_bench_parse_list(value, levels)) > 0;
+            } else if (strcmp(arg, "window-log") == 0) {
+                valid = (window_log_count = zstd_proxy_bench_parse_list(value, window_logs)) > 0;
+            } else if (strcmp(arg, "dictionary") == 0) {
+                valid = (dictionary_count = zstd_proxy_bench_parse_names(value, dictionary_specs)) > 0;
+            } else if (strcmp(arg, "dictionary-out") == 0) {
+                dictionary_out = value;
+            } else if (strcmp(arg, "buffer-size") == 0) {
+                valid = (buffer_size_count = zstd_proxy_bench_parse_list(value, buffer_sizes)) > 0;
+            } else if (strcmp(arg, "flush-delay") == 0) {
+                valid = (flush_delay_count = zstd_proxy_bench_parse_list(value, flush_delays)) > 0;
+            } else if (strcmp(arg, "threads") == 0) {
+                threads = strtol(value, NULL, 10);
+                valid = threads > 0;
+            } else {
+                valid = false;
+            }
+        }
+
+        if (!valid) {
+            zstd_proxy_advisor_usage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < buffer_size_count; i++) {
+        if (buffer_sizes[i] == 0) {
+            zstd_proxy_advisor_usage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    if (capture_path == NULL) {
+        zstd_proxy_advisor_usage(argv[0]);
+
+        return 1;
+    }
+
+    zstd_proxy_advisor_capture capture = { NULL, 0, 0, NULL, 0 };
+    zstd_proxy_advisor_dictionary dictionaries[zstd_proxy_bench_max_values];
+
+    if (zstd_proxy_advisor_load(&capture, capture_path) != 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < dictionary_count; i++) {
+        if (zstd_proxy_advisor_dictionary_load(&dictionaries[i], dictionary_specs[i], &capture) != 0) {
+            return 1;
+        }
+
+        if (dictionary_out != NULL && strncmp(dictionary_specs[i], "train:", 6) == 0) {
+            FILE *file = fopen(dictionary_out, "wb");
+
+            if (file == NULL || fwrite(dictionaries[i].data, 1, dictionaries[i].size, file) != dictionaries[i].size) {
+                log_error("failed to write dictionary to %s", dictionary_out);
+
+                return 1;
+            }
+
+            fclose(file);
+
+            dictionary_out = NULL;
+        }
+    }
+
+    zstd_proxy_advisor_queue queue = {
+        .capture = &capture,
+        .runs = calloc(level_count * window_log_count * dictionary_count * buffer_size_count * flush_delay_count, sizeof(zstd_proxy_advisor_run)),
+        .count = 0,
+        .next = 0,
+    };
+
+    if (queue.runs == NULL) {
+        return 1;
+    }
+
+    for (int l = 0; l < level_count; l++)
+    for (int w = 0; w < window_log_count; w++)
+    for (int d = 0; d < dictionary_count; d++)
+    for (int s = 0; s < buffer_size_count; s++)
+    for (int f = 0; f < flush_delay_count; f++) {
+        queue.runs[queue.count++] = (zstd_proxy_advisor_run){
+            .level = levels[l],
+            .window_log = window_logs[w],
+            .dictionary = &dictionaries[d],
+            .buffer_size = buffer_sizes[s],
+            .flush_delay_us = flush_delays[f],
+        };
+    }
+
+    pthread_t workers[threads];
+    long started = 0;
+
+    for (; started < threads && started < (long)queue.count; started++) {
+        if (pthread_create(&workers[started], NULL, zstd_proxy_advisor_worker, &queue) != 0) {
+            break;
+        }
+    }
+
+    // Without any thread, run everything here
+    if (started == 0) {
+        zstd_proxy_advisor_worker(&queue);
+    }
+
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    int error = 0;
+
+    printf("[\n");
+
+    for (size_t i = 0; i < queue.count; i++) {
+        zstd_proxy_advisor_print(&queue.runs[i], i == 0);
+
+        if (queue.runs[i].error != 0) {
+            error = queue.runs[i].error;
+        }
+    }
+
+    printf("\n]\n");
+
+    return error == 0 ? 0 : 1;
+}
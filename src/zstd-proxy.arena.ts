@@ -0,0 +1,46 @@
+import {
+  arenaConfigure,
+  arenaStats,
+  arenaTrim,
+} from "../native/build/Release/zstd_proxy.node";
+
+export interface ZstdProxyArenaOptions {
+  /** Bytes of freed Zstd memory kept for the next connections. Defaults to 64 MB. */
+  cacheSize?: number;
+  /** Bytes of Zstd memory all connections may use, connections fail beyond it. `0` for no limit, the default. */
+  limit?: number;
+}
+
+export interface ZstdProxyArenaStats {
+  cacheSize: number;
+  limit: number;
+  /** Bytes allocated by the Zstd contexts of every connection. */
+  used: number;
+  /** Bytes of freed memory cached for reuse. */
+  cached: number;
+  /** Allocations served from the cache. */
+  hits: number;
+  /** Allocations which mapped new memory. */
+  misses: number;
+  /** Allocations refused by the limit. */
+  failures: number;
+}
+
+/**
+ * Configure the process-wide allocator of the Zstd contexts, see `zstd-proxy-arena.h`.
+ * Options left out keep their current value. Returns the counters after the change.
+ */
+export function zstdProxyArena(options: ZstdProxyArenaOptions = {}): ZstdProxyArenaStats {
+  const current: ZstdProxyArenaStats = arenaStats();
+
+  if (options.cacheSize !== undefined || options.limit !== undefined) {
+    arenaConfigure(options.cacheSize ?? current.cacheSize, options.limit ?? current.limit);
+  }
+
+  return arenaStats();
+}
+
+/** Release the cached memory back to the system, eg. after a burst of connections. */
+export function zstdProxyArenaTrim(): void {
+  arenaTrim();
+}
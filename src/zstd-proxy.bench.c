@@ -0,0 +1,467 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "zstd-proxy-bench.h"
+#include "zstd-proxy-utils.h"
+#include "zstd-proxy-capture.h"
+
+/**
+ * Throughput and latency benchmark.
+ *
+ * Every connection runs writer -> compress proxy -> decompress proxy -> reader over
+ * UNIX or loopback TCP sockets. The writer stamps each message with its send time
+ * so the reader can measure the end-to-end latency. Results are printed as JSON.
+ */
+
+typedef struct {
+    const char *transport;
+    const char *backend;
+    const zstd_proxy_bench_corpus *corpus;
+    size_t message_size;
+    size_t connections;
+    size_t rate;
+    double duration;
+    /** Capture one chunk out of this many to `capture_path` during the run, 0 to disable. */
+    size_t capture_sample;
+    const char *capture_path;
+    zstd_proxy_options options;
+} zstd_proxy_bench_run;
+
+typedef struct {
+    zstd_proxy_bench_run *run;
+    zstd_proxy_bench_pipeline pipeline;
+    pthread_t writer;
+    pthread_t reader;
+    int error;
+    size_t bytes;
+    zstd_proxy_histogram latency;
+} zstd_proxy_bench_connection;
+
+static void *zstd_proxy_bench_writer(void *data) {
+    zstd_proxy_bench_connection *connection = data;
+    zstd_proxy_bench_run *run = connection->run;
+    const zstd_proxy_bench_corpus *corpus = run->corpus;
+    size_t size = run->message_size;
+    char *message = malloc(size);
+    size_t offset = 0;
+    uint64_t start = zstd_proxy_now_ns();
+    uint64_t deadline = start + run->duration * 1e9;
+    uint64_t interval = run->rate > 0 ? 1000000000 / run->rate : 0;
+    int fd = connection->pipeline.client_fd;
+
+    for (uint64_t sent = 0; message != NULL; sent++) {
+        // Use the intended send time when rate limited to avoid coordinated omission
+        uint64_t now = zstd_proxy_now_ns();
+        uint64_t scheduled = interval > 0 ? start + sent * interval : now;
+
+        if (scheduled >= deadline || now >= deadline) {
+            break;
+        }
+
+        while (now < scheduled) {
+            usleep((scheduled - now) / 1000);
+            now = zstd_proxy_now_ns();
+        }
+
+        for (size_t filled = 0; filled < size;) {
+            size_t copy = corpus->size - offset < size - filled ? corpus->size - offset : size - filled;
+
+            memcpy(&message[filled], &corpus->data[offset], copy);
+            filled += copy;
+            offset = (offset + copy) % corpus->size;
+        }
+
+        if (size >= sizeof(uint64_t)) {
+            memcpy(message, &scheduled, sizeof(uint64_t));
+        }
+
+        int error = zstd_proxy_bench_write(fd, message, size);
+
+        if (error != 0) {
+            log_error("failed to write message: %s", strerror(error));
+
+            connection->error = error;
+
+            break;
+        }
+    }
+
+    shutdown(fd, SHUT_WR);
+    free(message);
+
+    return NULL;
+}
+
+static void *zstd_proxy_bench_reader(void *data) {
+    zstd_proxy_bench_connection *connection = data;
+    size_t size = connection->run->message_size;
+    size_t chunk_size = size > 256 * 1024 ? size : 256 * 1024;
+    char *chunk = malloc(chunk_size);
+    char header[sizeof(uint64_t)];
+    size_t position = 0;
+    int fd = connection->pipeline.server_fd;
+
+    while (chunk != NULL) {
+        ssize_t received = read(fd, chunk, chunk_size);
+
+        if (received <= 0) {
+            if (received < 0) {
+                connection->error = errno;
+            }
+
+            break;
+        }
+
+        uint64_t now = zstd_proxy_now_ns();
+
+        connection->bytes += received;
+
+        // Walk message boundaries to pick up the timestamps
+        for (size_t offset = 0; offset < (size_t)received;) {
+            size_t take = size - position < received - offset ? size - position : received - offset;
+
+            if (position < sizeof(header)) {
+                size_t copy = sizeof(header) - position < take ? sizeof(header) - position : take;
+
+                memcpy(&header[position], &chunk[offset], copy);
+
+                if (position + copy == sizeof(header) && size >= sizeof(header)) {
+                    uint64_t sent_at;
+
+                    memcpy(&sent_at, header, sizeof(sent_at));
+                    zstd_proxy_histogram_record(&connection->latency, now > sent_at ? now - sent_at : 0);
+                }
+            }
+
+            offset += take;
+            position = (position + take) % size;
+        }
+    }
+
+    free(chunk);
+
+    return NULL;
+}
+
+static int zstd_proxy_bench_execute(zstd_proxy_bench_run *run, bool *first) {
+    int error = 0;
+    zstd_proxy_bench_connection *connections = calloc(run->connections, sizeof(zstd_proxy_bench_connection));
+    zstd_proxy_histogram *latency = calloc(1, sizeof(zstd_proxy_histogram));
+    size_t started = 0;
+    bool proxied = strcmp(run->backend, "none") != 0;
+    zstd_proxy_epoll *engine = NULL;
+
+    if (connections == NULL || latency == NULL) {
+        free(connections);
+        free(latency);
+
+        return ENOMEM;
+    }
+
+    run->options.io_uring.enabled = strcmp(run->backend, "uring") == 0;
+
+    if (strcmp(run->backend, "epoll") == 0 && (error = zstd_proxy_bench_engine_create(&engine)) != 0) {
+        free(connections);
+        free(latency);
+
+        return error;
+    }
+
+    if (run->capture_sample > 0 && (error = zstd_proxy_capture_start(run->capture_path, 256 * 1024 * 1024, run->capture_sample)) != 0) {
+        if (engine != NULL) {
+            zstd_proxy_bench_engine_destroy(engine);
+        }
+
+        free(connections);
+        free(latency);
+
+        return error;
+    }
+
+    double cpu = zstd_proxy_bench_cpu_seconds();
+    uint64_t start = zstd_proxy_now_ns();
+
+    for (; started < run->connections; started++) {
+        zstd_proxy_bench_connection *connection = &connections[started];
+
+        connection->run = run;
+        connection->pipeline.proxied = proxied;
+        connection->pipeline.options = run->options;
+        connection->pipeline.engine = engine;
+
+        if ((error = zstd_proxy_bench_pipeline_start(&connection->pipeline, run->transport)) != 0) {
+            break;
+        }
+
+        if (
+            (error = pthread_create(&connection->reader, NULL, zstd_proxy_bench_reader, connection)) != 0 ||
+            (error = pthread_create(&connection->writer, NULL, zstd_proxy_bench_writer, connection)) != 0
+        ) {
+            log_error("failed to start connection: %s", strerror(error));
+
+            break;
+        }
+    }
+
+    size_t bytes = 0, compressed = 0;
+    uint64_t process_ns = 0;
+
+    for (size_t i = 0; i < started; i++) {
+        zstd_proxy_bench_connection *connection = &connections[i];
+
+        pthread_join(connection->writer, NULL);
+        pthread_join(connection->reader, NULL);
+        close(connection->pipeline.client_fd);
+        close(connection->pipeline.server_fd);
+
+        int pipeline_error = zstd_proxy_bench_pipeline_join(&connection->pipeline);
+
+        if (error == 0) {
+            error = connection->error != 0 ? connection->error : pipeline_error;
+        }
+
+        bytes += connection->bytes;
+        zstd_proxy_histogram_merge(latency, &connection->latency);
+
+        if (proxied) {
+            compressed += connection->pipeline.compress.metrics.compress.bytes_out;
+            process_ns += connection->pipeline.compress.metrics.compress.process_ns;
+            process_ns += connection->pipeline.decompress.metrics.decompress.process_ns;
+        }
+    }
+
+    double seconds = (zstd_proxy_now_ns() - start) / 1e9;
+    double gb = bytes / 1e9;
+
+    cpu = zstd_proxy_bench_cpu_seconds() - cpu;
+
+    zstd_proxy_capture_header capture = { .records = 0, .record_ns = 0 };
+
+    if (run->capture_sample > 0) {
+        zstd_proxy_capture_stats(&capture);
+        zstd_proxy_capture_stop();
+    }
+
+    printf(
+        "%s  {\"backend\": \"%s\", \"transport\": \"%s\", \"corpus\": \"%s\", \"message_size\": %zu, "
+        "\"connections\": %zu, \"rate\": %zu, \"zstd\": %s, \"level\": %d, \"buffer_size\": %zu, "
+        "\"io_uring\": {\"depth\": %zu, \"zero_copy\": %s, \"fixed_buffers\": %s}, "
+        "\"posix\": {\"depth\": %zu, \"zero_copy_threshold\": %zu}, "
+        "\"error\": %d, \"bytes\": %zu, \"seconds\": %.3f, \"throughput_mbps\": %.2f, \"ratio\": %.3f, "
+        "\"cpu_seconds_per_gb\": %.3f, \"zstd_seconds_per_gb\": %.3f, "
+        "\"capture\": {\"sample\": %zu, \"records\": %" PRIu64 ", \"seconds_per_gb\": %.3f}, \"latency_us\": ",
+        *first ? "" : ",\n",
+        run->backend,
+        run->transport,
+        run->corpus->name,
+        run->message_size,
+        run->connections,
+        run->rate,
+        run->options.zstd.enabled ? "true" : "false",
+        run->options.zstd.level,
+        run->options.buffer_size,
+        run->options.io_uring.depth,
+        run->options.io_uring.zero_copy ? "true" : "false",
+        run->options.io_uring.fixed_buffers ? "true" : "false",
+        run->options.posix.depth,
+        run->options.posix.zero_copy_threshold,
+        error,
+        bytes,
+        seconds,
+        bytes * 8 / seconds / 1e6,
+        compressed > 0 ? (double)bytes / compressed : 1,
+        gb > 0 ? cpu / gb : 0,
+        gb > 0 ? process_ns / 1e9 / gb : 0,
+        run->capture_sample,
+        capture.records,
+        gb > 0 ? capture.record_ns / 1e9 / gb : 0
+    );
+    zstd_proxy_bench_print_histogram(latency);
+    printf("}");
+    fflush(stdout);
+
+    *first = false;
+
+    if (engine != NULL) {
+        zstd_proxy_bench_engine_destroy(engine);
+    }
+
+    free(connections);
+    free(latency);
+
+    return error;
+}
+
+static void zstd_proxy_bench_usage(const char *name) {
+    fprintf(
+        stderr,
+        "usage: %s [options], list options accept comma-separated values and run every combination\n"
+        "  --corpus=LIST           zeros, random, json, file:<path> or capture:<path> (default: json)\n"
+        "  --compressibility=N     share of each block kept from the corpus, 0 to 1 (default: 1)\n"
+        "  --message-size=LIST     bytes per message, accepts k/m/g suffixes (default: 64k)\n"
+        "  --connections=LIST      concurrent connections (default: 1)\n"
+        "  --backend=LIST          none, posix, uring or epoll (default: posix,uring)\n"
+        "  --transport=NAME        unix or tcp (default: unix)\n"
+        "  --zstd=LIST             compress, 0 or 1, 0 measures the proxy without the codec (default: 1)\n"
+        "  --level=LIST            Zstd level (default: 1)\n"
+        "  --buffer-size=LIST      proxy buffer size (default: 4m)\n"
+        "  --depth=LIST            io_uring depth, or posix output buffers (default: 4)\n"
+        "  --zero-copy=LIST        io_uring zero-copy or posix MSG_ZEROCOPY, 0 or 1 (default: 0,1)\n"
+        "  --fixed-buffers=LIST    io_uring fixed buffers, 0 or 1 (default: 1)\n"
+        "  --rate=N                messages per second per connection, 0 for unlimited (default: 0)\n"
+        "  --capture=LIST          capture one chunk out of N during each run, 0 to disable (default: 0)\n"
+        "  --capture-file=PATH     capture file, replaced by each run (default: zstd-proxy.capture)\n"
+        "  --duration=SECONDS      duration of each run (default: 5)\n",
+        name
+    );
+}
+
+int main(int argc, char **argv) {
+    char corpus_names[] = "json", backend_names[] = "posix,uring";
+    const char *corpora[zstd_proxy_bench_max_values], *backends[zstd_proxy_bench_max_values];
+    size_t message_sizes[zstd_proxy_bench_max_values] = { 64 * 1024 };
+    size_t connection_counts[zstd_proxy_bench_max_values] = { 1 };
+    size_t zstd[zstd_proxy_bench_max_values] = { 1 };
+    size_t levels[zstd_proxy_bench_max_values] = { 1 };
+    size_t buffer_sizes[zstd_proxy_bench_max_values] = { 4 * 1024 * 1024 };
+    size_t depths[zstd_proxy_bench_max_values] = { 4 };
+    size_t zero_copies[zstd_proxy_bench_max_values] = { 0, 1 };
+    size_t fixed_buffers[zstd_proxy_bench_max_values] = { 1 };
+    size_t capture_samples[zstd_proxy_bench_max_values] = { 0 };
+    int corpus_count = zstd_proxy_bench_parse_names(corpus_names, corpora);
+    int backend_count = zstd_proxy_bench_parse_names(backend_names, backends);
+    int message_size_count = 1, connection_count = 1, level_count = 1, buffer_size_count = 1;
+    int depth_count = 1, zero_copy_count = 2, fixed_buffers_count = 1, capture_count = 1, zstd_count = 1;
+    double compressibility = 1, duration = 5;
+    const char *transport = "unix", *capture_path = "zstd-proxy.capture";
+    size_t rate = 0;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        char *value = strchr(arg, '=');
+        bool valid = value != NULL && strncmp(arg, "--", 2) == 0;
+
+        if (valid) {
+            *value++ = '\0';
+            arg += 2;
+
+            if (strcmp(arg, "corpus") == 0) {
+                valid = (corpus_count = zstd_proxy_bench_parse_names(value, corpora)) > 0;
+            } else if (strcmp(arg, "backend") == 0) {
+                valid = (backend_count = zstd_proxy_bench_parse_names(value, backends)) > 0;
+            } else if (strcmp(arg, "message-size") == 0) {
+                valid = (message_size_count = zstd_proxy_bench_parse_list(value, message_sizes)) > 0;
+            } else if (strcmp(arg, "connections") == 0) {
+                valid = (connection_count = zstd_proxy_bench_parse_list(value, connection_counts)) > 0;
+            } else if (strcmp(arg, "zstd") == 0) {
+                valid = (zstd_count = zstd_proxy_bench_parse_list(value, zstd)) > 0;
+            } else if (strcmp(arg, "level") == 0) {
+                valid = (level_count = zstd_proxy_bench_parse_list(value, levels)) > 0;
+            } else if (strcmp(arg, "buffer-size") == 0) {
+                valid = (buffer_size_count = zstd_proxy_bench_parse_list(value, buffer_sizes)) > 0;
+            } else if (strcmp(arg, "depth") == 0) {
+                valid = (depth_count = zstd_proxy_bench_parse_list(value, depths)) > 0;
+            } else if (strcmp(arg, "zero-copy") == 0) {
+                valid = (zero_copy_count = zstd_proxy_bench_parse_list(value, zero_copies)) > 0;
+            } else if (strcmp(arg, "fixed-buffers") == 0) {
+                valid = (fixed_buffers_count = zstd_proxy_bench_parse_list(value, fixed_buffers)) > 0;
+            } else if (strcmp(arg, "capture") == 0) {
+                valid = (capture_count = zstd_proxy_bench_parse_list(value, capture_samples)) > 0;
+            } else if (strcmp(arg, "capture-file") == 0) {
+                capture_path = value;
+            } else if (strcmp(arg, "transport") == 0) {
+                transport = value;
+            } else if (strcmp(arg, "compressibility") == 0) {
+                compressibility = atof(value);
+                valid = compressibility >= 0 && compressibility <= 1;
+            } else if (strcmp(arg, "duration") == 0) {
+                duration = atof(value);
+                valid = duration > 0;
+            } else if (strcmp(arg, "rate") == 0) {
+                rate = strtoull(value, NULL, 10);
+            } else {
+                valid = false;
+            }
+        }
+
+        if (!valid) {
+            zstd_proxy_bench_usage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    int error = 0;
+    bool first = true;
+
+    printf("[\n");
+
+    for (int c = 0; c < corpus_count && error == 0; c++) {
+        zstd_proxy_bench_corpus corpus;
+
+        if ((error = zstd_proxy_bench_corpus_load(&corpus, corpora[c], compressibility, 64 * 1024 * 1024)) != 0) {
+            break;
+        }
+
+        for (int b = 0; b < backend_count; b++)
+        for (int m = 0; m < message_size_count; m++)
+        for (int n = 0; n < connection_count; n++)
+        for (int x = 0; x < zstd_count; x++)
+        for (int l = 0; l < level_count; l++)
+        for (int s = 0; s < buffer_size_count; s++)
+        for (int d = 0; d < depth_count; d++)
+        for (int z = 0; z < zero_copy_count; z++)
+        for (int f = 0; f < fixed_buffers_count; f++)
+        for (int k = 0; k < capture_count; k++) {
+            bool uring = strcmp(backends[b], "uring") == 0;
+
+            bool posix = strcmp(backends[b], "posix") == 0;
+
+            // The depth and zero-copy matrix only applies to the io_uring and posix backends
+            if ((!uring && f > 0) || (!uring && !posix && (d > 0 || z > 0))) {
+                continue;
+            }
+
+            zstd_proxy_bench_run run = {
+                .transport = transport,
+                .backend = backends[b],
+                .corpus = &corpus,
+                .message_size = message_sizes[m],
+                .connections = connection_counts[n],
+                .rate = rate,
+                .duration = duration,
+                .capture_sample = capture_samples[k],
+                .capture_path = capture_path,
+            };
+
+            zstd_proxy tmp;
+
+            zstd_proxy_init(&tmp);
+
+            run.options = tmp.options;
+            run.options.zstd.enabled = zstd[x];
+            run.options.zstd.level = levels[l];
+            run.options.buffer_size = buffer_sizes[s];
+            run.options.io_uring.depth = depths[d];
+            run.options.io_uring.zero_copy = uring && zero_copies[z];
+            run.options.io_uring.fixed_buffers = uring && fixed_buffers[f];
+            run.options.posix.depth = depths[d];
+            run.options.posix.zero_copy_threshold = posix && zero_copies[z] ? tmp.options.posix.zero_copy_threshold : 0;
+
+            // Keep going on errors, they are reported in the results
+            zstd_proxy_bench_execute(&run, &first);
+        }
+
+        zstd_proxy_bench_corpus_free(&corpus);
+    }
+
+    printf("\n]\n");
+
+    return error == 0 ? 0 : 1;
+}
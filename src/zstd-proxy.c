@@ -1,3 +1,4 @@
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
@@ -7,6 +8,13 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zstd_errors.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #ifndef VERSION
 #define VERSION "dev"
@@ -20,18 +28,42 @@
 #define DISABLE_ZSTD 0
 #endif
 
+#ifndef ENABLE_EPOLL
+#define ENABLE_EPOLL 1
+#endif
+
 #ifndef __linux__
 #undef ENABLE_URING
 #define ENABLE_URING 0
+#undef ENABLE_EPOLL
+#define ENABLE_EPOLL 0
 #endif
 
 #if ENABLE_URING
 #include "zstd-proxy-uring.h"
 #endif
 
+#if ENABLE_EPOLL
+#include "zstd-proxy-epoll.h"
+#endif
+
 #include "zstd-proxy-posix.h"
+#include "zstd-proxy-arena.h"
+#include "zstd-proxy-dedup.h"
+#include "zstd-proxy-capture.h"
+#include "zstd-proxy-framing.h"
 #include "zstd-proxy-utils.h"
 
+/** Dedup records are staged in a buffer of this size between the dedup stage and Zstd. */
+#define zstd_proxy_staging_size (128 * 1024)
+
+const char *const zstd_proxy_close_reason_names[] = {
+    [zstd_proxy_close_none] = "none",
+    [zstd_proxy_close_stopped] = "stopped",
+    [zstd_proxy_close_idle_timeout] = "idle_timeout",
+    [zstd_proxy_close_stall_timeout] = "stall_timeout",
+};
+
 typedef struct {
     zstd_proxy *proxy;
 
@@ -39,7 +71,92 @@ typedef struct {
     int decompress_error;
 } zstd_proxy_thread;
 
-static inline int zstd_proxy_remove_nonblock(int fd) {
+/** Kernel codec reading the codec of the connection from its state, see `zstd_proxy_kernels`. */
+#define zstd_proxy_codec_negotiated zstd_proxy_codec_count
+
+typedef struct {
+    /** `NULL` unless compressing with Zstd, or negotiating from it. */
+    ZSTD_CCtx *ctx;
+    /** `NULL` until compressing with LZ4. */
+    zstd_proxy_lz4_encoder *lz4;
+    zstd_proxy_options *options;
+
+    /** Codec of the current frame, `none` when compression is disabled. */
+    zstd_proxy_codec codec;
+    /** `zstd_proxy.peer_codecs`. */
+    uint32_t *peer_codecs;
+    /** `true` while ending the frame before switching to `options->codec.preferred`. */
+    bool codec_pending;
+    /** `true` once the codec was given data, a switch has to end its frame first. */
+    bool started;
+    /** Hello announcing `codec`, written before its first frame. */
+    uint8_t hello[zstd_proxy_hello_size];
+    size_t hello_pos;
+
+    /** Last `options->generation` seen. */
+    uint64_t generation;
+    /** Current compression level. */
+    int level;
+    /** `true` while ending the frame before switching level. */
+    bool level_pending;
+
+    /** `NULL` when deduplication is disabled, records are compressed from `staged`. */
+    zstd_proxy_dedup *dedup;
+    char *staging;
+    ZSTD_inBuffer staged;
+    /** `true` while the dedup stage holds input waiting for room in `staging`. */
+    bool dedup_pending;
+
+    /** `NULL` without framing, input is then flushed every call. */
+    zstd_proxy_framing *framing;
+    /** Input bytes consumed and scanned by `framing`, and the end of the last message they completed. */
+    uint64_t position;
+    uint64_t scanned;
+    uint64_t flush_end;
+    /** `true` while flushing up to `flush_end` waits for room in the output. */
+    bool flush_pending;
+    /** `true` once the input ended, a message it cut short is flushed anyway. */
+    bool ending;
+
+    /** `zstd_proxy.id`, and chunks seen for capture sampling. */
+    uint64_t id;
+    uint64_t chunks;
+} zstd_proxy_compressor;
+
+typedef struct {
+    /** `NULL` when compression is disabled. */
+    ZSTD_DCtx *ctx;
+    /** `NULL` until a hello announces LZ4. */
+    zstd_proxy_lz4_decoder *lz4;
+
+    /** Codec of the current frame, Zstd until a hello says otherwise, `none` when compression is disabled. */
+    zstd_proxy_codec codec;
+    /** `zstd_proxy.peer_codecs`. */
+    uint32_t *peer_codecs;
+    /** `true` between frames, where a hello can be. */
+    bool boundary;
+    /** Start of a frame, buffered until it's known to be a hello or replayed to the decoder. */
+    uint8_t header[zstd_proxy_hello_size];
+    size_t header_pos;
+    size_t header_size;
+    /** Bytes left of a hello longer than `zstd_proxy_hello_size`, from a later version. */
+    size_t skip;
+    /** Checked against the hellos, their frames would fail to decode otherwise. */
+    uint32_t dictionary_id;
+    int window_log_max;
+
+    /** `NULL` when deduplication is disabled, records are decompressed into `staged`. */
+    zstd_proxy_dedup *dedup;
+    char *staging;
+    ZSTD_inBuffer staged;
+
+    /** `zstd_proxy.id`, and chunks seen for capture sampling. */
+    uint64_t id;
+    uint64_t chunks;
+} zstd_proxy_decompressor;
+
+/** Blocking sockets for the thread backends, non-blocking for epoll. */
+static inline int zstd_proxy_set_nonblock(int fd, bool nonblock) {
     int flags = fcntl(fd, F_GETFL, 0);
 
     if (flags == -1) {
@@ -48,8 +165,8 @@ static inline int zstd_proxy_remove_nonblock(int fd) {
         return errno;
     }
 
-    if (flags & O_NONBLOCK) {
-        int error = fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    if (!(flags & O_NONBLOCK) != !nonblock) {
+        int error = fcntl(fd, F_SETFL, nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
 
         if (error == -1) {
             log_error("error setting socket flags on fd %d: %s", fd, strerror(errno));
@@ -61,22 +178,159 @@ static inline int zstd_proxy_remove_nonblock(int fd) {
     return 0;
 }
 
-static inline int zstd_proxy_prepare(int listen_fd, int connect_fd) {
-    int error = zstd_proxy_remove_nonblock(listen_fd);
+/** Set an integer socket option, logging failures other than the option not applying to the socket. */
+static void zstd_proxy_set_socket_option(int fd, int level, int option, const char *name, size_t value) {
+    int flag = value;
+
+    // TCP options don't apply to UNIX sockets
+    if (setsockopt(fd, level, option, &flag, sizeof(flag)) != 0 && errno != EOPNOTSUPP && errno != ENOPROTOOPT) {
+        log_error("error setting %s on fd %d: %s", name, fd, strerror(errno));
+    }
+}
+
+/** Apply `options->socket` to `fd`, failures only cost latency or memory so they are logged. */
+static void zstd_proxy_tune_socket(const zstd_proxy_options *options, int fd) {
+    const zstd_proxy_socket_options *socket = &options->socket;
+
+    if (socket->send_buffer > 0) {
+        zstd_proxy_set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", socket->send_buffer);
+    }
+
+    if (socket->recv_buffer > 0) {
+        zstd_proxy_set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", socket->recv_buffer);
+    }
+
+    if (socket->nodelay) {
+        zstd_proxy_set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+    }
+
+#ifdef TCP_NOTSENT_LOWAT
+    if (socket->notsent_lowat > 0) {
+        zstd_proxy_set_socket_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", socket->notsent_lowat);
+    }
+#endif
+}
+
+/** Set the blocking mode of both sockets, then tune them. */
+static inline int zstd_proxy_prepare(const zstd_proxy_options *options, int listen_fd, int connect_fd, bool nonblock) {
+    int error = zstd_proxy_set_nonblock(listen_fd, nonblock);
 
     if (error != 0) {
         return error;
     }
 
-    error = zstd_proxy_remove_nonblock(connect_fd);
+    error = zstd_proxy_set_nonblock(connect_fd, nonblock);
 
     if (error != 0) {
         return error;
     }
 
+    zstd_proxy_tune_socket(options, listen_fd);
+    zstd_proxy_tune_socket(options, connect_fd);
+
+    return 0;
+}
+
+static int zstd_proxy_wakeup_open(zstd_proxy_wakeup *wakeup) {
+#ifdef __linux__
+    // Blocking, io_uring completes reads on O_NONBLOCK files with EAGAIN instead of waiting
+    int fd = eventfd(0, EFD_CLOEXEC);
+
+    if (fd < 0) {
+        log_error("failed to create eventfd: %s", strerror(errno));
+
+        return errno;
+    }
+
+    wakeup->read_fd = wakeup->write_fd = fd;
+#else
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        log_error("failed to create wakeup pipe: %s", strerror(errno));
+
+        return errno;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    wakeup->read_fd = fds[0];
+    wakeup->write_fd = fds[1];
+#endif
+
     return 0;
 }
 
+static void zstd_proxy_wakeup_close(zstd_proxy_wakeup *wakeup) {
+    if (wakeup->read_fd >= 0) {
+        close(wakeup->read_fd);
+    }
+
+    if (wakeup->write_fd >= 0 && wakeup->write_fd != wakeup->read_fd) {
+        close(wakeup->write_fd);
+    }
+
+    wakeup->read_fd = wakeup->write_fd = -1;
+}
+
+void zstd_proxy_wakeup_drain(int fd) {
+    uint64_t value;
+    struct pollfd readable = { .fd = fd, .events = POLLIN };
+
+    // An eventfd is reset by a single read, a pipe may need more
+    while (poll(&readable, 1, 0) > 0 && read(fd, &value, sizeof(value)) > 0) {}
+}
+
+/** Bump the options generation and wake both direction threads up, the caller holds `proxy->lock`. */
+static void zstd_proxy_notify_locked(zstd_proxy *proxy) {
+    uint64_t value = 1;
+
+    __atomic_fetch_add(&proxy->options.generation, 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < 2; i++) {
+        if (proxy->wakeup[i].write_fd >= 0 && write(proxy->wakeup[i].write_fd, &value, sizeof(value)) < 0) {
+            // EAGAIN: a wakeup is already pending
+            debug_assert(errno == EAGAIN);
+        }
+    }
+}
+
+static void zstd_proxy_notify(zstd_proxy *proxy) {
+    pthread_mutex_lock(&proxy->lock);
+    zstd_proxy_notify_locked(proxy);
+    pthread_mutex_unlock(&proxy->lock);
+}
+
+/** Apply the `SO_BUSY_POLL` options to `fd`, failures only cost latency so they are logged. */
+static void zstd_proxy_busy_poll_socket(const zstd_proxy_busy_poll_options *options, int fd) {
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    if (options->socket_us == 0) {
+        return;
+    }
+
+    int value = options->socket_us;
+
+    // Raising it above net.core.busy_read requires CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0) {
+        log_error("error setting SO_BUSY_POLL on fd %d: %s", fd, strerror(errno));
+    }
+
+#ifdef SO_PREFER_BUSY_POLL
+    value = 1;
+
+    if (options->prefer && setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value)) != 0) {
+        log_error("error setting SO_PREFER_BUSY_POLL on fd %d: %s", fd, strerror(errno));
+    }
+#endif
+#else
+    (void)options;
+    (void)fd;
+#endif
+}
+
 static inline bool zstd_proxy_is_socket(int fd) {
     int type;
     socklen_t length = sizeof(type);
@@ -94,34 +348,63 @@ static inline int zstd_proxy_platform_run(zstd_proxy_connection* connection) {
     return zstd_proxy_posix_run(connection);
 }
 
+/** Describe the compress (`invert` false) or decompress direction of `proxy`. */
+static void zstd_proxy_connection_init(
+    zstd_proxy_connection *connection,
+    zstd_proxy *proxy,
+    zstd_proxy_process_callback process,
+    void *process_data,
+    zstd_proxy_end_callback end,
+    bool invert
+) {
+    zstd_proxy_metrics *global_metrics = zstd_proxy_metrics_global();
+    zstd_proxy_latency *global_latency = zstd_proxy_latency_global();
+
+    *connection = (zstd_proxy_connection){
+        .listen = invert ? &proxy->connect : &proxy->listen,
+        .connect = invert ? &proxy->listen : &proxy->connect,
+        .wakeup_fd = proxy->wakeup[invert ? 1 : 0].read_fd,
+        .options = &proxy->options,
+        .process = process,
+        .process_data = process_data,
+        .end = end,
+        .metrics = invert ? &proxy->metrics.decompress : &proxy->metrics.compress,
+        .global_metrics = invert ? &global_metrics->decompress : &global_metrics->compress,
+        .latency = invert ? &proxy->latency.decompress : &proxy->latency.compress,
+        .global_latency = invert ? &global_latency->decompress : &global_latency->compress,
+    };
+}
+
 int zstd_proxy_io(
     zstd_proxy_thread *data,
     int (*process)(void *process_data, ZSTD_inBuffer *input, ZSTD_outBuffer *output),
     void *process_data,
+    zstd_proxy_end_callback end,
     bool invert
 ) {
     zstd_proxy *proxy = data->proxy;
     zstd_proxy_options *options = &proxy->options;
-    zstd_proxy_descriptor *listen = invert ? &proxy->connect : &proxy->listen;
-    zstd_proxy_descriptor *connect = invert ? &proxy->listen : &proxy->connect;
-    zstd_proxy_connection connection = {
-        .listen = listen,
-        .connect = connect,
-        .options = options,
-        .process = process,
-        .process_data = process_data,
-    };
+    zstd_proxy_connection connection;
+
+    zstd_proxy_connection_init(&connection, proxy, process, process_data, end, invert);
 
-    int listen_fd = listen->fd;
-    int connect_fd = connect->fd;
+    int listen_fd = connection.listen->fd;
+    int connect_fd = connection.connect->fd;
 
     if (!zstd_proxy_is_socket(listen_fd)) {
         return 0;
     }
 
+    // Before the backend allocates its buffers, so they are faulted in on the local NUMA node
+    zstd_proxy_affinity_apply(&options->affinity, listen_fd);
+    zstd_proxy_busy_poll_socket(&options->busy_poll, listen_fd);
+
     int error = zstd_proxy_platform_run(&connection);
 
-    options->stop = true;
+    // Stop the other direction right away
+    __atomic_store_n(&options->stop, true, __ATOMIC_RELEASE);
+
+    zstd_proxy_notify(proxy);
 
     shutdown(listen_fd, SHUT_RDWR);
     shutdown(connect_fd, SHUT_RDWR);
@@ -129,184 +412,1356 @@ int zstd_proxy_io(
     return error;
 }
 
-int zstd_proxy_compress_stream(void *ctx, ZSTD_inBuffer *input, ZSTD_outBuffer *output) {
-    if (ctx == NULL) {
-        output->pos = input->pos = input->size;
+/** Passthrough when compression is disabled, bounded by the space left in `output`. */
+static inline void zstd_proxy_copy_stream(ZSTD_inBuffer *input, ZSTD_outBuffer *output) {
+    size_t size = input->size - input->pos;
 
-        memcpy(output->dst, input->src, input->size);
-    } else {
-        size_t size = ZSTD_compressStream2(ctx, output, input, ZSTD_e_flush);
+    if (size > output->size - output->pos) {
+        size = output->size - output->pos;
+    }
 
-        if (ZSTD_isError(size)) {
-            log_error("error compressing data: %s", ZSTD_getErrorName(size));
+    memcpy(&((char *)output->dst)[output->pos], &((const char *)input->src)[input->pos], size);
 
-            return size;
+    input->pos += size;
+    output->pos += size;
+}
+
+/** Contexts allocate their workspace on first use, fail like their creation when the arena refuses it. */
+static int zstd_proxy_stream_error(size_t code) {
+    return ZSTD_getErrorCode(code) == ZSTD_error_memory_allocation ? ENOMEM : (int)code;
+}
+
+/*
+ * The process callbacks are built in one variant per combination of the stages a connection uses, see
+ * `zstd_proxy_kernels`. Their stages take the combination as constant arguments and are always inlined,
+ * so the variants don't test the options of the connection for every chunk.
+ */
+#define zstd_proxy_kernel static inline __attribute__((always_inline))
+
+/** Queue the hello announcing `compressor->codec`, written before the next frame. */
+static void zstd_proxy_compress_hello(zstd_proxy_compressor *compressor) {
+    zstd_proxy_options *options = compressor->options;
+    bool zstd = compressor->codec == zstd_proxy_codec_zstd;
+    int level = zstd ? compressor->level : options->codec.lz4_level;
+    zstd_proxy_hello hello = {
+        .version = zstd_proxy_hello_version,
+        .codec = compressor->codec,
+        // Informative, negative Zstd levels go down to -131072
+        .level = level < INT8_MIN ? INT8_MIN : level,
+        .window_log = zstd ? options->zstd.window_log : 0,
+        .dictionary_id = zstd && options->zstd.dictionary != NULL
+            ? ZSTD_getDictID_fromDict(options->zstd.dictionary, options->zstd.dictionary_size)
+            : 0,
+        .codecs = zstd_proxy_codecs_supported,
+    };
+
+    zstd_proxy_hello_write(compressor->hello, &hello);
+    compressor->hello_pos = 0;
+}
+
+static int zstd_proxy_compress_lz4_init(zstd_proxy_compressor *compressor) {
+    return compressor->lz4 != NULL
+        ? 0
+        : zstd_proxy_lz4_encoder_create(&compressor->lz4, compressor->options->codec.lz4_level);
+}
+
+/** Switch to the preferred codec once the peer can decode it, ending the current frame first. */
+static int zstd_proxy_compress_negotiate(zstd_proxy_compressor *compressor, ZSTD_outBuffer *output) {
+    zstd_proxy_codec preferred = compressor->options->codec.preferred;
+
+    if (!compressor->codec_pending) {
+        uint32_t peer_codecs = __atomic_load_n(compressor->peer_codecs, __ATOMIC_RELAXED);
+
+        // Don't switch in the middle of a hello, a complete one can be followed by another
+        bool hello = compressor->hello_pos > 0 && compressor->hello_pos < zstd_proxy_hello_size;
+
+        if (compressor->codec == preferred || !(peer_codecs & zstd_proxy_codec_bit(preferred)) || hello) {
+            return 0;
+        }
+
+        compressor->codec_pending = true;
+    }
+
+    if (compressor->started) {
+        bool done = false;
+
+        if (compressor->codec == zstd_proxy_codec_zstd) {
+            ZSTD_inBuffer empty = { NULL, 0, 0 };
+            size_t size = ZSTD_compressStream2(compressor->ctx, output, &empty, ZSTD_e_end);
+
+            if (ZSTD_isError(size)) {
+                log_error("error ending frame: %s", ZSTD_getErrorName(size));
+
+                return size;
+            }
+
+            done = size == 0;
+        } else {
+            int error = zstd_proxy_lz4_encode_end(compressor->lz4, output, &done);
+
+            if (error != 0) {
+                return error;
+            }
+        }
+
+        if (!done) {
+            return 0;
         }
     }
 
+    int error = preferred == zstd_proxy_codec_lz4 ? zstd_proxy_compress_lz4_init(compressor) : 0;
+
+    if (error != 0) {
+        return error;
+    }
+
+    compressor->codec = preferred;
+    compressor->codec_pending = false;
+    compressor->started = false;
+    zstd_proxy_compress_hello(compressor);
+
     return 0;
 }
 
-int zstd_proxy_decompress_stream(void *ctx, ZSTD_inBuffer *input, ZSTD_outBuffer *output) {
-    if (ctx == NULL) {
-        output->pos = input->pos = input->size;
+zstd_proxy_kernel int zstd_proxy_compress_zstd(
+    zstd_proxy_compressor *compressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    bool flush
+) {
+    ZSTD_CCtx *ctx = compressor->ctx;
+    uint64_t generation = __atomic_load_n(&compressor->options->generation, __ATOMIC_ACQUIRE);
+
+    if (generation != compressor->generation) {
+        int level = __atomic_load_n(&compressor->options->zstd.level, __ATOMIC_RELAXED);
 
-        memcpy(output->dst, input->src, input->size);
-    } else {
-        size_t size = ZSTD_decompressStream(ctx, output, input);
+        compressor->generation = generation;
+
+        if (level != compressor->level) {
+            compressor->level = level;
+            compressor->level_pending = true;
+        }
+    }
+
+    // The level only applies to new frames: end the current one, the decompressor reads frames back to back
+    ZSTD_EndDirective directive = compressor->level_pending ? ZSTD_e_end : flush ? ZSTD_e_flush : ZSTD_e_continue;
+    size_t size = ZSTD_compressStream2(ctx, output, input, directive);
+
+    if (ZSTD_isError(size)) {
+        log_error("error compressing data: %s", ZSTD_getErrorName(size));
+
+        return zstd_proxy_stream_error(size);
+    }
+
+    if (compressor->level_pending && size == 0) {
+        size = ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, compressor->level);
 
         if (ZSTD_isError(size)) {
-            log_error("error decompressing data: %s", ZSTD_getErrorName(size));
+            log_error("failed to set compression level: %s", ZSTD_getErrorName(size));
 
             return size;
         }
+
+        compressor->level_pending = false;
     }
 
     return 0;
 }
 
-void *zstd_proxy_compress_thread(void *data_ptr) {
-    int error = 0;
-    zstd_proxy_thread *data = data_ptr;
-    ZSTD_CCtx *ctx = data->proxy->options.zstd.enabled ? ZSTD_createCCtx() : NULL;
+zstd_proxy_kernel int zstd_proxy_compress_chunk(
+    zstd_proxy_compressor *compressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    zstd_proxy_codec codec,
+    bool flush
+) {
+    if (codec == zstd_proxy_codec_none) {
+        zstd_proxy_copy_stream(input, output);
 
-    if (ctx != NULL) {
-        error = ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, data->proxy->options.zstd.level);
+        return 0;
+    }
 
-        if (ZSTD_isError(error)) {
-            log_error("failed to set compression level: %s", ZSTD_getErrorName(error));
+    if (codec == zstd_proxy_codec_negotiated) {
+        int error = zstd_proxy_compress_negotiate(compressor, output);
 
-            goto cleanup;
+        if (error != 0 || compressor->codec_pending) {
+            return error;
         }
+
+        codec = compressor->codec;
     }
 
-    error = zstd_proxy_io(data, zstd_proxy_compress_stream, ctx, false);
+    if (compressor->hello_pos < zstd_proxy_hello_size) {
+        ZSTD_inBuffer hello = { compressor->hello, zstd_proxy_hello_size, compressor->hello_pos };
 
-    cleanup:
+        zstd_proxy_copy_stream(&hello, output);
+        compressor->hello_pos = hello.pos;
 
-    if (ctx != NULL) {
-        ZSTD_freeCCtx(ctx);
+        if (hello.pos < hello.size) {
+            return 0;
+        }
     }
 
-    data->compress_error = error;
+    compressor->started = true;
 
-    return NULL;
+    return codec == zstd_proxy_codec_lz4
+        ? zstd_proxy_lz4_encode(compressor->lz4, input, output, flush)
+        : zstd_proxy_compress_zstd(compressor, input, output, flush);
 }
 
-void *zstd_proxy_decompress_thread(void *data_ptr) {
-    int error = 0;
-    zstd_proxy_thread *data = data_ptr;
-    ZSTD_DCtx *ctx = data->proxy->options.zstd.enabled ? ZSTD_createDCtx() : NULL;
+zstd_proxy_kernel int zstd_proxy_compress_dedup(
+    zstd_proxy_compressor *compressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    zstd_proxy_codec codec,
+    bool flush
+) {
+    // Callers stop once the input is consumed and the output has room, so nothing can be left staged then
+    for (;;) {
+        ZSTD_inBuffer *staged = &compressor->staged;
 
-    error = zstd_proxy_io(data, zstd_proxy_decompress_stream, ctx, true);
+        if (staged->pos == staged->size) {
+            ZSTD_outBuffer records = { compressor->staging, zstd_proxy_staging_size, 0 };
 
-    if (ctx != NULL) {
-        ZSTD_freeDCtx(ctx);
-    }
+            compressor->dedup_pending = zstd_proxy_dedup_encode(compressor->dedup, input, &records);
 
-    data->decompress_error = error;
+            staged->size = records.pos;
+            staged->pos = 0;
+        }
 
-    return NULL;
+        // Called even without records so Zstd flushes
+        int error = zstd_proxy_compress_chunk(compressor, staged, output, codec, flush);
+
+        if (error != 0 || output->pos == output->size) {
+            return error;
+        }
+
+        if (staged->pos == staged->size && input->pos == input->size && !compressor->dedup_pending) {
+            return 0;
+        }
+    }
 }
 
-void zstd_proxy_init(zstd_proxy *proxy) {
-    proxy->listen.fd = -1;
-    proxy->listen.data = NULL;
-    proxy->listen.data_length = 0;
+/** Limit `input` to the messages which ended and weren't flushed yet, returns whether to flush it. */
+static inline bool zstd_proxy_compress_framing(zstd_proxy_compressor *compressor, ZSTD_inBuffer *input) {
+    zstd_proxy_framing *framing = compressor->framing;
 
-    proxy->connect.fd = -1;
-    proxy->connect.data = NULL;
-    proxy->connect.data_length = 0;
+    if (framing == NULL || compressor->ending) {
+        return true;
+    }
 
-    proxy->options.stop = false;
-    proxy->options.buffer_size = 4 * 1024 * 1024;
+    uint64_t position = compressor->position;
+    uint64_t end = position + (input->size - input->pos);
 
-    proxy->options.zstd.enabled = true;
-    proxy->options.zstd.level = 1;
+    // Callers pass the same input again while the output is full, only scan what's new
+    if (compressor->scanned < end) {
+        const uint8_t *data = &((const uint8_t *)input->src)[input->pos + (compressor->scanned - position)];
+        size_t ended = zstd_proxy_framing_scan(framing, data, end - compressor->scanned);
 
-    proxy->options.io_uring.enabled = true;
-    proxy->options.io_uring.depth = 4;
-    proxy->options.io_uring.zero_copy = true;
-    proxy->options.io_uring.fixed_buffers = true;
+        if (ended > 0) {
+            compressor->flush_end = compressor->scanned + ended;
+        }
+
+        compressor->scanned = end;
+    }
+
+    if (position < compressor->flush_end) {
+        input->size = input->pos + (compressor->flush_end - position);
+
+        return true;
+    }
+
+    // Finish the previous flush before compressing the next message
+    if (compressor->flush_pending) {
+        input->size = input->pos;
+
+        return true;
+    }
+
+    return false;
 }
 
-/** Connection thread. */
-int zstd_proxy_run(zstd_proxy *proxy) {
+zstd_proxy_kernel int zstd_proxy_compress_stream(
+    zstd_proxy_compressor *compressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    zstd_proxy_codec codec,
+    bool dedup
+) {
+    size_t start = input->pos;
     int error = 0;
-    int listen_fd = proxy->listen.fd;
-    int connect_fd = proxy->connect.fd;
-    pthread_t compress_thread_id = 0, decompress_thread_id = 0;
-    zstd_proxy_thread *thread = malloc(sizeof(zstd_proxy_thread));
 
-    thread->proxy = proxy;
-    thread->compress_error = 0;
-    thread->decompress_error = 0;
+    // Messages which ended are flushed first, then the start of the next one is compressed without flushing
+    for (;;) {
+        ZSTD_inBuffer messages = *input;
+        bool flush = zstd_proxy_compress_framing(compressor, &messages);
 
-    error = zstd_proxy_prepare(listen_fd, connect_fd);
+        compressor->flush_pending = flush;
+        error = dedup
+            ? zstd_proxy_compress_dedup(compressor, &messages, output, codec, flush)
+            : zstd_proxy_compress_chunk(compressor, &messages, output, codec, flush);
+        compressor->position += messages.pos - input->pos;
+        input->pos = messages.pos;
 
-    if (error != 0) {
-        goto cleanup;
+        if (error != 0 || output->pos == output->size) {
+            break;
+        }
+
+        compressor->flush_pending = false;
+
+        if (input->pos == input->size) {
+            break;
+        }
     }
 
-#if ENABLE_URING
-    if (proxy->options.io_uring.enabled) {
-        zstd_proxy_uring_options(&proxy->options);
+    if (input->pos > start && zstd_proxy_capture_sampled(&compressor->chunks)) {
+        zstd_proxy_capture_record_chunk(
+            compressor->id,
+            zstd_proxy_capture_compress,
+            &((const char *)input->src)[start],
+            input->pos - start
+        );
     }
-#endif
 
-    error = pthread_create(&compress_thread_id, NULL, zstd_proxy_compress_thread, thread);
+    return error;
+}
 
-    if (error != 0) {
-        log_error("error creating read thread: %s", strerror(error));
+/** Follow a hello from the peer, see `zstd-proxy-codec.h`. */
+static int zstd_proxy_decompress_hello(zstd_proxy_decompressor *decompressor, const zstd_proxy_hello *hello) {
+    zstd_proxy_codec codec = hello->codec;
 
-        goto cleanup;
+    if (codec == zstd_proxy_codec_none || codec >= zstd_proxy_codec_count || !(zstd_proxy_codecs_supported & zstd_proxy_codec_bit(codec))) {
+        log_error("peer compresses with unsupported codec %u", codec);
+
+        return EPROTONOSUPPORT;
     }
 
-    error = pthread_create(&decompress_thread_id, NULL, zstd_proxy_decompress_thread, thread);
+    if (codec == zstd_proxy_codec_zstd) {
+        if (hello->dictionary_id != decompressor->dictionary_id) {
+            log_error("peer uses dictionary %u, this end uses %u", hello->dictionary_id, decompressor->dictionary_id);
 
-    if (error != 0) {
-        log_error("error creating write thread: %s", strerror(error));
+            return EPROTO;
+        }
 
-        goto cleanup;
+        if (hello->window_log > decompressor->window_log_max) {
+            log_error("peer uses window log %u, this end accepts up to %d", hello->window_log, decompressor->window_log_max);
+
+            return EPROTO;
+        }
     }
 
-    cleanup:
+    if (codec == zstd_proxy_codec_lz4 && decompressor->lz4 == NULL) {
+        int error = zstd_proxy_lz4_decoder_create(&decompressor->lz4);
 
-    if (error != 0) {
-        shutdown(listen_fd, SHUT_RDWR);
-        shutdown(connect_fd, SHUT_RDWR);
-    } else {
-        if (compress_thread_id != 0) {
-            error = pthread_join(compress_thread_id, NULL);
+        if (error != 0) {
+            return error;
+        }
+    }
 
-            if (error != 0) {
-                log_error("error running compress thread: %s", strerror(error));
+    decompressor->codec = codec;
+    __atomic_fetch_or(decompressor->peer_codecs, hello->codecs, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/** Read hellos at the start of a frame, `boundary` is cleared once the frame turns out to be something else. */
+static int zstd_proxy_decompress_boundary(zstd_proxy_decompressor *decompressor, ZSTD_inBuffer *input) {
+    for (;;) {
+        if (decompressor->skip > 0) {
+            size_t size = input->size - input->pos;
+
+            size = size < decompressor->skip ? size : decompressor->skip;
+            input->pos += size;
+            decompressor->skip -= size;
+
+            if (decompressor->skip > 0) {
+                return 0;
             }
         }
 
-        if (decompress_thread_id != 0) {
-            error = pthread_join(decompress_thread_id, NULL);
+        // The magic and size first, the payload once they make a hello
+        uint8_t *header = decompressor->header;
+        size_t needed = decompressor->header_size < 8 ? 8 : zstd_proxy_hello_size;
+        ZSTD_outBuffer buffer = { header, needed, decompressor->header_size };
 
-            if (error != 0) {
-                log_error("error running decompress thread: %s", strerror(error));
-            }
+        zstd_proxy_copy_stream(input, &buffer);
+        decompressor->header_size = buffer.pos;
+
+        if (buffer.pos >= 4 && zstd_proxy_read_le32(header) != zstd_proxy_hello_magic) {
+            // Replayed to the decoder before the rest of the input
+            decompressor->boundary = false;
+            decompressor->header_pos = 0;
+
+            return 0;
+        }
+
+        if (buffer.pos < needed) {
+            return 0;
         }
-    }
 
-    int compress_error = thread->compress_error;
-    int decompress_error = thread->decompress_error;
+        if (needed == 8) {
+            continue;
+        }
 
-    close(listen_fd);
-    close(connect_fd);
-    free(thread);
+        size_t size = zstd_proxy_read_le32(&header[4]);
+        zstd_proxy_hello hello;
+        int error = zstd_proxy_hello_read(&header[8], size, &hello);
 
-    if (compress_error != 0) {
-        return compress_error;
-    }
+        if (error == 0) {
+            error = zstd_proxy_decompress_hello(decompressor, &hello);
+        }
+
+        if (error != 0) {
+            return error;
+        }
 
-    if (decompress_error != 0) {
-        return decompress_error;
+        decompressor->header_size = 0;
+        decompressor->skip = size - zstd_proxy_hello_payload_size;
+    }
+}
+
+zstd_proxy_kernel int zstd_proxy_decode(
+    zstd_proxy_decompressor *decompressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    bool *frame_end
+) {
+    if (decompressor->codec == zstd_proxy_codec_lz4) {
+        return zstd_proxy_lz4_decode(decompressor->lz4, input, output, frame_end);
+    }
+
+    size_t size = ZSTD_decompressStream(decompressor->ctx, output, input);
+
+    if (ZSTD_isError(size)) {
+        log_error("error decompressing data: %s", ZSTD_getErrorName(size));
+
+        return zstd_proxy_stream_error(size);
+    }
+
+    *frame_end = size == 0;
+
+    return 0;
+}
+
+zstd_proxy_kernel int zstd_proxy_decompress_chunk(
+    zstd_proxy_decompressor *decompressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    zstd_proxy_codec codec
+) {
+    if (codec == zstd_proxy_codec_none) {
+        zstd_proxy_copy_stream(input, output);
+
+        return 0;
+    }
+
+    for (;;) {
+        int error = 0;
+
+        if (decompressor->boundary) {
+            if ((error = zstd_proxy_decompress_boundary(decompressor, input)) != 0 || decompressor->boundary) {
+                return error;
+            }
+        }
+
+        // Bytes buffered while looking for a hello go first
+        bool replay = decompressor->header_pos < decompressor->header_size;
+        ZSTD_inBuffer header = { decompressor->header, decompressor->header_size, decompressor->header_pos };
+        bool frame_end = false;
+
+        error = zstd_proxy_decode(decompressor, replay ? &header : input, output, &frame_end);
+        decompressor->header_pos = header.pos;
+
+        if (error != 0) {
+            return error;
+        }
+
+        if (frame_end) {
+            decompressor->boundary = true;
+            decompressor->header_pos = decompressor->header_size = 0;
+        } else if (!replay || output->pos == output->size) {
+            return 0;
+        }
+    }
+}
+
+zstd_proxy_kernel int zstd_proxy_decompress_dedup(
+    zstd_proxy_decompressor *decompressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    zstd_proxy_codec codec
+) {
+    for (;;) {
+        ZSTD_inBuffer *staged = &decompressor->staged;
+        int error = zstd_proxy_dedup_decode(decompressor->dedup, staged, output);
+
+        if (error != 0) {
+            log_error("error decoding dedup records: %s", strerror(error));
+
+            return error;
+        }
+
+        // Records are only left staged when the output is full
+        if (output->pos == output->size) {
+            return 0;
+        }
+
+        ZSTD_outBuffer records = { decompressor->staging, zstd_proxy_staging_size, 0 };
+
+        if ((error = zstd_proxy_decompress_chunk(decompressor, input, &records, codec)) != 0) {
+            return error;
+        }
+
+        staged->size = records.pos;
+        staged->pos = 0;
+
+        // Zstd fills `records` as far as it can, an empty one means it needs more input
+        if (records.pos == 0) {
+            return 0;
+        }
+    }
+}
+
+zstd_proxy_kernel int zstd_proxy_decompress_stream(
+    zstd_proxy_decompressor *decompressor,
+    ZSTD_inBuffer *input,
+    ZSTD_outBuffer *output,
+    zstd_proxy_codec codec,
+    bool dedup
+) {
+    size_t start = output->pos;
+    int error = dedup
+        ? zstd_proxy_decompress_dedup(decompressor, input, output, codec)
+        : zstd_proxy_decompress_chunk(decompressor, input, output, codec);
+
+    if (output->pos > start && zstd_proxy_capture_sampled(&decompressor->chunks)) {
+        zstd_proxy_capture_record_chunk(
+            decompressor->id,
+            zstd_proxy_capture_decompress,
+            &((const char *)output->dst)[start],
+            output->pos - start
+        );
     }
 
     return error;
 }
+
+/** Compressing variants: name, codec, dedup. */
+#define zstd_proxy_compress_kernels(kernel) \
+    kernel(passthrough, zstd_proxy_codec_none, false) \
+    kernel(zstd, zstd_proxy_codec_zstd, false) \
+    kernel(lz4, zstd_proxy_codec_lz4, false) \
+    kernel(negotiated, zstd_proxy_codec_negotiated, false) \
+    kernel(dedup, zstd_proxy_codec_none, true) \
+    kernel(zstd_dedup, zstd_proxy_codec_zstd, true) \
+    kernel(lz4_dedup, zstd_proxy_codec_lz4, true) \
+    kernel(negotiated_dedup, zstd_proxy_codec_negotiated, true)
+
+/** Decompressing variants, the codec of each frame is announced by the hellos. */
+#define zstd_proxy_decompress_kernels(kernel) \
+    kernel(passthrough, zstd_proxy_codec_none, false) \
+    kernel(decode, zstd_proxy_codec_negotiated, false) \
+    kernel(dedup, zstd_proxy_codec_none, true) \
+    kernel(decode_dedup, zstd_proxy_codec_negotiated, true)
+
+#define zstd_proxy_compress_kernel_define(name, codec, dedup) \
+    static int zstd_proxy_##name##_compress(void *data, ZSTD_inBuffer *input, ZSTD_outBuffer *output) { \
+        return zstd_proxy_compress_stream(data, input, output, codec, dedup); \
+    }
+
+#define zstd_proxy_decompress_kernel_define(name, codec, dedup) \
+    static int zstd_proxy_##name##_decompress(void *data, ZSTD_inBuffer *input, ZSTD_outBuffer *output) { \
+        return zstd_proxy_decompress_stream(data, input, output, codec, dedup); \
+    }
+
+zstd_proxy_compress_kernels(zstd_proxy_compress_kernel_define)
+zstd_proxy_decompress_kernels(zstd_proxy_decompress_kernel_define)
+
+#define zstd_proxy_compress_kernel_select(name, codec, dedup) \
+    if (kernel_codec == codec && has_dedup == dedup) { \
+        return zstd_proxy_##name##_compress; \
+    }
+
+#define zstd_proxy_decompress_kernel_select(name, codec, dedup) \
+    if (kernel_codec == codec && has_dedup == dedup) { \
+        return zstd_proxy_##name##_decompress; \
+    }
+
+/** Codec the kernels of a connection are specialized for, `zstd_proxy_codec_negotiated` when it can change. */
+static zstd_proxy_codec zstd_proxy_kernel_codec(const zstd_proxy_options *options, bool decompress) {
+    zstd_proxy_codec preferred = options->codec.preferred;
+
+    if (!options->zstd.enabled || preferred == zstd_proxy_codec_none) {
+        return zstd_proxy_codec_none;
+    }
+
+    if (decompress || (preferred != zstd_proxy_codec_zstd && options->codec.negotiate)) {
+        return zstd_proxy_codec_negotiated;
+    }
+
+    return preferred;
+}
+
+/** Pick the variant matching the stages created by `zstd_proxy_compressor_init` or `zstd_proxy_decompressor_init`. */
+static zstd_proxy_process_callback zstd_proxy_kernel_for(zstd_proxy_codec kernel_codec, bool has_dedup, bool decompress) {
+    if (decompress) {
+        zstd_proxy_decompress_kernels(zstd_proxy_decompress_kernel_select)
+    } else {
+        zstd_proxy_compress_kernels(zstd_proxy_compress_kernel_select)
+    }
+
+    return NULL;
+}
+
+static inline zstd_proxy_process_callback zstd_proxy_compress_kernel(const zstd_proxy_compressor *compressor) {
+    return zstd_proxy_kernel_for(
+        zstd_proxy_kernel_codec(compressor->options, false),
+        compressor->dedup != NULL,
+        false
+    );
+}
+
+static void zstd_proxy_compress_end(void *process_data) {
+    zstd_proxy_compressor *compressor = process_data;
+
+    compressor->ending = true;
+}
+
+/** Only framing holds input back, the other stages write or buffer everything they consume. */
+static inline zstd_proxy_end_callback zstd_proxy_compress_end_callback(const zstd_proxy_compressor *compressor) {
+    return compressor->framing != NULL ? zstd_proxy_compress_end : NULL;
+}
+
+static inline zstd_proxy_process_callback zstd_proxy_decompress_kernel(const zstd_proxy_decompressor *decompressor) {
+    return zstd_proxy_kernel_for(
+        decompressor->codec == zstd_proxy_codec_none ? zstd_proxy_codec_none : zstd_proxy_codec_negotiated,
+        decompressor->dedup != NULL,
+        true
+    );
+}
+
+/** `link` is `NULL` for streams, which have no other direction to exchange cache offers through. */
+static int zstd_proxy_dedup_init(
+    zstd_proxy_options *options,
+    zstd_proxy_dedup_link *link,
+    zstd_proxy_dedup **dedup,
+    char **staging,
+    bool encoder
+) {
+    if (!options->dedup.enabled) {
+        return 0;
+    }
+
+    if ((*staging = malloc(zstd_proxy_staging_size)) == NULL) {
+        log_error("failed to allocate dedup staging buffer");
+
+        return ENOMEM;
+    }
+
+    return zstd_proxy_dedup_create(dedup, options->dedup.cache_size, encoder, link);
+}
+
+static int zstd_proxy_compressor_init(zstd_proxy_compressor *compressor, zstd_proxy *proxy, zstd_proxy_dedup_link *link) {
+    zstd_proxy_options *options = &proxy->options;
+
+    *compressor = (zstd_proxy_compressor){
+        .ctx = NULL,
+        .lz4 = NULL,
+        .options = options,
+        .codec = zstd_proxy_kernel_codec(options, false),
+        .peer_codecs = &proxy->peer_codecs,
+        .codec_pending = false,
+        .started = false,
+        .hello_pos = zstd_proxy_hello_size,
+        .generation = __atomic_load_n(&options->generation, __ATOMIC_ACQUIRE),
+        .level = __atomic_load_n(&options->zstd.level, __ATOMIC_RELAXED),
+        .level_pending = false,
+        .dedup = NULL,
+        .staging = NULL,
+        .staged = { NULL, 0, 0 },
+        .dedup_pending = false,
+        .framing = NULL,
+        .position = 0,
+        .scanned = 0,
+        .flush_end = 0,
+        .flush_pending = false,
+        .ending = false,
+        .id = proxy->id,
+        .chunks = 0,
+    };
+
+    int dedup_error = zstd_proxy_dedup_init(options, link, &compressor->dedup, &compressor->staging, true);
+
+    compressor->staged.src = compressor->staging;
+
+    if (dedup_error != 0) {
+        return dedup_error;
+    }
+
+    if (compressor->codec == zstd_proxy_codec_none) {
+        return 0;
+    }
+
+    // Only compressors hold data between flushes, passthrough connections send every chunk as is
+    if (options->framing.protocol != zstd_proxy_framing_none) {
+        if (zstd_proxy_framing_create(&compressor->framing, &options->framing) != 0) {
+            log_error("invalid framing options");
+
+            return EINVAL;
+        }
+    }
+
+    // Negotiating connections start with Zstd, peers without hellos only know it
+    if (compressor->codec == zstd_proxy_codec_negotiated) {
+        compressor->codec = zstd_proxy_codec_zstd;
+    }
+
+    zstd_proxy_compress_hello(compressor);
+
+    if (compressor->codec == zstd_proxy_codec_lz4) {
+        return zstd_proxy_compress_lz4_init(compressor);
+    }
+
+    if ((compressor->ctx = ZSTD_createCCtx_advanced(zstd_proxy_arena_allocator(&proxy->metrics.zstd_memory))) == NULL) {
+        log_error("failed to create compression context");
+
+        return ENOMEM;
+    }
+
+    size_t error = ZSTD_CCtx_setParameter(compressor->ctx, ZSTD_c_compressionLevel, compressor->level);
+
+    if (ZSTD_isError(error)) {
+        log_error("failed to set compression level: %s", ZSTD_getErrorName(error));
+
+        return error;
+    }
+
+    if (options->zstd.window_log > 0) {
+        error = ZSTD_CCtx_setParameter(compressor->ctx, ZSTD_c_windowLog, options->zstd.window_log);
+
+        if (ZSTD_isError(error)) {
+            log_error("failed to set window log: %s", ZSTD_getErrorName(error));
+
+            return error;
+        }
+    }
+
+    if (options->zstd.dictionary != NULL) {
+        error = ZSTD_CCtx_loadDictionary(
+            compressor->ctx,
+            options->zstd.dictionary,
+            options->zstd.dictionary_size
+        );
+
+        if (ZSTD_isError(error)) {
+            log_error("failed to load dictionary: %s", ZSTD_getErrorName(error));
+
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+static void zstd_proxy_compressor_free(zstd_proxy_compressor *compressor) {
+    if (compressor->ctx != NULL) {
+        ZSTD_freeCCtx(compressor->ctx);
+    }
+
+    zstd_proxy_lz4_encoder_destroy(compressor->lz4);
+    zstd_proxy_framing_destroy(compressor->framing);
+
+    zstd_proxy_dedup_destroy(compressor->dedup);
+    free(compressor->staging);
+}
+
+static int zstd_proxy_decompressor_init(
+    zstd_proxy_decompressor *decompressor,
+    zstd_proxy *proxy,
+    zstd_proxy_dedup_link *link
+) {
+    zstd_proxy_options *options = &proxy->options;
+
+    *decompressor = (zstd_proxy_decompressor){
+        .ctx = NULL,
+        .lz4 = NULL,
+        .codec = zstd_proxy_kernel_codec(options, true) == zstd_proxy_codec_none
+            ? zstd_proxy_codec_none
+            : zstd_proxy_codec_zstd,
+        .peer_codecs = &proxy->peer_codecs,
+        .boundary = true,
+        .header_pos = 0,
+        .header_size = 0,
+        .skip = 0,
+        .dictionary_id = options->zstd.dictionary != NULL
+            ? ZSTD_getDictID_fromDict(options->zstd.dictionary, options->zstd.dictionary_size)
+            : 0,
+        .window_log_max = options->zstd.window_log > 27 ? options->zstd.window_log : 27,
+        .dedup = NULL,
+        .staging = NULL,
+        .staged = { NULL, 0, 0 },
+        .id = proxy->id,
+        .chunks = 0,
+    };
+
+    int error = zstd_proxy_dedup_init(options, link, &decompressor->dedup, &decompressor->staging, false);
+
+    decompressor->staged.src = decompressor->staging;
+
+    if (error != 0) {
+        return error;
+    }
+
+    if (decompressor->codec == zstd_proxy_codec_none) {
+        return 0;
+    }
+
+    if ((decompressor->ctx = ZSTD_createDCtx_advanced(zstd_proxy_arena_allocator(&proxy->metrics.zstd_memory))) == NULL) {
+        log_error("failed to create decompression context");
+
+        return ENOMEM;
+    }
+
+    size_t size = 0;
+
+    // Decoders refuse windows above 2^27 unless told otherwise
+    if (options->zstd.window_log > 27) {
+        size = ZSTD_DCtx_setParameter(decompressor->ctx, ZSTD_d_windowLogMax, options->zstd.window_log);
+    }
+
+    if (!ZSTD_isError(size) && options->zstd.dictionary != NULL) {
+        size = ZSTD_DCtx_loadDictionary(
+            decompressor->ctx,
+            options->zstd.dictionary,
+            options->zstd.dictionary_size
+        );
+    }
+
+    if (ZSTD_isError(size)) {
+        log_error("failed to configure decompression context: %s", ZSTD_getErrorName(size));
+
+        return size;
+    }
+
+    return 0;
+}
+
+static void zstd_proxy_decompressor_free(zstd_proxy_decompressor *decompressor) {
+    if (decompressor->ctx != NULL) {
+        ZSTD_freeDCtx(decompressor->ctx);
+    }
+
+    zstd_proxy_lz4_decoder_destroy(decompressor->lz4);
+
+    zstd_proxy_dedup_destroy(decompressor->dedup);
+    free(decompressor->staging);
+}
+
+struct zstd_proxy_stream {
+    bool decompress;
+    zstd_proxy_process_callback process;
+    void *process_data;
+
+    union {
+        zstd_proxy_compressor compressor;
+        zstd_proxy_decompressor decompressor;
+    };
+};
+
+int zstd_proxy_stream_create(zstd_proxy_stream **stream_ptr, zstd_proxy *proxy, bool decompress) {
+    zstd_proxy_stream *stream = malloc(sizeof(zstd_proxy_stream));
+
+    *stream_ptr = NULL;
+
+    if (stream == NULL) {
+        return ENOMEM;
+    }
+
+    stream->decompress = decompress;
+
+    int error = decompress
+        ? zstd_proxy_decompressor_init(&stream->decompressor, proxy, NULL)
+        : zstd_proxy_compressor_init(&stream->compressor, proxy, NULL);
+
+    if (error != 0) {
+        zstd_proxy_stream_destroy(stream);
+
+        return error;
+    }
+
+    if (decompress) {
+        stream->process = zstd_proxy_decompress_kernel(&stream->decompressor);
+        stream->process_data = &stream->decompressor;
+    } else {
+        stream->process = zstd_proxy_compress_kernel(&stream->compressor);
+        stream->process_data = &stream->compressor;
+    }
+
+    *stream_ptr = stream;
+
+    return 0;
+}
+
+int zstd_proxy_stream_process(zstd_proxy_stream *stream, ZSTD_inBuffer *input, ZSTD_outBuffer *output) {
+    return stream->process(stream->process_data, input, output);
+}
+
+void zstd_proxy_stream_end(zstd_proxy_stream *stream) {
+    if (!stream->decompress) {
+        zstd_proxy_compress_end(&stream->compressor);
+    }
+}
+
+void zstd_proxy_stream_destroy(zstd_proxy_stream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+
+    if (stream->decompress) {
+        zstd_proxy_decompressor_free(&stream->decompressor);
+    } else {
+        zstd_proxy_compressor_free(&stream->compressor);
+    }
+
+    free(stream);
+}
+
+void *zstd_proxy_compress_thread(void *data_ptr) {
+    zstd_proxy_thread *data = data_ptr;
+    zstd_proxy_compressor compressor;
+    int error = zstd_proxy_compressor_init(&compressor, data->proxy, &data->proxy->dedup_link);
+
+    if (error == 0) {
+        error = zstd_proxy_io(
+            data,
+            zstd_proxy_compress_kernel(&compressor),
+            &compressor,
+            zstd_proxy_compress_end_callback(&compressor),
+            false
+        );
+    }
+
+    zstd_proxy_compressor_free(&compressor);
+
+    data->compress_error = error;
+
+    return NULL;
+}
+
+void *zstd_proxy_decompress_thread(void *data_ptr) {
+    zstd_proxy_thread *data = data_ptr;
+    zstd_proxy_decompressor decompressor;
+    int error = zstd_proxy_decompressor_init(&decompressor, data->proxy, &data->proxy->dedup_link);
+
+    if (error == 0) {
+        error = zstd_proxy_io(data, zstd_proxy_decompress_kernel(&decompressor), &decompressor, NULL, true);
+    }
+
+    zstd_proxy_decompressor_free(&decompressor);
+
+    data->decompress_error = error;
+
+    return NULL;
+}
+
+void zstd_proxy_init(zstd_proxy *proxy) {
+    static uint64_t next_id = 0;
+
+    proxy->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+
+    proxy->listen.fd = -1;
+    proxy->listen.data = NULL;
+    proxy->listen.data_length = 0;
+
+    proxy->connect.fd = -1;
+    proxy->connect.data = NULL;
+    proxy->connect.data_length = 0;
+
+    memset(&proxy->metrics, 0, sizeof(proxy->metrics));
+    memset(&proxy->latency, 0, sizeof(proxy->latency));
+
+    proxy->peer_codecs = 0;
+    memset(&proxy->dedup_link, 0, sizeof(proxy->dedup_link));
+
+    pthread_mutex_init(&proxy->lock, NULL);
+
+    for (int i = 0; i < 2; i++) {
+        proxy->wakeup[i].read_fd = proxy->wakeup[i].write_fd = -1;
+    }
+
+    proxy->options.stop = false;
+    proxy->options.close_reason = zstd_proxy_close_none;
+    proxy->options.buffer_size = 4 * 1024 * 1024;
+
+    proxy->options.idle_timeout_ms = 0;
+    proxy->options.stall_timeout_ms = 0;
+    proxy->options.active_at = 0;
+
+    proxy->options.generation = 0;
+    proxy->options.paused = false;
+    proxy->options.recv_size = 0;
+    proxy->options.depth_limit = 0;
+    proxy->options.weight = 1;
+
+    proxy->options.zstd.enabled = true;
+    proxy->options.zstd.level = 1;
+    proxy->options.zstd.window_log = 0;
+    proxy->options.zstd.dictionary = NULL;
+    proxy->options.zstd.dictionary_size = 0;
+
+    proxy->options.codec.preferred = zstd_proxy_codec_zstd;
+    proxy->options.codec.negotiate = true;
+    proxy->options.codec.lz4_level = 0;
+
+    proxy->options.framing.protocol = zstd_proxy_framing_none;
+    proxy->options.framing.length_offset = 0;
+    proxy->options.framing.length_size = 4;
+    proxy->options.framing.length_adjust = 0;
+    proxy->options.framing.length_little_endian = false;
+
+    proxy->options.dedup.enabled = false;
+    proxy->options.dedup.cache_size = 16 * 1024 * 1024;
+    proxy->options.dedup.sessions = 8;
+
+    memset(&proxy->options.affinity, 0, sizeof(proxy->options.affinity));
+    memset(&proxy->options.busy_poll, 0, sizeof(proxy->options.busy_poll));
+    memset(&proxy->options.socket, 0, sizeof(proxy->options.socket));
+
+    proxy->options.posix.depth = 2;
+    proxy->options.posix.zero_copy_threshold = 64 * 1024;
+
+    proxy->options.io_uring.enabled = true;
+    proxy->options.io_uring.depth = 4;
+    proxy->options.io_uring.zero_copy = true;
+    proxy->options.io_uring.fixed_buffers = true;
+}
+
+/** Address of the peer without its port, which changes with every connection it opens. */
+static uint64_t zstd_proxy_peer_key(int fd) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    const uint8_t *bytes = NULL;
+    size_t size = 0;
+    uint64_t key = UINT64_C(0xCBF29CE484222325);
+
+    if (getpeername(fd, (struct sockaddr *)&address, &length) != 0) {
+        return 0;
+    }
+
+    if (address.ss_family == AF_INET) {
+        bytes = (const uint8_t *)&((struct sockaddr_in *)&address)->sin_addr;
+        size = sizeof(struct in_addr);
+    } else if (address.ss_family == AF_INET6) {
+        bytes = (const uint8_t *)&((struct sockaddr_in6 *)&address)->sin6_addr;
+        size = sizeof(struct in6_addr);
+    }
+
+    // FNV-1a, UNIX sockets all share the family key
+    key = (key ^ address.ss_family) * UINT64_C(0x100000001B3);
+
+    for (size_t i = 0; i < size; i++) {
+        key = (key ^ bytes[i]) * UINT64_C(0x100000001B3);
+    }
+
+    return key;
+}
+
+/** Count the connection and open its wakeups, `zstd_proxy_end` must be called even on error. */
+static int zstd_proxy_begin(zstd_proxy *proxy) {
+    int error = 0;
+    zstd_proxy_metrics *metrics = &proxy->metrics;
+    zstd_proxy_metrics *global_metrics = zstd_proxy_metrics_global();
+    zstd_proxy_wakeup wakeup[2] = { { -1, -1 }, { -1, -1 } };
+
+    zstd_proxy_metrics_add(&metrics->connections_opened, &global_metrics->connections_opened, 1);
+    zstd_proxy_metrics_add(&metrics->connections_active, &global_metrics->connections_active, 1);
+
+    if ((error = zstd_proxy_wakeup_open(&wakeup[0])) == 0) {
+        error = zstd_proxy_wakeup_open(&wakeup[1]);
+    }
+
+    pthread_mutex_lock(&proxy->lock);
+    memcpy(proxy->wakeup, wakeup, sizeof(wakeup));
+    pthread_mutex_unlock(&proxy->lock);
+
+    proxy->options.active_at = zstd_proxy_now_ns();
+
+    if (proxy->options.dedup.enabled) {
+        zstd_proxy_dedup_link_open(
+            &proxy->dedup_link,
+            zstd_proxy_peer_key(proxy->connect.fd),
+            proxy->options.dedup.cache_size,
+            proxy->options.dedup.sessions
+        );
+    }
+
+    return error;
+}
+
+/** Close the sockets and wakeups, returns the final error of the connection. */
+static int zstd_proxy_end(zstd_proxy *proxy, int error) {
+    zstd_proxy_metrics *metrics = &proxy->metrics;
+    zstd_proxy_metrics *global_metrics = zstd_proxy_metrics_global();
+
+    pthread_mutex_lock(&proxy->lock);
+
+    close(proxy->listen.fd);
+    close(proxy->connect.fd);
+
+    proxy->listen.fd = -1;
+    proxy->connect.fd = -1;
+
+    zstd_proxy_wakeup_close(&proxy->wakeup[0]);
+    zstd_proxy_wakeup_close(&proxy->wakeup[1]);
+
+    pthread_mutex_unlock(&proxy->lock);
+
+    // The other direction usually fails with a broken pipe once a timeout shut the sockets down
+    switch (__atomic_load_n(&proxy->options.close_reason, __ATOMIC_RELAXED)) {
+        case zstd_proxy_close_idle_timeout:
+        case zstd_proxy_close_stall_timeout:
+            error = ETIMEDOUT;
+            break;
+        default:
+            break;
+    }
+
+    zstd_proxy_dedup_link_close(&proxy->dedup_link);
+
+    zstd_proxy_metrics_add(&metrics->connections_active, &global_metrics->connections_active, -1);
+
+    if (error != 0) {
+        zstd_proxy_metrics_add(&metrics->connections_failed, &global_metrics->connections_failed, 1);
+    }
+
+    return error;
+}
+
+/** Connection thread. */
+int zstd_proxy_run(zstd_proxy *proxy) {
+    int error = 0;
+    int listen_fd = proxy->listen.fd;
+    int connect_fd = proxy->connect.fd;
+    pthread_t compress_thread_id = 0, decompress_thread_id = 0;
+    zstd_proxy_thread *thread = malloc(sizeof(zstd_proxy_thread));
+
+    thread->proxy = proxy;
+    thread->compress_error = 0;
+    thread->decompress_error = 0;
+
+    error = zstd_proxy_begin(proxy);
+
+    if (error != 0) {
+        goto cleanup;
+    }
+
+    error = zstd_proxy_prepare(&proxy->options, listen_fd, connect_fd, false);
+
+    if (error != 0) {
+        goto cleanup;
+    }
+
+#if ENABLE_URING
+    if (proxy->options.io_uring.enabled) {
+        zstd_proxy_uring_options(&proxy->options);
+    }
+#endif
+
+    error = pthread_create(&compress_thread_id, NULL, zstd_proxy_compress_thread, thread);
+
+    if (error != 0) {
+        log_error("error creating read thread: %s", strerror(error));
+
+        goto cleanup;
+    }
+
+    error = pthread_create(&decompress_thread_id, NULL, zstd_proxy_decompress_thread, thread);
+
+    if (error != 0) {
+        log_error("error creating write thread: %s", strerror(error));
+
+        goto cleanup;
+    }
+
+    cleanup:
+
+    if (error != 0) {
+        shutdown(listen_fd, SHUT_RDWR);
+        shutdown(connect_fd, SHUT_RDWR);
+    } else {
+        if (compress_thread_id != 0) {
+            error = pthread_join(compress_thread_id, NULL);
+
+            if (error != 0) {
+                log_error("error running compress thread: %s", strerror(error));
+            }
+        }
+
+        if (decompress_thread_id != 0) {
+            error = pthread_join(decompress_thread_id, NULL);
+
+            if (error != 0) {
+                log_error("error running decompress thread: %s", strerror(error));
+            }
+        }
+    }
+
+    if (thread->compress_error != 0) {
+        error = thread->compress_error;
+    } else if (thread->decompress_error != 0) {
+        error = thread->decompress_error;
+    }
+
+    free(thread);
+
+    return zstd_proxy_end(proxy, error);
+}
+
+#if ENABLE_EPOLL
+typedef struct {
+    zstd_proxy *proxy;
+    zstd_proxy_compressor compressor;
+    zstd_proxy_decompressor decompressor;
+    zstd_proxy_connection compress;
+    zstd_proxy_connection decompress;
+    zstd_proxy_done_callback done;
+    void *data;
+} zstd_proxy_session;
+
+static void zstd_proxy_session_free(zstd_proxy_session *session) {
+    zstd_proxy_compressor_free(&session->compressor);
+    zstd_proxy_decompressor_free(&session->decompressor);
+
+    free(session);
+}
+
+static void zstd_proxy_session_done(void *data, int error) {
+    zstd_proxy_session *session = data;
+    zstd_proxy_done_callback done = session->done;
+    zstd_proxy *proxy = session->proxy;
+    void *done_data = session->data;
+
+    zstd_proxy_session_free(session);
+
+    error = zstd_proxy_end(proxy, error);
+
+    done(proxy, error, done_data);
+}
+#endif
+
+int zstd_proxy_start(zstd_proxy *proxy, zstd_proxy_epoll *engine, zstd_proxy_done_callback done, void *data) {
+#if ENABLE_EPOLL
+    zstd_proxy_session *session = calloc(1, sizeof(zstd_proxy_session));
+    int error = zstd_proxy_begin(proxy);
+
+    if (session == NULL) {
+        error = ENOMEM;
+    }
+
+    if (error != 0) {
+        goto cleanup;
+    }
+
+    if (!zstd_proxy_is_socket(proxy->listen.fd) || !zstd_proxy_is_socket(proxy->connect.fd)) {
+        error = ENOTSOCK;
+        log_error("epoll requires sockets");
+
+        goto cleanup;
+    }
+
+    if ((error = zstd_proxy_prepare(&proxy->options, proxy->listen.fd, proxy->connect.fd, true)) != 0) {
+        goto cleanup;
+    }
+
+    // Workers are shared so they don't spin, but epoll_wait busy polls the sockets
+    zstd_proxy_busy_poll_socket(&proxy->options.busy_poll, proxy->listen.fd);
+    zstd_proxy_busy_poll_socket(&proxy->options.busy_poll, proxy->connect.fd);
+
+    if ((error = zstd_proxy_compressor_init(&session->compressor, proxy, &proxy->dedup_link)) != 0) {
+        goto cleanup;
+    }
+
+    if ((error = zstd_proxy_decompressor_init(&session->decompressor, proxy, &proxy->dedup_link)) != 0) {
+        goto cleanup;
+    }
+
+    session->proxy = proxy;
+    session->done = done;
+    session->data = data;
+
+    zstd_proxy_connection_init(
+        &session->compress,
+        proxy,
+        zstd_proxy_compress_kernel(&session->compressor),
+        &session->compressor,
+        zstd_proxy_compress_end_callback(&session->compressor),
+        false
+    );
+    zstd_proxy_connection_init(
+        &session->decompress,
+        proxy,
+        zstd_proxy_decompress_kernel(&session->decompressor),
+        &session->decompressor,
+        NULL,
+        true
+    );
+
+    error = zstd_proxy_epoll_add(engine, &session->compress, &session->decompress, zstd_proxy_session_done, session);
+
+    cleanup:
+
+    if (error != 0) {
+        if (session != NULL) {
+            zstd_proxy_session_free(session);
+        }
+
+        zstd_proxy_end(proxy, error);
+    }
+
+    return error;
+#else
+    return ENOTSUP;
+#endif
+}
+
+void zstd_proxy_stop(zstd_proxy *proxy) {
+    zstd_proxy_set_close_reason(&proxy->options, zstd_proxy_close_stopped);
+    __atomic_store_n(&proxy->options.stop, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&proxy->lock);
+
+    zstd_proxy_notify_locked(proxy);
+
+    // Unblock a posix recv() or send(), unless the sockets were already closed
+    if (proxy->listen.fd >= 0) {
+        shutdown(proxy->listen.fd, SHUT_RDWR);
+    }
+
+    if (proxy->connect.fd >= 0) {
+        shutdown(proxy->connect.fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_unlock(&proxy->lock);
+}
+
+void zstd_proxy_pause(zstd_proxy *proxy, bool paused) {
+    __atomic_store_n(&proxy->options.paused, paused, __ATOMIC_RELAXED);
+
+    // Time spent paused doesn't count as idle
+    zstd_proxy_touch(&proxy->options, zstd_proxy_now_ns());
+
+    zstd_proxy_notify(proxy);
+}
+
+void zstd_proxy_set_level(zstd_proxy *proxy, int level) {
+    __atomic_store_n(&proxy->options.zstd.level, level, __ATOMIC_RELAXED);
+
+    zstd_proxy_notify(proxy);
+}
+
+void zstd_proxy_set_buffer_limits(zstd_proxy *proxy, size_t recv_size, size_t depth) {
+    __atomic_store_n(&proxy->options.recv_size, recv_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&proxy->options.depth_limit, depth, __ATOMIC_RELAXED);
+
+    zstd_proxy_notify(proxy);
+}
@@ -0,0 +1,108 @@
+import { readFileSync } from "fs";
+
+import {
+  captureStart,
+  captureStats,
+  captureStop,
+} from "../native/build/Release/zstd_proxy.node";
+
+export interface ZstdProxyCaptureOptions {
+  /** File to capture to, created or truncated. */
+  path: string;
+  /** Size of the ring file in bytes, the oldest chunks are overwritten once it's full. Defaults to 64 MB. */
+  size?: number;
+  /** Capture one chunk out of `sample` per direction. Defaults to `1`. */
+  sample?: number;
+}
+
+export interface ZstdProxyCaptureStats {
+  /** Chunks captured, including the ones overwritten since. */
+  records: number;
+  /** Bytes captured. */
+  bytes: number;
+  /** Chunks overwritten by newer ones. */
+  overwritten: number;
+  /** Chunks dropped because the oldest chunk in their way was still being copied. */
+  dropped: number;
+  /** Nanoseconds the proxies spent capturing. */
+  recordNs: number;
+}
+
+export interface ZstdProxyCaptureRecord {
+  /** Connection the chunk belongs to, unique within the capturing process. */
+  connection: bigint;
+  /** `compress` for plaintext received by the compressing side, `decompress` for plaintext it sent. */
+  direction: "compress" | "decompress";
+  /** Capture time in nanoseconds since the epoch. */
+  timestamp: bigint;
+  /** Size of the chunk, above `data.length` when it was truncated. */
+  length: number;
+  data: Buffer;
+}
+
+/**
+ * Capture sampled plaintext chunks of every connection of the process to a memory-mapped ring file,
+ * replacing the running capture. Pass `null` to stop.
+ */
+export function zstdProxyCapture(options: ZstdProxyCaptureOptions | null): void {
+  if (options === null) {
+    return captureStop();
+  }
+
+  captureStart(options.path, options.size ?? 64 * 1024 * 1024, options.sample ?? 1);
+}
+
+/** Counters of the running capture, `null` when there is none. */
+export function zstdProxyCaptureStats(): ZstdProxyCaptureStats | null {
+  return captureStats();
+}
+
+const headerSize = 80;
+const recordSize = 32;
+const states = { committed: 1, padding: 2 };
+
+/** Read the chunks of a capture file oldest first, see `zstd-proxy-capture.h` for the format. */
+export function readZstdProxyCapture(path: string): ZstdProxyCaptureRecord[] {
+  const file = readFileSync(path);
+
+  if (file.length < headerSize || file.toString("latin1", 0, 8) !== "ZPCAPTUR" || file.readUInt32LE(8) !== 1) {
+    throw new Error(`Invalid capture file: ${path}`);
+  }
+
+  const base = file.readUInt32LE(12);
+  const capacity = Number(file.readBigUInt64LE(16));
+  const entries = Number(file.readBigUInt64LE(40));
+  const records: ZstdProxyCaptureRecord[] = [];
+  let offset = Number(file.readBigUInt64LE(32));
+
+  for (let i = 0; i < entries; i++) {
+    if (offset + recordSize > capacity) {
+      offset = 0;
+    }
+
+    const position = base + offset;
+    const state = file.readUInt32LE(position);
+
+    if (state === states.padding) {
+      offset = 0;
+
+      continue;
+    }
+
+    const length = file.readUInt32LE(position + 8);
+
+    if (state === states.committed) {
+      records.push({
+        connection: file.readBigUInt64LE(position + 16),
+        direction: file.readUInt32LE(position + 4) === 0 ? "compress" : "decompress",
+        timestamp: file.readBigUInt64LE(position + 24),
+        length: file.readUInt32LE(position + 12),
+        data: file.subarray(position + recordSize, position + recordSize + length),
+      });
+    }
+
+    offset += Math.ceil((recordSize + length) / 8) * 8;
+  }
+
+  return records;
+}
@@ -0,0 +1,859 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "zstd-proxy.h"
+#include "zstd-proxy-utils.h"
+#include "zstd-proxy-capture.h"
+#include "zstd-proxy-arena.h"
+#include "zstd-proxy-stripe.h"
+#include "zstd-proxy-balancer.h"
+
+#if __linux__
+#include "zstd-proxy-epoll.h"
+#endif
+
+/**
+ * Native equivalent of `zstd-proxy.cli.ts`, without a Node.js runtime.
+ *
+ * Accepts connections on `--listen`, opens a connection to `--connect` for each of them
+ * and proxies the pair, compressing the data received from the `--compress` side.
+ * With `--stripes`, the compressed side is a set of connections, see `zstd-proxy-stripe.h`.
+ * `--connect` takes a list of upstreams, each connection goes to one of them, see `zstd-proxy-balancer.h`.
+ */
+
+/** Most upstreams in `--connect`. */
+#define zstd_proxy_cli_upstreams_max 64
+
+typedef struct {
+    const char *listen;
+    char *connect;
+    const char *upstreams[zstd_proxy_cli_upstreams_max];
+    size_t upstream_count;
+    zstd_proxy_balancer_options balance;
+    /** Picks among `upstreams` when there are several. */
+    zstd_proxy_balancer *balancer;
+    /** Most time connecting to an upstream may take, in milliseconds, 0 for no limit. */
+    uint64_t connect_timeout_ms;
+    bool compress_listen;
+    bool epoll;
+    bool epoll_steal;
+    size_t epoll_workers;
+    size_t epoll_quantum;
+    const char *capture;
+    size_t capture_size;
+    size_t capture_sample;
+    zstd_proxy_stripe_options stripe;
+    /** Sets being accepted when the compressed side is striped and accepted. */
+    zstd_proxy_stripe_listener *stripes;
+    zstd_proxy_options options;
+} zstd_proxy_cli;
+
+/** A proxied connection, freed with its `proxy`. */
+typedef struct {
+    zstd_proxy proxy;
+    zstd_proxy_cli *cli;
+    /** Load of the upstream it's counted in, `NULL` with a single upstream. */
+    zstd_proxy_balancer_entry *upstream;
+} zstd_proxy_cli_connection;
+
+/** An accepted connection waiting for its stripe set and its upstream connection. */
+typedef struct {
+    zstd_proxy_cli *cli;
+    zstd_proxy_epoll *engine;
+    int fd;
+} zstd_proxy_cli_accepted;
+
+static void zstd_proxy_cli_usage(const char *name) {
+    fprintf(
+        stderr,
+        "usage: %s --listen=ADDRESS --connect=ADDRESS[,ADDRESS...] --compress=listen|connect [options]\n"
+        "  addresses are [host:]port, or a UNIX socket path starting with . or /, or null for /dev/null\n"
+        "  --balance=p2c|least     pick among several --connect addresses by queued data (default: p2c)\n"
+        "  --eject-failures=N      failed connections in a row ejecting an upstream (default: 3)\n"
+        "  --eject-time=MS         first ejection time, doubled for each repeated ejection (default: 10000)\n"
+        "  --eject-slow=MS         eject upstreams whose sends take longer on average, 0 to disable (default: 1000)\n"
+        "  --connect-timeout=MS    give up connecting to an upstream after this long, 0 to disable (default: 5000)\n"
+        "  --idle-timeout=MS       close connections without traffic for this long (default: 0, disabled)\n"
+        "  --stall-timeout=MS      close connections when a send is blocked for this long (default: 0, disabled)\n"
+        "  --zstd=0|1              compress (default: 1)\n"
+        "  --codec=zstd|lz4|none   codec to compress with, decompressing ends follow the peer (default: zstd)\n"
+        "  --negotiate=0|1         use Zstd until the peer announces it decodes --codec (default: 1)\n"
+        "  --level=N               Zstd level (default: 1)\n"
+        "  --lz4-level=N           LZ4 level, 3 and above for LZ4 HC (default: 0)\n"
+        "  --window-log=N          Zstd window log, both ends must accept it (default: 0, from the level)\n"
+        "  --dictionary=PATH       Zstd dictionary, both ends must use the same one (default: none)\n"
+        "  --zstd-cache=N          freed Zstd memory kept for new connections, accepts k/m/g suffixes (default: 64m)\n"
+        "  --zstd-memory-limit=N   Zstd memory of all connections, accepts k/m/g suffixes (default: 0, no limit)\n"
+        "  --framing=PROTOCOL      flush at the end of messages: none, length, http or lines (default: none)\n"
+        "  --length-offset=N       --framing=length: bytes before the length field (default: 0)\n"
+        "  --length-size=N         --framing=length: length field size, from 1 to 8 (default: 4)\n"
+        "  --length-adjust=N       --framing=length: added to the length to get the bytes following it (default: 0)\n"
+        "  --length-little-endian=0|1  --framing=length: little-endian length field (default: 0)\n"
+        "  --dedup=0|1             deduplicate repeated data before compressing, both ends must agree (default: 0)\n"
+        "  --dedup-cache=N         dedup cache size per direction, accepts k/m/g suffixes (default: 16m)\n"
+        "  --dedup-sessions=N      dedup caches of closed connections kept for the same peer, 0 for none (default: 8)\n"
+        "  --stripes=N             connections carrying each compressed stream, both ends must enable it (default: 1)\n"
+        "  --stripe-segment=N      largest striped segment, accepts k/m/g suffixes (default: 64k)\n"
+        "  --stripe-reorder=N      out-of-order bytes buffered per stream, accepts k/m/g suffixes (default: 16m)\n"
+        "  --buffer-size=N         buffer size, accepts k/m/g suffixes (default: 4m)\n"
+        "  --io-uring=0|1          use io_uring on Linux (default: 1)\n"
+        "  --depth=N               io_uring depth (default: 4)\n"
+        "  --zero-copy=0|1         io_uring zero-copy (default: 1)\n"
+        "  --fixed-buffers=0|1     io_uring fixed buffers (default: 1)\n"
+        "  --posix-depth=N         posix output buffers per direction (default: 2)\n"
+        "  --epoll=0|1             serve connections on epoll workers on Linux (default: 0)\n"
+        "  --workers=N             epoll worker threads, 0 for one per CPU (default: 0)\n"
+        "  --quantum=N             bytes processed per turn on a busy epoll worker, 0 for no limit (default: 64k)\n"
+        "  --weight=N              quanta per turn of each connection (default: 1)\n"
+        "  --steal=0|1             let idle epoll workers take over waiting connections (default: 1)\n"
+        "  --cpus=LIST             pin connection threads or epoll workers to CPUs, eg. 0-3,8 (default: none)\n"
+        "  --incoming-cpu=0|1      run connections on the CPU receiving their packets when in --cpus (default: 0)\n"
+        "  --spin=US               spin on completions or recvs before sleeping (default: 0, disabled)\n"
+        "  --busy-poll=US          SO_BUSY_POLL on the sockets (default: 0, system default)\n"
+        "  --prefer-busy-poll=0|1  SO_PREFER_BUSY_POLL on the sockets (default: 0)\n"
+        "  --taskrun=MODE          io_uring task work: default, coop or defer (default: default)\n"
+        "  --notsent-lowat=N       TCP_NOTSENT_LOWAT, accepts k/m/g suffixes (default: 0, system default)\n"
+        "  --sndbuf=N              SO_SNDBUF, accepts k/m/g suffixes (default: 0, autotuned)\n"
+        "  --rcvbuf=N              SO_RCVBUF, accepts k/m/g suffixes (default: 0, autotuned)\n"
+        "  --nodelay=0|1           TCP_NODELAY (default: 0, system default)\n"
+        "  --cork=0|1              send frames larger than a buffer with MSG_MORE (default: 0)\n"
+        "  --capture=PATH          capture plaintext chunks to a ring file, SIGUSR2 toggles it (default: none)\n"
+        "  --capture-size=N        capture file size, accepts k/m/g suffixes (default: 64m)\n"
+        "  --capture-sample=N      capture one chunk out of N (default: 1)\n",
+        name
+    );
+}
+
+/** Parse an unsigned integer with an optional k/m/g suffix. */
+static bool zstd_proxy_cli_parse_size(const char *value, size_t *size) {
+    char *end = NULL;
+    unsigned long long parsed = strtoull(value, &end, 10);
+
+    if (end == value) {
+        return false;
+    }
+
+    switch (*end) {
+        case 'g': parsed *= 1024;
+        // fall through
+        case 'm': parsed *= 1024;
+        // fall through
+        case 'k': parsed *= 1024;
+            end++;
+            break;
+    }
+
+    *size = parsed;
+
+    return *end == '\0';
+}
+
+static bool zstd_proxy_cli_parse_int(const char *value, int64_t *number) {
+    char *end = NULL;
+
+    *number = strtoll(value, &end, 10);
+
+    return end != value && *end == '\0';
+}
+
+static bool zstd_proxy_cli_parse_bool(const char *value, bool *flag) {
+    *flag = strcmp(value, "1") == 0;
+
+    return *flag || strcmp(value, "0") == 0;
+}
+
+/** Read a whole file into a buffer kept for the lifetime of the process. */
+static bool zstd_proxy_cli_read_file(const char *path, const void **data, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    char *buffer = NULL;
+    long length = -1;
+
+    if (file != NULL && fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        buffer = malloc(length);
+
+        if (buffer != NULL && fread(buffer, 1, length, file) != (size_t)length) {
+            free(buffer);
+
+            buffer = NULL;
+        }
+    }
+
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    if (buffer == NULL) {
+        log_error("failed to read %s", path);
+
+        return false;
+    }
+
+    *data = buffer;
+    *size = length;
+
+    return true;
+}
+
+static bool zstd_proxy_cli_is_path(const char *address) {
+    return address[0] == '.' || address[0] == '/';
+}
+
+/** `connect`, failing with `ETIMEDOUT` after `timeout_ms` unless it's 0. */
+static int zstd_proxy_cli_connect_socket(int fd, const struct sockaddr *address, socklen_t length, uint64_t timeout_ms) {
+    int flags = fcntl(fd, F_GETFL);
+
+    if (timeout_ms == 0 || flags < 0) {
+        return connect(fd, address, length);
+    }
+
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return -1;
+    }
+
+    int error = connect(fd, address, length) == 0 ? 0 : errno;
+
+    if (error == EINPROGRESS) {
+        struct pollfd event = { .fd = fd, .events = POLLOUT };
+        socklen_t size = sizeof(error);
+        int ready;
+
+        while ((ready = poll(&event, 1, timeout_ms)) < 0 && errno == EINTR);
+
+        if (ready < 0) {
+            error = errno;
+        } else if (ready == 0) {
+            error = ETIMEDOUT;
+        } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0) {
+            error = errno;
+        }
+    }
+
+    // Back to blocking, the proxy sets the mode its backend needs
+    if (error == 0 && fcntl(fd, F_SETFL, flags) != 0) {
+        error = errno;
+    }
+
+    errno = error;
+
+    return error == 0 ? 0 : -1;
+}
+
+/** Open a listening socket or a connection to `address`, returns the fd or -1. Connecting gives up after `timeout_ms`. */
+static int zstd_proxy_cli_socket(const char *address, bool listening, uint64_t timeout_ms) {
+    int fd = -1;
+
+    if (strcmp(address, "null") == 0) {
+        return listening ? -1 : open("/dev/null", O_RDWR);
+    }
+
+    if (zstd_proxy_cli_is_path(address)) {
+        struct sockaddr_un path = { .sun_family = AF_UNIX };
+
+        if (strlen(address) >= sizeof(path.sun_path)) {
+            log_error("socket path too long: %s", address);
+
+            return -1;
+        }
+
+        strcpy(path.sun_path, address);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            log_error("error creating socket: %s", strerror(errno));
+
+            return -1;
+        }
+
+        if (listening) {
+            unlink(address);
+        }
+
+        if (
+            listening
+                ? bind(fd, (struct sockaddr *)&path, sizeof(path))
+                : zstd_proxy_cli_connect_socket(fd, (struct sockaddr *)&path, sizeof(path), timeout_ms)
+        ) {
+            log_error("error %s %s: %s", listening ? "binding" : "connecting to", address, strerror(errno));
+            close(fd);
+
+            return -1;
+        }
+    } else {
+        char host[256] = "";
+        const char *port = strrchr(address, ':');
+
+        if (port == NULL) {
+            port = address;
+        } else if ((size_t)(port - address) < sizeof(host)) {
+            memcpy(host, address, port - address);
+            host[port - address] = '\0';
+            port++;
+        } else {
+            log_error("host name too long: %s", address);
+
+            return -1;
+        }
+
+        struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = listening ? AI_PASSIVE : 0 };
+        struct addrinfo *addresses = NULL;
+        int error = getaddrinfo(host[0] == '\0' ? NULL : host, port, &hints, &addresses);
+
+        if (error != 0) {
+            log_error("error resolving %s: %s", address, gai_strerror(error));
+
+            return -1;
+        }
+
+        for (struct addrinfo *info = addresses; info != NULL; info = info->ai_next) {
+            int enable = 1;
+
+            if ((fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol)) < 0) {
+                continue;
+            }
+
+            if (listening) {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+            }
+
+            if ((
+                listening
+                    ? bind(fd, info->ai_addr, info->ai_addrlen)
+                    : zstd_proxy_cli_connect_socket(fd, info->ai_addr, info->ai_addrlen, timeout_ms)
+            ) == 0) {
+                break;
+            }
+
+            close(fd);
+            fd = -1;
+        }
+
+        if (fd < 0) {
+            log_error("error %s %s: %s", listening ? "binding" : "connecting to", address, strerror(errno));
+        }
+
+        freeaddrinfo(addresses);
+    }
+
+    if (fd >= 0 && listening && listen(fd, SOMAXCONN) != 0) {
+        log_error("error listening on %s: %s", address, strerror(errno));
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+/** Toggle the capture on `SIGUSR2`, blocked in every other thread. */
+static void *zstd_proxy_cli_capture_thread(void *data) {
+    zstd_proxy_cli *cli = data;
+    bool capturing = true;
+    sigset_t signals;
+    int received;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+
+    while (sigwait(&signals, &received) == 0) {
+        if (capturing) {
+            zstd_proxy_capture_stop();
+            printf("Capture stopped\n");
+        } else if (zstd_proxy_capture_start(cli->capture, cli->capture_size, cli->capture_sample) == 0) {
+            printf("Capture started to %s\n", cli->capture);
+        }
+
+        capturing = !capturing;
+    }
+
+    return NULL;
+}
+
+static void zstd_proxy_cli_closed(zstd_proxy *proxy, int error) {
+    zstd_proxy_cli_connection *connection = (zstd_proxy_cli_connection *)proxy;
+    zstd_proxy_close_reason reason = __atomic_load_n(&proxy->options.close_reason, __ATOMIC_RELAXED);
+
+    if (error != 0) {
+        log_error("connection closed with error %d: %s", error, strerror(error));
+    } else if (reason != zstd_proxy_close_none) {
+        printf("Connection closed (%s)\n", zstd_proxy_close_reason_names[reason]);
+    } else {
+        printf("Connection closed\n");
+    }
+
+    fflush(stdout);
+
+    if (connection->upstream != NULL) {
+        zstd_proxy_balancer_closed(connection->cli->balancer, connection->upstream);
+    }
+
+    free(connection);
+}
+
+static void zstd_proxy_cli_done(zstd_proxy *proxy, int error, void *data) {
+    zstd_proxy_cli_closed(proxy, error);
+}
+
+/** Open a connection to `address`, or a striped set of them when it's the compressed side. */
+static int zstd_proxy_cli_connect_to(zstd_proxy_cli *cli, const char *address) {
+    int fds[zstd_proxy_stripe_max];
+    int fd = -1;
+
+    if (!cli->compress_listen || cli->stripe.count == 1) {
+        return zstd_proxy_cli_socket(address, false, cli->connect_timeout_ms);
+    }
+
+    for (size_t i = 0; i < cli->stripe.count; i++) {
+        if ((fds[i] = zstd_proxy_cli_socket(address, false, cli->connect_timeout_ms)) < 0) {
+            while (i-- > 0) {
+                close(fds[i]);
+            }
+
+            return -1;
+        }
+    }
+
+    return zstd_proxy_stripe_connect(fds, &cli->stripe, &fd) == 0 ? fd : -1;
+}
+
+/** Connect to one of the upstreams, trying the next pick when one fails. Sets `upstream` to its index. */
+static int zstd_proxy_cli_connect(zstd_proxy_cli *cli, size_t *upstream) {
+    int fd = -1;
+
+    *upstream = 0;
+
+    if (cli->balancer == NULL) {
+        return zstd_proxy_cli_connect_to(cli, cli->upstreams[0]);
+    }
+
+    for (size_t attempt = 0; attempt < cli->upstream_count && fd < 0; attempt++) {
+        *upstream = zstd_proxy_balancer_pick(cli->balancer);
+        fd = zstd_proxy_cli_connect_to(cli, cli->upstreams[*upstream]);
+
+        zstd_proxy_balancer_connected(cli->balancer, *upstream, fd >= 0);
+    }
+
+    return fd;
+}
+
+/** Proxy `listen_fd` to a new connection, takes ownership of `listen_fd`. Without `engine`, runs it on this thread. */
+static int zstd_proxy_cli_open(zstd_proxy_cli *cli, zstd_proxy_epoll *engine, int listen_fd) {
+    int error = 0;
+    size_t upstream = 0;
+    int connect_fd = zstd_proxy_cli_connect(cli, &upstream);
+    zstd_proxy_cli_connection *connection = calloc(1, sizeof(zstd_proxy_cli_connection));
+    zstd_proxy *proxy = &connection->proxy;
+
+    if (connect_fd < 0 || connection == NULL) {
+        close(listen_fd);
+
+        if (connect_fd >= 0) {
+            close(connect_fd);
+        }
+
+        free(connection);
+
+        return connect_fd < 0 ? ECONNREFUSED : ENOMEM;
+    }
+
+    printf("Connection opened\n");
+    fflush(stdout);
+
+    zstd_proxy_init(proxy);
+
+    proxy->options = cli->options;
+    proxy->listen.fd = cli->compress_listen ? listen_fd : connect_fd;
+    proxy->connect.fd = cli->compress_listen ? connect_fd : listen_fd;
+    connection->cli = cli;
+
+    // Counted before it runs, it can close as soon as it starts
+    if (cli->balancer != NULL && (error = zstd_proxy_balancer_opened(
+        cli->balancer, upstream, proxy, cli->compress_listen, &connection->upstream
+    )) != 0) {
+        close(listen_fd);
+        close(connect_fd);
+        free(connection);
+
+        return error;
+    }
+
+    if (engine != NULL) {
+        // The sockets are closed on error
+        if ((error = zstd_proxy_start(proxy, engine, zstd_proxy_cli_done, NULL)) != 0) {
+            if (connection->upstream != NULL) {
+                zstd_proxy_balancer_closed(cli->balancer, connection->upstream);
+            }
+
+            free(connection);
+        }
+
+        return error;
+    }
+
+    zstd_proxy_cli_closed(proxy, zstd_proxy_run(proxy));
+
+    return 0;
+}
+
+static void *zstd_proxy_cli_thread(void *data) {
+    zstd_proxy_cli_accepted accepted = *(zstd_proxy_cli_accepted *)data;
+    int fd = accepted.fd;
+
+    free(data);
+
+    // Only the connection completing its set goes on with the stream, the others end here
+    if (accepted.cli->stripes != NULL && (zstd_proxy_stripe_accept(accepted.cli->stripes, fd, &fd) != 0 || fd < 0)) {
+        return NULL;
+    }
+
+    zstd_proxy_cli_open(accepted.cli, accepted.engine, fd);
+
+    return NULL;
+}
+
+/**
+ * Proxy `listen_fd` on a thread of its own, takes ownership of `listen_fd`. Stripe hellos are read and
+ * the upstream connection is made there, so a silent client or an unreachable upstream doesn't hold up
+ * the accept loop.
+ */
+static int zstd_proxy_cli_serve(zstd_proxy_cli *cli, zstd_proxy_epoll *engine, int listen_fd) {
+    zstd_proxy_cli_accepted *accepted = malloc(sizeof(zstd_proxy_cli_accepted));
+    pthread_t thread;
+    pthread_attr_t attributes;
+    int error = 0;
+
+    if (accepted == NULL) {
+        close(listen_fd);
+
+        return ENOMEM;
+    }
+
+    *accepted = (zstd_proxy_cli_accepted){ .cli = cli, .engine = engine, .fd = listen_fd };
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    if ((error = pthread_create(&thread, &attributes, zstd_proxy_cli_thread, accepted)) != 0) {
+        log_error("error creating connection thread: %s", strerror(error));
+
+        close(listen_fd);
+        free(accepted);
+    }
+
+    pthread_attr_destroy(&attributes);
+
+    return error;
+}
+
+int main(int argc, char **argv) {
+    zstd_proxy defaults;
+    zstd_proxy_cli cli = { 0 };
+    zstd_proxy_arena_options arena;
+    const char *compress = NULL;
+
+    zstd_proxy_init(&defaults);
+    zstd_proxy_arena_get_options(&arena);
+    zstd_proxy_stripe_default_options(&cli.stripe);
+    zstd_proxy_balancer_default_options(&cli.balance);
+
+    cli.options = defaults.options;
+    cli.epoll_quantum = 64 * 1024;
+    cli.epoll_steal = true;
+    cli.capture_size = 64 * 1024 * 1024;
+    cli.capture_sample = 1;
+    cli.connect_timeout_ms = 5000;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+
+        if (strcmp(arg, "--help") == 0) {
+            zstd_proxy_cli_usage(argv[0]);
+
+            return 0;
+        }
+
+        char *value = strchr(arg, '=');
+        bool valid = value != NULL && strncmp(arg, "--", 2) == 0;
+        size_t size = 0;
+        int64_t number = 0;
+
+        if (valid) {
+            *value++ = '\0';
+            arg += 2;
+
+            if (strcmp(arg, "listen") == 0) {
+                cli.listen = value;
+            } else if (strcmp(arg, "connect") == 0) {
+                cli.connect = value;
+            } else if (strcmp(arg, "compress") == 0) {
+                compress = value;
+                valid = strcmp(value, "listen") == 0 || strcmp(value, "connect") == 0;
+            } else if (strcmp(arg, "idle-timeout") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size);
+                cli.options.idle_timeout_ms = size;
+            } else if (strcmp(arg, "stall-timeout") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size);
+                cli.options.stall_timeout_ms = size;
+            } else if (strcmp(arg, "zstd") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.zstd.enabled);
+            } else if (strcmp(arg, "codec") == 0) {
+                cli.options.codec.preferred = zstd_proxy_codec_parse(value);
+                valid = cli.options.codec.preferred != zstd_proxy_codec_count;
+            } else if (strcmp(arg, "negotiate") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.codec.negotiate);
+            } else if (strcmp(arg, "level") == 0) {
+                valid = zstd_proxy_cli_parse_int(value, &number) && number >= ZSTD_minCLevel() && number <= ZSTD_maxCLevel();
+                cli.options.zstd.level = number;
+            } else if (strcmp(arg, "lz4-level") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size) && size <= 12;
+                cli.options.codec.lz4_level = size;
+            } else if (strcmp(arg, "zstd-cache") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &arena.cache_size);
+            } else if (strcmp(arg, "zstd-memory-limit") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &arena.limit);
+            } else if (strcmp(arg, "window-log") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size) && size <= 31;
+                cli.options.zstd.window_log = size;
+            } else if (strcmp(arg, "dictionary") == 0) {
+                valid = zstd_proxy_cli_read_file(value, &cli.options.zstd.dictionary, &cli.options.zstd.dictionary_size);
+            } else if (strcmp(arg, "framing") == 0) {
+                cli.options.framing.protocol = zstd_proxy_framing_parse(value);
+                valid = cli.options.framing.protocol != zstd_proxy_framing_count;
+            } else if (strcmp(arg, "length-offset") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size) && size <= 1000;
+                cli.options.framing.length_offset = size;
+            } else if (strcmp(arg, "length-size") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size) && size >= 1 && size <= 8;
+                cli.options.framing.length_size = size;
+            } else if (strcmp(arg, "length-adjust") == 0) {
+                valid = zstd_proxy_cli_parse_int(value, &cli.options.framing.length_adjust);
+            } else if (strcmp(arg, "length-little-endian") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.framing.length_little_endian);
+            } else if (strcmp(arg, "dedup") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.dedup.enabled);
+            } else if (strcmp(arg, "dedup-cache") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.dedup.cache_size) && cli.options.dedup.cache_size > 0;
+            } else if (strcmp(arg, "dedup-sessions") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.dedup.sessions);
+            } else if (strcmp(arg, "balance") == 0) {
+                cli.balance.policy = zstd_proxy_balance_parse(value);
+                valid = cli.balance.policy != zstd_proxy_balance_count;
+            } else if (strcmp(arg, "eject-failures") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.balance.max_failures) && cli.balance.max_failures > 0;
+            } else if (strcmp(arg, "eject-time") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size);
+                cli.balance.ejection_ms = size;
+            } else if (strcmp(arg, "eject-slow") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size);
+                cli.balance.slow_ms = size;
+            } else if (strcmp(arg, "connect-timeout") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size);
+                cli.connect_timeout_ms = size;
+            } else if (strcmp(arg, "stripes") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.stripe.count) && cli.stripe.count > 0 && cli.stripe.count <= zstd_proxy_stripe_max;
+            } else if (strcmp(arg, "stripe-segment") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.stripe.segment_size) && cli.stripe.segment_size > 0 && cli.stripe.segment_size <= zstd_proxy_stripe_segment_max;
+            } else if (strcmp(arg, "stripe-reorder") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.stripe.reorder_size);
+            } else if (strcmp(arg, "buffer-size") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.buffer_size) && cli.options.buffer_size > 0;
+            } else if (strcmp(arg, "io-uring") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.io_uring.enabled);
+            } else if (strcmp(arg, "depth") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.io_uring.depth) && cli.options.io_uring.depth > 0;
+            } else if (strcmp(arg, "zero-copy") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.io_uring.zero_copy);
+            } else if (strcmp(arg, "fixed-buffers") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.io_uring.fixed_buffers);
+            } else if (strcmp(arg, "posix-depth") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.posix.depth) && cli.options.posix.depth > 0;
+            } else if (strcmp(arg, "epoll") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.epoll);
+            } else if (strcmp(arg, "workers") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.epoll_workers);
+            } else if (strcmp(arg, "quantum") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.epoll_quantum);
+            } else if (strcmp(arg, "weight") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.weight) && cli.options.weight > 0;
+            } else if (strcmp(arg, "steal") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.epoll_steal);
+            } else if (strcmp(arg, "cpus") == 0) {
+                valid = zstd_proxy_cpu_set_parse(&cli.options.affinity.cpus, value) == 0;
+            } else if (strcmp(arg, "incoming-cpu") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.affinity.incoming_cpu);
+            } else if (strcmp(arg, "spin") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size);
+                cli.options.busy_poll.spin_us = size;
+            } else if (strcmp(arg, "busy-poll") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &size);
+                cli.options.busy_poll.socket_us = size;
+            } else if (strcmp(arg, "prefer-busy-poll") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.busy_poll.prefer);
+            } else if (strcmp(arg, "taskrun") == 0) {
+                cli.options.busy_poll.coop_taskrun = strcmp(value, "coop") == 0;
+                cli.options.busy_poll.defer_taskrun = strcmp(value, "defer") == 0;
+                valid = cli.options.busy_poll.coop_taskrun || cli.options.busy_poll.defer_taskrun || strcmp(value, "default") == 0;
+            } else if (strcmp(arg, "notsent-lowat") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.socket.notsent_lowat);
+            } else if (strcmp(arg, "sndbuf") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.socket.send_buffer);
+            } else if (strcmp(arg, "rcvbuf") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.options.socket.recv_buffer);
+            } else if (strcmp(arg, "nodelay") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.socket.nodelay);
+            } else if (strcmp(arg, "cork") == 0) {
+                valid = zstd_proxy_cli_parse_bool(value, &cli.options.socket.cork);
+            } else if (strcmp(arg, "capture") == 0) {
+                cli.capture = value;
+            } else if (strcmp(arg, "capture-size") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.capture_size);
+            } else if (strcmp(arg, "capture-sample") == 0) {
+                valid = zstd_proxy_cli_parse_size(value, &cli.capture_sample) && cli.capture_sample > 0 && cli.capture_sample <= UINT32_MAX;
+            } else {
+                valid = false;
+            }
+        }
+
+        if (!valid) {
+            log_error("invalid argument: %s", argv[i]);
+            zstd_proxy_cli_usage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    if (cli.listen == NULL || cli.connect == NULL || compress == NULL) {
+        zstd_proxy_cli_usage(argv[0]);
+
+        return 1;
+    }
+
+    cli.compress_listen = strcmp(compress, "listen") == 0;
+
+    for (char *state = NULL, *address = strtok_r(cli.connect, ",", &state); address != NULL; address = strtok_r(NULL, ",", &state)) {
+        if (cli.upstream_count == zstd_proxy_cli_upstreams_max) {
+            log_error("more than %d upstreams in --connect", zstd_proxy_cli_upstreams_max);
+
+            return 1;
+        }
+
+        cli.upstreams[cli.upstream_count++] = address;
+    }
+
+    if (cli.upstream_count == 0) {
+        zstd_proxy_cli_usage(argv[0]);
+
+        return 1;
+    }
+
+    if (cli.upstream_count > 1 && zstd_proxy_balancer_create(&cli.balancer, cli.upstreams, cli.upstream_count, &cli.balance) != 0) {
+        return 1;
+    }
+
+    // Accepted connections are the compressed side, they are grouped in sets before being proxied
+    if (!cli.compress_listen && cli.stripe.count > 1 && zstd_proxy_stripe_listener_create(&cli.stripes, &cli.stripe) != 0) {
+        return 1;
+    }
+
+    zstd_proxy_arena_configure(&arena);
+
+    // A peer closing its socket must fail the send, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    if (cli.capture != NULL) {
+        sigset_t signals;
+        pthread_t thread;
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR2);
+
+        if (
+            zstd_proxy_capture_start(cli.capture, cli.capture_size, cli.capture_sample) != 0 ||
+            pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 ||
+            pthread_create(&thread, NULL, zstd_proxy_cli_capture_thread, &cli) != 0
+        ) {
+            log_error("failed to start capture to %s", cli.capture);
+
+            return 1;
+        }
+
+        pthread_detach(thread);
+    }
+
+    zstd_proxy_epoll *engine = NULL;
+
+    if (cli.epoll) {
+#if __linux__
+        zstd_proxy_epoll_options options;
+
+        zstd_proxy_epoll_default_options(&options);
+
+        if (cli.epoll_workers > 0) {
+            options.workers = cli.epoll_workers;
+        }
+
+        options.quantum = cli.epoll_quantum;
+        options.steal = cli.epoll_steal;
+        options.cpus = cli.options.affinity.cpus;
+        options.incoming_cpu = cli.options.affinity.incoming_cpu;
+
+        if (zstd_proxy_epoll_create(&engine, &options) != 0) {
+            return 1;
+        }
+#else
+        log_error("--epoll is only available on Linux");
+
+        return 1;
+#endif
+    }
+
+    // Proxy a single connection between two null devices
+    if (strcmp(cli.listen, "null") == 0) {
+        int fd = open("/dev/null", O_RDWR);
+
+        if (fd < 0 || zstd_proxy_cli_serve(&cli, engine, fd) != 0) {
+            return 1;
+        }
+
+        pthread_exit(NULL);
+    }
+
+    int server_fd = zstd_proxy_cli_socket(cli.listen, true, 0);
+
+    if (server_fd < 0) {
+        return 1;
+    }
+
+    while (true) {
+        int fd = accept(server_fd, NULL, NULL);
+
+        if (fd < 0) {
+            int error = errno;
+
+            if (error == EINTR || error == ECONNABORTED) {
+                continue;
+            }
+
+            log_error("error accepting connection: %s", strerror(error));
+
+            // Out of descriptors, wait for connections to close
+            if (error == EMFILE || error == ENFILE) {
+                usleep(100 * 1000);
+
+                continue;
+            }
+
+            return 1;
+        }
+
+        zstd_proxy_cli_serve(&cli, engine, fd);
+    }
+}
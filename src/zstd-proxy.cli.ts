@@ -1,7 +1,9 @@
 import { openSync } from "fs"
+import { createServer as createHttpServer } from "http"
 import { createConnection, createServer, Socket } from "net"
 
 import { zstdProxy } from "./zstd-proxy"
+import { zstdProxyPrometheusMetrics } from "./zstd-proxy.metrics"
 
 export function zstdProxyCli() {
     const args = new Map(process.argv.slice(2).map(string => {
@@ -17,6 +19,9 @@ export function zstdProxyCli() {
     const listen = args.get('listen')
     const connect = args.get('connect')
     const compress = args.get('compress')
+    const metrics = args.get('metrics')
+    const idleTimeout = parseTimeout(args.get('idle-timeout'))
+    const stallTimeout = parseTimeout(args.get('stall-timeout'))
 
     if(!listen) {
         throw new Error('Missing --listen argument')
@@ -34,6 +39,24 @@ export function zstdProxyCli() {
         throw new Error(`Invalid --compress argument: "${compress}"`)
     }
 
+    if(metrics) {
+        createHttpServer((req, res) => {
+            if(req.url !== '/metrics') {
+                return res.writeHead(404).end()
+            }
+
+            res
+                .writeHead(200, {'Content-Type': 'text/plain; version=0.0.4'})
+                .end(zstdProxyPrometheusMetrics())
+        })
+            .listen(parseSocketOptions(metrics))
+            .on('error', error => {
+                console.error(error)
+
+                process.exit(1)
+            })
+    }
+
     const getListenSocket = (cb: (server: number | Socket) => void) => {
         switch(listen) {
             case 'null':
@@ -67,11 +90,13 @@ export function zstdProxyCli() {
                 zstdProxy({
                     compress: compress === 'listen' ? server : client,
                     to: compress === 'listen' ? client : server,
-                    onClose(error) {
+                    idleTimeout,
+                    stallTimeout,
+                    onClose(error, _metrics, _latency, reason) {
                         if(error) {
                             console.error(error)
                         } else {
-                            console.log('Connection closed')
+                            console.log(reason ? `Connection closed (${reason})` : 'Connection closed')
                         }
                     }
                 })
@@ -90,13 +115,34 @@ function parseArgument(argument: string) {
         return null
     }
 
-    if(key !== 'listen' && key !== 'connect' && key !== 'compress') {
+    if(
+        key !== 'listen' &&
+        key !== 'connect' &&
+        key !== 'compress' &&
+        key !== 'metrics' &&
+        key !== 'idle-timeout' &&
+        key !== 'stall-timeout'
+    ) {
         return null
     }
     
     return {key, value}
 }
 
+function parseTimeout(value?: string) {
+    if(value === undefined) {
+        return undefined
+    }
+
+    const timeout = parseInt(value, 10)
+
+    if(Number.isNaN(timeout) || timeout < 0) {
+        throw new Error(`Invalid timeout: ${value}`)
+    }
+
+    return timeout
+}
+
 function parseSocketOptions(path: string) {
     if(path[0] === '.' || path[1] === '/') {
         return {path}
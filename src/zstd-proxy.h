@@ -2,10 +2,19 @@
 #define zstd_proxy_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <zstd.h>
 
+#include "zstd-proxy-codec.h"
+#include "zstd-proxy-dedup.h"
+#include "zstd-proxy-framing.h"
+#include "zstd-proxy-metrics.h"
+#include "zstd-proxy-affinity.h"
+#include "zstd-proxy-histogram.h"
+
 typedef struct {
     int fd;
     void* data;
@@ -23,35 +32,236 @@ typedef struct {
 typedef struct {
     bool enabled;
 
-    size_t level;
+    /** Between `ZSTD_minCLevel()` and `ZSTD_maxCLevel()`. */
+    int level;
+    /** `ZSTD_c_windowLog`, 0 for the default of the level. Both ends must set it above 27. */
+    int window_log;
+    /** Raw content or trained dictionary, both ends must use the same one. Loaded by each connection when it starts. */
+    const void *dictionary;
+    size_t dictionary_size;
 } zstd_proxy_zstd_options;
 
+/** Codec compressing the connection while `zstd.enabled`, see `zstd-proxy-codec.h`. */
+typedef struct {
+    /** Codec to compress with, `zstd_proxy_codec_zstd` by default. Decompressing ends follow the hellos. */
+    zstd_proxy_codec preferred;
+    /** Compress with Zstd until the peer announces it can decode `preferred`, so peers without it keep working. */
+    bool negotiate;
+    /** LZ4 compression level, 0 for the fast default and 3 and above for LZ4 HC. */
+    int lz4_level;
+} zstd_proxy_codec_options;
+
+/** Replace data sent earlier to the same peer with references before compressing it, see `zstd-proxy-dedup.h`. */
+typedef struct {
+    /** Both ends must agree, the decompressing end expects dedup records. */
+    bool enabled;
+    /** Bytes of chunks kept by each end, both ends must use the same size. */
+    size_t cache_size;
+    /** Caches of closed connections kept for the next connections to the same peer, 0 to keep none. */
+    size_t sessions;
+} zstd_proxy_dedup_options;
+
 typedef struct {
+    /** Output buffers per direction, above 1 a sender thread overlaps sends with recv and compression. */
+    size_t depth;
+    /** Send chunks of at least this many bytes with `MSG_ZEROCOPY` when `depth` is above 1, 0 to disable. */
+    size_t zero_copy_threshold;
+} zstd_proxy_posix_options;
+
+/** Trade CPU for latency by polling instead of sleeping until data arrives. */
+typedef struct {
+    /** Spin on completions (io_uring) or non-blocking recvs (posix) for this long before sleeping, 0 to disable. */
+    uint64_t spin_us;
+    /** `SO_BUSY_POLL` on the sockets: microseconds a blocking recv polls the device queue, 0 to leave the system default. */
+    uint32_t socket_us;
+    /** Set `SO_PREFER_BUSY_POLL` on the sockets along with `socket_us`. */
+    bool prefer;
+    /** Create the ring with `IORING_SETUP_COOP_TASKRUN`: completions don't interrupt the thread, it picks them up when it checks. */
+    bool coop_taskrun;
+    /** Create the ring with `IORING_SETUP_DEFER_TASKRUN`: completions are only processed while waiting for them, takes precedence. */
+    bool defer_taskrun;
+} zstd_proxy_busy_poll_options;
+
+/** Socket tuning applied to both sockets, every field is left to the system when 0 or `false`. */
+typedef struct {
+    /**
+     * `TCP_NOTSENT_LOWAT`: unsent bytes the kernel queues before blocking the sender.
+     * Bounds the unsent data of a direction to `depth * buffer_size + notsent_lowat`.
+     */
+    size_t notsent_lowat;
+    /** `SO_SNDBUF` in bytes, disables autotuning. */
+    size_t send_buffer;
+    /** `SO_RCVBUF` in bytes, disables autotuning. */
+    size_t recv_buffer;
+    /** `TCP_NODELAY`. */
+    bool nodelay;
+    /** Send the parts of a frame which don't fit in one buffer with `MSG_MORE`, so they leave in full segments. */
+    bool cork;
+} zstd_proxy_socket_options;
+
+/** Why a connection closed, besides end of stream and I/O errors. */
+typedef enum {
+    zstd_proxy_close_none,
+    /** `zstd_proxy_stop` was called. */
+    zstd_proxy_close_stopped,
+    /** No data was received in either direction for `idle_timeout_ms`. */
+    zstd_proxy_close_idle_timeout,
+    /** A send was blocked for `stall_timeout_ms`. */
+    zstd_proxy_close_stall_timeout,
+} zstd_proxy_close_reason;
+
+extern const char *const zstd_proxy_close_reason_names[];
+
+typedef struct {
+    /** Set once the connection is closing, read with `zstd_proxy_stopped`. */
     bool stop;
+    /** Set before `stop`, the first reason wins. */
+    zstd_proxy_close_reason close_reason;
     size_t buffer_size;
 
+    /** Close the connection when no data is received in either direction for this long, 0 to disable. */
+    uint64_t idle_timeout_ms;
+    /** Close the connection when a send can't make progress for this long, 0 to disable. */
+    uint64_t stall_timeout_ms;
+    /** Monotonic time of the last recv in either direction, only kept when `idle_timeout_ms` is set. */
+    uint64_t active_at;
+
+    /** Bumped by the `zstd_proxy_set_*` functions, event loops re-read the options below when it changes. */
+    uint64_t generation;
+    /** `true` to stop reading from the source sockets. */
+    bool paused;
+    /** Maximum bytes per recv, `buffer_size` if 0. */
+    size_t recv_size;
+    /** Maximum queue items in flight per direction, `io_uring.depth` if 0. */
+    size_t depth_limit;
+    /** Share of an epoll worker given to this connection when it competes with others, in quanta per turn. */
+    size_t weight;
+
     zstd_proxy_zstd_options zstd;
+    zstd_proxy_codec_options codec;
+    /** Message boundaries compressed data is flushed at, see `zstd-proxy-framing.h`. */
+    zstd_proxy_framing_options framing;
+    zstd_proxy_dedup_options dedup;
+    zstd_proxy_affinity_options affinity;
+    zstd_proxy_busy_poll_options busy_poll;
+    zstd_proxy_socket_options socket;
+    zstd_proxy_posix_options posix;
     zstd_proxy_io_uring_options io_uring;
 } zstd_proxy_options;
 
+/** Wakes up a direction thread waiting on I/O, both ends are the same eventfd on Linux. */
+typedef struct {
+    int read_fd;
+    int write_fd;
+} zstd_proxy_wakeup;
+
 typedef struct {
+    /** Unique within the process, set by `zstd_proxy_init`. */
+    uint64_t id;
     zstd_proxy_options options;
     zstd_proxy_descriptor listen;
     zstd_proxy_descriptor connect;
+    zstd_proxy_metrics metrics;
+    zstd_proxy_latency latency;
+
+    /** `zstd_proxy_codec_bit` of the codecs the peer announced it can decode, set by the decompressing direction. */
+    uint32_t peer_codecs;
+    /** Dedup cache offers, read by the decompressing direction and sent by the compressing one. */
+    zstd_proxy_dedup_link dedup_link;
+
+    /** Compress and decompress thread wakeups, open while `zstd_proxy_run` is running. */
+    zstd_proxy_wakeup wakeup[2];
+
+    /** Guards `listen.fd`, `connect.fd` and `wakeup` against the runtime controls once they get closed. */
+    pthread_mutex_t lock;
 } zstd_proxy;
 
+/** Multi-connection engine, see `zstd-proxy-epoll.h`. */
+typedef struct zstd_proxy_epoll zstd_proxy_epoll;
+
+typedef void (*zstd_proxy_done_callback)(zstd_proxy *proxy, int error, void *data);
+
 typedef int (*zstd_proxy_process_callback)(void *process_data, ZSTD_inBuffer *input, ZSTD_outBuffer *output);
 
+/** Called once the listen side ended, the next `process` calls then flush everything they held back. */
+typedef void (*zstd_proxy_end_callback)(void *process_data);
+
 typedef struct {
     zstd_proxy_options *options;
     zstd_proxy_descriptor *listen;
     zstd_proxy_descriptor *connect;
 
+    /** Readable when `options` changed, see `zstd_proxy_wakeup_drain`. */
+    int wakeup_fd;
+
     zstd_proxy_process_callback process;
     void *process_data;
+    /** `NULL` when `process` never holds input back, which then needs no flush at end of stream. */
+    zstd_proxy_end_callback end;
+
+    zstd_proxy_direction_metrics *metrics;
+    zstd_proxy_direction_metrics *global_metrics;
+    zstd_proxy_direction_latency *latency;
+    zstd_proxy_direction_latency *global_latency;
 } zstd_proxy_connection;
 
+static inline bool zstd_proxy_stopped(zstd_proxy_options *options) {
+    return __atomic_load_n(&options->stop, __ATOMIC_ACQUIRE);
+}
+
+static inline void zstd_proxy_set_close_reason(zstd_proxy_options *options, zstd_proxy_close_reason reason) {
+    zstd_proxy_close_reason none = zstd_proxy_close_none;
+
+    __atomic_compare_exchange_n(&options->close_reason, &none, reason, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/** Record activity for the idle timeout. */
+static inline void zstd_proxy_touch(zstd_proxy_options *options, uint64_t now) {
+    if (options->idle_timeout_ms > 0) {
+        __atomic_store_n(&options->active_at, now, __ATOMIC_RELAXED);
+    }
+}
+
+/** Nanoseconds left before the connection is idle, 0 once it is. */
+static inline uint64_t zstd_proxy_idle_remaining(zstd_proxy_options *options, uint64_t now) {
+    uint64_t timeout = options->idle_timeout_ms * 1000 * 1000;
+    uint64_t idle = now - __atomic_load_n(&options->active_at, __ATOMIC_RELAXED);
+
+    return idle >= timeout ? 0 : timeout - idle;
+}
+
+/** Reset a readable `wakeup_fd` before re-reading the options. */
+void zstd_proxy_wakeup_drain(int fd);
+
 void zstd_proxy_init(zstd_proxy *proxy);
 int zstd_proxy_run(zstd_proxy *proxy);
 
+/**
+ * One direction of `proxy` without sockets, running the same process callback as the proxy.
+ * Call `zstd_proxy_stream_process` until the input is consumed and the output isn't full.
+ * Once the input ended, call `zstd_proxy_stream_end` then process an empty input until the output isn't full.
+ */
+typedef struct zstd_proxy_stream zstd_proxy_stream;
+
+int zstd_proxy_stream_create(zstd_proxy_stream **stream_ptr, zstd_proxy *proxy, bool decompress);
+int zstd_proxy_stream_process(zstd_proxy_stream *stream, ZSTD_inBuffer *input, ZSTD_outBuffer *output);
+void zstd_proxy_stream_end(zstd_proxy_stream *stream);
+void zstd_proxy_stream_destroy(zstd_proxy_stream *stream);
+
+/**
+ * Proxy on an epoll engine instead of two blocking threads, Linux only.
+ * `done` is called from an engine thread with the same error `zstd_proxy_run` would return.
+ * Both sockets are closed on error, in which case `done` is not called.
+ */
+int zstd_proxy_start(zstd_proxy *proxy, zstd_proxy_epoll *engine, zstd_proxy_done_callback done, void *data);
+
+/**
+ * Runtime controls, safe to call from any thread while `zstd_proxy_run` is running.
+ * Waiting threads are woken up through `zstd_proxy.wakeup` to pick up changes.
+ */
+void zstd_proxy_stop(zstd_proxy *proxy);
+void zstd_proxy_pause(zstd_proxy *proxy, bool paused);
+void zstd_proxy_set_level(zstd_proxy *proxy, int level);
+void zstd_proxy_set_buffer_limits(zstd_proxy *proxy, size_t recv_size, size_t depth);
+
 #endif
@@ -0,0 +1,138 @@
+import {
+  latency,
+  metrics as globalMetrics,
+  metricsLayout,
+} from "../native/build/Release/zstd_proxy.node";
+
+interface MetricInfo {
+  name: string;
+  help: string;
+  type: "counter" | "gauge";
+}
+
+const layout: { connection: MetricInfo[]; direction: MetricInfo[] } =
+  metricsLayout;
+
+export type ZstdProxyDirectionMetrics = Record<string, number>;
+
+export interface ZstdProxyMetrics {
+  connection: Record<string, number>;
+  compress: ZstdProxyDirectionMetrics;
+  decompress: ZstdProxyDirectionMetrics;
+}
+
+/** Latency distribution of a hop, durations are in nanoseconds. */
+export interface ZstdProxyHistogram {
+  count: number;
+  mean: number;
+  p50: number;
+  p99: number;
+  p999: number;
+}
+
+export interface ZstdProxyDirectionLatency {
+  /** Time from recv completion to the start of processing. */
+  recv_to_process: ZstdProxyHistogram;
+  /** Time spent in Zstd. */
+  process: ZstdProxyHistogram;
+  /** Time from the end of processing to send completion. */
+  process_to_send: ZstdProxyHistogram;
+}
+
+export interface ZstdProxyLatency {
+  compress: ZstdProxyDirectionLatency;
+  decompress: ZstdProxyDirectionLatency;
+}
+
+/** Read the latency added by the proxy, merged across every connection of the process. */
+export function zstdProxyLatency(): ZstdProxyLatency {
+  return latency();
+}
+
+/** Read the counters aggregated across every connection of the process. */
+export function zstdProxyMetrics(): ZstdProxyMetrics {
+  return readMetrics(globalMetrics);
+}
+
+/** Decode a native metrics snapshot, see `zstd_proxy_metrics` in `zstd-proxy-metrics.h`. */
+export function readMetrics(array: BigUint64Array): ZstdProxyMetrics {
+  let offset = 0;
+
+  const read = (fields: MetricInfo[]) =>
+    Object.fromEntries(
+      fields.map(({ name }) => [name, Number(array[offset++])])
+    );
+
+  const connection = read(layout.connection);
+  const compress = read(layout.direction);
+  const decompress = read(layout.direction);
+
+  return { connection, compress, decompress };
+}
+
+/** Format the global counters using the Prometheus text exposition format. */
+export function zstdProxyPrometheusMetrics(prefix = "zstd_proxy") {
+  const metrics = zstdProxyMetrics();
+  const lines: string[] = [];
+  const header = ({ name, help, type }: MetricInfo) => {
+    const scale = name.endsWith("_ns") ? 1e-9 : 1;
+    const baseName = scale === 1 ? name : `${name.slice(0, -3)}_seconds`;
+    const metricName = `${prefix}_${baseName}${
+      type === "counter" ? "_total" : ""
+    }`;
+
+    lines.push(`# HELP ${metricName} ${help}`);
+    lines.push(`# TYPE ${metricName} ${type}`);
+
+    return { metricName, scale };
+  };
+
+  for (const info of layout.connection) {
+    const { metricName } = header(info);
+
+    lines.push(`${metricName} ${metrics.connection[info.name]}`);
+  }
+
+  for (const info of layout.direction) {
+    const { metricName, scale } = header(info);
+
+    for (const direction of ["compress", "decompress"] as const) {
+      lines.push(
+        `${metricName}{direction="${direction}"} ${
+          metrics[direction][info.name] * scale
+        }`
+      );
+    }
+  }
+
+  const latencies = zstdProxyLatency();
+
+  for (const hop of ["recv_to_process", "process", "process_to_send"] as const) {
+    const metricName = `${prefix}_latency_${hop}_seconds`;
+
+    lines.push(`# HELP ${metricName} Latency added by the proxy`);
+    lines.push(`# TYPE ${metricName} summary`);
+
+    for (const direction of ["compress", "decompress"] as const) {
+      const histogram = latencies[direction][hop];
+      const labels = `direction="${direction}"`;
+
+      for (const [quantile, value] of [
+        ["0.5", histogram.p50],
+        ["0.99", histogram.p99],
+        ["0.999", histogram.p999],
+      ] as const) {
+        lines.push(
+          `${metricName}{${labels},quantile="${quantile}"} ${value * 1e-9}`
+        );
+      }
+
+      lines.push(
+        `${metricName}_sum{${labels}} ${histogram.mean * histogram.count * 1e-9}`
+      );
+      lines.push(`${metricName}_count{${labels}} ${histogram.count}`);
+    }
+  }
+
+  return lines.join("\n") + "\n";
+}
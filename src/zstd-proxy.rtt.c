@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "zstd-proxy-bench.h"
+#include "zstd-proxy-utils.h"
+
+/**
+ * Request/response round-trip benchmark.
+ *
+ * Mirrors the topology of `zstd-proxy.test.ts`: each connection runs
+ * client -> compress proxy -> decompress proxy -> echo server and back,
+ * with one message in flight. Every size and concurrency is first measured
+ * without proxies to report the overhead against that baseline.
+ */
+
+/** Requests per connection which are not recorded. */
+#define zstd_proxy_rtt_warmup 100
+
+typedef struct {
+    const char *transport;
+    const char *backend;
+    const zstd_proxy_bench_corpus *corpus;
+    size_t message_size;
+    size_t concurrency;
+    double duration;
+    zstd_proxy_options options;
+} zstd_proxy_rtt_run;
+
+typedef struct {
+    zstd_proxy_rtt_run *run;
+    zstd_proxy_bench_pipeline pipeline;
+    pthread_t client;
+    pthread_t server;
+    int error;
+    size_t requests;
+    zstd_proxy_histogram rtt;
+} zstd_proxy_rtt_connection;
+
+static void *zstd_proxy_rtt_server(void *data) {
+    zstd_proxy_rtt_connection *connection = data;
+    int fd = connection->pipeline.server_fd;
+    char buffer[64 * 1024];
+
+    while (true) {
+        ssize_t received = read(fd, buffer, sizeof(buffer));
+
+        if (received <= 0 || zstd_proxy_bench_write(fd, buffer, received) != 0) {
+            break;
+        }
+    }
+
+    shutdown(fd, SHUT_WR);
+
+    return NULL;
+}
+
+static void *zstd_proxy_rtt_client(void *data) {
+    zstd_proxy_rtt_connection *connection = data;
+    zstd_proxy_rtt_run *run = connection->run;
+    size_t size = run->message_size;
+    char *request = malloc(size);
+    char *response = malloc(size);
+    int fd = connection->pipeline.client_fd;
+    uint64_t deadline = zstd_proxy_now_ns() + run->duration * 1e9;
+
+    if (request == NULL || response == NULL) {
+        connection->error = ENOMEM;
+    } else {
+        for (size_t filled = 0; filled < size;) {
+            size_t copy = run->corpus->size < size - filled ? run->corpus->size : size - filled;
+
+            memcpy(&request[filled], run->corpus->data, copy);
+            filled += copy;
+        }
+    }
+
+    for (size_t i = 0; connection->error == 0; i++) {
+        uint64_t start = zstd_proxy_now_ns();
+
+        if (start >= deadline) {
+            break;
+        }
+
+        if (
+            (connection->error = zstd_proxy_bench_write(fd, request, size)) != 0 ||
+            (connection->error = zstd_proxy_bench_read(fd, response, size)) != 0
+        ) {
+            log_error("request failed: %s", strerror(connection->error));
+
+            break;
+        }
+
+        if (i >= zstd_proxy_rtt_warmup) {
+            zstd_proxy_histogram_record(&connection->rtt, zstd_proxy_now_ns() - start);
+            connection->requests++;
+        }
+    }
+
+    shutdown(fd, SHUT_WR);
+    free(request);
+    free(response);
+
+    return NULL;
+}
+
+static int zstd_proxy_rtt_execute(zstd_proxy_rtt_run *run, zstd_proxy_histogram *rtt, size_t *requests) {
+    int error = 0;
+    size_t started = 0;
+    zstd_proxy_epoll *engine = NULL;
+    zstd_proxy_rtt_connection *connections = calloc(run->concurrency, sizeof(zstd_proxy_rtt_connection));
+
+    if (connections == NULL) {
+        return ENOMEM;
+    }
+
+    run->options.io_uring.enabled = strcmp(run->backend, "uring") == 0;
+
+    if (strcmp(run->backend, "epoll") == 0 && (error = zstd_proxy_bench_engine_create(&engine)) != 0) {
+        free(connections);
+
+        return error;
+    }
+
+    for (; started < run->concurrency; started++) {
+        zstd_proxy_rtt_connection *connection = &connections[started];
+
+        connection->run = run;
+        connection->pipeline.proxied = strcmp(run->backend, "none") != 0;
+        connection->pipeline.options = run->options;
+        connection->pipeline.engine = engine;
+
+        if ((error = zstd_proxy_bench_pipeline_start(&connection->pipeline, run->transport)) != 0) {
+            break;
+        }
+
+        if (
+            (error = pthread_create(&connection->server, NULL, zstd_proxy_rtt_server, connection)) != 0 ||
+            (error = pthread_create(&connection->client, NULL, zstd_proxy_rtt_client, connection)) != 0
+        ) {
+            log_error("failed to start connection: %s", strerror(error));
+
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        zstd_proxy_rtt_connection *connection = &connections[i];
+
+        pthread_join(connection->client, NULL);
+        pthread_join(connection->server, NULL);
+        close(connection->pipeline.client_fd);
+        close(connection->pipeline.server_fd);
+
+        int pipeline_error = zstd_proxy_bench_pipeline_join(&connection->pipeline);
+
+        if (error == 0) {
+            error = connection->error != 0 ? connection->error : pipeline_error;
+        }
+
+        *requests += connection->requests;
+        zstd_proxy_histogram_merge(rtt, &connection->rtt);
+    }
+
+    if (engine != NULL) {
+        zstd_proxy_bench_engine_destroy(engine);
+    }
+
+    free(connections);
+
+    return error;
+}
+
+static void zstd_proxy_rtt_usage(const char *name) {
+    fprintf(
+        stderr,
+        "usage: %s [options], list options accept comma-separated values and run every combination\n"
+        "  --sizes=LIST            message sizes in bytes, accepts k/m/g suffixes (default: 64,1k,16k,256k)\n"
+        "  --concurrency=LIST      connections running requests in parallel (default: 1,16)\n"
+        "  --backend=LIST          posix, uring and/or epoll, compared to a run without proxy (default: posix,uring)\n"
+        "  --corpus=NAME           zeros, random, json or file:<path> (default: json)\n"
+        "  --transport=NAME        unix or tcp (default: tcp)\n"
+        "  --level=N               Zstd level (default: 1)\n"
+        "  --buffer-size=N         proxy buffer size (default: 4m)\n"
+        "  --depth=N               io_uring depth (default: 4)\n"
+        "  --zero-copy=0|1         io_uring zero-copy (default: 0)\n"
+        "  --fixed-buffers=0|1     io_uring fixed buffers (default: 1)\n"
+        "  --spin=US               busy poll for this long before sleeping (default: 0)\n"
+        "  --duration=SECONDS      duration of each run (default: 2)\n",
+        name
+    );
+}
+
+int main(int argc, char **argv) {
+    char backend_names[] = "posix,uring";
+    const char *backends[zstd_proxy_bench_max_values];
+    size_t sizes[zstd_proxy_bench_max_values] = { 64, 1024, 16 * 1024, 256 * 1024 };
+    size_t concurrencies[zstd_proxy_bench_max_values] = { 1, 16 };
+    int backend_count = zstd_proxy_bench_parse_names(backend_names, backends);
+    int size_count = 4, concurrency_count = 2;
+    const char *transport = "tcp", *corpus_name = "json";
+    double duration = 2;
+    size_t values[zstd_proxy_bench_max_values];
+    zstd_proxy defaults;
+
+    zstd_proxy_init(&defaults);
+    defaults.options.io_uring.zero_copy = false;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        char *value = strchr(arg, '=');
+        bool valid = value != NULL && strncmp(arg, "--", 2) == 0;
+
+        if (valid) {
+            *value++ = '\0';
+            arg += 2;
+
+            if (strcmp(arg, "sizes") == 0) {
+                valid = (size_count = zstd_proxy_bench_parse_list(value, sizes)) > 0;
+            } else if (strcmp(arg, "concurrency") == 0) {
+                valid = (concurrency_count = zstd_proxy_bench_parse_list(value, concurrencies)) > 0;
+            } else if (strcmp(arg, "backend") == 0) {
+                valid = (backend_count = zstd_proxy_bench_parse_names(value, backends)) > 0;
+            } else if (strcmp(arg, "corpus") == 0) {
+                corpus_name = value;
+            } else if (strcmp(arg, "transport") == 0) {
+                transport = value;
+            } else if (strcmp(arg, "level") == 0) {
+                defaults.options.zstd.level = strtol(value, NULL, 10);
+            } else if (strcmp(arg, "buffer-size") == 0) {
+                valid = zstd_proxy_bench_parse_list(value, values) == 1;
+                defaults.options.buffer_size = values[0];
+            } else if (strcmp(arg, "depth") == 0) {
+                valid = zstd_proxy_bench_parse_list(value, values) == 1;
+                defaults.options.io_uring.depth = values[0];
+            } else if (strcmp(arg, "zero-copy") == 0) {
+                defaults.options.io_uring.zero_copy = strcmp(value, "1") == 0;
+            } else if (strcmp(arg, "fixed-buffers") == 0) {
+                defaults.options.io_uring.fixed_buffers = strcmp(value, "1") == 0;
+            } else if (strcmp(arg, "spin") == 0) {
+                valid = zstd_proxy_bench_parse_list(value, values) == 1;
+                defaults.options.busy_poll.spin_us = values[0];
+            } else if (strcmp(arg, "duration") == 0) {
+                duration = atof(value);
+                valid = duration > 0;
+            } else {
+                valid = false;
+            }
+        }
+
+        if (!valid) {
+            zstd_proxy_rtt_usage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    zstd_proxy_bench_corpus corpus;
+    int error = zstd_proxy_bench_corpus_load(&corpus, corpus_name, 1, 1024 * 1024);
+
+    if (error != 0) {
+        return 1;
+    }
+
+    bool first = true;
+    zstd_proxy_histogram *baseline = malloc(sizeof(zstd_proxy_histogram));
+    zstd_proxy_histogram *rtt = malloc(sizeof(zstd_proxy_histogram));
+
+    printf("[\n");
+
+    for (int s = 0; s < size_count && baseline != NULL && rtt != NULL; s++)
+    for (int c = 0; c < concurrency_count; c++)
+    for (int b = -1; b < backend_count; b++) {
+        // Run without proxies first to get the baseline
+        const char *backend = b < 0 ? "none" : backends[b];
+        zstd_proxy_rtt_run run = {
+            .transport = transport,
+            .backend = backend,
+            .corpus = &corpus,
+            .message_size = sizes[s],
+            .concurrency = concurrencies[c],
+            .duration = duration,
+            .options = defaults.options,
+        };
+        size_t requests = 0;
+        zstd_proxy_histogram *histogram = b < 0 ? baseline : rtt;
+
+        memset(histogram, 0, sizeof(zstd_proxy_histogram));
+
+        int run_error = zstd_proxy_rtt_execute(&run, histogram, &requests);
+
+        if (run_error != 0) {
+            error = run_error;
+        }
+
+        printf(
+            "%s  {\"backend\": \"%s\", \"transport\": \"%s\", \"corpus\": \"%s\", \"message_size\": %zu, "
+            "\"concurrency\": %zu, \"spin_us\": %" PRIu64 ", \"error\": %d, \"requests_per_second\": %.1f, \"rtt_us\": ",
+            first ? "" : ",\n",
+            backend,
+            transport,
+            corpus_name,
+            run.message_size,
+            run.concurrency,
+            run.options.busy_poll.spin_us,
+            run_error,
+            requests / duration
+        );
+        zstd_proxy_bench_print_histogram(histogram);
+
+        if (b >= 0) {
+            printf(
+                ", \"overhead_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f}",
+                ((double)zstd_proxy_histogram_percentile(rtt, 0.5) - zstd_proxy_histogram_percentile(baseline, 0.5)) / 1e3,
+                ((double)zstd_proxy_histogram_percentile(rtt, 0.99) - zstd_proxy_histogram_percentile(baseline, 0.99)) / 1e3,
+                ((double)zstd_proxy_histogram_percentile(rtt, 0.999) - zstd_proxy_histogram_percentile(baseline, 0.999)) / 1e3
+            );
+        }
+
+        printf("}");
+        fflush(stdout);
+
+        first = false;
+    }
+
+    printf("\n]\n");
+
+    free(baseline);
+    free(rtt);
+    zstd_proxy_bench_corpus_free(&corpus);
+
+    return error == 0 ? 0 : 1;
+}
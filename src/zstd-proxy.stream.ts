@@ -0,0 +1,172 @@
+import { Duplex, pipeline } from "stream";
+
+import { stream } from "../native/build/Release/zstd_proxy.node";
+import { ZstdProxyOptions } from "./zstd-proxy";
+
+export interface ZstdProxyStreamOptions {
+  /** Same as the proxy, both ends must agree on them. */
+  zstd?: ZstdProxyOptions["zstd"];
+  codec?: ZstdProxyOptions["codec"];
+  /** `sessions` doesn't apply, a stream has no other direction to resume caches through. */
+  dedup?: ZstdProxyOptions["dedup"];
+  /** Compressing streams only output the messages which ended, the rest waits for the next writes or the end. */
+  framing?: ZstdProxyOptions["framing"];
+
+  /** Most bytes processed and flushed at once. Defaults to 4 MB. */
+  bufferSize?: number;
+}
+
+/**
+ * Run one direction of the proxy on the libuv thread pool. Output chunks are native memory exposed
+ * to JavaScript as is, writes made while a batch is running are processed together in the next one.
+ */
+class ZstdProxyTransform extends Duplex {
+  readonly #native: any;
+  /** Write callback held back until the readable side is consumed. */
+  #pending?: (error?: Error | null) => void;
+
+  constructor(decompress: boolean, options: ZstdProxyStreamOptions) {
+    super();
+
+    this.#native = stream(decompress, {
+      zstd: options.zstd?.enabled,
+      zstd_level: options.zstd?.level,
+      zstd_window_log: options.zstd?.windowLog,
+      zstd_dictionary: options.zstd?.dictionary,
+      codec: options.codec?.preferred,
+      codec_negotiate: options.codec?.negotiate,
+      codec_lz4_level: options.codec?.lz4Level,
+      framing: options.framing?.protocol,
+      framing_length_offset: options.framing?.lengthOffset,
+      framing_length_size: options.framing?.lengthSize,
+      framing_length_adjust: options.framing?.lengthAdjust,
+      framing_length_little_endian: options.framing?.lengthLittleEndian,
+      dedup: options.dedup?.enabled,
+      dedup_cache_size: options.dedup?.cacheSize,
+      buffer_size: options.bufferSize,
+    });
+  }
+
+  _write(chunk: Buffer, _: BufferEncoding, callback: (error?: Error | null) => void) {
+    this.#process([chunk], false, callback);
+  }
+
+  _writev(chunks: { chunk: Buffer }[], callback: (error?: Error | null) => void) {
+    this.#process(
+      chunks.map(({ chunk }) => chunk),
+      false,
+      callback
+    );
+  }
+
+  _final(callback: (error?: Error | null) => void) {
+    // Like the proxy, the Zstd frame is left open: only a message cut short by the end is flushed
+    this.#process([], true, (error) => {
+      if (!error) {
+        this.push(null);
+      }
+
+      callback(error);
+    });
+  }
+
+  _read() {
+    const callback = this.#pending;
+
+    this.#pending = undefined;
+    callback?.();
+  }
+
+  _destroy(error: Error | null, callback: (error?: Error | null) => void) {
+    this.#native.close();
+    callback(error);
+  }
+
+  #process(chunks: Buffer[], end: boolean, callback: (error?: Error | null) => void) {
+    this.#native.process(chunks, end, (code: number | undefined, outputs: Buffer[]) => {
+      if (typeof code === "number") {
+        return callback(new Error(`Error ${code}`));
+      }
+
+      let more = true;
+
+      for (const output of outputs) {
+        more = this.push(output);
+      }
+
+      if (more) {
+        callback();
+      } else {
+        this.#pending = callback;
+      }
+    });
+  }
+}
+
+/** Compress written data with the framing of the proxy, the output can be read by a decompressing proxy. */
+export function zstdProxyCompressStream(options: ZstdProxyStreamOptions = {}): Duplex {
+  return new ZstdProxyTransform(false, options);
+}
+
+/** Decompress data written by a compressing proxy or `zstdProxyCompressStream`. */
+export function zstdProxyDecompressStream(options: ZstdProxyStreamOptions = {}): Duplex {
+  return new ZstdProxyTransform(true, options);
+}
+
+/** Writes go to `compress`, reads come from `decompress`. */
+class ZstdProxyWrappedStream extends Duplex {
+  readonly #compress: Duplex;
+  readonly #decompress: Duplex;
+
+  constructor(stream: Duplex, options: ZstdProxyStreamOptions) {
+    super();
+
+    this.#compress = zstdProxyCompressStream(options);
+    this.#decompress = zstdProxyDecompressStream(options);
+
+    pipeline(this.#compress, stream, this.#decompress, (error) => {
+      if (error) {
+        this.destroy(error);
+      }
+    });
+
+    this.#decompress.on("data", (chunk: Buffer) => {
+      if (!this.push(chunk)) {
+        this.#decompress.pause();
+      }
+    });
+    this.#decompress.on("end", () => this.push(null));
+  }
+
+  _write(chunk: Buffer, _: BufferEncoding, callback: (error?: Error | null) => void) {
+    // Acknowledge right away while there's room, so writes keep batching in the compressing stream
+    if (this.#compress.write(chunk)) {
+      callback();
+    } else {
+      this.#compress.once("drain", () => callback());
+    }
+  }
+
+  _final(callback: (error?: Error | null) => void) {
+    this.#compress.end(callback);
+  }
+
+  _read() {
+    this.#decompress.resume();
+  }
+
+  _destroy(error: Error | null, callback: (error?: Error | null) => void) {
+    this.#compress.destroy();
+    this.#decompress.destroy();
+    callback(error);
+  }
+}
+
+/**
+ * Wrap a stream Node.js keeps owning, eg. a TLS socket or an IPC channel: data written to the returned
+ * stream is compressed into `stream`, data read from `stream` is decompressed. Equivalent to proxying
+ * the stream with `compress` set to the returned side.
+ */
+export function zstdProxyStream(stream: Duplex, options: ZstdProxyStreamOptions = {}): Duplex {
+  return new ZstdProxyWrappedStream(stream, options);
+}
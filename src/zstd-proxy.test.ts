@@ -1,8 +1,36 @@
+import { spawn } from "child_process";
+import { randomBytes } from "crypto";
+import { existsSync, unlinkSync } from "fs";
 import { request } from "http";
 import { createServer, createConnection, Server, Socket } from "net";
 import { createServer as createHttpServer } from "http";
+import { constants, tmpdir } from "os";
+import { join } from "path";
+import { Readable } from "stream";
 
-import { zstdProxy } from "./zstd-proxy";
+import {
+  zstdProxy,
+  ZstdProxyCloseReason,
+  ZstdProxyConnection,
+  ZstdProxyFraming,
+  ZstdProxyOptions,
+} from "./zstd-proxy";
+import { zstdProxyArena, zstdProxyArenaTrim } from "./zstd-proxy.arena";
+import {
+  readZstdProxyCapture,
+  zstdProxyCapture,
+  zstdProxyCaptureStats,
+} from "./zstd-proxy.capture";
+import {
+  zstdProxyLatency,
+  zstdProxyMetrics,
+  ZstdProxyMetrics,
+} from "./zstd-proxy.metrics";
+import {
+  zstdProxyCompressStream,
+  zstdProxyDecompressStream,
+  zstdProxyStream,
+} from "./zstd-proxy.stream";
 
 const serverPort = 8540;
 const serverProxyPort = 8541;
@@ -15,6 +43,21 @@ const fail = (error: Error) => {
 
 console.log("running test");
 runTest()
+  .then((exchanged) => runMetricsTest(exchanged))
+  .then(() => runTimeoutTest())
+  // The engine is shared, its first connection gives it a single worker for every test
+  .then(() => runTest({ epoll: { enabled: true, workers: 1 } }))
+  .then(() => runBackpressureTest(8580, { epoll: { enabled: true } }))
+  .then(() => runFairnessTest())
+  .then(() => runPosixPipelineTest())
+  .then(() => runDedupTest(8615))
+  .then(() => runCaptureTest(8635))
+  .then(() => runStreamTest(8640))
+  .then(() => runArenaTest(8645))
+  .then(() => runStripeTest(8650))
+  .then(() => runBalancerTest(8660))
+  .then(() => runTrailingMessageTest())
+  .then(() => runWireFormatTest(8600))
   .catch((error) => {
     console.error(error);
     process.exit(1);
@@ -23,8 +66,20 @@ runTest()
     console.log("Test passed");
   });
 
-async function runTest() {
+type PairOptions = Omit<ZstdProxyOptions, "compress" | "to">;
+
+/**
+ * Chat through a proxy pair, resolves with the plaintext bytes delivered. The client
+ * side changes the level and pauses its proxy along the way, then closes it.
+ */
+async function runTest(options: PairOptions = {}) {
   let pass = false;
+  let exchanged = 0;
+  let stats: ReturnType<ZstdProxyConnection["stats"]> | undefined;
+  let closed: (reason?: ZstdProxyCloseReason) => void;
+  const reason = new Promise<ZstdProxyCloseReason | undefined>(
+    (resolve) => (closed = resolve)
+  );
 
   await testHarness({
     // mode: 'http',
@@ -34,6 +89,7 @@ async function runTest() {
         // socket.write("yo");
       },
       data(data, socket) {
+        exchanged += data.length;
         console.log(
           "Message from client: %s, size=%s",
           data.toString("utf-8"),
@@ -49,25 +105,45 @@ async function runTest() {
             return socket.write("yea I guess you're right");
           case "always am, ciao":
             pass = true;
-            return socket.end();
+            return socket.write("ciao");
           default:
             return fail(new Error("Invalid client message"));
         }
       },
     },
+    proxy: options,
     client: {
-      data(data, socket) {
+      proxy: {
+        ...options,
+        onClose: (_error, _metrics, _latency, reason) => closed(reason),
+      },
+      data(data, socket, connection) {
+        exchanged += data.length;
         console.log("Message from server: %s", data.toString("utf-8"));
 
         switch (data.toString("utf-8")) {
           case "yo":
+            // Above the size of the messages, which the server expects whole
+            connection.setBufferLimits({ recvSize: 64, depth: 1 });
             return socket.write("yo! what's up?");
           case "just trying to test a proxy":
+            expectRangeError(() => connection.setLevel(0.5));
+            expectRangeError(() => connection.setLevel(23));
+
+            // Ends the current frame, the next message starts one at level 19
+            connection.setLevel(19);
             return socket.write("how it is going?");
           case "you tell me!":
+            // Recvs already waiting still complete, nothing is lost across resume()
+            connection.pause();
+            setTimeout(() => connection.resume(), 100);
             return socket.write("seems to be working fine");
           case "yea I guess you're right":
             return socket.write("always am, ciao");
+          case "ciao":
+            connection.setBufferLimits({});
+            stats = connection.stats();
+            return connection.close();
           default:
             return fail(new Error("Invalid server message"));
         }
@@ -78,20 +154,1074 @@ async function runTest() {
   if (!pass) {
     throw new Error("Connection closed");
   }
+
+  const { compress, decompress } = stats!.metrics;
+
+  if (
+    !compress.bytes_in ||
+    !compress.bytes_out ||
+    !decompress.bytes_in ||
+    !decompress.bytes_out
+  ) {
+    throw new Error("Connection stats missed bytes");
+  }
+  if ((await reason) !== "stopped") {
+    throw new Error("Connection closed without close()");
+  }
+
+  return exchanged;
+}
+
+/** Global counters and latencies, after `runTest` opened the only connections so far. */
+function runMetricsTest(exchanged: number) {
+  const { connection, compress, decompress } = zstdProxyMetrics();
+
+  console.log(
+    "Metrics: %d connections, %d bytes in, %d compressed, %d out",
+    connection.connections_opened,
+    compress.bytes_in,
+    compress.bytes_out,
+    decompress.bytes_out
+  );
+
+  if (connection.connections_opened !== 2) {
+    throw new Error("Metrics missed connections");
+  }
+  if (compress.bytes_in < exchanged || decompress.bytes_out < exchanged) {
+    throw new Error(`Metrics missed bytes of the ${exchanged} exchanged`);
+  }
+  if (compress.bytes_out === 0 || decompress.bytes_in === 0) {
+    throw new Error("Metrics missed the compressed bytes");
+  }
+
+  const latency = zstdProxyLatency();
+
+  for (const direction of ["compress", "decompress"] as const) {
+    for (const [hop, { count, p50, p99, p999 }] of Object.entries(
+      latency[direction]
+    )) {
+      console.log(
+        "Latency of %s %s: %d samples, p50 %d, p99 %d, p999 %d ns",
+        direction,
+        hop,
+        count,
+        p50,
+        p99,
+        p999
+      );
+
+      if (count === 0 || !(p50 <= p99 && p99 <= p999)) {
+        throw new Error(`Invalid ${direction} ${hop} latency histogram`);
+      }
+    }
+  }
+}
+
+async function runTimeoutTest() {
+  // A client connecting without sending anything
+  await expectTimeout(8570, { idleTimeout: 200 }, "idle_timeout", () => {});
+
+  // A client not reading the echo of what it sends, its proxy can't send
+  await expectTimeout(8575, { stallTimeout: 200 }, "stall_timeout", (socket) =>
+    socket.pause().write(randomBytes(32 * 1024 * 1024))
+  );
+}
+
+/** Connect a client to a proxy pair and expect a timeout to close its proxy. */
+async function expectTimeout(
+  port: number,
+  options: PairOptions,
+  expected: ZstdProxyCloseReason,
+  client: (socket: Socket) => void
+) {
+  let closed: (close: [Error?, ZstdProxyCloseReason?]) => void;
+  const close = new Promise<[Error?, ZstdProxyCloseReason?]>(
+    (resolve) => (closed = resolve)
+  );
+
+  const pair = await proxyPair(
+    port,
+    {
+      ...options,
+      onClose: (error, _metrics, _latency, reason) => closed([error, reason]),
+    },
+    { onClose: () => {} }
+  );
+  const socket = createConnection(pair.port).on("error", () => {});
+
+  client(socket);
+
+  const [error, reason] = await close;
+
+  socket.destroy();
+  pair.close();
+
+  console.log("Timeout %s: %s", expected, error?.message);
+  if (
+    reason !== expected ||
+    error?.message !== `Error ${constants.errno.ETIMEDOUT} (${expected})`
+  ) {
+    throw new Error(`Expected ETIMEDOUT (${expected}), got ${error?.message}`);
+  }
+}
+
+/**
+ * Echo more than the socket buffers hold to a client reading late: the client
+ * side proxy sends in parts and queues its buffers until it stops reading.
+ */
+async function runBackpressureTest(port: number, options: PairOptions) {
+  let closed: (metrics: ZstdProxyMetrics) => void;
+  const metrics = new Promise<ZstdProxyMetrics>(
+    (resolve) => (closed = resolve)
+  );
+
+  const pair = await proxyPair(
+    port,
+    {
+      ...options,
+      onClose: (error, metrics) => (error ? fail(error) : closed(metrics!)),
+    },
+    options
+  );
+  const data = randomBytes(16 * 1024 * 1024);
+  const socket = createConnection(pair.port);
+  const chunks: Buffer[] = [];
+  let received = 0;
+  let queued = 0;
+
+  // The proxy closes both sockets once either ends, so only end once echoed
+  const echoed = new Promise<void>((resolve) =>
+    socket.pause().on("data", (chunk: Buffer) => {
+      chunks.push(chunk);
+      received += chunk.length;
+      if (received === data.length) {
+        resolve();
+      }
+    })
+  );
+
+  socket.write(data);
+
+  for (let i = 0; i < 50; i++) {
+    await new Promise((resolve) => setTimeout(resolve, 10));
+
+    const stats = pair.connections[0]?.stats();
+    queued = Math.max(queued, stats?.metrics.decompress.queue_running ?? 0);
+  }
+
+  socket.resume();
+  await echoed;
+  socket.end();
+
+  const { decompress } = await metrics;
+
+  pair.close();
+
+  console.log(
+    "Backpressure: %d partial sends, up to %d buffers queued",
+    decompress.partial_sends,
+    queued
+  );
+  if (!Buffer.concat(chunks).equals(data)) {
+    throw new Error("Backpressure lost data");
+  }
+  if (decompress.partial_sends === 0 || queued < 2) {
+    throw new Error("Backpressure never filled the queue");
+  }
+}
+
+/**
+ * Ping-pong next to bulk transfers on the single epoll worker: with quanta it
+ * gets a turn between their chunks instead of waiting for them to finish.
+ */
+async function runFairnessTest() {
+  const options: PairOptions = { epoll: { enabled: true }, zstd: { level: 6 } };
+  const pair = await proxyPair(8590, options, options);
+  const bulks = [0, 1, 2].map(() => [randomBytes(8 * 1024 * 1024)]);
+  let pending = bulks.length;
+  const bulk = Promise.all(
+    bulks.map((rounds) =>
+      echoRoundTrip(pair.port, rounds).then((echo) => {
+        pending--;
+        return echo;
+      })
+    )
+  );
+  const pings = [...Array(20)].map(() => randomBytes(64));
+  const start = process.hrtime.bigint();
+  const echo = await echoRoundTrip(pair.port, pings);
+  const elapsed = Number(process.hrtime.bigint() - start) / 1e6;
+  const waiting = pending;
+  const echoes = await bulk;
+
+  pair.close();
+
+  console.log(
+    "Fairness: %d round trips in %sms, %d bulk transfers still running",
+    pings.length,
+    elapsed.toFixed(1),
+    waiting
+  );
+  expectRoundTrip("Ping-pong", echo, pings);
+  echoes.forEach((echo, i) => expectRoundTrip("Bulk", echo, bulks[i]));
+  if (waiting === 0) {
+    throw new Error("Ping-pong waited for the bulk transfers");
+  }
+}
+
+/** Sends overlapping compression, with `MSG_ZEROCOPY` and its completions. */
+async function runPosixPipelineTest() {
+  const options: PairOptions = {
+    io_uring: { enabled: false },
+    posix: { depth: 4, zeroCopyThreshold: 4096 },
+  };
+  const closes: Promise<ZstdProxyMetrics>[] = [];
+  const onClose = () => {
+    let closed: (metrics: ZstdProxyMetrics) => void;
+
+    closes.push(new Promise((resolve) => (closed = resolve)));
+
+    return (error?: Error, metrics?: ZstdProxyMetrics) =>
+      error ? fail(error) : closed(metrics!);
+  };
+
+  const pair = await proxyPair(
+    8585,
+    { ...options, onClose: onClose() },
+    { ...options, onClose: onClose() }
+  );
+  const data = randomBytes(4 * 1024 * 1024);
+  const rounds = [data, data.subarray(0, 1024)];
+  const { echo } = await pair.exchange(rounds);
+  const [client, server] = await Promise.all(closes);
+
+  pair.close();
+
+  const sends =
+    client.compress.zero_copy_sends + server.compress.zero_copy_sends;
+  const copied =
+    client.compress.zero_copy_copied + server.compress.zero_copy_copied;
+
+  console.log("Posix pipeline: %d zero-copy sends, %d copied", sends, copied);
+  expectRoundTrip("Posix pipeline", echo, rounds);
+  // Loopback completes zero-copy sends with a copy, reported on the error queue
+  if (process.platform === "linux" && (!sends || !copied)) {
+    throw new Error("Posix pipeline missed zero-copy completions");
+  }
+  for (const metrics of [client, server]) {
+    if (metrics.compress.queue_running || metrics.decompress.queue_running) {
+      throw new Error("Posix pipeline left buffers in its queue gauge");
+    }
+  }
+}
+
+async function runDedupTest(port: number) {
+  // Incompressible, only deduplication makes the repeated sends smaller
+  const blob = randomBytes(256 * 1024);
+  const options: PairOptions = { zstd: { enabled: false } };
+  const dedup: PairOptions = { ...options, dedup: { enabled: true } };
+
+  let pair = await proxyPair(port, options, options);
+  const off = await pair.exchange([blob, blob]);
+  pair.close();
+
+  pair = await proxyPair(port + 5, dedup, dedup);
+  const on = await pair.exchange([blob, blob]);
+  // A later connection to the same peer resumes the caches of the first
+  const resumed = await pair.exchange([blob]);
+  pair.close();
+
+  console.log(
+    "Dedup: %d bytes up off, %d on, %d down on the next connection",
+    off.up.length,
+    on.up.length,
+    resumed.down.length
+  );
+  expectRoundTrip("Dedup off", off.echo, [blob, blob]);
+  expectRoundTrip("Dedup on", on.echo, [blob, blob]);
+  expectRoundTrip("Dedup on the next connection", resumed.echo, [blob]);
+  if (off.up.length < 2 * blob.length) {
+    throw new Error("Dedup off sent less than the data");
+  }
+  if (
+    on.up.length > 1.5 * blob.length ||
+    resumed.down.length > 0.5 * blob.length
+  ) {
+    throw new Error("Dedup sent repeated data again");
+  }
+
+  // The ends of a connection cut short parked different caches, the next
+  // connection can't resume them and must start from an empty one
+  const cut: PairOptions = {
+    ...options,
+    dedup: { enabled: true, cacheSize: 4 * 1024 * 1024 },
+    onClose: () => {},
+  };
+
+  pair = await proxyPair(port + 10, cut, cut);
+  await pair.truncate([blob], 64 * 1024);
+  const truncated = await pair.exchange([blob]);
+  pair.close();
+
+  console.log("Dedup after a cut: %d bytes down", truncated.down.length);
+  expectRoundTrip("Dedup after a cut", truncated.echo, [blob]);
+
+  // Session records the decoder can't accept: a second session, the resume
+  // of a cache it never offered (the first parked session 1), a second offer
+  const closes: ((error?: Error) => void)[] = [];
+
+  pair = await proxyPair(port + 15, dedup, {
+    ...dedup,
+    onClose: (error) => closes.shift()?.(error),
+  });
+  for (const records of [
+    [3, 1, 3, 2],
+    [3, 2, 5, 3],
+    [3, 4, 4, 1, 1, 1, 4, 1, 1, 1],
+  ]) {
+    const socket = createConnection(port + 16).on("error", () => {});
+    const error = await new Promise<Error | undefined>((resolve) => {
+      closes.push(resolve);
+      socket.write(Buffer.from(records));
+    });
+
+    socket.destroy();
+    if (error?.message !== `Error ${constants.errno.EPROTO}`) {
+      throw new Error(`Dedup accepted records ${records}: ${error?.message}`);
+    }
+  }
+  pair.close();
+}
+
+/** Every chunk of a pair sampled: each proxy captures the plaintext both ways. */
+async function runCaptureTest(port: number) {
+  const path = join(tmpdir(), `zstd-proxy-capture-${process.pid}`);
+  const rounds = [randomBytes(1024), randomBytes(16 * 1024), randomBytes(64)];
+
+  zstdProxyCapture({ path, sample: 1 });
+
+  const pair = await proxyPair(port, {}, {});
+  const { echo } = await pair.exchange(rounds);
+  const stats = zstdProxyCaptureStats()!;
+
+  pair.close();
+  zstdProxyCapture(null);
+
+  const records = readZstdProxyCapture(path);
+  const flows = new Map<string, Buffer[]>();
+
+  unlinkSync(path);
+  for (const { connection, direction, length, data } of records) {
+    const key = `${connection} ${direction}`;
+
+    if (length !== data.length) {
+      throw new Error(`Capture truncated a ${length} byte chunk`);
+    }
+    flows.set(key, [...(flows.get(key) ?? []), data]);
+  }
+
+  console.log(
+    "Capture: %d records in %d flows, %d dropped",
+    records.length,
+    flows.size,
+    stats.dropped
+  );
+  expectRoundTrip("Capture", echo, rounds);
+  if (stats.dropped !== 0 || flows.size !== 4) {
+    throw new Error("Capture missed chunks");
+  }
+  for (const [key, chunks] of flows) {
+    expectRoundTrip(`Capture of ${key}`, Buffer.concat(chunks), rounds);
+  }
+}
+
+/**
+ * Streams on one end, a proxy on the other. The client compresses many small
+ * writes with the stream halves through a proxy in front of an echo server,
+ * then a proxy client goes through an echo made of a wrapped stream.
+ */
+async function runStreamTest(port: number) {
+  const options: PairOptions = { zstd: { level: 3 } };
+  const onClose = (error?: Error) => error && fail(error);
+  const writes = Array.from({ length: 2000 }, () => randomBytes(64));
+  const rounds = [randomBytes(64), randomBytes(256 * 1024), randomBytes(16)];
+  let outputs = 0;
+
+  const servers = [
+    await listen(port, (socket) => socket.on("error", () => {}).pipe(socket), {
+      pauseOnConnect: false,
+    }),
+    await listen(port + 1, (downstream) => {
+      const socket = createConnection(port);
+
+      socket.on("error", fail).on("connect", () =>
+        zstdProxy({ onClose, ...options, compress: socket, to: downstream })
+      );
+    }),
+    await listen(
+      port + 2,
+      (socket) => {
+        const stream = zstdProxyStream(socket, options);
+
+        stream.on("error", () => {}).pipe(stream);
+      },
+      { pauseOnConnect: false }
+    ),
+    await listen(port + 3, (socket) => {
+      const upstream = createConnection(port + 2);
+
+      upstream.on("error", fail).on("connect", () =>
+        zstdProxy({ onClose, ...options, compress: socket, to: upstream })
+      );
+    }),
+  ];
+
+  const compress = zstdProxyCompressStream(options);
+  const decompress = zstdProxyDecompressStream(options);
+  const socket = createConnection(port + 1).on("error", fail);
+  const output = collect(decompress);
+  const expected = writes.length * 64;
+  let received = 0;
+
+  compress.on("data", () => outputs++);
+  compress.pipe(socket).pipe(decompress);
+
+  // Written at once, they queue behind the first batch and go through _writev
+  writes.forEach((chunk) => compress.write(chunk));
+
+  // The proxy closes both sides at the end, so only end once everything came back
+  await new Promise<void>((resolve) =>
+    decompress.on("data", (chunk: Buffer) => {
+      received += chunk.length;
+      if (received >= expected) {
+        resolve();
+      }
+    })
+  );
+  compress.end();
+
+  const echo = await output;
+  const reverse = await echoRoundTrip(port + 3, rounds);
+
+  servers.forEach((server) => server.close());
+
+  console.log(
+    "Streams: %d writes compressed in %d chunks",
+    writes.length,
+    outputs
+  );
+  expectRoundTrip("Stream to proxy", echo, writes);
+  expectRoundTrip("Proxy to stream", reverse, rounds);
+  if (outputs >= writes.length / 2) {
+    throw new Error("Small writes were not batched");
+  }
+}
+
+/**
+ * A limit below the memory of one Zstd context fails the connection with
+ * ENOMEM. Without it, the contexts are cached when the connection closes,
+ * until they are trimmed.
+ */
+async function runArenaTest(port: number) {
+  const closes: ((error?: Error) => void)[] = [];
+  const closed = () =>
+    new Promise<Error | undefined>((resolve) => closes.push(resolve));
+  const rounds = [randomBytes(1024), randomBytes(64 * 1024)];
+
+  const servers = [
+    await listen(port, (socket) => socket.on("error", () => {}).pipe(socket), {
+      pauseOnConnect: false,
+    }),
+    await listen(port + 1, (client) => {
+      const socket = createConnection(port);
+
+      socket.on("error", fail).on("connect", () =>
+        zstdProxy({
+          compress: client,
+          to: socket,
+          onClose: (error) => closes.shift()!(error),
+        })
+      );
+    }),
+  ];
+
+  zstdProxyArena({ limit: 64 * 1024 });
+
+  const refused = closed();
+
+  await echoRoundTrip(port + 1, rounds).then(
+    () => fail(new Error("Connection beyond the arena limit completed")),
+    () => {}
+  );
+
+  const error = await refused;
+
+  zstdProxyArena({ limit: 0 });
+  if (error?.message !== `Error ${constants.errno.ENOMEM}`) {
+    throw new Error(`Expected ENOMEM beyond the arena limit, got ${error}`);
+  }
+
+  const done = closed();
+  const echo = await echoRoundTrip(port + 1, rounds);
+
+  await done.then((error) => error && fail(error));
+
+  const { cached, failures } = zstdProxyArena();
+
+  zstdProxyArenaTrim();
+
+  const trimmed = zstdProxyArena();
+
+  servers.forEach((server) => server.close());
+
+  console.log(
+    "Arena: %d failures, %d bytes cached after a connection, %d after trimming",
+    failures,
+    cached,
+    trimmed.cached
+  );
+  expectRoundTrip("Arena", echo, rounds);
+  if (failures === 0 || cached === 0 || trimmed.cached !== 0) {
+    throw new Error("Arena did not cache or trim the Zstd contexts");
+  }
+}
+
+/**
+ * Striping is only in the native executable, skipped when it isn't built.
+ * Clients connecting to the striped listener without sending their hello
+ * mustn't hold up the sets of other clients.
+ */
+async function runStripeTest(port: number) {
+  const executable = join(__dirname, "../native/build/Release/zstd-proxy");
+
+  if (!existsSync(executable)) {
+    console.log("Striped pair skipped, %s is not built", executable);
+    return;
+  }
+
+  const echo = await listen(port, (socket) => socket.pipe(socket), {
+    pauseOnConnect: false,
+  });
+  const stripes = ["--stripes=3", "--stripe-segment=4k"];
+  const proxies = [
+    [`--listen=${port + 1}`, `--connect=${port}`, "--compress=connect"],
+    [`--listen=${port + 2}`, `--connect=${port + 1}`, "--compress=listen"],
+  ].map((args) =>
+    spawn(executable, [...args, ...stripes], {
+      stdio: ["ignore", "ignore", "inherit"],
+    })
+  );
+  const silent: Socket[] = [];
+
+  try {
+    await waitForEcho(port + 2);
+
+    const data = randomBytes(64 * 1024);
+    const rounds = [Buffer.concat([data, data, data, data]), data];
+    const result = await echoRoundTrip(port + 2, rounds);
+
+    console.log("Striped pair: %d bytes", result.length);
+    expectRoundTrip("Striped pair", result, rounds);
+
+    for (let i = 0; i < 3; i++) {
+      silent.push(
+        await new Promise<Socket>((resolve, reject) => {
+          const socket = createConnection(port + 1)
+            .on("error", reject)
+            .on("connect", () => resolve(socket));
+        })
+      );
+    }
+
+    const start = performance.now();
+    const behind = await echoRoundTrip(port + 2, rounds);
+    const elapsed = performance.now() - start;
+
+    console.log("Striped pair behind silent clients: %sms", elapsed.toFixed(1));
+    expectRoundTrip("Striped pair behind silent clients", behind, rounds);
+    // Hellos time out after 10 s
+    if (elapsed > 5000) {
+      throw new Error("Silent clients held up the striped listener");
+    }
+  } finally {
+    silent.forEach((socket) => socket.destroy());
+    proxies.forEach((proxy) => proxy.kill());
+    echo.close();
+  }
+}
+
+/**
+ * Balancing is only in the native executable, skipped when it isn't built.
+ * Two echo upstreams and a port refusing connections: the dead upstream is
+ * ejected on its first failure and every connection goes through.
+ */
+async function runBalancerTest(port: number) {
+  const executable = join(__dirname, "../native/build/Release/zstd-proxy");
+
+  if (!existsSync(executable)) {
+    console.log("Balancer skipped, %s is not built", executable);
+    return;
+  }
+
+  const accepted = [0, 0];
+  const echos = await Promise.all(
+    accepted.map((_, i) =>
+      listen(
+        port + i,
+        (socket) => {
+          accepted[i]++;
+          socket.pipe(socket);
+        },
+        { pauseOnConnect: false }
+      )
+    )
+  );
+  const proxy = spawn(
+    executable,
+    [
+      `--listen=${port + 3}`,
+      `--connect=${port},${port + 1},${port + 2}`,
+      "--compress=listen",
+      "--balance=least",
+      "--eject-failures=1",
+    ],
+    { stdio: ["ignore", "ignore", "pipe"] }
+  );
+  let errors = "";
+
+  proxy.stderr.on("data", (data: Buffer) => (errors += data.toString()));
+
+  try {
+    await waitForEcho(port + 3);
+
+    // Picks rotate between equally loaded upstreams, the dead one comes up
+    for (let i = 0; i < 6; i++) {
+      const rounds = [randomBytes(1024), randomBytes(16 * 1024)];
+
+      const echo = await echoRoundTrip(port + 3, rounds);
+
+      expectRoundTrip("Balancer", echo, rounds);
+    }
+
+    const ejections = errors.split(`upstream ${port + 2} ejected`).length - 1;
+
+    console.log(
+      "Balancer: %d and %d connections, dead upstream ejected %d times",
+      accepted[0],
+      accepted[1],
+      ejections
+    );
+    if (ejections !== 1 || accepted[0] === 0 || accepted[1] === 0) {
+      throw new Error("Balancer did not eject the dead upstream");
+    }
+  } finally {
+    proxy.kill();
+    echos.forEach((echo) => echo.close());
+  }
+}
+
+/** Complete messages followed by one the end of the stream cuts short. */
+const trailingMessages: [ZstdProxyFraming, Buffer][] = [
+  ["lines", Buffer.from("first line\nsecond line\nno newline at the end")],
+  [
+    "length",
+    Buffer.concat([
+      Buffer.from([0, 0, 0, 5]),
+      Buffer.from("hello"),
+      Buffer.from([0, 0, 0, 100]),
+      Buffer.from("cut short"),
+    ]),
+  ],
+  [
+    "http",
+    Buffer.from(
+      "GET / HTTP/1.1\r\nHost: a\r\n\r\nGET /partial HTTP/1.1\r\nHo"
+    ),
+  ],
+];
+
+async function runTrailingMessageTest() {
+  let port = 8550;
+
+  for (const [protocol, data] of trailingMessages) {
+    const results = {
+      stream: await streamRoundTrip(protocol, data),
+      threads: await proxyRoundTrip(protocol, data, false, (port += 3)),
+      epoll: await proxyRoundTrip(protocol, data, true, (port += 3)),
+    };
+
+    for (const [name, result] of Object.entries(results)) {
+      console.log("Trailing %s message through %s: %s", protocol, name, result);
+
+      if (!result.equals(data)) {
+        throw new Error(`Lost the end of a ${protocol} message (${name})`);
+      }
+    }
+  }
+}
+
+async function streamRoundTrip(protocol: ZstdProxyFraming, data: Buffer) {
+  const compress = zstdProxyCompressStream({ framing: { protocol } });
+  const output = collect(compress.pipe(zstdProxyDecompressStream()));
+
+  compress.end(data);
+
+  return await output;
+}
+
+async function proxyRoundTrip(
+  protocol: ZstdProxyFraming,
+  data: Buffer,
+  epoll: boolean,
+  port: number
+) {
+  let accept: (socket: Socket) => void;
+  const output = new Promise<Buffer>(
+    (resolve) => (accept = (socket) => resolve(collect(socket)))
+  );
+
+  const server = await listen(port, (socket) => accept(socket), {
+    pauseOnConnect: false,
+  });
+
+  const serverProxy = await listen(port + 1, (client) => {
+    const socket = createConnection(port);
+
+    socket.on("error", fail).on("connect", () =>
+      zstdProxy({ compress: socket, to: client, epoll: { enabled: epoll } })
+    );
+  });
+
+  const clientProxy = await listen(port + 2, (client) => {
+    const socket = createConnection(port + 1);
+
+    socket.on("error", fail).on("connect", () =>
+      zstdProxy({
+        compress: client,
+        to: socket,
+        framing: { protocol },
+        epoll: { enabled: epoll },
+      })
+    );
+  });
+
+  await new Promise<void>((resolve, reject) => {
+    createConnection(port + 2)
+      .on("error", reject)
+      .on("close", () => resolve())
+      .on("connect", function (this: Socket) {
+        this.end(data);
+      })
+      .resume();
+  });
+
+  const result = await output;
+
+  server.close();
+  serverProxy.close();
+  clientProxy.close();
+
+  return result;
+}
+
+/** Hello starting each compressed stream, see `zstd-proxy-codec.h`. */
+const helloMagic = 0x184d2a5a;
+const lz4Magic = Buffer.from([0x04, 0x22, 0x4d, 0x18]);
+const lz4Bit = 1 << 2;
+
+/**
+ * LZ4 and the hellos negotiating it, expecting LZ4 frames only once both
+ * hellos announce it so addons built without LZ4 pass too.
+ */
+async function runWireFormatTest(port: number) {
+  const text = Buffer.from(
+    Array.from({ length: 4096 }, (_, i) => `message ${i}\n`).join("")
+  );
+  const rounds = [text, text.subarray(0, 4096)];
+  const lz4: PairOptions = { codec: { preferred: "lz4" } };
+
+  // Both ends prefer LZ4, they send Zstd until reading the other's hello
+  let pair = await proxyPair(port, lz4, lz4);
+  let result = await pair.exchange(rounds);
+  pair.close();
+
+  const supported =
+    (announcedCodecs(result.up) & announcedCodecs(result.down) & lz4Bit) !== 0;
+  console.log(
+    "LZ4 pair, LZ4 %s: %d bytes up, %d down",
+    supported ? "built" : "not built",
+    result.up.length,
+    result.down.length
+  );
+  expectRoundTrip("LZ4 pair", result.echo, rounds);
+  if (
+    result.up.includes(lz4Magic) !== supported ||
+    result.down.includes(lz4Magic) !== supported
+  ) {
+    throw new Error(`LZ4 pair ${supported ? "never sent" : "sent"} LZ4`);
+  }
+
+  // Each end sends what it prefers once the other announces it decodes it
+  pair = await proxyPair(port + 5, lz4, {});
+  result = await pair.exchange(rounds);
+  pair.close();
+
+  console.log(
+    "LZ4 client, Zstd server: %d bytes up, %d down",
+    result.up.length,
+    result.down.length
+  );
+  expectRoundTrip("LZ4 client and Zstd server", result.echo, rounds);
+  if (
+    result.up.includes(lz4Magic) !== supported ||
+    result.down.includes(lz4Magic)
+  ) {
+    throw new Error("LZ4 client and Zstd server sent the wrong codec");
+  }
+
+  // Peers older than codec negotiation send no hello, both ends stay on Zstd
+  pair = await proxyPair(port + 10, lz4, lz4, { stripHellos: true });
+  result = await pair.exchange(rounds);
+  pair.close();
+
+  console.log(
+    "Peers without hellos: %d bytes up, %d down",
+    result.up.length,
+    result.down.length
+  );
+  expectRoundTrip("Peers without hellos", result.echo, rounds);
+  if (result.up.includes(lz4Magic) || result.down.includes(lz4Magic)) {
+    throw new Error("Sent LZ4 to a peer without hellos");
+  }
+}
+
+/**
+ * Proxy pair in front of an echo server, clients connect to its `port`. A
+ * relay between the proxies keeps the compressed bytes of each direction.
+ * `connections` are the handles of the client side proxies. `stripHellos`
+ * removes the hello starting each direction, like peers older than codec
+ * negotiation.
+ */
+async function proxyPair(
+  port: number,
+  client: PairOptions,
+  server: PairOptions,
+  { stripHellos = false } = {}
+) {
+  const onClose = (error?: Error) => error && fail(error);
+  const connections: ZstdProxyConnection[] = [];
+  const flows: Promise<{ up: Buffer; down: Buffer }>[] = [];
+  let cut = 0;
+
+  const servers = [
+    await listen(port, (socket) => socket.on("error", () => {}).pipe(socket), {
+      pauseOnConnect: false,
+    }),
+    await listen(port + 1, (downstream) => {
+      const socket = createConnection(port);
+
+      socket.on("error", fail).on("connect", () =>
+        zstdProxy({ onClose, ...server, compress: socket, to: downstream })
+      );
+    }),
+    await listen(
+      port + 2,
+      (socket) => {
+        const upstream = createConnection(port + 1);
+
+        const flow = Promise.all([
+          relay(socket, upstream, 0, stripHellos),
+          relay(upstream, socket, cut, stripHellos),
+        ]).then(([up, down]) => ({ up, down }));
+
+        // Only exchanges wait for their flow, other tests reset connections
+        flow.catch(() => {});
+        flows.push(flow);
+        cut = 0;
+      },
+      { pauseOnConnect: false }
+    ),
+    await listen(port + 3, (socket) => {
+      const upstream = createConnection(port + 2);
+
+      upstream.on("error", fail).on("connect", () =>
+        connections.push(
+          zstdProxy({ onClose, ...client, compress: socket, to: upstream })
+        )
+      );
+    }),
+  ];
+
+  return {
+    port: port + 3,
+    connections,
+    async exchange(rounds: Buffer[]) {
+      const flow = flows.length;
+      const echo = await echoRoundTrip(port + 3, rounds);
+
+      return { echo, ...(await flows[flow]) };
+    },
+    /** Like `exchange`, but the relay drops the connection after `size` bytes of the echo. */
+    async truncate(rounds: Buffer[], size: number) {
+      cut = size;
+      await echoRoundTrip(port + 3, rounds).then(
+        () => fail(new Error(`Truncated connection to ${port} completed`)),
+        () => {}
+      );
+    },
+    close() {
+      servers.forEach((server) => server.close());
+    },
+  };
+}
+
+/**
+ * Forward `from` to `to`, resolves with the bytes read once `from` closes.
+ * With `cut`, both are destroyed once more than `cut` bytes were read, the
+ * rest isn't forwarded. With `stripHello`, the hello starting the stream is
+ * neither forwarded nor counted.
+ */
+function relay(from: Socket, to: Socket, cut = 0, stripHello = false) {
+  const chunks: Buffer[] = [];
+  let head = stripHello ? Buffer.alloc(0) : undefined;
+  let read = 0;
+
+  from
+    .on("data", (data: Buffer) => {
+      if (head) {
+        head = Buffer.concat([head, data]);
+        if (head.length < 8) {
+          return;
+        }
+
+        const size =
+          head.readUInt32LE(0) === helloMagic ? 8 + head.readUInt32LE(4) : 0;
+        if (head.length < size) {
+          return;
+        }
+
+        data = head.subarray(size);
+        head = undefined;
+      }
+
+      chunks.push(data);
+      if (cut && read + data.length > cut) {
+        to.write(data.subarray(0, cut - read));
+        from.destroy();
+        to.destroy();
+      } else {
+        to.write(data);
+      }
+      read += data.length;
+    })
+    .on("end", () => to.end());
+
+  return new Promise<Buffer>((resolve, reject) =>
+    from
+      .on("error", (error) => {
+        to.destroy();
+        reject(error);
+      })
+      .on("close", () => resolve(Buffer.concat(chunks)))
+  );
+}
+
+/** Send each round once the previous ones are echoed, resolve with the echo. */
+async function echoRoundTrip(port: number, rounds: Buffer[]) {
+  const socket = createConnection(port);
+  const chunks: Buffer[] = [];
+  let received = 0;
+  let expected = 0;
+  let echoed = () => {};
+  let closed = (_error: Error) => {};
+  let failure: Error | undefined;
+
+  socket
+    .on("error", (error) => (failure = error))
+    .on("close", () =>
+      closed(failure ?? new Error(`Lost the connection to ${port}`))
+    )
+    .on("data", (data: Buffer) => {
+      chunks.push(data);
+      received += data.length;
+      if (received >= expected) {
+        echoed();
+      }
+    });
+
+  for (const round of rounds) {
+    expected += round.length;
+    await new Promise<void>((resolve, reject) => {
+      echoed = resolve;
+      closed = reject;
+      socket.write(round);
+    });
+  }
+
+  await new Promise<void>((resolve, reject) => {
+    closed = () => (failure ? reject(failure) : resolve());
+    socket.end();
+  });
+
+  return Buffer.concat(chunks);
+}
+
+function expectRoundTrip(name: string, result: Buffer, rounds: Buffer[]) {
+  if (!result.equals(Buffer.concat(rounds))) {
+    throw new Error(`${name} did not round trip (${result.length} bytes)`);
+  }
+}
+
+function announcedCodecs(stream: Buffer) {
+  return stream.length >= 20 && stream.readUInt32LE(0) === helloMagic
+    ? stream.readUInt32LE(16)
+    : 0;
+}
+
+/** Retry a short round trip until everything behind `port` is listening. */
+async function waitForEcho(port: number) {
+  for (let attempt = 0; ; attempt++) {
+    try {
+      return await echoRoundTrip(port, [Buffer.from("ready")]);
+    } catch (error) {
+      if (attempt === 50) {
+        throw error;
+      }
+    }
+
+    await new Promise((resolve) => setTimeout(resolve, 100));
+  }
+}
+
+function collect(stream: Readable) {
+  return new Promise<Buffer>((resolve, reject) => {
+    const chunks: Buffer[] = [];
+
+    stream
+      .on("error", reject)
+      .on("data", (chunk: Buffer) => chunks.push(chunk))
+      .on("end", () => resolve(Buffer.concat(chunks)));
+  });
 }
 
 async function testHarness(options: {
   mode?: "socket" | "http";
+  /** Options of both proxies. */
+  proxy?: PairOptions;
   server: {
     head?: Buffer;
     connect?(socket: Socket): void;
     data?(data: Buffer, socket: Socket): void;
   };
   client: {
+    /** Options of the proxy on the client side. */
+    proxy?: PairOptions;
     connect?(socket: Socket): void;
-    data?(data: Buffer, socket: Socket): void;
+    data?(data: Buffer, socket: Socket, connection: ZstdProxyConnection): void;
   };
 }) {
+  let connection: ZstdProxyConnection;
+
   const server = await listen(
     serverPort,
     (socket, head) => {
@@ -116,6 +1246,7 @@ async function testHarness(options: {
         .on("error", fail)
         .on("upgrade", (_, socket, head) => {
           zstdProxy({
+            ...options.proxy,
             compress: { socket, head: options.server.head },
             to: { socket: client, head },
           });
@@ -126,6 +1257,7 @@ async function testHarness(options: {
 
       socket.on("error", fail).on("connect", () =>
         zstdProxy({
+          ...options.proxy,
           compress: { socket, head: options.server.head },
           to: client,
         })
@@ -136,9 +1268,13 @@ async function testHarness(options: {
   const clientProxy = await listen(clientProxyPort, (client) => {
     const socket = createConnection(serverProxyPort);
 
-    socket
-      .on("error", fail)
-      .on("connect", () => zstdProxy({ compress: client, to: socket }));
+    socket.on("error", fail).on("connect", () => {
+      connection = zstdProxy({
+        ...(options.client.proxy ?? options.proxy),
+        compress: client,
+        to: socket,
+      });
+    });
   });
 
   await new Promise<void>((resolve, reject) => {
@@ -148,7 +1284,7 @@ async function testHarness(options: {
       .on("error", reject)
       .on("close", () => resolve())
       .on("connect", () => options.client.connect?.(socket))
-      .on("data", (data) => options.client.data?.(data, socket));
+      .on("data", (data) => options.client.data?.(data, socket, connection));
   });
 
   server.close();
@@ -156,6 +1292,20 @@ async function testHarness(options: {
   clientProxy.close();
 }
 
+function expectRangeError(call: () => void) {
+  try {
+    call();
+  } catch (error) {
+    if (error instanceof RangeError) {
+      return;
+    }
+
+    throw error;
+  }
+
+  throw new Error("Expected a RangeError");
+}
+
 async function listen(
   port: number,
   handle: (socket: Socket, head?: Buffer) => void,
@@ -1,6 +1,19 @@
 import { Socket } from "net";
 
 import { proxy } from "../native/build/Release/zstd_proxy.node";
+import {
+  readMetrics,
+  ZstdProxyLatency,
+  ZstdProxyMetrics,
+} from "./zstd-proxy.metrics";
+
+export type ZstdProxyCloseReason = "stopped" | "idle_timeout" | "stall_timeout";
+
+/** `"lz4"` is only available when the addon is built with `--lz4=1`. */
+export type ZstdProxyCodec = "zstd" | "lz4" | "none";
+
+/** Protocols the compressing end can find message boundaries in, see `framing`. */
+export type ZstdProxyFraming = "none" | "length" | "http" | "lines";
 
 export type SocketWithHead = { socket: Socket; head?: Buffer };
 export type MaybeSocketWithHead = Socket | SocketWithHead;
@@ -9,14 +22,159 @@ export interface ZstdProxyOptions {
   compress: number | MaybeSocketWithHead;
   to: number | MaybeSocketWithHead;
 
-  onClose?(error?: Error): void;
+  /**
+   * Called once both directions are closed, with the final counters and latencies of the connection.
+   * `reason` is set when the connection was closed by `close()` or a timeout.
+   */
+  onClose?(
+    error?: Error,
+    metrics?: ZstdProxyMetrics,
+    latency?: ZstdProxyLatency,
+    reason?: ZstdProxyCloseReason
+  ): void;
+
+  /** Close the connection after this many milliseconds without data in either direction. Disabled by default. */
+  idleTimeout?: number;
+  /** Close the connection when sending is blocked for this many milliseconds. Disabled by default. */
+  stallTimeout?: number;
 
   zstd?: {
     /** Set to `false` to disable compression */
     enabled?: boolean;
 
-    /** Zstd compression level. Defaults to `1`. */
+    /** Zstd compression level, an integer from `-131072` (`ZSTD_minCLevel()`) to `22`. Defaults to `1`. */
     level?: number;
+
+    /** Zstd window log, both ends must use the same value above 27. Defaults to the one of the level. */
+    windowLog?: number;
+
+    /** Dictionary loaded by both ends, they must use the same one. The `advisor` script trains one from a capture. */
+    dictionary?: Buffer;
+  };
+
+  /**
+   * Codec compressing the connection while `zstd.enabled`. Each end announces its codec and the codecs
+   * it can decode when it starts sending, decompressing ends follow the announcement of their peer.
+   */
+  codec?: {
+    /** Defaults to `"zstd"`, `"none"` sends data as is like disabling Zstd. */
+    preferred?: ZstdProxyCodec;
+    /** Compress with Zstd until the peer announces it decodes `preferred`, so older peers keep working. Defaults to `true`. */
+    negotiate?: boolean;
+    /** LZ4 level, 3 and above for LZ4 HC. Defaults to `0`. */
+    lz4Level?: number;
+  };
+
+  /**
+   * Flush compressed data at the end of messages instead of after every read, so a message split across
+   * reads is sent in one piece. Only the compressing end parses its input, peers don't need to agree. A
+   * protocol not matching the traffic holds data until the connection sends more, streams which can't be
+   * parsed are flushed after every read from then on.
+   */
+  framing?: {
+    /** `"http"` follows HTTP/1.1 requests and responses, `"lines"` ends messages with `\n`. Defaults to `"none"`. */
+    protocol?: ZstdProxyFraming;
+    /** `"length"`: bytes before the length field. Defaults to `0`. */
+    lengthOffset?: number;
+    /** `"length"`: size of the length field, from 1 to 8 bytes. Defaults to `4`. */
+    lengthSize?: number;
+    /** `"length"`: added to the length to get the bytes following the field, eg. `-4` when it counts itself. Defaults to `0`. */
+    lengthAdjust?: number;
+    /** `"length"`: the field is little-endian instead of network order. Defaults to `false`. */
+    lengthLittleEndian?: boolean;
+  };
+
+  /**
+   * Replace data already sent to the same peer with references before compressing it, so repeated
+   * payloads are deduplicated beyond the Zstd window and across connections. Both ends must use the same options.
+   */
+  dedup?: {
+    /** Defaults to `false`. */
+    enabled?: boolean;
+    /** Bytes of previously sent data kept by each end and direction. Defaults to 16 MB. */
+    cacheSize?: number;
+    /** Caches of closed connections kept by the process for the next connections to the same peer, 0 for none. Defaults to 8. */
+    sessions?: number;
+  };
+
+  /**
+   * Serve the connection on a shared pool of epoll worker threads instead of two threads, Linux only.
+   * Takes precedence over io_uring when enabled.
+   */
+  epoll?: {
+    /** Set to `true` to use the epoll engine. */
+    enabled?: boolean;
+
+    /** Worker threads, only read by the first connection using the engine. Defaults to one per CPU. */
+    workers?: number;
+
+    /**
+     * Bytes a connection processes before the other busy connections of its worker get a turn, `0` for no limit.
+     * Keeps bulk transfers from delaying small requests, only read by the first connection using the engine. Defaults to 64 KB.
+     */
+    quantum?: number;
+
+    /** Quanta this connection gets per turn, relative to the others. Defaults to `1`. */
+    weight?: number;
+
+    /**
+     * Let idle workers take over connections waiting for their turn on a busy worker.
+     * Only read by the first connection using the engine. Defaults to `true`.
+     */
+    steal?: boolean;
+  };
+
+  /** CPU placement of the threads serving the connection, Linux only. */
+  affinity?: {
+    /**
+     * CPUs to pin to, like `0-3,8`. Buffers are then allocated on the NUMA node of these CPUs.
+     * With epoll, worker `i` is pinned to the `i`-th CPU, only read by the first connection using the engine.
+     */
+    cpus?: string;
+    /** Prefer the CPU receiving the packets of the socket when it's in `cpus`. Defaults to `false`. */
+    incomingCpu?: boolean;
+  };
+
+  /**
+   * Poll instead of sleeping while waiting for data, lowering latency at the cost of CPU.
+   * Useful on sub-millisecond links where waking up a thread is a large part of each hop.
+   */
+  busyPoll?: {
+    /** Microseconds spent spinning on io_uring completions or non-blocking recvs before sleeping, ignored by epoll. Defaults to `0`. */
+    spin?: number;
+    /** `SO_BUSY_POLL` in microseconds on the sockets, raising it above `net.core.busy_read` requires `CAP_NET_ADMIN`. */
+    socket?: number;
+    /** Also set `SO_PREFER_BUSY_POLL` on the sockets. Defaults to `false`. */
+    prefer?: boolean;
+    /** Create the io_uring with `IORING_SETUP_COOP_TASKRUN`, completions no longer interrupt the thread. Defaults to `false`. */
+    coopTaskrun?: boolean;
+    /** Create the io_uring with `IORING_SETUP_DEFER_TASKRUN` (Linux 6.1), takes precedence over `coopTaskrun`. Defaults to `false`. */
+    deferTaskrun?: boolean;
+  };
+
+  /** Options applied to both sockets, left to the system by default. */
+  socket?: {
+    /**
+     * `TCP_NOTSENT_LOWAT` in bytes: the kernel stops accepting data once this much is unsent, so a slow peer
+     * blocks the proxy, and then the source, after `depth * bufferSize + notsentLowat` bytes instead of filling the send buffer.
+     */
+    notsentLowat?: number;
+    /** `SO_SNDBUF` in bytes, disables the kernel autotuning. */
+    sendBuffer?: number;
+    /** `SO_RCVBUF` in bytes, disables the kernel autotuning. */
+    recvBuffer?: number;
+    /** Set `TCP_NODELAY`. */
+    noDelay?: boolean;
+    /** Send the parts of a frame which don't fit in one buffer with `MSG_MORE`, so it leaves in full segments. */
+    cork?: boolean;
+  };
+
+  /** Options of the threaded backend used when io_uring and epoll are disabled. */
+  posix?: {
+    /** Output buffers per direction, above `1` sends run on their own thread while the next chunk is compressed. Defaults to `2`. */
+    depth?: number;
+    /** Send chunks of at least this many bytes with `MSG_ZEROCOPY` over TCP on Linux, `0` disables it. Defaults to 64 KB. */
+    zeroCopyThreshold?: number;
   };
 
   /**
@@ -38,33 +196,110 @@ export interface ZstdProxyOptions {
   };
 }
 
-export async function zstdProxy(options: ZstdProxyOptions) {
+/** Live handle on a proxied connection, calls are ignored once it closed. */
+export interface ZstdProxyConnection {
+  /** Counters and latencies of this connection so far. */
+  stats(): { metrics: ZstdProxyMetrics; latency: ZstdProxyLatency };
+
+  /** Change the compression level, applied from the next Zstd frame. Throws a `RangeError` unless it's a valid Zstd level. */
+  setLevel(level: number): void;
+
+  /** Stop reading from both sockets, data in flight is still sent. */
+  pause(): void;
+  resume(): void;
+
+  /** Lower the bytes read per call and the io_uring items in flight, `0` restores the configured value. */
+  setBufferLimits(limits: { recvSize?: number; depth?: number }): void;
+
+  /** Shut both sockets down, `onClose` is called once both directions stopped. */
+  close(): void;
+}
+
+export function zstdProxy(options: ZstdProxyOptions): ZstdProxyConnection {
   const to = socketWithHead(options.to);
   const compress = socketWithHead(options.compress);
 
-  proxy(
+  const connection = proxy(
     compress.fd,
     to.fd,
     compress.head,
     to.head,
     {
+      idle_timeout: options.idleTimeout,
+      stall_timeout: options.stallTimeout,
+      epoll: options.epoll?.enabled,
+      epoll_workers: options.epoll?.workers,
+      epoll_quantum: options.epoll?.quantum,
+      epoll_weight: options.epoll?.weight,
+      epoll_steal: options.epoll?.steal,
+      cpus: options.affinity?.cpus,
+      incoming_cpu: options.affinity?.incomingCpu,
+      busy_poll_spin: options.busyPoll?.spin,
+      busy_poll_socket: options.busyPoll?.socket,
+      busy_poll_prefer: options.busyPoll?.prefer,
+      busy_poll_coop_taskrun: options.busyPoll?.coopTaskrun,
+      busy_poll_defer_taskrun: options.busyPoll?.deferTaskrun,
+      socket_notsent_lowat: options.socket?.notsentLowat,
+      socket_send_buffer: options.socket?.sendBuffer,
+      socket_recv_buffer: options.socket?.recvBuffer,
+      socket_nodelay: options.socket?.noDelay,
+      socket_cork: options.socket?.cork,
+      posix_depth: options.posix?.depth,
+      posix_zero_copy_threshold: options.posix?.zeroCopyThreshold,
       zstd: options.zstd?.enabled,
       zstd_level: options.zstd?.level,
+      zstd_window_log: options.zstd?.windowLog,
+      zstd_dictionary: options.zstd?.dictionary,
+      codec: options.codec?.preferred,
+      codec_negotiate: options.codec?.negotiate,
+      codec_lz4_level: options.codec?.lz4Level,
+      framing: options.framing?.protocol,
+      framing_length_offset: options.framing?.lengthOffset,
+      framing_length_size: options.framing?.lengthSize,
+      framing_length_adjust: options.framing?.lengthAdjust,
+      framing_length_little_endian: options.framing?.lengthLittleEndian,
+      dedup: options.dedup?.enabled,
+      dedup_cache_size: options.dedup?.cacheSize,
+      dedup_sessions: options.dedup?.sessions,
       io_uring: options.io_uring?.enabled,
       io_uring_depth: options.io_uring?.depth,
       io_uring_zero_copy: options.io_uring?.zeroCopy,
       io_uring_buffer_size: options.io_uring?.bufferSize,
       io_uring_fixed_buffers: options.io_uring?.fixedBuffers,
     },
-    (code?: number) => {
+    (
+      code: number | undefined,
+      metrics: BigUint64Array,
+      latency: ZstdProxyLatency,
+      reason?: ZstdProxyCloseReason
+    ) => {
       to.socket?.destroy();
       compress.socket?.destroy();
 
       options.onClose?.(
-        typeof code === "number" ? new Error(`Error ${code}`) : undefined
+        typeof code === "number"
+          ? new Error(reason ? `Error ${code} (${reason})` : `Error ${code}`)
+          : undefined,
+        readMetrics(metrics),
+        latency,
+        reason
       );
     }
   );
+
+  return {
+    stats() {
+      const { metrics, latency } = connection.stats();
+
+      return { metrics: readMetrics(metrics), latency };
+    },
+    setLevel: (level) => connection.setLevel(level),
+    pause: () => connection.pause(),
+    resume: () => connection.resume(),
+    setBufferLimits: ({ recvSize = 0, depth = 0 }) =>
+      connection.setBufferLimits(recvSize, depth),
+    close: () => connection.close(),
+  };
 }
 
 // Prevent Node.js from sending any system calls on the socket file descriptor.